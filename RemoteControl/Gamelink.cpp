@@ -17,6 +17,10 @@
 #include <Windows.h>
 #include "Gamelink.h"
 #include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <intrin.h>
+#include "../addons/ams.h"
 #include "../resource.h"
 
 //------------------------------------------------------------------------------
@@ -28,6 +32,15 @@
 #define GAMELINK_MUTEX_NAME		"DWD_GAMELINK_MUTEX_R4"
 #define GAMELINK_MMAP_NAME		"DWD_GAMELINK_MMAP_R4"
 
+// Protocol 5 - lock free, see sSharedMMapSeq_R5. The mutex is only created so that
+// a second emulator knows the name is taken, nobody ever waits on it.
+#define PROTOCOL_VER_SEQ		5
+#define GAMELINK_MUTEX_NAME_SEQ		"DWD_GAMELINK_MUTEX_R5"
+#define GAMELINK_MMAP_NAME_SEQ		"DWD_GAMELINK_MMAP_R5"
+
+// how many times we re-read a section the client is writing before leaving it for next time
+#define SEQ_READ_TRIES		4
+
 extern int max_cpf;		// max cycles per frame. Set to 0 when game is paused
 
 using namespace GameLink;
@@ -42,6 +55,17 @@ static HANDLE g_mmapcomp_handle;
 
 static bool g_bEnableGamelink = true;		// default to true
 static bool g_bEnableTrackOnly;
+static bool g_bEnableDeltaFrames = false;	// only publish frames (and rows) that changed
+static int g_protocol = PROTOCOL_VER;		// PROTOCOL_VER (mutex) or PROTOCOL_VER_SEQ (sequence counters)
+static LONG g_last_input_seq;				// protocol 5 - input counter we last took
+
+// Stall statistics - how long the emulator's video thread spends in Out()
+static LARGE_INTEGER g_stall_freq;
+static UINT64 g_stall_total_us;
+static UINT g_stall_max_us;
+static UINT g_stall_count;
+static UINT g_stall_timeouts;				// protocol 4 - gave up on the mutex
+static UINT g_torn_reads;					// protocol 5 - re-reads because the client was mid-write
 
 static UINT g_membase_size;
 
@@ -49,8 +73,94 @@ static bool g_use_native_format = false;
 
 static GameLink::sSharedMemoryMap_R4* g_p_shared_memory;
 static GameLink::sSharedMMapBuffer_R1* g_p_outbuf;
+static GameLink::sSharedMMapFrameDelta_R1* g_p_frame_delta;	// after the RAM block
+
+// Delta frames - the last frame we exported, top-down but otherwise as the emulator drew it
+static UINT8* g_p_frame_shadow;
+static UINT16 g_shadow_width;
+static UINT16 g_shadow_height;
+static UINT g_row_hash[ GameLink::sSharedMMapFrame_R1::MAX_HEIGHT ];
+static UINT8 g_row_dirty[ GameLink::sSharedMMapFrame_R1::MAX_HEIGHT ];
+static int g_dirty_first;
+static int g_dirty_last;
 
 #define MEMORY_MAP_CORE_SIZE sizeof( GameLink::sSharedMemoryMap_R4 )
+#define MEMORY_MAP_SIZE ( MEMORY_MAP_CORE_SIZE + g_membase_size + sizeof( GameLink::sSharedMMapFrameDelta_R1 ) + sizeof( GameLink::sSharedMMapSeq_R5 ) + sizeof( GameLink::sSharedMMapPeekSub_R1 ) )
+static GameLink::sSharedMMapSeq_R5* g_p_seq;					// after the frame delta
+static GameLink::sSharedMMapPeekSub_R1* g_p_peek_sub;			// after the sequence counters
+
+//
+// Per-game peek fixups
+//
+// Some games keep a value the client wants in a form it can't work out itself.
+// Each entry here replaces one peek address with a value computed from memory,
+// for one program (matched on program_hash[3], the CRC of the program name).
+// The watch addresses are what the value depends on, so subscriptions notice.
+//
+struct sPeekFixup
+{
+	UINT hash;					// program_hash[3]
+	UINT addr;					// peek address to replace
+	UINT8 (*value)( const UINT8* p_sysmem );
+	UINT watch_count;
+	UINT watch[4];
+};
+
+// Realms of Antiquity - some maps are slanted, and xpos is really based on x and y.
+// GridCarto doesn't support calculating xpos using y, so we do it here.
+static UINT8 roa_xpos( const UINT8* p_sysmem )
+{
+	UINT8 xpos = p_sysmem[0x1a009];
+	const UINT8 ypos = p_sysmem[0x1a007];
+	const UINT8 slant = p_sysmem[0x1a833];
+	const UINT8 rows = p_sysmem[0x1a82d];
+	switch (slant)
+	{
+	case 0:	// left
+		xpos = xpos - ypos + (rows - 1);
+		break;
+	case 2:	// normal
+		break;
+	case 4:	// right
+		xpos = xpos + ypos;
+		break;
+	default:
+		break;
+	}
+	return xpos;
+}
+
+static const sPeekFixup g_peek_fixups[] = {
+	{ 0x503359be, 0x1a009, roa_xpos, 4, { 0x1a009, 0x1a007, 0x1a833, 0x1a82d } },		// Realms of Antiquity
+};
+
+static const sPeekFixup* volatile g_p_fixups;	// the run of g_peek_fixups for the loaded program
+static volatile UINT g_fixup_count;
+
+//
+// Peek subscriptions - the addresses grouped by the 256 byte block of memory they
+// live in, and the write generation (see GetCodeBlockGen) each block had when we
+// last read it. WriteMemoryByte bumps the generation on every write, so a block
+// whose generation hasn't moved still holds what we already sent.
+//
+struct sPeekRun
+{
+	const DWord* p_gen;			// write generation for this block
+	DWord gen;					// value when we last read it
+	UINT first;					// into g_peek_watch
+	UINT count;
+};
+static std::vector< UINT > g_peek_watch;		// peek indexes, grouped by block
+static std::vector< sPeekRun > g_peek_runs;
+static UINT g_peek_list_seq;				// list_seq the runs were built from
+static unsigned int g_peek_epoch;			// nCodeCacheEpoch the runs were read under
+static UINT g_peek_frames;					// frames since the last full read
+static volatile bool g_peek_rebuild = true;
+static bool g_peek_open;					// protocol 5 - peek counter left odd, the data follows neither list
+
+// Even when watching, read everything now and then - loaders that fill memory
+// directly (like RestoreAMS) don't bump the generations.
+#define PEEK_FULL_READ_FRAMES	60
 
 
 //------------------------------------------------------------------------------
@@ -61,7 +171,7 @@ static void shared_memory_init()
 {
 	// Initialise
 
-	g_p_shared_memory->version = PROTOCOL_VER;
+	g_p_shared_memory->version = (UINT8)g_protocol;
 	g_p_shared_memory->flags = 0;
 
 	memset( g_p_shared_memory->system, 0, sizeof( g_p_shared_memory->system ) );
@@ -106,6 +216,156 @@ static void shared_memory_init()
 	// RAM
 	g_p_shared_memory->ram_size = g_membase_size;
 
+	// nothing has changed yet
+	memset( g_p_frame_delta, 0, sizeof( GameLink::sSharedMMapFrameDelta_R1 ) );
+	g_shadow_width = 0;
+	g_shadow_height = 0;
+
+	memset( g_p_seq, 0, sizeof( GameLink::sSharedMMapSeq_R5 ) );
+	g_last_input_seq = 0;
+	g_peek_open = false;
+
+	memset( g_p_peek_sub, 0, sizeof( GameLink::sSharedMMapPeekSub_R1 ) );
+	g_peek_rebuild = true;
+}
+
+//
+// seq_begin/seq_end
+//
+// Bracket a write to a protocol 5 section. InterlockedIncrement is a full barrier,
+// so the section writes can't move outside the odd window.
+//
+static void seq_begin( volatile LONG* p_seq )
+{
+	InterlockedIncrement( p_seq );
+}
+
+static void seq_end( volatile LONG* p_seq )
+{
+	InterlockedIncrement( p_seq );
+}
+
+//
+// stall_log
+//
+static void stall_log()
+{
+	debug_write( "GameLink R%d: %u frames, %uus average, %uus worst, %u mutex timeouts, %u torn reads",
+		g_protocol, g_stall_count, (UINT)( g_stall_total_us / g_stall_count ), g_stall_max_us,
+		g_stall_timeouts, g_torn_reads );
+}
+
+//
+// stall_report
+//
+// Account for one call to Out(), and log the totals now and then.
+//
+static void stall_report( const LARGE_INTEGER& start )
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+
+	if ( g_stall_freq.QuadPart == 0 )
+		QueryPerformanceFrequency( &g_stall_freq );
+
+	const UINT us = (UINT)( ( now.QuadPart - start.QuadPart ) * 1000000 / g_stall_freq.QuadPart );
+	g_stall_total_us += us;
+	if ( us > g_stall_max_us )
+		g_stall_max_us = us;
+
+	// about once a minute
+	if ( ++g_stall_count >= 3600 )
+	{
+		stall_log();
+		g_stall_total_us = 0;
+		g_stall_max_us = 0;
+		g_stall_count = 0;
+		g_stall_timeouts = 0;
+		g_torn_reads = 0;
+	}
+}
+
+//
+// write_row
+//
+// Copy one row of pixels into shared memory, setting the alpha channel to 0xff
+// as we go (the emulator leaves it at 0).
+//
+static void write_row( UINT8* p_dest, const UINT8* p_src, const UINT16 width )
+{
+	const UINT32* src = reinterpret_cast< const UINT32* >( p_src );
+	UINT32* dest = reinterpret_cast< UINT32* >( p_dest );
+
+	for ( UINT x = 0; x < width; ++x ) {
+		dest[x] = src[x] | 0xff000000;
+	}
+}
+
+//
+// hash_row
+//
+// FNV-1a over one row, used to build the frame hash.
+//
+static UINT hash_row( const UINT8* p_src, const UINT linesize )
+{
+	UINT hash = 2166136261u;
+	for ( UINT i = 0; i < linesize; ++i ) {
+		hash = ( hash ^ p_src[i] ) * 16777619u;
+	}
+	return hash;
+}
+
+//
+// diff_frame
+//
+// Compare a new frame against the shadow of the last one exported and pull the changed
+// rows into the shadow. Runs outside the mutex, so only the changed rows need to be
+// written while we hold it.
+//
+// \returns the number of rows that changed, or -1 if we can't do deltas (no memory).
+//
+static int diff_frame( const UINT8* p_frame, const UINT16 width, const UINT16 height, const bool bottom_up )
+{
+	const UINT linesize = width * 4;
+	bool all = false;
+
+	if ( ( width != g_shadow_width ) || ( height != g_shadow_height ) || ( g_p_frame_shadow == NULL ) )
+	{
+		// new size, start again
+		free( g_p_frame_shadow );
+		g_p_frame_shadow = (UINT8*)malloc( linesize * height );
+		if ( g_p_frame_shadow == NULL ) {
+			g_shadow_width = 0;
+			g_shadow_height = 0;
+			return -1;
+		}
+		g_shadow_width = width;
+		g_shadow_height = height;
+		all = true;
+	}
+
+	int rows = 0;
+	g_dirty_first = -1;
+	g_dirty_last = -1;
+
+	for ( UINT y = 0; y < height; ++y )
+	{
+		const UINT8* src = p_frame + ( bottom_up ? ( height - 1 - y ) : y ) * linesize;
+		UINT8* shadow = g_p_frame_shadow + y * linesize;
+
+		g_row_dirty[y] = 0;
+		if ( all || memcmp( shadow, src, linesize ) )
+		{
+			memcpy( shadow, src, linesize );
+			g_row_hash[y] = hash_row( shadow, linesize );
+			g_row_dirty[y] = 1;
+			if ( g_dirty_first < 0 ) g_dirty_first = y;
+			g_dirty_last = y;
+			++rows;
+		}
+	}
+
+	return rows;
 }
 
 //
@@ -161,10 +421,11 @@ static void destroy_mutex( const char* p_name )
 //
 static int create_shared_memory()
 {
-	const int memory_map_size = MEMORY_MAP_CORE_SIZE + g_membase_size;
+	const int memory_map_size = MEMORY_MAP_SIZE;
 
 	g_mmap_handle = CreateFileMappingA( INVALID_HANDLE_VALUE, NULL,
-			PAGE_READWRITE, 0, memory_map_size,	GAMELINK_MMAP_NAME );
+			PAGE_READWRITE, 0, memory_map_size,
+			( g_protocol == PROTOCOL_VER_SEQ ) ? GAMELINK_MMAP_NAME_SEQ : GAMELINK_MMAP_NAME );
 
 	if ( g_mmap_handle )
 	{
@@ -174,6 +435,11 @@ static int create_shared_memory()
 
 		if ( g_p_shared_memory )
 		{
+			g_p_frame_delta = reinterpret_cast< GameLink::sSharedMMapFrameDelta_R1* >(
+				((UINT8*)g_p_shared_memory) + MEMORY_MAP_CORE_SIZE + g_membase_size
+				);
+			g_p_seq = reinterpret_cast< GameLink::sSharedMMapSeq_R5* >( g_p_frame_delta + 1 );
+			g_p_peek_sub = reinterpret_cast< GameLink::sSharedMMapPeekSub_R1* >( g_p_seq + 1 );
 			return 1; // Success!
 		}
 	}
@@ -195,14 +461,20 @@ static int create_shared_memory()
 //
 static void destroy_shared_memory()
 {
-	const int memory_map_size = MEMORY_MAP_CORE_SIZE + g_membase_size;
-
 	if ( g_p_shared_memory )
 	{
 		UnmapViewOfFile( g_p_shared_memory );
 		g_p_shared_memory = NULL;
+		g_p_frame_delta = NULL;
+		g_p_seq = NULL;
+		g_p_peek_sub = NULL;
 	}
 
+	free( g_p_frame_shadow );
+	g_p_frame_shadow = NULL;
+	g_shadow_width = 0;
+	g_shadow_height = 0;
+
 	if ( g_mmap_handle )
 	{
 		CloseHandle( g_mmap_handle );
@@ -274,6 +546,28 @@ void GameLink::SetTrackOnlyEnabled(const bool bEnabled)
 	g_bEnableTrackOnly = bEnabled;
 }
 
+bool GameLink::GetDeltaFramesEnabled(void)
+{
+	return g_bEnableDeltaFrames;
+}
+
+void GameLink::SetDeltaFramesEnabled(const bool bEnabled)
+{
+	g_bEnableDeltaFrames = bEnabled;
+}
+
+int GameLink::GetProtocol(void)
+{
+	return g_protocol;
+}
+
+// only takes effect before the shared memory is created
+void GameLink::SetProtocol(const int protocol)
+{
+	if ( g_p_shared_memory == NULL )
+		g_protocol = ( protocol == PROTOCOL_VER_SEQ ) ? PROTOCOL_VER_SEQ : PROTOCOL_VER;
+}
+
 
 //------------------------------------------------------------------------------
 // GameLink::Init
@@ -293,7 +587,7 @@ int GameLink::Init( const bool trackonly_mode )
 	g_bEnableTrackOnly = trackonly_mode;
 
 	// Create a fresh mutex.
-	iresult = create_mutex( GAMELINK_MUTEX_NAME );
+	iresult = create_mutex( ( g_protocol == PROTOCOL_VER_SEQ ) ? GAMELINK_MUTEX_NAME_SEQ : GAMELINK_MUTEX_NAME );
 	if ( iresult != 1 )
 	{
 		// failed.
@@ -326,8 +620,6 @@ UINT8* GameLink::AllocRAM( const UINT size )
 
 	GameLink::InitTerminal();
 
-	const int memory_map_size = MEMORY_MAP_CORE_SIZE + g_membase_size;
-
 	UINT8* membase = ((UINT8*)g_p_shared_memory) + MEMORY_MAP_CORE_SIZE;
 
 	// Return RAM base pointer.
@@ -343,10 +635,16 @@ void GameLink::Term()
 	if ( g_p_shared_memory )
 		g_p_shared_memory->version = 0;
 
+	if ( g_stall_count )
+		stall_log();
+
 	destroy_shared_memory();
 
 	destroy_mutex( GAMELINK_MUTEX_NAME );
 
+	g_peek_watch.clear();
+	g_peek_runs.clear();
+
 	g_membase_size = 0;
 }
 
@@ -369,6 +667,24 @@ void GameLink::SetProgramInfo(const std::string name, UINT i1, UINT i2, UINT i3,
 		g_p_shared_memory->program_hash[2] = i3;
 		g_p_shared_memory->program_hash[3] = i4;
 	}
+
+	// pick up the peek fixups for this program (they are grouped by hash in the table)
+	const sPeekFixup* p_fixups = NULL;
+	UINT fixup_count = 0;
+	for (UINT idx = 0; idx < sizeof(g_peek_fixups) / sizeof(g_peek_fixups[0]); ++idx)
+	{
+		if (g_peek_fixups[idx].hash == i4)
+		{
+			if (p_fixups == NULL)
+				p_fixups = &g_peek_fixups[idx];
+			++fixup_count;
+		}
+	}
+	// the video thread may be reading these, so never let the count cover a stale pointer
+	g_fixup_count = 0;
+	g_p_fixups = p_fixups;
+	g_fixup_count = fixup_count;
+	g_peek_rebuild = true;
 }
 
 //------------------------------------------------------------------------------
@@ -391,6 +707,47 @@ int GameLink::In( GameLink::sSharedMMapInput_R2* p_input,
 			// No input.
 			memset( p_input, 0, sizeof( sSharedMMapInput_R2 ) );
 		}
+		else if (g_protocol == PROTOCOL_VER_SEQ)
+		{
+			// Lock free - copy it out and check the client didn't write it while we copied
+			for (int tries = 0; tries < SEQ_READ_TRIES; ++tries)
+			{
+				const LONG seq = g_p_seq->input;
+				if (seq & 1)
+				{
+					// client is mid-write
+					++g_torn_reads;
+					YieldProcessor();
+					continue;
+				}
+				MemoryBarrier();
+
+				sSharedMMapInput_R2 input;
+				sSharedMMapAudio_R1 audio;
+				memcpy(&input, &(g_p_shared_memory->input), sizeof(sSharedMMapInput_R2));
+				memcpy(&audio, &(g_p_shared_memory->audio), sizeof(sSharedMMapAudio_R1));
+
+				MemoryBarrier();
+				if (g_p_seq->input != seq)
+				{
+					++g_torn_reads;
+					continue;
+				}
+
+				// a new counter value is new input - the mouse deltas are only counted once that way
+				if (seq != g_last_input_seq)
+				{
+					g_last_input_seq = seq;
+					memcpy(p_input, &input, sizeof(sSharedMMapInput_R2));
+					ready = 1;
+				}
+				if (audio.master_vol_l <= 100)
+					p_audio->master_vol_l = audio.master_vol_l;
+				if (audio.master_vol_r <= 100)
+					p_audio->master_vol_r = audio.master_vol_r;
+				break;
+			}
+		}
 		else
 		{
 			if (g_p_shared_memory->input.ready)
@@ -417,6 +774,59 @@ int GameLink::In( GameLink::sSharedMMapInput_R2* p_input,
 	return ready;
 }
 
+//
+// write_frame
+//
+// Write the frame into shared memory - either the rows diff_frame() found, or all of
+// them straight from the emulator's frame. The caller owns the frame section.
+//
+static void write_frame( const UINT16 frame_width, const UINT16 frame_height,
+						 const UINT16 par_x, const UINT16 par_y,
+						 const UINT8* p_frame, const bool bottom_up,
+						 const bool frame_fits, const int changed_rows )
+{
+	// Update the frame sequence
+	++g_p_shared_memory->frame.seq;
+
+	// Copy frame properties
+	g_p_shared_memory->frame.image_fmt = 1; // = 32-bit RGBA
+	g_p_shared_memory->frame.width = frame_width;
+	g_p_shared_memory->frame.height = frame_height;
+	g_p_shared_memory->frame.par_x = par_x;
+	g_p_shared_memory->frame.par_y = par_y;
+
+	// Frame Buffer
+	const UINT linesize = frame_width * 4;
+	if ( changed_rows > 0 )
+	{
+		// just the rows that changed, from the shadow
+		for ( int y = g_dirty_first; y <= g_dirty_last; ++y )
+		{
+			if ( g_row_dirty[y] )
+				write_row( g_p_shared_memory->frame.buffer + y * linesize, g_p_frame_shadow + y * linesize, frame_width );
+		}
+
+		// and describe them
+		UINT hash = 2166136261u;
+		for ( UINT y = 0; y < frame_height; ++y ) {
+			hash = ( hash ^ g_row_hash[y] ) * 16777619u;
+		}
+		g_p_frame_delta->seq = g_p_shared_memory->frame.seq;
+		g_p_frame_delta->dirty_first = (UINT16)g_dirty_first;
+		g_p_frame_delta->dirty_count = (UINT16)( g_dirty_last - g_dirty_first + 1 );
+		g_p_frame_delta->frame_hash = hash;
+		memcpy( g_p_frame_delta->row_dirty, g_row_dirty, frame_height );
+	}
+	else if ( frame_fits )
+	{
+		for ( UINT y = 0; y < frame_height; ++y )
+		{
+			const UINT8* src = p_frame + ( bottom_up ? ( frame_height - 1 - y ) : y ) * linesize;
+			write_row( g_p_shared_memory->frame.buffer + y * linesize, src, frame_width );
+		}
+	}
+}
+
 //------------------------------------------------------------------------------
 // GameLink::Out
 //------------------------------------------------------------------------------
@@ -427,15 +837,18 @@ int GameLink::In( GameLink::sSharedMMapInput_R2* p_input,
 // Version only with memory, used for out-of-band commands
 void GameLink::Out(const UINT8* p_sysmem)
 {
-	Out(0, 0, 1, false, NULL, p_sysmem);
+	Out(0, 0, 1, false, NULL, false, p_sysmem);
 }
 
 // Full version with video out
+// p_frame is 32-bit pixels with no alpha, bottom_up if the rows are stored bottom to top (like a DIB).
+// The flip and the alpha are done as the rows are written into shared memory.
 void GameLink::Out( const UINT16 frame_width,
 					const UINT16 frame_height,
 					const double source_ratio,
 					const bool want_mouse,
 					const UINT8* p_frame,
+					const bool bottom_up,
 					const UINT8* p_sysmem )
 {
 	// Not initialised (or disabled) ?
@@ -476,48 +889,93 @@ void GameLink::Out( const UINT16 frame_width,
 	if (0 == max_cpf)
 		flags |= sSharedMemoryMap_R4::FLAG_PAUSED;
 
+	flags |= sSharedMemoryMap_R4::FLAG_PEEK_CHANGES;
+
+	// Work out what changed before we take the mutex, so we hold it as briefly as possible
+	const bool send_frame = ( g_bEnableTrackOnly == false ) && p_frame;
+	const bool frame_fits = ( frame_width <= sSharedMMapFrame_R1::MAX_WIDTH ) && ( frame_height <= sSharedMMapFrame_R1::MAX_HEIGHT );
+	int changed_rows = -1;		// -1 means export the whole frame
+	if ( send_frame && frame_fits && g_bEnableDeltaFrames )
+	{
+		changed_rows = diff_frame( p_frame, frame_width, frame_height, bottom_up );
+		if ( changed_rows >= 0 )
+			flags |= sSharedMemoryMap_R4::FLAG_DELTA_FRAMES;
+	}
+	if ( changed_rows < 0 )
+	{
+		// shared memory will no longer match the shadow
+		g_shadow_width = 0;
+		g_shadow_height = 0;
+	}
+
 
 	//
 	// Send data?
 
+	LARGE_INTEGER start;
+	QueryPerformanceCounter( &start );
+
 	// Message buffer
 	sSharedMMapBuffer_R1 proc_mech_buffer;
 	proc_mech_buffer.payload = 0;
 
-	DWORD mutex_result;
-	mutex_result = WaitForSingleObject( g_mutex_handle, 3000 );
-	if ( mutex_result == WAIT_OBJECT_0 )
-
+	if ( g_protocol == PROTOCOL_VER_SEQ )
 	{
+		// No mutex - each section is bracketed by its own counter, and we never wait for the client
+		seq_begin( &g_p_seq->frame );
+		g_p_shared_memory->version = PROTOCOL_VER_SEQ;
+		g_p_shared_memory->flags = flags;
+		if ( send_frame && ( changed_rows != 0 ) )
+			write_frame( frame_width, frame_height, par_x, par_y, p_frame, bottom_up, frame_fits, changed_rows );
+		seq_end( &g_p_seq->frame );
+
+		// If the client is changing the address list, leave the data alone until next frame.
+		// If it starts changing it while we update, what we wrote matches neither list, so
+		// try again. Only close the counter on data that matches an unchanged list - if the
+		// client keeps moving it, the counter stays odd and readers reject the data until
+		// a later frame gets a clean pass.
+		for ( int tries = 0; tries < SEQ_READ_TRIES; ++tries )
+		{
+			const LONG req = g_p_seq->peek_req;
+			if ( req & 1 )
+				break;
+			if ( !g_peek_open )
+			{
+				seq_begin( &g_p_seq->peek );
+				g_peek_open = true;
+			}
+			UpdatePeekInfo( &g_p_shared_memory->peek, p_sysmem );
+			MemoryBarrier();
+			if ( g_p_seq->peek_req == req )
+			{
+				seq_end( &g_p_seq->peek );
+				g_peek_open = false;
+				break;
+			}
+			++g_torn_reads;
+			g_peek_rebuild = true;
+		}
 
-		{ // ========================
-
+		// Message Processing - the payload fields already hand the buffers back and forth
+		ExecTerminal( &(g_p_shared_memory->buf_recv),
+					  &(g_p_shared_memory->buf_tohost),
+					  &(proc_mech_buffer) );
+	}
+	else
+	{
+		DWORD mutex_result;
+		mutex_result = WaitForSingleObject( g_mutex_handle, 3000 );
+		if ( mutex_result == WAIT_OBJECT_0 )
+		{
 			// Set version
 			g_p_shared_memory->version = PROTOCOL_VER;
 
 			// Store flags
 			g_p_shared_memory->flags = flags;
 
-			if ((g_bEnableTrackOnly == false) && p_frame)
-			{
-				// Update the frame sequence
-				++g_p_shared_memory->frame.seq;
-
-				// Copy frame properties
-				g_p_shared_memory->frame.image_fmt = 1; // = 32-bit RGBA
-				g_p_shared_memory->frame.width = frame_width;
-				g_p_shared_memory->frame.height = frame_height;
-				g_p_shared_memory->frame.par_x = par_x;
-				g_p_shared_memory->frame.par_y = par_y;
-
-				// Frame Buffer
-				UINT payload;
-				payload = frame_width * frame_height * 4;
-				if ( frame_width <= sSharedMMapFrame_R1::MAX_WIDTH && frame_height <= sSharedMMapFrame_R1::MAX_HEIGHT )
-				{
-					memcpy( g_p_shared_memory->frame.buffer, p_frame, payload );
-				}
-			}
+			// An unchanged delta frame leaves the buffer and the sequence alone
+			if ( send_frame && ( changed_rows != 0 ) )
+				write_frame( frame_width, frame_height, par_x, par_y, p_frame, bottom_up, frame_fits, changed_rows );
 
 			// Peek for special requested memory items
 			UpdatePeekInfo(&g_p_shared_memory->peek, p_sysmem);
@@ -527,77 +985,178 @@ void GameLink::Out( const UINT16 frame_width,
 						  &(g_p_shared_memory->buf_tohost),
 						  &(proc_mech_buffer) );
 
-		} // ========================
+			ReleaseMutex( g_mutex_handle );
+		}
+		else
+		{
+			++g_stall_timeouts;
+
+			// diff_frame() already took this frame into the shadow, but the rows never
+			// reached shared memory - start over with a whole frame next time
+			g_shadow_width = 0;
+			g_shadow_height = 0;
+		}
+	}
+
+	stall_report( start );
 
-		ReleaseMutex( g_mutex_handle );
+	// Mechanical Message Processing, out of mutex.
+	if ( proc_mech_buffer.payload )
+		ExecTerminalMech( &proc_mech_buffer );
+}
 
-		// Mechanical Message Processing, out of mutex.
-		if ( proc_mech_buffer.payload )
-			ExecTerminalMech( &proc_mech_buffer );
+//
+// peek_value
+//
+// What we send for one peek address.
+//
+static UINT8 peek_value( const UINT address, const UINT8* p_sysmem )
+{
+	// valid?
+	if ( address >= g_membase_size )
+		return 0; // <-- safe
+
+	for ( UINT idx = 0; idx < g_fixup_count; ++idx )
+	{
+		if ( g_p_fixups[idx].addr == address )
+			return g_p_fixups[idx].value( p_sysmem );
 	}
 
+	return p_sysmem[address];
 }
 
-void GameLink::UpdatePeekInfo(sSharedMMapPeek_R2* peek, const UINT8* p_sysmem)
+//
+// build_peek_runs
+//
+// Group the subscribed addresses by the memory block they live in. Fixed up
+// addresses are filed under every block they depend on.
+//
+static void build_peek_runs( const sSharedMMapPeek_R2* peek, const UINT count, const UINT8* p_sysmem )
 {
-	// Peek for special requested memory items
-	for (UINT pindex = 0;
-		pindex < peek->addr_count &&
-		pindex < sSharedMMapPeek_R2::PEEK_LIMIT;
-		++pindex)
+	std::vector< std::pair< UINT, UINT > > blocks;		// block, pindex
+	blocks.reserve( count );
+
+	for ( UINT pindex = 0; pindex < count; ++pindex )
 	{
-		// read address
-		UINT address;
-		address = peek->addr[pindex];
+		const UINT address = peek->addr[pindex];
+		if ( address >= g_membase_size )
+			continue;	// always zero
 
-		UINT8 data;
-		// valid?
-		if (address < g_membase_size)
+		bool fixed = false;
+		for ( UINT idx = 0; idx < g_fixup_count; ++idx )
 		{
-			data = p_sysmem[address]; // read data
+			if ( g_p_fixups[idx].addr == address )
+			{
+				for ( UINT w = 0; w < g_p_fixups[idx].watch_count; ++w )
+					blocks.push_back( std::make_pair( g_p_fixups[idx].watch[w] >> 8, pindex ) );
+				fixed = true;
+			}
 		}
-		else
+		if ( !fixed )
+			blocks.push_back( std::make_pair( address >> 8, pindex ) );
+	}
+	std::sort( blocks.begin(), blocks.end() );
+
+	g_peek_watch.clear();
+	g_peek_runs.clear();
+	bool watching = false;
+	for ( size_t idx = 0; idx < blocks.size(); ++idx )
+	{
+		if ( ( idx == 0 ) || ( blocks[idx].first != blocks[idx - 1].first ) )
+		{
+			sPeekRun run;
+			run.p_gen = GetCodeBlockGen( p_sysmem + ( blocks[idx].first << 8 ) );
+			run.gen = 0;
+			run.first = (UINT)g_peek_watch.size();
+			run.count = 0;
+
+			// not ours to watch (no generation), the full reads will cover it
+			watching = ( run.p_gen != NULL );
+			if ( watching )
+				g_peek_runs.push_back( run );
+		}
+		else if ( blocks[idx].second == blocks[idx - 1].second )
 		{
-			data = 0; // <-- safe
+			continue;	// a fixup with two watches in the same block
 		}
 
-		// write data
-		peek->data[pindex] = data;
+		if ( watching )
+		{
+			g_peek_watch.push_back( blocks[idx].second );
+			++g_peek_runs.back().count;
+		}
 	}
+}
+
+void GameLink::UpdatePeekInfo(sSharedMMapPeek_R2* peek, const UINT8* p_sysmem)
+{
+	const UINT count = std::min( peek->addr_count, (UINT)sSharedMMapPeek_R2::PEEK_LIMIT );
+	const UINT list_seq = g_p_peek_sub->list_seq;
+	UINT changed = 0;
 
-	// HACK: For Realms of Antiquity, some maps are slanted, and xpos is really based on x and y
-	// GridCarto doesn't support calculating xpos using y, so we need to do it here before sending it to GC
-	if (g_p_shared_memory->program_hash[3] == 0x503359be) // This is Realms of Antiquity
+	// Anything we can't follow by watching - a new list, a new program, new ROMs,
+	// or a client that doesn't tell us when its list changes - means a full read
+	bool full_read = ( list_seq == 0 ) || g_peek_rebuild || ( list_seq != g_peek_list_seq ) ||
+					 ( g_peek_epoch != nCodeCacheEpoch ) || ( ++g_peek_frames >= PEEK_FULL_READ_FRAMES );
+
+	if ( full_read )
 	{
-		UINT8 xpos = p_sysmem[0x1a009];
-		const UINT8 ypos = p_sysmem[0x1a007];
-		const UINT8 slant = p_sysmem[0x1a833];
-		const UINT8 rows = p_sysmem[0x1a82d];
-		switch (slant)
+		if ( list_seq != 0 )
 		{
-		case 0:	// left
-			xpos = xpos - ypos + (rows - 1);
-			break;
-		case 2:	// normal
-			break;
-		case 4:	// right
-			xpos = xpos + ypos;
-			break;
-		default:
-			break;
+			if ( g_peek_rebuild || ( list_seq != g_peek_list_seq ) )
+			{
+				g_peek_rebuild = false;
+				g_peek_list_seq = list_seq;
+				build_peek_runs( peek, count, p_sysmem );
+			}
+
+			// take the generations first, so a write while we read shows up next frame
+			for ( size_t idx = 0; idx < g_peek_runs.size(); ++idx )
+				g_peek_runs[idx].gen = *g_peek_runs[idx].p_gen;
 		}
-		// find where we're asking for xpos and replace it
-		for (UINT pindex = 0;
-			pindex < peek->addr_count &&
-			pindex < sSharedMMapPeek_R2::PEEK_LIMIT;
-			++pindex)
+		g_peek_epoch = nCodeCacheEpoch;
+		g_peek_frames = 0;
+
+		for ( UINT pindex = 0; pindex < count; ++pindex )
 		{
-			if (peek->addr[pindex] == 0x1a009)	// xpos
+			const UINT8 data = peek_value( peek->addr[pindex], p_sysmem );
+			if ( peek->data[pindex] != data )
 			{
-				peek->data[pindex] = xpos;
+				peek->data[pindex] = data;
+				++changed;
 			}
 		}
 	}
+	else
+	{
+		// Only the blocks that were written since we last looked
+		for ( size_t idx = 0; idx < g_peek_runs.size(); ++idx )
+		{
+			sPeekRun& run = g_peek_runs[idx];
+			const DWord gen = *run.p_gen;
+			if ( gen == run.gen )
+				continue;
+			run.gen = gen;
+
+			for ( UINT w = run.first; w < run.first + run.count; ++w )
+			{
+				const UINT pindex = g_peek_watch[w];
+				const UINT8 data = peek_value( peek->addr[pindex], p_sysmem );
+				if ( peek->data[pindex] != data )
+				{
+					peek->data[pindex] = data;
+					++changed;
+				}
+			}
+		}
+	}
+
+	if ( changed )
+	{
+		g_p_peek_sub->change_count = changed;
+		++g_p_peek_sub->change_seq;
+	}
+	g_p_peek_sub->list_ack = list_seq;
 }
 
 void GameLink::InitTerminal()
@@ -620,12 +1179,16 @@ void GameLink::ExecTerminal(GameLink::sSharedMMapBuffer_R1* p_inbuf,
 	GameLink::sSharedMMapBuffer_R1* p_procbuf)
 {
 	// Nothing from the host, or host hasn't acknowledged our last message.
-	if (p_inbuf->payload == 0) {
+	// In protocol 5 there's no mutex here, so payload is read exactly once and
+	// before any of the data it covers (see sSharedMMapSeq_R5).
+	const UINT16 payload = *(volatile UINT16*)&(p_inbuf->payload);
+	if (payload == 0) {
 		return;
 	}
-	if (p_outbuf->payload > 0) {
+	if (*(volatile UINT16*)&(p_outbuf->payload) > 0) {
 		return;
 	}
+	MemoryBarrier();
 
 	// Store output pointer
 	g_p_outbuf = p_outbuf;
@@ -633,12 +1196,148 @@ void GameLink::ExecTerminal(GameLink::sSharedMMapBuffer_R1* p_inbuf,
 	// Process mode select ...
 	if (p_inbuf->data[0] == ':')
 	{
-		// Acknowledge now, to avoid loops.
-		UINT16 payload = p_inbuf->payload;
-		p_inbuf->payload = 0;
-
 		// Copy out.
 		memcpy(p_procbuf->data, p_inbuf->data, payload);
 		p_procbuf->payload = payload;
+
+		// Acknowledge now, to avoid loops. This is a full barrier, so the client
+		// can't see the buffer as free until the copy is done.
+		_InterlockedExchange16((volatile short*)&(p_inbuf->payload), 0);
 	}
-}
\ No newline at end of file
+}
+
+//------------------------------------------------------------------------------
+// GameLink::RunTestClient
+//------------------------------------------------------------------------------
+//
+// A fake client for measuring what a busy consumer costs the emulator. Run it from
+// a second console against an emulator with GameLink on: classic99 -gamelinkclient 5 60
+// It reads every frame, rewrites the input and the peek list and sends a terminal
+// command as fast as it can. In protocol 4 it also holds the mutex for a millisecond
+// each pass, like a slow client would. The emulator side of the story is the
+// "GameLink R4/R5" stall line in the debug log - compare it between the two protocols.
+//
+// \returns 0 when the run finished, 1 if there was nothing to connect to.
+//
+int GameLink::RunTestClient( const int protocol, const int seconds )
+{
+	const bool seq = ( protocol == PROTOCOL_VER_SEQ );
+	HANDLE mmap = OpenFileMappingA( FILE_MAP_ALL_ACCESS, FALSE, seq ? GAMELINK_MMAP_NAME_SEQ : GAMELINK_MMAP_NAME );
+	if ( mmap == NULL ) {
+		printf( "GameLink client: no R%d mapping - is the emulator running with Protocol=%d?\n", protocol, protocol );
+		return 1;
+	}
+
+	// the layout after the core depends on the emulator's RAM size, so look that up first
+	sSharedMemoryMap_R4* p_map = reinterpret_cast< sSharedMemoryMap_R4* >(
+		MapViewOfFile( mmap, FILE_MAP_ALL_ACCESS, 0, 0, MEMORY_MAP_CORE_SIZE ) );
+	if ( p_map == NULL ) {
+		CloseHandle( mmap );
+		return 1;
+	}
+	const UINT ram_size = p_map->ram_size;
+	UnmapViewOfFile( p_map );
+
+	p_map = reinterpret_cast< sSharedMemoryMap_R4* >( MapViewOfFile( mmap, FILE_MAP_ALL_ACCESS, 0, 0,
+		MEMORY_MAP_CORE_SIZE + ram_size + sizeof( sSharedMMapFrameDelta_R1 ) + sizeof( sSharedMMapSeq_R5 ) ) );
+	if ( p_map == NULL ) {
+		CloseHandle( mmap );
+		return 1;
+	}
+	sSharedMMapSeq_R5* p_seq = reinterpret_cast< sSharedMMapSeq_R5* >(
+		((UINT8*)p_map) + MEMORY_MAP_CORE_SIZE + ram_size + sizeof( sSharedMMapFrameDelta_R1 ) );
+
+	HANDLE mutex = NULL;
+	if ( !seq ) {
+		mutex = OpenMutexA( SYNCHRONIZE, FALSE, GAMELINK_MUTEX_NAME );
+		if ( mutex == NULL ) {
+			printf( "GameLink client: can't open the R4 mutex\n" );
+			UnmapViewOfFile( p_map );
+			CloseHandle( mmap );
+			return 1;
+		}
+	}
+
+	UINT8* p_frame = (UINT8*)malloc( sSharedMMapFrame_R1::MAX_PAYLOAD );
+	UINT passes = 0, frames = 0, torn = 0, sent = 0, taken = 0;
+	UINT16 last_frame = p_map->frame.seq;
+	bool waiting = false;
+
+	printf( "GameLink client: protocol %d, %u bytes of RAM, %d seconds\n", protocol, ram_size, seconds );
+	const DWORD end = GetTickCount() + seconds * 1000;
+	while ( (int)( end - GetTickCount() ) > 0 )
+	{
+		++passes;
+		if ( !seq && ( WaitForSingleObject( mutex, 3000 ) != WAIT_OBJECT_0 ) ) {
+			continue;
+		}
+
+		// frame - in protocol 5, copy and check the counter didn't move under us
+		const LONG frame_seq = seq ? p_seq->frame : 0;
+		if ( frame_seq & 1 ) {
+			++torn;
+		} else {
+			MemoryBarrier();
+			const UINT16 fseq = p_map->frame.seq;
+			const UINT size = std::min< UINT >( p_map->frame.width * p_map->frame.height * 4, sSharedMMapFrame_R1::MAX_PAYLOAD );
+			if ( p_frame ) {
+				memcpy( p_frame, p_map->frame.buffer, size );
+			}
+			MemoryBarrier();
+			if ( seq && ( p_seq->frame != frame_seq ) ) {
+				++torn;
+			} else if ( fseq != last_frame ) {
+				last_frame = fseq;
+				++frames;
+			}
+		}
+
+		// input - a little mouse movement, no keys
+		if ( seq ) InterlockedIncrement( &p_seq->input );
+		p_map->input.mouse_dx = 1.0f;
+		p_map->input.mouse_dy = 0.0f;
+		p_map->input.mouse_btn = 0;
+		memset( p_map->input.keyb_state, 0, sizeof( p_map->input.keyb_state ) );
+		p_map->input.ready = sSharedMMapInput_R2::READY_GC;
+		if ( seq ) InterlockedIncrement( &p_seq->input );
+
+		// rewrite the peek list now and then
+		if ( ( passes & 15 ) == 0 ) {
+			if ( seq ) InterlockedIncrement( &p_seq->peek_req );
+			for ( UINT i = 0; i < 64; ++i ) {
+				p_map->peek.addr[i] = ( passes + i ) & 0xffff;
+			}
+			p_map->peek.addr_count = 64;
+			if ( seq ) InterlockedIncrement( &p_seq->peek_req );
+		}
+
+		// terminal - a command the emulator ignores, only sent once the last one was taken
+		const UINT16 payload = *(volatile UINT16*)&( p_map->buf_recv.payload );
+		if ( waiting && ( payload == 0 ) ) {
+			waiting = false;
+			++taken;
+		}
+		if ( !waiting && ( payload == 0 ) ) {
+			memcpy( p_map->buf_recv.data, ":nop", 4 );
+			_InterlockedExchange16( (volatile short*)&( p_map->buf_recv.payload ), 4 );
+			waiting = true;
+			++sent;
+		}
+
+		if ( !seq ) {
+			// hold on to it like a slow client
+			Sleep( 1 );
+			ReleaseMutex( mutex );
+		}
+		YieldProcessor();
+	}
+
+	printf( "GameLink client: %u passes, %u new frames, %u torn frame reads, %u/%u terminal commands taken\n",
+		passes, frames, torn, taken, sent );
+
+	free( p_frame );
+	if ( mutex ) CloseHandle( mutex );
+	UnmapViewOfFile( p_map );
+	CloseHandle( mmap );
+	return 0;
+}
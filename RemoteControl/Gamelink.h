@@ -111,6 +111,67 @@ namespace GameLink
 		UINT8 master_vol_r;
 	};
 
+	//
+	// sSharedMMapFrameDelta_R1
+	//
+	// What changed in the last frame, when delta frames are on (FLAG_DELTA_FRAMES).
+	// This lives after the RAM block, so R4 clients that don't know about it never
+	// see it. Rows are top-down, like the frame buffer.
+	//
+	struct sSharedMMapFrameDelta_R1
+	{
+		UINT16 seq;				// frame.seq this describes
+		UINT16 dirty_first;		// first changed row
+		UINT16 dirty_count;		// rows from dirty_first to the last changed row, 0 if none
+		UINT16 reserved0;
+		UINT frame_hash;		// hash of the whole frame, equal frames hash equal
+		UINT8 row_dirty[ sSharedMMapFrame_R1::MAX_HEIGHT ];	// 1 for each row rewritten in this frame
+	};
+
+	//
+	// sSharedMMapSeq_R5
+	//
+	// Protocol 5 uses the same layout as 4, but drops the mutex. Instead each section
+	// has a sequence counter, owned by whoever writes that section. The writer makes it
+	// odd, writes the section, then makes it even again. A reader copies the section
+	// and tries again if the counter was odd or has moved. Nobody ever waits on anybody.
+	// If the client changes peek_req while the emulator fills peek.data, peek stays odd
+	// (for a frame or more) until the emulator gets a pass that matches one list.
+	// This lives after sSharedMMapFrameDelta_R1.
+	//
+	// The terminal buffers (buf_recv, buf_tohost) have no counter - payload is the
+	// handshake. The sender fills data[] and only then sets payload, with an interlocked
+	// store. The receiver reads payload, copies data[], and only then clears payload with
+	// an interlocked store, which hands the buffer back. Neither side touches data[]
+	// while the other one owns it.
+	//
+	struct sSharedMMapSeq_R5
+	{
+		volatile LONG frame;		// emulator: version, flags, frame (and the frame delta)
+		volatile LONG peek;			// emulator: peek.data
+		volatile LONG peek_req;		// client: peek.addr_count, peek.addr
+		volatile LONG input;		// client: input, audio - the emulator never writes these in protocol 5,
+									// a new even value means new input (there is no ready flag to clear)
+	};
+
+	//
+	// sSharedMMapPeekSub_R1
+	//
+	// Peek subscriptions. A client that sets list_seq to anything but zero promises to
+	// change it whenever it rewrites peek.addr_count or peek.addr. The emulator then only
+	// re-reads an address when memory around it has been written, and only writes the
+	// peek.data bytes that actually changed. change_seq tells the client whether it needs
+	// to look at peek.data at all. With list_seq left at zero every address is re-read
+	// every frame, as before. This lives after sSharedMMapSeq_R5.
+	//
+	struct sSharedMMapPeekSub_R1
+	{
+		UINT list_seq;			// client: bumped after each change to the address list
+		UINT list_ack;			// emulator: the list_seq peek.data follows
+		UINT change_seq;		// emulator: bumped on each frame that changed peek.data
+		UINT change_count;		// emulator: how many peek.data bytes that frame changed
+	};
+
 	//
 	// sSharedMemoryMap_R4
 	//
@@ -123,6 +184,8 @@ namespace GameLink
 			FLAG_WANT_MOUSE			= 1 << 1,
 			FLAG_NO_FRAME			= 1 << 2,
 			FLAG_PAUSED				= 1 << 3,
+			FLAG_DELTA_FRAMES		= 1 << 4,	// frame.seq only moves when the picture changes, see sSharedMMapFrameDelta_R1
+			FLAG_PEEK_CHANGES		= 1 << 5,	// sSharedMMapPeekSub_R1 is maintained
 		};
 
 		enum {
@@ -161,6 +224,10 @@ namespace GameLink
 	extern void SetGameLinkEnabled(const bool bEnabled);
 	extern bool GetTrackOnlyEnabled(void);
 	extern void SetTrackOnlyEnabled(const bool bEnabled);
+	extern bool GetDeltaFramesEnabled(void);
+	extern void SetDeltaFramesEnabled(const bool bEnabled);
+	extern int GetProtocol(void);
+	extern void SetProtocol(const int protocol);
 
 	extern int Init( const bool trackonly_mode );
 	
@@ -180,6 +247,7 @@ namespace GameLink
 					 const double source_ratio,
 					 const bool need_mouse,
 					 const UINT8* p_frame,
+					 const bool bottom_up,
 					 const UINT8* p_sysmem );
 
 	extern void UpdatePeekInfo(sSharedMMapPeek_R2* peek, const UINT8* p_sysmem);
@@ -194,6 +262,8 @@ namespace GameLink
 
 	extern bool GetVideoNativeFormat();
 
+	extern int RunTestClient( const int protocol, const int seconds );
+
 }; // namespace GameLink
 
 //==============================================================================
@@ -61,17 +61,12 @@ struct Info_HDV {
 };
 Info_HDV g_infoHdv = { std::string(UNKNOWN_VOLUME_NAME), 0 };
 
-UINT8* framedataRC;	// reversed framebuffer
-
 UINT64 iCurrentTicks;						// Used to check the repeat interval
 static std::unordered_set<UINT8> exclusionSet;		// list of VK codes that will not be passed through to the emulator
 
 bool bHardDiskIsLoaded = false;			// If HD is loaded, use it instead of floppy
 bool bFloppyIsLoaded = false;
 
-// Private Prototypes
-static void reverseScanlines(uint8_t* destination, uint8_t* source, uint32_t width, uint32_t height, uint8_t depth);
-
 //===========================================================================
 // Global functions
 
@@ -101,15 +96,47 @@ void RemoteControlManager::setTrackOnlyEnabled(bool bEnabled)
 	return GameLink::SetTrackOnlyEnabled(bEnabled);
 }
 
+//===========================================================================
+
+bool RemoteControlManager::isDeltaFramesEnabled()
+{
+	return GameLink::GetDeltaFramesEnabled();
+}
+
+//===========================================================================
+
+void RemoteControlManager::setDeltaFramesEnabled(bool bEnabled)
+{
+	return GameLink::SetDeltaFramesEnabled(bEnabled);
+}
+
+//===========================================================================
+
+int RemoteControlManager::getProtocol()
+{
+	return GameLink::GetProtocol();
+}
+
+//===========================================================================
+
+void RemoteControlManager::setProtocol(int protocol)
+{
+	return GameLink::SetProtocol(protocol);
+}
+
+//===========================================================================
+
+// Fake GameLink client against another running copy, for stall measurements
+int RemoteControlManager::runTestClient(int protocol, int seconds)
+{
+	return GameLink::RunTestClient(protocol, seconds);
+}
+
 //===========================================================================
 LPBYTE RemoteControlManager::initializeMem(UINT size)
 {
 	if (GameLink::GetGameLinkEnabled())
 	{
-		if (framedataRC == NULL)
-		{
-			framedataRC = (UINT8*)malloc((256 + 16) * 4 * (192 + 16) * 4 * 4);
-		}
 		LPBYTE _mem = (LPBYTE)GameLink::AllocRAM(size);
 
 		// initialize the gamelink previous input to 0
@@ -131,7 +158,6 @@ bool RemoteControlManager::destroyMem()
 	if (GameLink::GetGameLinkEnabled())
 	{
 		GameLink::Term();
-		free(framedataRC);
 		return true;
 	}
 	return false;
@@ -297,14 +323,13 @@ void RemoteControlManager::sendOutput(UINT16 width, UINT16 height, UINT8 *pFrame
 {
 	if (GameLink::GetGameLinkEnabled()) {
 		// here send the last drawn frame to GameLink
-		// We could efficiently send to GameLink g_pFramebufferbits with GetFrameBufferWidth/GetFrameBufferHeight, but the scanlines are reversed
-		// We instead memcpy each scanline of the bitmap of the frame in reverse into another buffer, and pass that to GameLink.
-		// When GridCartographer/GameLink allows to pass in flags specifying the x/y/w/h etc...,
+		// The scanlines are stored bottom to top, GameLink flips them (and sets alpha) as it
+		// writes them into shared memory, so we don't need a reversed copy of the frame.
 
 		if (pFramebufferbits == NULL)
 		{
 			// Don't send out video, just handle out-of-band commands
-			GameLink::Out(systemMemory);
+			GameLink::Out(staticCPU);
 			return;
 		}
 
@@ -313,13 +338,13 @@ void RemoteControlManager::sendOutput(UINT16 width, UINT16 height, UINT8 *pFrame
 
 		if (pFramebufferbits != NULL)
 		{
-			reverseScanlines(framedataRC, pFramebufferbits, width, height, 4);
 			GameLink::Out(
 				width,
 				height,
 				1.0,								// image ratio
 				g_gamelink.want_mouse,
-				framedataRC,
+				pFramebufferbits,
+				true,								// bottom up
 				staticCPU);					// Main memory pointer
 		}
 	}
@@ -332,26 +357,6 @@ void RemoteControlManager::sendOutput(UINT16 width, UINT16 height, UINT8 *pFrame
 // Utility
 // --------------------------------------------
 
-// The framebuffer might have its scanlines inverted, from bottom to top
-// To send a correct bitmap out to a 3rd party program we need to reverse the scanlines
-// And set the alpha channel to 0xff
-void reverseScanlines(uint8_t* destination, uint8_t* source, uint32_t width, uint32_t height, uint8_t depth)
-{
-	uint32_t linesize = width * depth;
-	uint8_t* loln = source;
-	uint8_t* hiln = destination + (height - 1) * (uint_fast64_t)linesize;	// first pixel of the last line
-	for (size_t i = 0; i < height; i++)
-	{
-		memcpy(hiln, loln, linesize);
-		for (size_t j = (depth - 1); j < linesize; j += depth)
-		{
-			hiln[j] = 0xff;
-		}
-		loln = loln + linesize;
-		hiln = hiln - linesize;
-	}
-}
-
 // CRC32 implementation Copyright (C) 1986 Gary S. Brown
 static uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
 0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -21,11 +21,15 @@ public:
 	static void RemoteControlManager::setRemoteControlEnabled(bool bEnabled);
 	static bool RemoteControlManager::isTrackOnlyEnabled();
 	static void RemoteControlManager::setTrackOnlyEnabled(bool bEnabled);
+	static bool RemoteControlManager::isDeltaFramesEnabled();
+	static void RemoteControlManager::setDeltaFramesEnabled(bool bEnabled);
+	static int RemoteControlManager::getProtocol();
+	static void RemoteControlManager::setProtocol(int protocol);
+	static int RemoteControlManager::runTestClient(int protocol, int seconds);
 
 	UINT const kMinRepeatInterval = 400;	// Minimum keypress repeat message interval in ms
 };
 
-void reverseScanlines(uint8_t* destination, uint8_t* source, uint32_t width, uint32_t height, uint8_t depth);
 uint32_t crc32buf(char* buf, size_t len);
 extern RemoteControlManager RCManager;
 
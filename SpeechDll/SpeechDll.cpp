@@ -88,6 +88,34 @@ bool SpeechWrite(unsigned char byte, bool /*fRetry*/) {
 	}
 }
 
+// Save the chip and speech ROM state. Returns the number of bytes
+// needed, and only copies if pBuf is big enough. 0 if there's no chip.
+int SpeechSaveState(unsigned char *pBuf, int nMax) {
+	if ((NULL == pChip) || (NULL == pRom)) {
+		return 0;
+	}
+	int nChip = pChip->save_state(NULL, 0);
+	int nRom = pRom->save_state(NULL, 0);
+	if ((NULL != pBuf) && (nChip + nRom <= nMax)) {
+		pChip->save_state(pBuf, nChip);
+		pRom->save_state(pBuf+nChip, nRom);
+	}
+	return nChip + nRom;
+}
+
+// Restore a state from SpeechSaveState. Fails if it came from a
+// different build of the DLL.
+bool SpeechLoadState(const unsigned char *pBuf, int nLen) {
+	if ((NULL == pChip) || (NULL == pRom)) {
+		return false;
+	}
+	int nChip = pChip->save_state(NULL, 0);
+	if (nLen != nChip + pRom->save_state(NULL, 0)) {
+		return false;
+	}
+	return pChip->load_state(pBuf, nChip) && pRom->load_state(pBuf+nChip, nLen-nChip);
+}
+
 void SpeechProcess(unsigned char *pBuf, int nMax) {
 	// get the data - 16 bit
 	if (NULL != pChip) {
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <cstring>
 
 // this enables the LOGMASKED to all emit
 //#define VERBOSE_DEBUG
@@ -27,16 +28,63 @@ typedef struct _mc {
     
 } machine_config;
         
+// save states - the devices list their state with save_item() when
+// they start, and the whole list is copied in and out as one block
+#define NAME(x) x, #x
+#define MAX_SAVE_ITEMS 128
+
 class device_t {
 public:
     device_t(const machine_config &, int , const void *, device_t *, int clk) 
-        : clock_rate(clk)
+        : clock_rate(clk), save_count(0)
     { }
 
     int clock() { return clock_rate; }
 
+    template<typename T> void save_item(T &item, const char * /*name*/) {
+        // device_start can run more than once, only list each item once
+        for (int idx=0; idx<save_count; idx++) {
+            if (save_list[idx].ptr == (void*)&item) return;
+        }
+        if (save_count < MAX_SAVE_ITEMS) {
+            save_list[save_count].ptr = (void*)&item;
+            save_list[save_count].size = sizeof(item);
+            ++save_count;
+        }
+    }
+
+    // copy the state out - returns the size needed, pBuf may be NULL to ask
+    int save_state(unsigned char *pBuf, int nMax) {
+        int pos = 0;
+        for (int idx=0; idx<save_count; idx++) {
+            if ((NULL != pBuf) && (pos + save_list[idx].size <= nMax)) {
+                memcpy(pBuf+pos, save_list[idx].ptr, save_list[idx].size);
+            }
+            pos += save_list[idx].size;
+        }
+        return pos;
+    }
+
+    // copy the state back in - it must be the same size it was saved at
+    bool load_state(const unsigned char *pBuf, int nLen) {
+        if (nLen != save_state(NULL, 0)) {
+            return false;
+        }
+        int pos = 0;
+        for (int idx=0; idx<save_count; idx++) {
+            memcpy(save_list[idx].ptr, pBuf+pos, save_list[idx].size);
+            pos += save_list[idx].size;
+        }
+        return true;
+    }
+
 private:
     int clock_rate;
+    struct {
+        void *ptr;
+        int size;
+    } save_list[MAX_SAVE_ITEMS];
+    int save_count;
 };
 
 class device_sound_interface {
@@ -144,4 +144,8 @@ void speechrom_device::device_start()
 void speechrom_device::device_start(unsigned char *pRom, int romLen) {
 	m_speechrom_data = pRom;
 	m_speechROMlen = romLen;
+
+	save_item(NAME(m_speechROMaddr));
+	save_item(NAME(m_load_pointer));
+	save_item(NAME(m_ROM_bits_count));
 }
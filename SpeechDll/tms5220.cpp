@@ -448,7 +448,6 @@ static const uint8_t reload_table[4] = { 0, 2, 4, 6 }; //sample count reload for
 
 void tms5220_device::register_for_save_states()
 {
-#if 0
 	// for sanity purposes these variables should be in the same order as in tms5220.h!
 
 	// 5110 specific stuff
@@ -532,7 +531,6 @@ void tms5220_device::register_for_save_states()
 	save_item(NAME(m_rs_ws));
 	save_item(NAME(m_read_latch));
 	save_item(NAME(m_write_latch));
-#endif
 }
 
 
@@ -69,6 +69,10 @@
 #include "..\disk\ImageDisk.h"
 #include "..\disk\TICCDisk.h"
 #include "loadsave_brk.h"
+#include "..\debugger\trace.h"
+#include "..\debugger\profiler.h"
+#include "..\console\savestate.h"
+#include "..\console\rewind.h"
 
 extern CPU9900 * volatile pCurrentCPU;
 extern CPU9900 *pCPU, *pGPU;
@@ -189,9 +193,7 @@ HBITMAP hHeatBmp=NULL;
 int g_DiskCfgNum;
 
 // whether logging disassembly to disk
-FILE *fpDisasm = NULL;
 int disasmLogType = 0;  // 0 = all, 1 = exclude < 2000
-CRITICAL_SECTION csDisasm;  // initialized in tiemul.c
 
 #ifndef GET_X_LPARAM
 #define GET_X_LPARAM(x) (x&0xffff)
@@ -1192,6 +1194,37 @@ LONG_PTR FAR PASCAL myproc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 				}
 				break;
 
+			case ID_FILE_SAVESTATE:
+			case ID_FILE_LOADSTATE:
+				{
+					// states are only good for the same system and cartridge
+					char szState[MAX_PATH] = "";
+					OPENFILENAME ofn;
+					memset(&ofn, 0, sizeof(OPENFILENAME));
+					ofn.lStructSize    = sizeof(OPENFILENAME);
+					ofn.hwndOwner      = hwnd;
+					ofn.lpstrFilter    = "Classic99 State (*.c99state)\0*.c99state\0All Files\0*.*\0\0";
+					ofn.lpstrDefExt    = "c99state";
+					ofn.lpstrFile      = szState;
+					ofn.nMaxFile       = MAX_PATH;
+					if (LOWORD(wParam) == ID_FILE_SAVESTATE) {
+						ofn.Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST | OFN_NOCHANGEDIR;
+						if (GetSaveFileName(&ofn)) {
+							if (!SaveStateFile(szState)) {
+								MessageBox(hwnd, "Failed to save the state - check the debug log.", "Classic99 Error", MB_OK);
+							}
+						}
+					} else {
+						ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST | OFN_NOCHANGEDIR;
+						if (GetOpenFileName(&ofn)) {
+							if (!LoadStateFile(szState)) {
+								MessageBox(hwnd, "Failed to load the state - check the debug log.", "Classic99 Error", MB_OK);
+							}
+						}
+					}
+				}
+				break;
+
 			case ID_FILE_RESET:
 			case ID_FILE_WARMRESET:
 			case ID_FILE_SCRAMBLERESET:
@@ -1266,6 +1299,7 @@ LONG_PTR FAR PASCAL myproc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 				    }
 				    nCurrentDSR=-1;
 				    memset(nDSRBank, 0, sizeof(nDSRBank));
+				    InvalidateMemoryMap();
 				    doLoadInt=false;						// no pending LOAD
 				    vdpReset(true);	    					// TODO: should move these vars into the reset function
 				    vdpaccess=0;							// No VDP address writes yet 
@@ -1829,6 +1863,35 @@ LONG_PTR FAR PASCAL myproc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 				ShowWindow(hBugWnd, SW_SHOW);
 				break;
 
+			case ID_EDIT_PROFILER:
+				if (bProfileActive) {
+					StopProfile();
+					CheckMenuItem(GetMenu(hwnd), ID_EDIT_PROFILER, MF_UNCHECKED);
+					MessageBox(hwnd, "Profile written to profile.txt, and profile.folded for flamegraph.pl", "Classic99", MB_OK);
+				} else {
+					char szSymbols[MAX_PATH] = "";
+					if (IDYES == MessageBox(hwnd, "Profile the CPU until this is selected again.\r\n"
+						"Do you want to load a symbol file for the report?", "Classic99", MB_YESNO)) {
+						OPENFILENAME ofn;
+						memset(&ofn, 0, sizeof(OPENFILENAME));
+						ofn.lStructSize    = sizeof(OPENFILENAME);
+						ofn.hwndOwner      = hwnd;
+						ofn.lpstrFilter    = "Symbol file\0*.*\0\0";
+						ofn.lpstrFile      = szSymbols;
+						ofn.nMaxFile       = MAX_PATH;
+						ofn.Flags          = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST | OFN_NOCHANGEDIR;
+						if (!GetOpenFileName(&ofn)) {
+							szSymbols[0] = '\0';
+						}
+					}
+					if (StartProfile("profile", szSymbols)) {
+						CheckMenuItem(GetMenu(hwnd), ID_EDIT_PROFILER, MF_CHECKED);
+					} else {
+						MessageBox(hwnd, "Not enough memory to start the profiler.", "Classic99 Error", MB_OK);
+					}
+				}
+				break;
+
 			case ID_EDIT_HEATMAP: 
 				// activate heatmap screen
 				if (NULL == hHeatMap) {
@@ -2958,6 +3021,7 @@ bool AddBreakpoint(char *buf1) {
 		BreakPoints[nBreakPoints].Bank=bank;
 		strcpy(buf1, FormatBreakpoint(nBreakPoints));
 		nBreakPoints++;
+		bBreakMapDirty=true;
 		bRet=true;
 	} else {
 		int nType=BREAK_NONE;
@@ -3193,6 +3257,7 @@ bool AddBreakpoint(char *buf1) {
 			BreakPoints[nBreakPoints].Mask=Mask;
 			strcpy(buf1, FormatBreakpoint(nBreakPoints));
 			nBreakPoints++;
+			bBreakMapDirty=true;
 			bRet=true;
 		}
 	}
@@ -3301,6 +3366,7 @@ INT_PTR CALLBACK DebugBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 						}
 						// rebuild the breakpoint list
 						nBreakPoints=0;
+						bBreakMapDirty=true;
 						n=SendDlgItemMessage(hwnd, IDC_COMBO1, CB_GETCOUNT, 0, 0);
 						while (n > 0) {
 							char buf[32];
@@ -3679,6 +3745,7 @@ INT_PTR CALLBACK DebugBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 											if ((ROMMAP[x]) && (romok)) {
 												// need to be direct
 												staticCPU[x]=y;
+												InvalidateMemoryMap(true);
 											} else {
 												// do this so side effects work
 												wcpubyte(x, y);
@@ -3701,6 +3768,7 @@ INT_PTR CALLBACK DebugBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 											    if ((ROMMAP[x]) && (romok)) {
 												    // need to be direct
 												    staticCPU[x]=y;
+												    InvalidateMemoryMap(true);
 											    } else {
 												    // do this so side effects work
 												    wcpubyte(x, y);
@@ -3799,6 +3867,7 @@ INT_PTR CALLBACK DebugBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 										}
 										// force VDP to update
 										redraw_needed=REDRAW_LINES;
+										RewindDirtyAll();		// the rewind buffer doesn't see direct writes
 										break;
 
 									case MEMGROM:		// GROM 
@@ -3966,13 +4035,11 @@ INT_PTR CALLBACK DebugBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 					break;
 
                 case ID_VIEW_LOGDISASMTODISK:
-                    EnterCriticalSection(&csDisasm);
-                    if (fpDisasm) {
-                        fclose(fpDisasm);
-                        fpDisasm = NULL;
+                    if (bTraceActive) {
+                        StopTrace();
                         CheckMenuItem(GetMenu(hwnd), ID_VIEW_LOGDISASMTODISK, MF_UNCHECKED);
                     } else {
-                        int ret = MessageBox(hwnd, "This will write all disassembly to 'disasm.txt' until you turn it off,\r\n"
+                        int ret = MessageBox(hwnd, "This will trace all execution to 'disasm.trc' until you turn it off,\r\n"
                             "quickly creating a very large file. Do you want to include console ROM (interrupt, etc)?\r\n"
                             "Click Yes to include, No to exclude, or Cancel to abort logging.", "Classic99", MB_YESNOCANCEL);
                         if (ret != IDCANCEL) {
@@ -3982,15 +4049,16 @@ INT_PTR CALLBACK DebugBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
                                 disasmLogType = 1;  // exclude > 0x2000
                             }
 
-                            fpDisasm = fopen("disasm.txt", "w");
-                            if (NULL == fpDisasm) {
+                            bool bWrites = (IDYES == MessageBox(hwnd, "Also record every CPU memory write?", "Classic99", MB_YESNO));
+                            if (!StartTrace("disasm.trc", bWrites)) {
                                 MessageBox(hwnd, "Failed to open file!", "Classic99 Error", MB_OK);
                             } else {
                                 CheckMenuItem(GetMenu(hwnd), ID_VIEW_LOGDISASMTODISK, MF_CHECKED);
+                                MessageBox(hwnd, "When you are done, convert the trace to text with:\r\n"
+                                    "classic99 -tracedump disasm.trc disasm.txt", "Classic99", MB_OK);
                             }
                         }
                     }
-                    LeaveCriticalSection(&csDisasm);
                     break;
 
 				case ID_MAKE_SAVEPROGRAM:
@@ -4430,7 +4498,7 @@ void DebugUpdateThread(void*) {
 				csOut+="\r\n";
 
 				// VDP tables
-				sprintf(buf1, " SIT  %04X\r\n", SIT);
+				sprintf(buf1, " SIT  %04X   Skip %3d\r\n", SIT, nSkippedLines);
 				csOut+=buf1;
 				sprintf(buf1, " SDT  %04X   SAL  %04X\r\n", SDT, SAL);
 				csOut+=buf1;
@@ -4445,6 +4513,8 @@ void DebugUpdateThread(void*) {
 					sprintf(buf1, "  CT  %04X   Size %04X\r\n", CT, CTsize);
 				}
 				csOut+=buf1;
+				sprintf(buf1, "Frame %5dus max %5dus drop %d\r\n", nFrameLatencyAvg, nFrameLatencyMax, nFramesDropped);
+				csOut+=buf1;
 
 				csOut+="\r\n";
 
@@ -9,6 +9,8 @@
 
 #include "tiemul.h"
 #include "ams.h"
+#include "savestate.h"
+#include "rewind.h"
 #include "../RemoteControl/RemoteControlManager.h"
 
 // temporary hack - might be right, needs testing
@@ -62,9 +64,28 @@ int systemMemorySize = MaxMapperPages * MaxPageSize;
 int staticCPUSize = 0x10000;
 Byte* systemMemory;		// MaxMapperPages * MaxPageSize
 Byte* staticCPU;				// 0x10000 (64k) for the base memory
+DWord* codeBlockGen = NULL;		// write generation for each 256 bytes of staticCPU+systemMemory (CPU decode cache)
 
 static bool mapperRegistersEnabled = false;
 
+// Resolved mapping for each 4k CPU page. This is only recalculated when the
+// mapper registers or mode change, so the byte accessors don't have to redo
+// the decode on every access. Only meaningful for the mappable pages.
+static const bool pageMappable[MaxMapperRegisters] = {
+	false, false, true,  true,			// >2000 and >3000
+	false, false, false, false,
+	false, false, true,  true,			// >A000 through >F000
+	true,  true,  true,  true
+};
+static Byte* pageHost[MaxMapperRegisters] = { NULL };		// host memory behind the page, NULL if out of range
+static DWord pageMapped[MaxMapperRegisters] = { 0 };		// AMS address of the page (for breakpoints and code generations)
+
+// AMS pages only get their power-up contents the first time they are
+// written. Nothing else touches them, so a large card only costs real
+// memory (and time at reset) for the pages software writes. A page that
+// is only ever read shows whatever the array already holds.
+static Byte pageReady[MaxMapperPages] = { 0 };
+
 // references into C99
 extern bool bWarmBoot;
 
@@ -72,6 +93,62 @@ extern bool bWarmBoot;
 extern struct _break BreakPoints[];
 extern int nBreakPoints;
 
+// Give an AMS page its power-up contents if nothing has used it yet
+static void PrepareAmsPage(DWord page)
+{
+	if ((page < (DWord)MaxMapperPages) && (!pageReady[page])) {
+		pageReady[page] = 1;
+		memrnd(systemMemory + (page << 12), MaxPageSize);
+		RewindDirtyAms[page] = 1;
+	}
+}
+
+// Work out which AMS page a mapper register selects
+static DWord MapperPageExtension(int reg)
+{
+	DWord wMask = 0x0000FF00;  // TODO: set for appropriate memory size	
+
+#ifdef ENABLE_HUGE_AMS
+    wMask = MaxMapperPages-1;
+    // use all 16 bits, but byte swapped (for compatibility)
+    DWORD value = ((mapperRegisters[reg]&0xff)<<8)|((mapperRegisters[reg]&0xff00)>>8);
+    // mask it down to only the actually valid bits
+    return (value & wMask);
+#else
+    // regular AMS is just the upper byte - wMask of 0xff gives 256x4k or 1MB
+	return (DWord)((mapperRegisters[reg] & wMask) >> 8);
+#endif
+}
+
+// Update the resolved pointer for one CPU page
+static void ResolveMapperPage(int reg)
+{
+	if (!pageMappable[reg]) {
+		return;
+	}
+
+	DWord pageExtension = reg;
+	if (mapperMode == Map) {
+		pageExtension = MapperPageExtension(reg);
+	}
+
+	pageMapped[reg] = (pageExtension << 12);
+	if ((NULL == systemMemory) || (pageMapped[reg] + MaxPageSize > (DWord)systemMemorySize)) {
+		// the accessors will complain about it
+		pageHost[reg] = NULL;
+	} else {
+		pageHost[reg] = systemMemory + pageMapped[reg];
+	}
+}
+
+static void ResolveMapperPages()
+{
+	for (int reg = 0; reg < MaxMapperRegisters; reg++)
+	{
+		ResolveMapperPage(reg);
+	}
+}
+
 void InitializeMemorySystem(EmulationMode cardMode)
 {
 	// Classic99 specific debug call
@@ -85,6 +162,9 @@ void InitializeMemorySystem(EmulationMode cardMode)
 	LPBYTE unifiedmem = RCManager.initializeMem(staticCPUSize + systemMemorySize); // One unified shm
 	staticCPU = unifiedmem;
 	systemMemory = unifiedmem + staticCPUSize;
+	if (NULL == codeBlockGen) {
+		codeBlockGen = (DWord*)calloc((staticCPUSize + systemMemorySize) >> 8, sizeof(DWord));
+	}
 
 	// 1. Save chosen card mode
 	emulationMode = cardMode;
@@ -105,9 +185,14 @@ void InitializeMemorySystem(EmulationMode cardMode)
 #endif
 
 	if (!bWarmBoot) {
-		memrnd(systemMemory, systemMemorySize);
+		// AMS pages are prepared as they are used (see PrepareAmsPage)
+		memset(pageReady, 0, sizeof(pageReady));
 		memrnd(staticCPU, staticCPUSize);
 	}
+
+	// the base pointers, registers and contents all changed
+	ResolveMapperPages();
+	InvalidateMemoryMap(true);
 }
 
 void SetAmsMemorySize(AmsMemorySize size)
@@ -129,8 +214,10 @@ void ShutdownMemorySystem()
 		mapperRegisters[reg] = (reg << 8);
 	}
 
-	memrnd(systemMemory, systemMemorySize);
+	memset(pageReady, 0, sizeof(pageReady));
 	memrnd(staticCPU, staticCPUSize);
+	ResolveMapperPages();
+	InvalidateMemoryMap(true);
 }
 
 void SetMemoryMapperMode(MapperMode mode)
@@ -149,28 +236,16 @@ void SetMemoryMapperMode(MapperMode mode)
 		mapperMode = Passthrough;
 		//debug_write("Set AMS mapper mode to PASSTHROUGH");
 	}
+	ResolveMapperPages();
+	InvalidateMemoryMap();
 }
 
 // TODO: placeholder function - dump the registers to the debug log for now
 void dumpMapperRegisters() {
     debug_write("AMS Mappers:");
     for (int idx=0; idx<MaxMapperRegisters; ++idx) {
-        // TODO: all this addressing BS needs to be in a separate function too... ;) Copied from the read function...
-	    DWord wMask = 0x0000FF00;  // TODO: set for appropriate memory size	
-	    DWord pageExtension;
-
-        #ifdef ENABLE_HUGE_AMS
-            wMask = MaxMapperPages-1;
-            // use all 16 bits, but byte swapped (for compatibility)
-            DWORD value = ((mapperRegisters[idx]&0xff)<<8)|((mapperRegisters[idx]&0xff00)>>8);
-            // mask it down to only the actually valid bits
-            pageExtension = (value & wMask);
-        #else
-            // regular AMS is just the upper byte - wMask of 0xff gives 256x4k or 1MB
-		    pageExtension = (DWord)((mapperRegisters[idx] & wMask) >> 8);
-        #endif
-	
-        bool isRam = ((idx >= 2)&&(idx<=3)) || ((idx>=10)&&(idx<=15));
+	    DWord pageExtension = MapperPageExtension(idx);
+        bool isRam = pageMappable[idx];
         debug_write("%X: >%04X (%04X -> %06X) %c", idx, mapperRegisters[idx], 0x1000*idx, pageExtension<<12, isRam ? ' ' : '*');
     }
     debug_write("(* = not mappable)");
@@ -220,6 +295,8 @@ void WriteMapperRegisterByte(Byte reg, Byte value, bool highByte, bool force)
 					mapperRegisters[reg] = ((mapperRegisters[reg] & 0xFF00) | value);
 				}
 				// debug_write("AMS Register %X now >%04X", reg, mapperRegisters[reg]);
+				ResolveMapperPage(reg);
+				InvalidateMemoryMap();
 				break;
 
 			case None:
@@ -270,24 +347,16 @@ Byte ReadRawAMS(int address) {
 }
 void WriteRawAMS(int address, int value) {
     address &= 0xfffff;     // TODO: assumes 1MB limit
+    PrepareAmsPage(address >> 12);
     systemMemory[address] = value&0xff;
+    RewindDirtyAms[address >> REWIND_PAGE_SHIFT] = 1;
+    ++codeBlockGen[(staticCPUSize + address) >> 8];
 }
 
 Byte ReadMemoryByte(Word address, READACCESSTYPE rmw)
 {
-	DWord wMask = 0x0000FF00;  // TODO: set for appropriate memory size	
-	DWord pageBase = ((DWord)address & 0x00000FFF);
 	DWord pageOffset = ((DWord)address & 0x0000F000) >> 12;
-	DWord pageExtension = pageOffset;
-
     bool bTrueAccess = (rmw == ACCESS_READ);
-	bool bIsMapMode = (mapperMode == Map);
-	bool bIsRAM = (!ROMMAP[address]) && (((pageOffset >= 0x2) && (pageOffset <= 0x3)) || ((pageOffset >= 0xA) && (pageOffset <= 0xF)));
-	bool bIsMappable = (((pageOffset >= 0x2) && (pageOffset <= 0x3)) || ((pageOffset >= 0xA) && (pageOffset <= 0xF)));
-
-#ifdef ENABLE_HUGE_AMS
-    wMask = MaxMapperPages-1;
-#endif
 
 #if 0
 	// little hack to dump AMS memory for making loader files
@@ -317,138 +386,124 @@ Byte ReadMemoryByte(Word address, READACCESSTYPE rmw)
 	}
 #endif
 
-	if (bIsMapMode && bIsMappable)
-	{
-#ifdef ENABLE_HUGE_AMS
-        // use all 16 bits, but byte swapped (for compatibility)
-        DWORD value = ((mapperRegisters[pageOffset]&0xff)<<8)|((mapperRegisters[pageOffset]&0xff00)>>8);
-        // mask it down to only the actually valid bits
-        pageExtension = (value & wMask);
-#else
-        // regular AMS is just the upper byte - wMask of 0xff gives 256x4k or 1MB
-		pageExtension = (DWord)((mapperRegisters[pageOffset] & wMask) >> 8);
-#endif
-	}
-	
-	DWord mappedAddress = (pageExtension << 12) | pageBase;
-
-	if (bIsRAM && bIsMappable)
+	// mappable RAM (and not covered by a ROM) comes through the resolved page
+	if ((pageMappable[pageOffset]) && (!ROMMAP[address]))
 	{
-        if (mappedAddress <= systemMemorySize) {
-		    if (bTrueAccess) {
-			    // Check for breakpoints
-			    for (int idx=0; idx<nBreakPoints; idx++) {
-				    switch (BreakPoints[idx].Type) {
-					    case BREAK_READAMS:
-						    if (CheckRange(idx, mappedAddress)) {
-	    						TriggerBreakPoint();
-						    }
-						    break;
-				    }
-			    }
-		    }
-            return systemMemory[mappedAddress];
-        } else {
+		Byte *pHost = pageHost[pageOffset];
+		if (NULL == pHost) {
             debug_write("AMS is asking for out of range memory...");
             return 0;
-        }
+		}
+		if ((bTrueAccess) && (TestBreakMap(bpAmsRead, pageMapped[pageOffset]>>12))) {
+			DWord mappedAddress = pageMapped[pageOffset] | (address & 0x0FFF);
+			// Check for breakpoints
+			for (int idx=0; idx<nBreakPoints; idx++) {
+				switch (BreakPoints[idx].Type) {
+					case BREAK_READAMS:
+						if (CheckRange(idx, mappedAddress)) {
+	    					TriggerBreakPoint();
+						}
+						break;
+				}
+			}
+		}
+		return pHost[address & 0x0FFF];
 	}
 
 	// this only works with the console RAM, not the AMS RAM
-	if ((g_bCheckUninit) && (bTrueAccess) && (0 == CPUMemInited[mappedAddress]) && (0 == ROMMAP[mappedAddress])) {
+	if ((g_bCheckUninit) && (bTrueAccess) && (0 == CPUMemInited[address]) && (0 == ROMMAP[address])) {
 		TriggerBreakPoint();
 		char buf[128];
-		sprintf(buf, "Breakpoint - reading uninitialized CPU memory at >%04X", mappedAddress);
+		sprintf(buf, "Breakpoint - reading uninitialized CPU memory at >%04X", address);
 		MessageBox(myWnd, buf, "Gamelink99 Debugger", MB_OK);
 	}
-	return staticCPU[mappedAddress];
+	return staticCPU[address];
 }
 
-// allowWrite = do the write, even if it is ROM! Otherwise only if it is RAM.
-void WriteMemoryByte(Word address, Byte value, bool allowWrite)
+// Returns the host memory currently backing the 4k CPU page that contains
+// address, for the CPU read dispatch table. This is the same mapping that
+// ReadMemoryByte does, but doesn't know about ROMMAP, so the caller has
+// to keep ROM overlays off the direct path.
+Byte* GetMemoryPagePointer(Word address)
 {
-	DWord wMask = 0x0000FF00;  // TODO: set for appropriate memory size	
-	DWord pageBase = ((DWord)address & 0x00000FFF);
 	DWord pageOffset = ((DWord)address & 0x0000F000) >> 12;
-	DWord pageExtension = pageOffset;
 
-	bool bIsMapMode = (mapperMode == Map);
-	bool bIsRAM = (((pageOffset >= 0x2) && (pageOffset <= 0x3)) || ((pageOffset >= 0xA) && (pageOffset <= 0xF)));
-	bool bIsMappable = (((pageOffset >= 0x2) && (pageOffset <= 0x3)) || ((pageOffset >= 0xA) && (pageOffset <= 0xF)));
+	if (!pageMappable[pageOffset]) {
+		return staticCPU + (pageOffset << 12);
+	}
 
-#ifdef ENABLE_HUGE_AMS
-    wMask = MaxMapperPages-1;
-#endif
+	// NULL if it's out of range - let the slow path complain about it
+	return pageHost[pageOffset];
+}
 
-	if (bIsMapMode && bIsMappable)
-	{			
-#ifdef ENABLE_HUGE_AMS
-        // use all 16 bits, but byte swapped (for compatibility)
-        DWORD value = ((mapperRegisters[pageOffset]&0xff)<<8)|((mapperRegisters[pageOffset]&0xff00)>>8);
-        // mask it down to only the actually valid bits
-        pageExtension = (value & wMask);
-#else
-        // regular AMS is just the upper byte - wMask of 0xff gives 256x4k or 1MB
-		pageExtension = (DWord)((mapperRegisters[pageOffset] & wMask) >> 8);
-#endif
+// Returns the AMS page mapped in at a CPU address, or -1 if the address
+// isn't mapped RAM. The profiler uses this to tell paged code apart.
+int GetMappedAmsPage(Word address)
+{
+	DWord pageOffset = ((DWord)address & 0x0000F000) >> 12;
+
+	if ((None == emulationMode) || (!pageMappable[pageOffset]) || (ROMMAP[address])) {
+		return -1;
 	}
-	
-	DWord mappedAddress = (pageExtension << 12) | pageBase;
 
-	if (bIsMapMode && bIsMappable)
+	return pageMapped[pageOffset] >> 12;
+}
+
+// Returns the write generation counter that covers a host byte returned
+// by GetMemoryPagePointer, or NULL if it's not in our memory (cartridge
+// and DSR ROM live elsewhere and only change when ROMs are reloaded).
+DWord* GetCodeBlockGen(const Byte *pHost)
+{
+	if ((NULL == codeBlockGen) || (pHost < staticCPU) || (pHost >= systemMemory + systemMemorySize)) {
+		return NULL;
+	}
+	return &codeBlockGen[(pHost - staticCPU) >> 8];
+}
+
+// allowWrite = do the write, even if it is ROM! Otherwise only if it is RAM.
+void WriteMemoryByte(Word address, Byte value, bool allowWrite)
+{
+	DWord pageOffset = ((DWord)address & 0x0000F000) >> 12;
+
+	if (pageMappable[pageOffset])
 	{
-        if (mappedAddress <= systemMemorySize) {
-		    // duplicated code, refactor this...
-		    for (int idx=0; idx<nBreakPoints; idx++) {
-			    switch (BreakPoints[idx].Type) {
-				    case BREAK_EQUALS_AMS:
-					    if ((CheckRange(idx, mappedAddress)) && ((value&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
-    						TriggerBreakPoint();
-					    }
-					    break;
-
-				    case BREAK_WRITEAMS:
-					    if (CheckRange(idx, mappedAddress)) {
-    						TriggerBreakPoint();
-					    }
-					    break;
-			    }
-		    }
-    		systemMemory[mappedAddress] = value;
-        } else {
+		Byte *pHost = pageHost[pageOffset];
+		if (NULL == pHost) {
             debug_write("AMS is writing out of range memory...");
             return;
-        }
+		}
+		DWord mappedAddress = pageMapped[pageOffset] | (address & 0x0FFF);
+		if (mapperMode != Map) {
+			// in passthrough this is just the normal expansion RAM
+			CPUMemInited[address] = 1;
+		}
+		int nScan = TestBreakMap(bpAmsWrite, pageMapped[pageOffset]>>12) ? nBreakPoints : 0;
+	    for (int idx=0; idx<nScan; idx++) {
+		    switch (BreakPoints[idx].Type) {
+			    case BREAK_EQUALS_AMS:
+				    if ((CheckRange(idx, mappedAddress)) && ((value&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
+    					TriggerBreakPoint();
+				    }
+				    break;
+
+			    case BREAK_WRITEAMS:
+				    if (CheckRange(idx, mappedAddress)) {
+    					TriggerBreakPoint();
+				    }
+				    break;
+		    }
+	    }
+		PrepareAmsPage(mappedAddress >> 12);
+		pHost[address & 0x0FFF] = value;
+		++codeBlockGen[(staticCPUSize + mappedAddress) >> 8];
+		RewindDirtyAms[mappedAddress >> REWIND_PAGE_SHIFT] = 1;
 	}
-	else
+	else if (allowWrite || (!ROMMAP[address]))
 	{
-		if (bIsRAM || bIsMappable)
-		{
-            if ((mappedAddress&0xffff)!=mappedAddress) debug_write("Unexpected AMS memory write, continuing.");
-			CPUMemInited[mappedAddress&0xffff] = 1;
-		    // duplicated code, refactor this...
-		    for (int idx=0; idx<nBreakPoints; idx++) {
-			    switch (BreakPoints[idx].Type) {
-				    case BREAK_EQUALS_AMS:
-					    if ((CheckRange(idx, mappedAddress)) && ((value&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
-    						TriggerBreakPoint();
-					    }
-					    break;
-
-				    case BREAK_WRITEAMS:
-					    if (CheckRange(idx, mappedAddress)) {
-    						TriggerBreakPoint();
-					    }
-					    break;
-			    }
-		    }
-			systemMemory[mappedAddress] = value;
-		}
-		else if (allowWrite || (!ROMMAP[mappedAddress]))
-		{
-			CPUMemInited[mappedAddress] = 1;
-			staticCPU[mappedAddress] = value;
-		}		
+		CPUMemInited[address] = 1;
+		staticCPU[address] = value;
+		++codeBlockGen[address >> 8];
+		RewindDirtyCpu[address >> REWIND_PAGE_SHIFT] = 1;
 	}
 }
 
@@ -503,11 +558,94 @@ void RestoreAMS(unsigned char *pData, int nLen) {
 		}
 		pData++;
 	}
+
+	// everything we wrote is real data now
+	for (int page=0; (page<<12) < i; page++) {
+		pageReady[page] = 1;
+	}
 }
 
 void PreloadAMS(unsigned char *pData, int nLen) {
     // another hack, but doesn't do RLE. Not sure this will have long term use
     if (nLen > systemMemorySize) nLen = systemMemorySize;
     memcpy(systemMemory, pData, nLen);
+	for (int page=0; (page<<12) < nLen; page++) {
+		pageReady[page] = 1;
+	}
+    InvalidateMemoryMap(true);
+}
+
+
+// Save states - the mapper and every AMS page that has been used.
+// Pages nobody has touched yet are left out, they still just hold
+// their power-up junk. A page count of -1 means the memory is kept
+// somewhere else, and the pages are left alone on load.
+void SaveAmsState(MachineState *pState) {
+	int nPages = 0;
+
+	if (pState->bNoMemory) {
+		nPages = -1;
+	} else {
+		for (int page=0; page<MaxMapperPages; page++) {
+			if (pageReady[page]) ++nPages;
+		}
+	}
+
+	StateBeginChunk(pState, "AMS ");
+	STATE_PUT(pState, emulationMode);
+	STATE_PUT(pState, mapperMode);
+	STATE_PUT(pState, mapperRegistersEnabled);
+	STATE_PUT(pState, mapperRegisters);
+	STATE_PUT(pState, nPages);
+	for (int page=0; (nPages > 0) && (page<MaxMapperPages); page++) {
+		if (pageReady[page]) {
+			Word nPage = page;
+			STATE_PUT(pState, nPage);
+			StateWrite(pState, systemMemory + (page << 12), MaxPageSize);
+		}
+	}
 }
 
+void LoadAmsState(StateReader *pRead) {
+	EmulationMode mode;
+	int nPages = 0;
+
+	STATE_GET(pRead, mode);
+	if ((!pRead->bOk) || (mode != emulationMode)) {
+		// it's checked before we get here, but don't mix card types
+		pRead->bOk = false;
+		return;
+	}
+	STATE_GET(pRead, mapperMode);
+	STATE_GET(pRead, mapperRegistersEnabled);
+	STATE_GET(pRead, mapperRegisters);
+	STATE_GET(pRead, nPages);
+
+	if (nPages >= 0) {
+		memset(pageReady, 0, sizeof(pageReady));
+	}
+	for (int idx=0; (idx<nPages) && (pRead->bOk); idx++) {
+		Word nPage = 0;
+		STATE_GET(pRead, nPage);
+		if ((nPage >= MaxMapperPages) || (((nPage+1) << 12) > systemMemorySize)) {
+			pRead->bOk = false;
+			break;
+		}
+		StateRead(pRead, systemMemory + (nPage << 12), MaxPageSize);
+		pageReady[nPage] = 1;
+	}
+
+	ResolveMapperPages();
+	InvalidateMemoryMap(true);
+}
+
+// Rewind support - which AMS pages hold real data
+bool AmsPageReady(int page) {
+	return (page >= 0) && (page < MaxMapperPages) && (pageReady[page] != 0);
+}
+
+void SetAmsPageReady(int page) {
+	if ((page >= 0) && (page < MaxMapperPages)) {
+		pageReady[page] = 1;
+	}
+}
@@ -83,6 +83,9 @@ Byte ReadMapperRegisterByte(Byte reg, bool highByte);
 /* Read/Write a single byte to AMS/SAMS memory */
 Byte ReadRawAMS(int address);
 Byte ReadMemoryByte(Word address, READACCESSTYPE rmw = ACCESS_READ);
+Byte* GetMemoryPagePointer(Word address);
+DWord* GetCodeBlockGen(const Byte *pHost);
+int GetMappedAmsPage(Word address);
 void WriteMemoryByte(Word address, Byte value, bool allowWrite);
 
 /* Read/Write a block of data to AMS/SAMS memory */
@@ -92,8 +95,11 @@ Byte* WriteMemoryBlock(Word address, void* vData, Word length);
 /* state management - simple for now */
 void RestoreAMS(unsigned char *pData, int nLen);
 void PreloadAMS(unsigned char *pData, int nLen);
+bool AmsPageReady(int page);
+void SetAmsPageReady(int page);
 
 extern Byte* systemMemory;		// MaxMapperPages * MaxPageSize
 extern Byte* staticCPU;			// 0x10000 (64k) for the base memory
+extern int systemMemorySize;
 
 #endif // AMS_H
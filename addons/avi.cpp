@@ -66,7 +66,7 @@ extern int AudioSampleRate;
 extern HWND myWnd;
 
 extern int InitAvi(bool bWithAudio);
-extern void WriteFrame();
+extern void WriteFrame(unsigned int *pFrame);
 extern void CloseAVI();
 extern void debug_write(char*, ...);
 extern void ConfigAVI();
@@ -74,7 +74,7 @@ extern void ConfigAVI();
 extern char AVIFileName[];
 
 int InitAvi(bool bWithAudio);
-void WriteFrame();
+void WriteFrame(unsigned int *pFrame);
 void CloseAVI();
 
 int InitAvi(bool bWithAudio)
@@ -264,7 +264,8 @@ int InitAvi(bool bWithAudio)
 }
 
 // TODO: will not work for 80 column mode!
-void WriteFrame()
+// Called from the video thread with the frame it just took from the frame ring
+void WriteFrame(unsigned int *pFrame)
 {
 	BOOL key;
 	void *data;
@@ -274,11 +275,11 @@ void WriteFrame()
 
 	// write a frame to the AVI
 	// Try every frame ;)
-	if ((myStream) && (framedata))
+	if ((myStream) && (pFrame))
 	{
 		// frame is 272*208
 		len=226304;		//	272x208x4 (32-bit)
-		data=ICSeqCompressFrame(&myComp, 0, framedata, &key, &len);						// compress the frame
+		data=ICSeqCompressFrame(&myComp, 0, pFrame, &key, &len);						// compress the frame
 		if (NULL != data) {
 			HRESULT ret = AVIStreamWrite(myStream, frame++, 1, data, len, NULL, NULL, NULL);	// write 1 frame
 			if (ret != 0) {
@@ -290,7 +291,7 @@ void WriteFrame()
 	}
 	else
 	{
-		debug_write("Can't write frame (myStream: 0x%08X, framedata: 0x%08X", myStream, framedata);
+		debug_write("Can't write frame (myStream: 0x%08X, frame: 0x%08X", myStream, pFrame);
 		CloseAVI();
 	}
 	
@@ -7,7 +7,9 @@
 
 #include <Windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "..\resource.h"
+#include "tiemul.h"
 
 extern bool AddBreakpoint(char *buf1);
 extern void debug_write(char *s, ...);
@@ -18,7 +20,9 @@ extern int nBreakPoints;
 int LoadBreakpoints(HWND *myhwnd) {
 	OPENFILENAME ofn;                          // Structure for filename dialog
 	char buf[256], buf2[256];
-	char ReadBuffer[32768] = {0};
+	// enough for a full list of breakpoints, 32 characters each
+	const int nBufSize = MAX_BREAKPOINTS*32;
+	char *ReadBuffer;
 
 	memset(&ofn, 0, sizeof(OPENFILENAME));
 	ofn.lStructSize    = sizeof(OPENFILENAME);
@@ -59,8 +63,10 @@ int LoadBreakpoints(HWND *myhwnd) {
 		}
 
 		// Read breakpoints file
-		if (!(ReadFile(fh, ReadBuffer, 32767, &BytesRead, NULL) && CloseHandle(fh))) {
+		ReadBuffer = (char*)calloc(nBufSize+1, 1);
+		if (!(ReadFile(fh, ReadBuffer, nBufSize, &BytesRead, NULL) && CloseHandle(fh))) {
 			MessageBox ( NULL, "Could not read file", "Load Breakpoints", MB_OK);
+			free(ReadBuffer);
 			return false;
 		}
 		// MessageBox( NULL, ReadBuffer, "Breakpoints File Content", MB_OK);		
@@ -70,6 +76,7 @@ int LoadBreakpoints(HWND *myhwnd) {
 	
 	// Remove all current breakpoints
 	nBreakPoints = 0;
+	bBreakMapDirty = true;
 	SendDlgItemMessage(*myhwnd, IDC_COMBO1, CB_RESETCONTENT, NULL, NULL);
 
 	// Add new breakpoints
@@ -87,6 +94,7 @@ int LoadBreakpoints(HWND *myhwnd) {
 		}
 		line = strtok(NULL, "\n");
 	}
+	free(ReadBuffer);
 	ReloadDumpFiles();
 	return true;
 }
@@ -99,7 +107,6 @@ int SaveBreakpoints(HWND *myhwnd) {
 
 	OPENFILENAME ofn;                          // Structure for filename dialog
 	char buf[256], buf2[256];
-	char WriteBuffer[32768] = {0};
 
 	memset(&ofn, 0, sizeof(OPENFILENAME));
 	ofn.lStructSize    = sizeof(OPENFILENAME);
@@ -140,16 +147,18 @@ int SaveBreakpoints(HWND *myhwnd) {
 
 		// Build breakpoint strings
 		int n=SendDlgItemMessage(*myhwnd, IDC_COMBO1, CB_GETCOUNT, 0, 0);
+		char *WriteBuffer = (char*)calloc(n*34+1, 1);		// 31 characters at most, plus CR/LF
+		int nPos = 0;
 		for (int l=0; l<n; l++) {
 			char buf[32] = {0};
 			SendDlgItemMessage(*myhwnd, IDC_COMBO1, CB_GETLBTEXT, (WPARAM)l, (LPARAM)buf);		
 			// MessageBox(NULL, buf,"DEBUG",MB_OK);
-			strcat(WriteBuffer,buf);			
-			strcat(WriteBuffer,"\r\n");
+			nPos += sprintf(&WriteBuffer[nPos], "%s\r\n", buf);
 		}
 		
-		WriteFile(fh,WriteBuffer,nBreakPoints*32,&BytesWritten,NULL);
+		WriteFile(fh,WriteBuffer,nPos,&BytesWritten,NULL);
 		CloseHandle(fh);
+		free(WriteBuffer);
 	}
 	return true;
 }
@@ -110,6 +110,10 @@
 #include "..\addons\mpd.h"
 #include "..\addons\ubergrom.h"
 #include "..\debugger\dbghook.h"
+#include "..\debugger\trace.h"
+#include "..\debugger\profiler.h"
+#include "savestate.h"
+#include "rewind.h"
 #include "..\RemoteControl\RemoteControlManager.h"
 
 extern void rampVolume(LPDIRECTSOUNDBUFFER ds, long newVol);       // to reduce up/down clicks
@@ -150,9 +154,6 @@ extern CRITICAL_SECTION csAudioBuf;
 
 // speech
 #define SPEECHUPDATETIMESPERFRAME 5
-INT16 SpeechTmp[SPEECHRATE*2];				// two seconds worth of buffer
-int nSpeechTmpPos=0;
-CRITICAL_SECTION csSpeechBuf;
 double nDACLevel=0.0;						// DAC level percentage (from cassette port) - added into the audio buffer on update
 HANDLE hSpeechBufferClearEvent=INVALID_HANDLE_VALUE;		// notification of speech buffer looping
 
@@ -162,9 +163,14 @@ void (*SpeechStop)(void);									// Pointer to SpeechStop function
 Byte (*SpeechRead)(void);									// Pointer to SpeechRead function
 bool (*SpeechWrite)(Byte b, bool f);						// Pointer to SpeechWrite function
 void (*SpeechProcess)(Byte *pBuf, int nLen);				// Pointer to SpeechProcess function
+int (*SpeechSaveState)(Byte *pBuf, int nMax);				// Pointer to SpeechSaveState function (optional)
+bool (*SpeechLoadState)(const Byte *pBuf, int nLen);		// Pointer to SpeechLoadState function (optional)
 HANDLE hWakeupEvent=NULL;									// used to sleep the CPU when not busy
 volatile signed long cycles_left=0;							// runs the CPU throttle
 volatile unsigned long total_cycles=0;						// used for interrupts
+bool bFreeRun=false;										// CPU thread owns the cycle budget (System Maximum)
+int nFreeCycles=0;											// cycles left in the current free-run frame (CPU thread only)
+int bBlockTier=1;											// run straight-line code as basic blocks in System Maximum
 unsigned long speech_cycles=0;								// used to sync speech
 bool total_cycles_looped=false;
 bool bDebugAfterStep=false;									// force debug after step
@@ -204,9 +210,7 @@ bool bIgnoreConsoleBreakpointHits = false;
 CRITICAL_SECTION debugCS;
 char g_cmdLine[512];
 extern bool bWarmBoot;
-extern FILE *fpDisasm;          // file pointer for logging disassembly, if active
-extern int disasmLogType;       // 0 = all, 1 = exclude < 2000, valid only when fpDisasm is not NULL
-extern CRITICAL_SECTION csDisasm; 
+extern int disasmLogType;       // 0 = all, 1 = exclude < 2000, valid only when tracing
 
 // disk
 extern bool bCorruptDSKRAM;
@@ -244,6 +248,14 @@ Byte CRU[4096];								// CRU space (todo: could be bits)
 Byte SPEECH[65536];							// Speech Synth ROM
 Byte DSR[16][16384];						// 16 CRU bases, up to 16k each (ROM >4000 space)
 int  nDSRBank[16];							// Is the DSR bank switched?
+Byte *pMemReadPage[64];						// 1k read dispatch - host pointer per CPU page, NULL for pages that need the full decode
+Word nMemReadMask[64];						// address mask within each dispatch page (scratchpad mirrors 256 bytes)
+int  nMemReadWait[64];						// wait states added on even addresses for each dispatch page
+Byte nRomMapPage[64];						// summary of ROMMAP per 1k page - 0 = none, 1 = all, 2 = mixed
+volatile bool bMemMapDirty=true;			// dispatch table needs a rebuild before next use
+volatile bool bRomMapDirty=true;			// ROMMAP summary needs a rescan before next rebuild
+volatile unsigned int nCodeCacheEpoch=0;	// bumped when ROM contents change, flushes the CPU decode cache
+volatile unsigned int nRomLoadSeq=0;		// bumped for every ROM image loaded (save state fingerprint)
 struct GROMType GROMBase[17];				// support 16 GROM bases (there is room for 256 of them!), plus 1 for PCODE
 int  nSystem=1;								// Which system do we default to?
 int  nCartGroup=0;							// Which cart group?
@@ -322,6 +334,7 @@ extern int bEnable80Columns;						// 80 column hack
 extern int bEnable128k;								// 128k hack
 extern int bF18Enabled;								// F18A support
 extern int bInterleaveGPU;							// simultaneous GPU (not really)
+extern int bSpanRender;								// draw pattern bytes as whole spans
 extern int vdpscanline;								// used for load stats
 int statusReadLine=0;								// the line we last read status at
 int statusReadCount=0;								// how many lines since we last read status
@@ -370,6 +383,15 @@ volatile int ThrottleMode = THROTTLE_NORMAL;		// overall throttling mode
 int enableSpeedKeys = 0;							// allow the INI to make F6,F7,F8,F11 available all the time
 int enableAltF4 = 0;								// allow alt+F4 to close the emulator
 int enableEscape = 1;								// allow Escape to act as Fctn-9 (back)
+bool bHeadless = false;								// batch mode - no visible window, no audio, no throttle
+int nHeadlessFrames = 0;							// frames to run in headless mode before exiting (0 = forever)
+char szHeadlessDump[MAX_PATH] = "";					// optional BMP to receive the last headless frame
+bool bSpanCheck = false;							// headless: draw every line with both renderers and compare
+static bool bInputEveryOp = false;					// headless: service host input on every instruction, as before the frame tick
+static bool bGromTest = false;						// headless: time the GROM prefetch before the run
+static unsigned int nGromReads = 0;					// GROM data reads, for the headless GPL rate
+static int nHeadlessResult = 0;						// process exit code for a headless run
+static char szHeadlessProfile[MAX_PATH] = "";		// optional profile report name for the headless run
 
 time_t STARTTIME, ENDTIME;
 volatile long ticks;
@@ -502,6 +524,118 @@ bool CheckRange(int nBreak, int x) {
 	return false;
 }
 
+// Breakpoint maps, so that the memory paths only scan BreakPoints[] when
+// something might be set on the address being accessed. Rebuilt on the
+// CPU thread whenever bBreakMapDirty is set.
+Byte bpCpuRead[65536/8];
+Byte bpCpuWrite[65536/8];
+Byte bpCpuPC[65536/8];
+Byte bpVdpRead[128*1024/8];
+Byte bpVdpWrite[128*1024/8];
+Byte bpGromRead[65536/8];
+Byte bpGromWrite[65536/8];
+Byte bpAmsRead[BREAK_AMS_PAGES/8];
+Byte bpAmsWrite[BREAK_AMS_PAGES/8];
+int nBreakRegisters=0;										// BREAK_EQUALS_REGISTER - follows WP, so no map
+int nBreakVdpRegs=0;										// BREAK_EQUALS_VDPREG
+int nBreakWPST=0;											// BREAK_WP and BREAK_ST
+int nBreakAmsRead=0;										// BREAK_READAMS - any of these turns off the direct read pages
+volatile bool bBreakMapDirty=true;							// set when BreakPoints[] changes
+
+// mark A (or A-B if B is set, same as CheckRange) in a map of nBits entries
+static void SetBreakBits(Byte *pMap, int nBits, int A, int B, int nShift) {
+	int nFirst = A >> nShift;
+	int nLast = (B ? B : A) >> nShift;
+	if (nFirst < 0) nFirst = 0;
+	if (nLast >= nBits) nLast = nBits-1;
+	for (int x=nFirst; x<=nLast; x++) {
+		pMap[x>>3] |= 1<<(x&7);
+	}
+}
+
+void RebuildBreakpointMaps() {
+	bBreakMapDirty = false;
+
+	memset(bpCpuRead, 0, sizeof(bpCpuRead));
+	memset(bpCpuWrite, 0, sizeof(bpCpuWrite));
+	memset(bpCpuPC, 0, sizeof(bpCpuPC));
+	memset(bpVdpRead, 0, sizeof(bpVdpRead));
+	memset(bpVdpWrite, 0, sizeof(bpVdpWrite));
+	memset(bpGromRead, 0, sizeof(bpGromRead));
+	memset(bpGromWrite, 0, sizeof(bpGromWrite));
+	memset(bpAmsRead, 0, sizeof(bpAmsRead));
+	memset(bpAmsWrite, 0, sizeof(bpAmsWrite));
+	nBreakRegisters = 0;
+	nBreakVdpRegs = 0;
+	nBreakWPST = 0;
+	nBreakAmsRead = 0;
+
+	for (int idx=0; idx<nBreakPoints; idx++) {
+		int A = BreakPoints[idx].A;
+		int B = BreakPoints[idx].B;
+
+		switch (BreakPoints[idx].Type) {
+			case BREAK_PC:
+				SetBreakBits(bpCpuPC, 65536, A, B, 0);
+				break;
+			case BREAK_RUN_TIMER:
+				// start and stop addresses, not a range
+				SetBreakBits(bpCpuPC, 65536, A, 0, 0);
+				SetBreakBits(bpCpuPC, 65536, B, 0, 0);
+				break;
+
+			case BREAK_ACCESS:
+				SetBreakBits(bpCpuRead, 65536, A, B, 0);
+				SetBreakBits(bpCpuWrite, 65536, A, B, 0);
+				break;
+			case BREAK_READ:
+				SetBreakBits(bpCpuRead, 65536, A, B, 0);
+				break;
+			case BREAK_WRITE:
+			case BREAK_EQUALS_WORD:
+			case BREAK_EQUALS_BYTE:
+			case BREAK_DISK_LOG:
+				SetBreakBits(bpCpuWrite, 65536, A, B, 0);
+				break;
+
+			case BREAK_READVDP:
+				SetBreakBits(bpVdpRead, 128*1024, A, B, 0);
+				break;
+			case BREAK_WRITEVDP:
+			case BREAK_EQUALS_VDP:
+				SetBreakBits(bpVdpWrite, 128*1024, A, B, 0);
+				break;
+
+			case BREAK_READGROM:
+				SetBreakBits(bpGromRead, 65536, A, B, 0);
+				break;
+			case BREAK_WRITEGROM:
+				SetBreakBits(bpGromWrite, 65536, A, B, 0);
+				break;
+
+			case BREAK_READAMS:
+				SetBreakBits(bpAmsRead, BREAK_AMS_PAGES, A, B, 12);
+				++nBreakAmsRead;
+				break;
+			case BREAK_WRITEAMS:
+			case BREAK_EQUALS_AMS:
+				SetBreakBits(bpAmsWrite, BREAK_AMS_PAGES, A, B, 12);
+				break;
+
+			case BREAK_EQUALS_REGISTER:
+				++nBreakRegisters;
+				break;
+			case BREAK_EQUALS_VDPREG:
+				++nBreakVdpRegs;
+				break;
+			case BREAK_WP:
+			case BREAK_ST:
+				++nBreakWPST;
+				break;
+		}
+	}
+}
+
 // Configuration access
 void ReadConfig() {
 	int idx,idx2,idx3;
@@ -527,6 +661,9 @@ void ReadConfig() {
 
 	// audio rate
 	AudioSampleRate =		GetPrivateProfileInt("audio",	"samplerate",	AudioSampleRate,			INIFILE);
+	nAudioLatency =			GetPrivateProfileInt("audio",	"latency",		nAudioLatency,				INIFILE);
+	if (nAudioLatency < 20) nAudioLatency = 20;
+	if (nAudioLatency > 250) nAudioLatency = 250;
 
 	// load the new style config
 	EnterCriticalSection(&csDriveType);
@@ -650,6 +787,13 @@ void ReadConfig() {
 	enableEscape = GetPrivateProfileInt("emulation",    "enableEscape",		    enableEscape, INIFILE);
 	// Pause emulator when window inactive: 0-no, 1-yes
 	PauseInactive=	GetPrivateProfileInt("emulation",	"pauseinactive",		PauseInactive,	INIFILE);
+	// Basic block execution in System Maximum: 0-no, 1-yes
+	bBlockTier=		GetPrivateProfileInt("emulation",	"blocktier",			bBlockTier,		INIFILE);
+	// Rewind buffer (ctrl+backspace): 0-no, 1-yes, and its length, memory in MB and frames per keyframe
+	bRewindEnabled=	GetPrivateProfileInt("emulation",	"rewind",				bRewindEnabled,	INIFILE);
+	nRewindSeconds=	GetPrivateProfileInt("emulation",	"rewindseconds",		nRewindSeconds,	INIFILE);
+	nRewindMB=		GetPrivateProfileInt("emulation",	"rewindmb",			nRewindMB,		INIFILE);
+	nRewindKeyframe=GetPrivateProfileInt("emulation",	"rewindkeyframe",		nRewindKeyframe,INIFILE);
 	// Disable speech if desired
 	SpeechEnabled=  GetPrivateProfileInt("emulation",   "speechenabled",         SpeechEnabled,  INIFILE);
 	// require additional control key to reset (QUIT)
@@ -818,6 +962,8 @@ skiprestofuser:
 	bEnable128k=GetPrivateProfileInt("video",	"Enable128k",		bEnable128k, INIFILE);
 	// whether to interleave the GPU execution
 	bInterleaveGPU = GetPrivateProfileInt("video",	"InterleaveGPU",	bInterleaveGPU, INIFILE);
+	// whether to use the span renderer (0 uses the old pixel at a time path, for comparing dumps)
+	bSpanRender = GetPrivateProfileInt("video",	"SpanRender",		bSpanRender,	INIFILE);
 	// whether to force correct aspect ratio
 	MaintainAspect=	GetPrivateProfileInt("video",	"MaintainAspect",	MaintainAspect, INIFILE);
 	// 0-none, 1-DIB, 2-DX, 3-DX Full
@@ -839,6 +985,11 @@ skiprestofuser:
 		enableAltF4 = 1;	// by default, allow Alt+F4
 	}
 
+	// GameLink only publishes frames (and rows) that changed
+	RCManager.setDeltaFramesEnabled(GetPrivateProfileInt("gamelink", "DeltaFrames", RCManager.isDeltaFramesEnabled() ? 1 : 0, INIFILE) != 0);
+	// 4 is the mutex protocol, 5 the lock free one (needs a client that knows sequence counters)
+	RCManager.setProtocol(GetPrivateProfileInt("gamelink", "Protocol", RCManager.getProtocol(), INIFILE));
+
     // the new application mode - this can only be set manually, it's not saved
     bEnableAppMode = GetPrivateProfileInt("AppMode", "EnableAppMode", bEnableAppMode, INIFILE);
 	if (bEnableAppMode) bEnableINIWrite = 0;	// turn off the INI write unless specifically overridden
@@ -943,6 +1094,7 @@ void SaveConfig() {
 
 	WritePrivateProfileInt(		"audio",		"max_volume",			max_volume,					INIFILE);
 	WritePrivateProfileInt(		"audio",		"samplerate",			AudioSampleRate,			INIFILE);
+	WritePrivateProfileInt(		"audio",		"latency",				nAudioLatency,				INIFILE);
 	if (NULL != GetSidEnable) {
 		WritePrivateProfileInt(	"audio",		"sid_blaster",			GetSidEnable(),				INIFILE);
 	}
@@ -985,6 +1137,11 @@ void SaveConfig() {
 	WritePrivateProfileInt(		"emulation",	"enableSpeedKeys",		enableSpeedKeys,			INIFILE);
 	WritePrivateProfileInt(		"emulation",	"enableEscape",			enableEscape,	  		    INIFILE);
 	WritePrivateProfileInt(		"emulation",	"pauseinactive",		PauseInactive,				INIFILE);
+	WritePrivateProfileInt(		"emulation",	"blocktier",			bBlockTier,					INIFILE);
+	WritePrivateProfileInt(		"emulation",	"rewind",				bRewindEnabled,				INIFILE);
+	WritePrivateProfileInt(		"emulation",	"rewindseconds",		nRewindSeconds,				INIFILE);
+	WritePrivateProfileInt(		"emulation",	"rewindmb",			nRewindMB,					INIFILE);
+	WritePrivateProfileInt(		"emulation",	"rewindkeyframe",		nRewindKeyframe,			INIFILE);
 	WritePrivateProfileInt(		"emulation",	"ctrlaltreset",			CtrlAltReset,				INIFILE);
 	WritePrivateProfileInt(		"emulation",	"invertcaps",			!gDontInvertCapsLock,		INIFILE);
 	WritePrivateProfileInt(     "emulation",    "speechenabled",        SpeechEnabled,              INIFILE);
@@ -1013,6 +1170,9 @@ void SaveConfig() {
 	WritePrivateProfileInt(		"video",		"Enable80Col",			bEnable80Columns,			INIFILE);
 	WritePrivateProfileInt(		"video",		"Enable128k",			bEnable128k,			    INIFILE);
 	WritePrivateProfileInt(		"video",		"InterleaveGPU",		bInterleaveGPU,				INIFILE);
+	WritePrivateProfileInt(		"video",		"SpanRender",			bSpanRender,				INIFILE);
+	WritePrivateProfileInt(		"gamelink",		"DeltaFrames",			RCManager.isDeltaFramesEnabled() ? 1 : 0,	INIFILE);
+	WritePrivateProfileInt(		"gamelink",		"Protocol",				RCManager.getProtocol(),					INIFILE);
 
 	WritePrivateProfileInt(		"video",		"StretchMode",			StretchMode,				INIFILE);
 	WritePrivateProfileInt(		"video",		"Flicker",				bUse5SpriteLimit,			INIFILE);
@@ -1182,6 +1342,215 @@ void RestoreWindowPosition() {
 	ShowWindow(myWnd, SW_SHOWNORMAL);
 }
 
+// copy one filename argument (optionally quoted) into pOut, which
+// must be MAX_PATH long, and return the command line after it
+static char *ParseFilenameArg(char *pCmd, char *pOut) {
+	char cEnd = ' ';
+	int idx = 0;
+
+	while (*pCmd == ' ') pCmd++;
+	if (*pCmd == '\"') {
+		cEnd = '\"';
+		pCmd++;
+	}
+	while ((*pCmd) && (*pCmd != cEnd) && (idx < MAX_PATH-1)) {
+		pOut[idx++] = *(pCmd++);
+	}
+	pOut[idx] = '\0';
+	if (*pCmd == cEnd) pCmd++;
+	while (*pCmd == ' ') pCmd++;
+
+	return pCmd;
+}
+
+// report to the launching console, if there is one
+static void AttachParentConsole() {
+	// (AttachConsole is newer than our _WIN32_WINNT, so look it up)
+	BOOL (WINAPI *pAttachConsole)(DWORD) = (BOOL (WINAPI *)(DWORD))GetProcAddress(GetModuleHandle("kernel32.dll"), "AttachConsole");
+	if ((NULL != pAttachConsole) && (pAttachConsole((DWORD)-1))) {	// ATTACH_PARENT_PROCESS
+		freopen("CONOUT$", "w", stdout);
+	}
+}
+
+///////////////////////////////////
+// Headless batch mode
+// Command line is: -headless [frames] [-dump file.bmp] [-profile name] [-spancheck] [-slowpath] [-gromtest] [-rom file]
+// We strip our part and return the rest for the normal -rom
+// processing in readroms(). Quotes are allowed around the dump
+// and profile filenames only. The profile is written to name.txt
+// and name.folded, using symbols from name.sym if it exists.
+// -spancheck draws every line with both the span and the per-pixel
+// renderer and exits with code 2 if any line differed.
+// -slowpath services host input on every instruction like do1()
+// used to, so one build can time the old and new paths.
+// -gromtest times the GROM prefetch on its own after the first frame.
+///////////////////////////////////
+static char *ParseHeadlessArgs(char *pCmd) {
+	if ((NULL == pCmd) || (0 != strncmp(pCmd, "-headless", 9))) {
+		return pCmd;
+	}
+
+	bHeadless = true;
+	pCmd += 9;
+	while (*pCmd == ' ') pCmd++;
+
+	if ((*pCmd >= '0') && (*pCmd <= '9')) {
+		nHeadlessFrames = strtol(pCmd, &pCmd, 10);
+		while (*pCmd == ' ') pCmd++;
+	}
+
+	if (0 == strncmp(pCmd, "-dump ", 6)) {
+		pCmd = ParseFilenameArg(pCmd+6, szHeadlessDump);
+	}
+
+	if (0 == strncmp(pCmd, "-profile ", 9)) {
+		pCmd = ParseFilenameArg(pCmd+9, szHeadlessProfile);
+	}
+
+	if (0 == strncmp(pCmd, "-spancheck", 10)) {
+		bSpanCheck = true;
+		pCmd += 10;
+		while (*pCmd == ' ') pCmd++;
+	}
+
+	if (0 == strncmp(pCmd, "-slowpath", 9)) {
+		bInputEveryOp = true;
+		pCmd += 9;
+		while (*pCmd == ' ') pCmd++;
+	}
+
+	if (0 == strncmp(pCmd, "-gromtest", 9)) {
+		bGromTest = true;
+		pCmd += 9;
+		while (*pCmd == ' ') pCmd++;
+	}
+
+	return pCmd;
+}
+
+///////////////////////////////////
+// Trace decode mode
+// Command line is: -tracedump file.trc [file.txt]
+// Converts a binary trace from the debugger to text and exits
+// without starting the emulator. Output goes to the console if
+// no text file is given.
+///////////////////////////////////
+static bool IsTraceDump(char *pCmd) {
+	return ((NULL != pCmd) && (0 == strncmp(pCmd, "-tracedump ", 11)));
+}
+
+static int RunTraceDump(char *pCmd) {
+	char szIn[MAX_PATH], szOut[MAX_PATH];
+
+	AttachParentConsole();
+	pCmd = ParseFilenameArg(pCmd+11, szIn);
+	ParseFilenameArg(pCmd, szOut);
+	if (szIn[0] == '\0') {
+		printf("Usage: classic99 -tracedump file.trc [file.txt]\n");
+		return 1;
+	}
+
+	return DecodeTraceFile(szIn, (szOut[0] == '\0') ? NULL : szOut);
+}
+
+///////////////////////////////////
+// GameLink test client mode
+// Command line is: -gamelinkclient [protocol] [seconds]
+// Connects to another, already running, Classic99 as a fake
+// GameLink client that hammers the shared memory, then exits.
+// Protocol is 4 (mutex) or 5 (sequence counters), default 5.
+///////////////////////////////////
+static bool IsGameLinkClient(char *pCmd) {
+	return ((NULL != pCmd) && (0 == strncmp(pCmd, "-gamelinkclient", 15)));
+}
+
+static int RunGameLinkClient(char *pCmd) {
+	int nProtocol = 5;
+	int nSeconds = 30;
+
+	AttachParentConsole();
+	pCmd += 15;
+	while (*pCmd == ' ') pCmd++;
+	if ((*pCmd >= '0') && (*pCmd <= '9')) {
+		nProtocol = strtol(pCmd, &pCmd, 10);
+		while (*pCmd == ' ') pCmd++;
+	}
+	if ((*pCmd >= '0') && (*pCmd <= '9')) {
+		nSeconds = strtol(pCmd, &pCmd, 10);
+	}
+
+	return RemoteControlManager::runTestClient(nProtocol, nSeconds);
+}
+
+// called by the VDP at the end of every frame in headless mode
+// also reports the host speed of the run, so a fixed cartridge and
+// frame count makes a repeatable benchmark
+void HeadlessFrameComplete() {
+	static int nFrames = 0;
+	static int nStartCount = 0;
+	static unsigned long nStartCycles = 0;
+	static unsigned int nStartGrom = 0;
+	static LARGE_INTEGER nStart;
+
+	if (nHeadlessFrames <= 0) {
+		return;
+	}
+
+	++nFrames;
+	if (nFrames == 1) {
+		// everything is loaded by now, and we're on the CPU thread
+		if (bGromTest) {
+			GromPrefetchBenchmark();
+		}
+
+		// start timing after the first frame so we don't count startup
+		QueryPerformanceCounter(&nStart);
+		nStartCount = cpucount;
+		nStartCycles = total_cycles;
+		nStartGrom = nGromReads;
+	}
+
+	if (nFrames == nHeadlessFrames) {
+		LARGE_INTEGER nEnd, nFreq;
+		QueryPerformanceCounter(&nEnd);
+		QueryPerformanceFrequency(&nFreq);
+		double nSecs = (double)(nEnd.QuadPart - nStart.QuadPart) / (double)nFreq.QuadPart;
+		if (nSecs <= 0.0) nSecs = 0.000001;
+
+		char buf[256];
+		sprintf(buf, "Headless: %d frames, %d instructions, %lu cycles in %.3fs - %.2f MIPS, %.1fx real time%s\n",
+			nFrames-1, cpucount-nStartCount, total_cycles-nStartCycles, nSecs,
+			(cpucount-nStartCount)/nSecs/1000000.0,
+			(nFrames-1)/nSecs/(double)hzRate,
+			bInputEveryOp ? " (slow path)" : "");
+		debug_write("%s", buf);
+		fputs(buf, stdout);
+
+		// just a count of GROM data reads (GPL runs out of GROM) - compare two
+		// builds on the same workload, it doesn't say anything on its own
+		sprintf(buf, "Headless: %u GROM data reads - %.3fM per second\n",
+			nGromReads-nStartGrom, (nGromReads-nStartGrom)/nSecs/1000000.0);
+		debug_write("%s", buf);
+		fputs(buf, stdout);
+
+		if (bSpanCheck) {
+			sprintf(buf, "Span check: %d lines differed from the per-pixel renderer\n", nSpanCheckLines);
+			debug_write("%s", buf);
+			fputs(buf, stdout);
+			if (nSpanCheckLines > 0) {
+				nHeadlessResult = 2;
+			}
+		}
+
+		debug_write("Headless run complete after %d frames", nFrames);
+		if (szHeadlessDump[0] != '\0') {
+			SaveFrameBMP(szHeadlessDump);
+		}
+		// exits through the normal shutdown path
+		PostMessage(myWnd, WM_CLOSE, 0, 0);
+	}
+}
+
 ///////////////////////////////////
 // Main
 // Startup and shutdown system
@@ -1200,13 +1569,28 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	InitializeCriticalSection(&DebugCS);
 	InitializeCriticalSection(&csDriveType);
 	InitializeCriticalSection(&csAudioBuf);
-	InitializeCriticalSection(&csSpeechBuf);
     InitializeCriticalSection(&TapeCS);
-    InitializeCriticalSection(&csDisasm);
 
 	hInstance = hInst;
 	hPrevInstance=hInPrevInstance;
 
+	// decoding a trace doesn't need the emulator at all
+	if (IsTraceDump(lpCmdLine)) {
+		return RunTraceDump(lpCmdLine);
+	}
+
+	// neither does the GameLink test client - it talks to another copy
+	if (IsGameLinkClient(lpCmdLine)) {
+		return RunGameLinkClient(lpCmdLine);
+	}
+
+	// check for batch mode before anything gets displayed
+	lpCmdLine = ParseHeadlessArgs(lpCmdLine);
+	if (bHeadless) {
+		AttachParentConsole();
+		g_dwMyStyle &= ~WS_VISIBLE;
+	}
+
 	// Null the pointers
 	myClass=0;
 	myWnd=NULL;		// Classic99 Window
@@ -1222,6 +1606,7 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	nLoadedUserGroups=0;
 	memset(BreakPoints, 0, sizeof(BreakPoints));
 	nBreakPoints=0;
+	bBreakMapDirty=true;
 	BreakOnIllegal=false;
 	BreakOnDiskCorrupt=false;
 	for (idx=0; idx<10; idx++) {
@@ -1260,6 +1645,7 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	// build the CPU super early - lots of init functions write to its memory
 	debug_write("Building CPU");
 	pCPU = new CPU9900();							// does NOT reset
+	pCPU->EnableDecodeCache();
 	pGPU = new GPUF18A();
 	pCurrentCPU = pCPU;
 	hWakeupEvent=CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -1280,7 +1666,7 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	framedata=(unsigned int*)malloc((512+16)*(192+16)*4);	// This is where we draw everything - 8 pixel border - extra room left for 80 column mode
 	framedata2=(unsigned int*)malloc((256+16)*4*(192+16)*4*4);// used for the filters - 16 pixel border on SAI and 8 horizontal on TV (x2), HQ4x is the largest
 
-    if ((framedata==NULL)||(framedata2==NULL)) {
+    if ((framedata==NULL)||(framedata2==NULL)||(!AllocateFrameRing())) {
         fail("Unable to allocate framebuffers");
     }
 
@@ -1433,6 +1819,7 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	quitflag=0;			// no quit yet
 	nCurrentDSR=-1;		// no DSR selected
 	memset(nDSRBank, 0, sizeof(nDSRBank));
+	InvalidateMemoryMap();
 	timer9901 = 0;
     timer9901Read = 0;
 	starttimer9901 = 0;
@@ -1514,6 +1901,14 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	pCPU->buildcpu();
 	pGPU->buildcpu();
 
+	if (bHeadless) {
+		// batch runs go as fast as the host allows and never touch the INI
+		debug_write("** Headless Mode - %d frames **", nHeadlessFrames);
+		ThrottleMode = THROTTLE_SYSTEMMAXIMUM;
+		PauseInactive = 0;
+		bEnableINIWrite = 0;
+	}
+
     // right off the bat, if we are in App Mode, then we need to do some work
     if (bEnableAppMode) {
         // notify
@@ -1575,12 +1970,14 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	debug_write("Starting Video");
 	startvdp();
 
-	// wait for the video thread to initialize so we can resize the window :)
-	Sleep(500);
+	if (!bHeadless) {
+		// wait for the video thread to initialize so we can resize the window :)
+		Sleep(500);
 
-	RestoreWindowPosition();
-	if (nDefaultScreenScale != -1) {
-		SendMessage(myWnd, WM_COMMAND, ID_CHANGESIZE_1X+nDefaultScreenScale-1, 1);
+		RestoreWindowPosition();
+		if (nDefaultScreenScale != -1) {
+			SendMessage(myWnd, WM_COMMAND, ID_CHANGESIZE_1X+nDefaultScreenScale-1, 1);
+		}
 	}
 
 	// Set menu-based settings (lParam 1 means it's coming from here, not the user)
@@ -1628,9 +2025,11 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	// Initialize emulated keyboard
 	init_kb();
 
-	// start sound
-	debug_write("Starting Sound");
-	startsound();
+	// start sound (headless runs have no audio device, same as a failed DirectSound init)
+	if (!bHeadless) {
+		debug_write("Starting Sound");
+		startsound();
+	}
 	
 	// Init disk
 	debug_write("Starting Disk");
@@ -1664,6 +2063,19 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 
 	Sleep(100);			// time for threads to start
 
+	// profile the whole batch run if asked
+	if ((bHeadless) && (szHeadlessProfile[0] != '\0')) {
+		char szSymbols[MAX_PATH+8];
+		sprintf(szSymbols, "%s.sym", szHeadlessProfile);
+		if (GetFileAttributes(szSymbols) == INVALID_FILE_ATTRIBUTES) {
+			szSymbols[0] = '\0';
+		}
+		StartProfile(szHeadlessProfile, szSymbols);
+	}
+
+	// the rewind history is allocated up front, not on the first frame
+	RewindInit();
+
 	// start up CPU handler
 	myThread=_beginthread(emulti, 0, NULL);
 	if (myThread != -1) {
@@ -1685,6 +2097,11 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	SaveConfig();
 	// save any previous NVRAM
 	saveroms();
+	// and anything the disk images are still holding
+	ServiceDiskCache(true);
+	// and flush out any trace or profile in progress
+	StopTrace();
+	StopProfile();
 
 	// Fail is the full exit
 	debug_write("Shutting down");
@@ -1698,7 +2115,7 @@ int WINAPI WinMain( HINSTANCE hInst, HINSTANCE hInPrevInstance, LPSTR lpCmdLine,
 	WSACleanup();
 
 	// good bye
-	return 0;
+	return nHeadlessResult;
 }
 
 
@@ -1895,11 +2312,13 @@ void startsound()
 		SpeechRead=(Byte (*)(void))GetProcAddress(hSpeechDll, "SpeechRead");
 		SpeechWrite=(bool (*)(Byte, bool))GetProcAddress(hSpeechDll, "SpeechWrite");
 		SpeechProcess=(void (*)(Byte*,int))GetProcAddress(hSpeechDll, "SpeechProcess");
+		// older DLLs don't have these, save states just leave speech alone
+		SpeechSaveState=(int (*)(Byte*,int))GetProcAddress(hSpeechDll, "SpeechSaveState");
+		SpeechLoadState=(bool (*)(const Byte*,int))GetProcAddress(hSpeechDll, "SpeechLoadState");
 	}
 
-	// Zero the temporary buffers
-	memset(SpeechTmp, 0, sizeof(SpeechTmp));
-	nSpeechTmpPos=0;
+	// Empty the speech ring
+	resetSpeechBuffer();
 
 	// Now load up the speech system
 	/* start audio stream - SPEECHBUFFER buffer, 16 bit, 8khz, max vol, center */
@@ -2034,6 +2453,11 @@ void fail(char *x)
 
 	// dump the stats to the debug log
 	OutputDebugString(buffer);
+	if (bHeadless) {
+		// and to the console for batch runs
+		fputs(buffer, stdout);
+		fflush(stdout);
+	}
 
 	Sleep(600);			// give the threads a little time to shut down
 
@@ -2125,7 +2549,8 @@ void wrword(Word x, Word y)
     // Putting a CRU timer reset based on address here seems to have no effect
 
 	// check breakpoints against what was written to where
-	for (int idx=0; idx<nBreakPoints; idx++) {
+	int nScan = ((nBreakRegisters > 0) || (TestBreakMap(bpCpuWrite, x))) ? nBreakPoints : 0;
+	for (int idx=0; idx<nScan; idx++) {
 		switch (BreakPoints[idx].Type) {
 			case BREAK_EQUALS_WORD:
 				if (CheckRange(idx, x)) {
@@ -2188,15 +2613,89 @@ void WindowThread() {
 	}
 }
 
+/////////////////////////////////////////////////////////
+// Run the GPU for a little while after a 9900 instruction
+/////////////////////////////////////////////////////////
+static void InterleaveGPU() {
+	// todo: this is a hack for interleaving F18GPU with the 9900 - and it works, but.. not correct at all.
+	if (pGPU->GetIdle() == 0) {
+		pCurrentCPU = pGPU;
+		for (int nCnt = 0; nCnt < 20; nCnt++) {	// /instructions/ per 9900 instruction - approximation!!
+			do1();
+			if (pGPU->GetIdle()) {
+				break;
+			}
+			// handle step
+			if ((!bFreeRun) && (cycles_left <= 1)) {
+				break;
+			}
+		}
+		pCurrentCPU = pCPU;
+	}
+}
+
+/////////////////////////////////////////////////////////
+// Run-to-completion for System Maximum
+// The CPU thread owns the cycle budget here, so there is no
+// handshake with the TimerThread and no interlocked math per
+// instruction. We run one emulated frame, then do the frame
+// processing the TimerThread would normally trigger.
+/////////////////////////////////////////////////////////
+static void RunFreeFrame() {
+	bool bFrameDone = false;
+
+	bFreeRun = true;
+	// a frame cut short by a pause or speed change picks up where it left off
+	if (nFreeCycles <= 0) {
+		nFreeCycles += (hzRate==HZ50?DEFAULT_50HZ_CPF:DEFAULT_60HZ_CPF);
+	}
+
+	while (!quitflag) {
+		do1();
+
+		if (bInterleaveGPU) {
+			InterleaveGPU();
+		}
+
+		if (nFreeCycles <= 0) {
+			bFrameDone = true;
+			break;
+		}
+
+		// drop out for pause, breakpoints and speed changes - the rest
+		// of the budget stays, since that time hasn't been emulated yet
+		if ((max_cpf == 0) || (ThrottleMode != THROTTLE_SYSTEMMAXIMUM)) {
+			break;
+		}
+	}
+
+	bFreeRun = false;
+
+	// one frame of emulated time has elapsed - only if we ran all of it
+	if (bFrameDone) {
+		Counting();
+	}
+}
+
 /////////////////////////////////////////////////////////
 // Main loop for Emulation
 /////////////////////////////////////////////////////////
 void __cdecl emulti(void *)
 {
 	quitflag=0;							// Don't quit
+	TraceSetThread();					// only this thread writes the trace ring
 
 	while (!quitflag)
 	{ 
+		// save and load state requests from the UI
+		if (nStateRequest) {
+			ServiceStateRequest();
+		}
+		// and the rewind buffer, once per completed frame
+		if (bRewindFrame) {
+			RewindFrame();
+		}
+
 		if ((PauseInactive)&&(!WindowActive)) {
 			// we're supposed to pause when inactive, and we are not active
 			// So, don't execute an instruction, and sleep a bit to relieve CPU
@@ -2204,27 +2703,16 @@ void __cdecl emulti(void *)
 			// we come back
 			Sleep(100);
 			InterlockedExchange((LONG*)&cycles_left, 0);
+		} else if ((ThrottleMode == THROTTLE_SYSTEMMAXIMUM) && (max_cpf > 0)) {
+			// unthrottled - run whole frames back to back
+			RunFreeFrame();
 		} else {
 			// execute one opcode
 			do1();
 
 			// GPU 
 			if (bInterleaveGPU) {
-				// todo: this is a hack for interleaving F18GPU with the 9900 - and it works, but.. not correct at all.
-				if (pGPU->GetIdle() == 0) {
-					pCurrentCPU = pGPU;
-					for (int nCnt = 0; nCnt < 20; nCnt++) {	// /instructions/ per 9900 instruction - approximation!!
-						do1();
-						if (pGPU->GetIdle()) {
-							break;
-						}
-						// handle step
-						if (cycles_left <= 1) {
-							break;
-						}
-					}
-					pCurrentCPU = pCPU;
-				}
+				InterleaveGPU();
 			}
 		}
 	}
@@ -2244,6 +2732,7 @@ void LoadOneImg(struct IMG *pImg, char *szFork) {
 
 	if ((NULL == pImg) || (pImg->nType == TYPE_NONE) || (pImg->nType == TYPE_UNSET)) return;
 
+	++nRomLoadSeq;
 	pData=NULL;
 
 	int nLen=pImg->nLength;
@@ -2797,6 +3286,9 @@ void LoadOneImg(struct IMG *pImg, char *szFork) {
 		}
 	}
 	
+	// ROMMAP and CPU2 may both have changed
+	InvalidateMemoryMap(true);
+
 	// WIN32 does not require (or even permit!) us to unlock and release these objects
     // But we do need to free DiskFile if set
     if (NULL != DiskFile) {
@@ -2829,6 +3321,7 @@ void findXBbank() {
         } else {
             debug_write("No ROM header found in paged cart, setting bank to 0.");
         }
+        InvalidateMemoryMap();
 		// RIK: Here parse the header and follow the linked list
 		// as described in http://www.unige.ch/medecine/nouspikel/ti99/headers.htm#header%20summary
 		// This would give the program name which we can send to RemoteControl
@@ -2951,6 +3444,7 @@ void readroms() {
 	grombanking=0;							// not using grom banking
 	nCurrentDSR=-1;							// no DSR paged in
 	memset(nDSRBank, 0, sizeof(nDSRBank));	// not on second page of DSR
+	InvalidateMemoryMap(true);				// ROMMAP and CPU2 were just reset
     memset(cycleCounter, 0, sizeof(cycleCounter));
 
 	// load the always load files
@@ -2968,7 +3462,7 @@ void readroms() {
             // make sure DSK 1-3 is a cf7Disk object, which does nothing
             for (int idx = 1; idx < 4; ++idx) {
                 if (NULL != pDriveType[idx]) {
-                    free(pDriveType[idx]);
+                    delete pDriveType[idx];
                 }
                 pDriveType[idx] = new Cf7Disk;
             }
@@ -3160,6 +3654,9 @@ void readroms() {
 #endif
         }
     }
+
+    // now that everything is loaded, work out which GROM bases need prefetching
+    UpdateGromPrefetchList();
 }
 
 void saveroms()
@@ -3209,6 +3706,225 @@ void saveroms()
 	nvRamUpdated = false;
 }
 
+/////////////////////////////////////////////////////////
+// Host input service tick for do1()
+// Hotkeys and debugger keys don't need to be checked on every
+// instruction, so this runs once per emulated frame, and on every
+// pass while the CPU is waiting for time (paused, stepping or
+// throttled) so the debugger stays responsive.
+// Returns true if the current instruction should be skipped.
+/////////////////////////////////////////////////////////
+static bool ServiceHostInput(bool nopFrame) {
+    // some shortcut keys that are always active...
+    // these all require control to be active
+    // launch debug dialog (with control)
+	if (key[VK_HOME]) 
+	{
+		if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+		    if (NULL == dbgWnd) {
+			    PostMessage(myWnd, WM_COMMAND, ID_EDIT_DEBUGGER, 0);
+			    // the dialog focus switch may cause a loss of the up event, so just fake it now
+			    // TODO: this should not be needed with the filter in decode(), right??
+			    decode(0xe0);	// extended key
+			    decode(0xf0);
+			    decode(VK_HOME);
+		    }
+    		key[VK_HOME]=0;
+        }
+	}
+
+	// edit->paste (with control)
+	if (key[VK_F1]) {
+    	if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+            PostMessage(myWnd, WM_COMMAND, ID_EDITPASTE, 0);
+            key[VK_F1] = 0;
+        }
+    }
+
+    // copy screen to clipboard (with control)
+	if (key[VK_F2]) {
+        // we'll try to use the screen offset byte - 0x83d3
+        // we'll explicitly check for only 0x60, otherwise 0
+    	if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+            PostMessage(myWnd, WM_COMMAND, ID_EDIT_COPYSCREEN, 0);
+            key[VK_F2]=0;
+        }
+	}
+
+	// rewind while held (with control) - one frame back per frame
+	bRewindHeld = (WindowActive) && (key[VK_BACK]) && (GetAsyncKeyState(VK_CONTROL)&0x8000);
+
+	// check alt+f4 if enabled
+	if (enableAltF4) {
+		if (GetAsyncKeyState(VK_MENU)&0x8000) {
+			if (key[VK_F4]) {
+				PostMessage(myWnd, WM_QUIT, 0, 0);
+			}
+		}
+	}
+	
+	// speedKeys doesn't include slow because slow is too slow to be useful
+	// to a non-debugger. Those people can change the CPU speed in config instead.
+	// ... someone will complain someday. ;) 5/5/2021
+	if (enableSpeedKeys) {
+		// CPU normal
+		if (key[VK_F6]) {
+			key[VK_F6]=0;
+			SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_NORMAL, 0);
+		}
+
+		// cpu overdrive
+		if (key[VK_F7]) {
+			key[VK_F7]=0;
+			SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_CPUOVERDRIVE, 0);
+		}
+
+		// system maximum
+		if (key[VK_F8]) {
+			key[VK_F8]=0;
+			SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_SYSTEMMAXIMUM, 0);
+		}
+
+		// toggle turbo
+		if (key[VK_F11]) {
+			key[VK_F11] = 0;
+
+			if (ThrottleMode == THROTTLE_SYSTEMMAXIMUM) {
+				// running in fast forward, return to normal
+				ThrottleMode = THROTTLE_NORMAL;
+				DoPlay();
+			}
+			else {
+				DoFastForward();
+			}
+		}
+	} // speedkeys
+
+	// Control keys - active only with the debug view open in PS/2 mode
+	if ((!gDisableDebugKeys) && (NULL != dbgWnd) && (!nopFrame)) {
+		// pause/play
+		if (key[VK_F1]) {
+            // in the case where the current CPU can not break but the other can, just
+            // hold onto this key...
+            if (!pCurrentCPU->enableDebug) {
+                if ((pCPU->enableDebug)||(pGPU->enableDebug)) {
+                    // just wait for the context switch
+                    return true;
+                } else {
+                    // no debugging, so discard the key
+                    debug_write("Neither processor is enabled to breakpoint!");
+        			key[VK_F1]=0;
+                    return true;
+                }
+            }
+
+			if (0 == max_cpf) {
+				// already paused, restore
+				DoPlay();
+			} else {
+				// running normal, so pause
+				DoPause();
+			}
+			key[VK_F1]=0;
+		}
+		
+		// step
+		if (key[VK_F2]) {
+			DoStep();
+			key[VK_F2]=0;
+		}
+
+		// step over
+		if (key[VK_F3]) {
+			DoStepOver();
+			key[VK_F3]=0;
+		}
+
+		// do automatic screenshot, unfiltered (ctrl), or set CPU slow (normal)
+		if (key[VK_F5]) {
+			key[VK_F5]=0;
+
+			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+				SaveScreenshot(true, false);
+			} else {
+				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_CPUSLOW, 0);
+			}
+		}
+
+		// auto screenshot, filtered (ctrl), or CPU normal (normal)
+		if (key[VK_F6]) {
+			key[VK_F6]=0;
+
+			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+				SaveScreenshot(true, true);
+			} else {
+				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_NORMAL, 0);
+			}
+		}
+
+		// toggle sprites (ctrl) / cpu overdrive (normal)
+		if (key[VK_F7]) {
+			key[VK_F7]=0;
+
+			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+				SendMessage(myWnd, WM_COMMAND, ID_LAYERS_DISABLESPRITES, 0);
+			} else {
+				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_CPUOVERDRIVE, 0);
+			}
+		}
+
+		// toggle background (ctrl) / system maximum (normal)
+		if (key[VK_F8]) {
+			key[VK_F8]=0;
+
+			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+				SendMessage(myWnd, WM_COMMAND, ID_LAYERS_DISABLEBACKGROUND, 0);
+			} else {
+				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_SYSTEMMAXIMUM, 0);
+			}
+		}
+
+		// tell VDP to draw character set
+		if (key[VK_F9]) {
+			VDPDebug=!VDPDebug;
+			key[VK_F9]=0;
+			redraw_needed=REDRAW_LINES;
+		}
+
+		// dump main memory
+		if (key[VK_F10]) {
+			key[VK_F10]=0;
+			DoMemoryDump();
+		}
+		
+		// toggle turbo (same as speedkeys)
+		if (key[VK_F11]) {
+			key[VK_F11] = 0;
+
+			if (ThrottleMode == THROTTLE_SYSTEMMAXIMUM) {
+				// running in fast forward, return to normal
+				DoPlay();
+			}
+			else {
+				DoFastForward();
+			}
+		}
+
+		// LOAD interrupt or RESET (ctrl)
+		if (key[VK_F12]) {
+			key[VK_F12]=0;
+			
+			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
+				SendMessage(myWnd, WM_COMMAND, ID_FILE_RESET, 0);
+			} else {
+				DoLoadInterrupt();
+			}
+		}
+	}
+
+	return false;
+}
+
 //////////////////////////////////////////////////////////
 // Interpret a single instruction
 // Note: op_X doesn't come here anymore as this function
@@ -3216,22 +3932,20 @@ void saveroms()
 //////////////////////////////////////////////////////////
 void do1()
 {
-	// TODO: instead of doing ALL the keyboard checks EVERY instruction, maybe
-	// we can split some of them off to a rotating check? Only breakpoints need
-	// to be checked EVERY instruction, and even then, maybe not EVERY.
+	// Keyboard checks are in ServiceHostInput(), once per frame. Only the
+	// armed breakpoints and hooks need to be checked EVERY instruction.
 
 	// used for emulating idle and halts (!READY) better
 	bool nopFrame = false;
+	bool bServiceTick = false;
 
 	// handle end of frame processing (some emulator, some hardware)
 	if (end_of_frame)
 	{
 		pCurrentCPU->ResetCycleCount();
+		bServiceTick = true;
 
-		// put this before setting the draw event to reduce conflict, though it makes it a frame behind
-		if (Recording) {
-			WriteFrame();
-		}
+		// AVI frames are written by the video thread as it takes them from the frame ring
 
 		int nNumFrames = retrace_count / (drawspeed+1);	// get count so we can update counters (ignore remainder)
 		if (fJoystickActiveOnKeys > 0) {
@@ -3245,6 +3959,8 @@ void do1()
 		timercount+=nNumFrames*(drawspeed+1);
 
 		end_of_frame=0;								// No matter what, this tick is passed!
+
+		ServiceDiskCache(false);					// cached disk images write back after a short delay
 	}
 
 	if (pCurrentCPU == pCPU) {
@@ -3297,96 +4013,23 @@ void do1()
 
 		// If an idle is set
 		if ((pCurrentCPU->GetIdle())||(pCurrentCPU->GetHalt())) {
-			nopFrame = true;
-		}
-	}
-
-    // some shortcut keys that are always active...
-    // these all require control to be active
-    // launch debug dialog (with control)
-	if (key[VK_HOME]) 
-	{
-		if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-		    if (NULL == dbgWnd) {
-			    PostMessage(myWnd, WM_COMMAND, ID_EDIT_DEBUGGER, 0);
-			    // the dialog focus switch may cause a loss of the up event, so just fake it now
-			    // TODO: this should not be needed with the filter in decode(), right??
-			    decode(0xe0);	// extended key
-			    decode(0xf0);
-			    decode(VK_HOME);
-		    }
-    		key[VK_HOME]=0;
-        }
-	}
-
-	// edit->paste (with control)
-	if (key[VK_F1]) {
-    	if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-            PostMessage(myWnd, WM_COMMAND, ID_EDITPASTE, 0);
-            key[VK_F1] = 0;
-        }
-    }
-
-    // copy screen to clipboard (with control)
-	if (key[VK_F2]) {
-        // we'll try to use the screen offset byte - 0x83d3
-        // we'll explicitly check for only 0x60, otherwise 0
-    	if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-            PostMessage(myWnd, WM_COMMAND, ID_EDIT_COPYSCREEN, 0);
-            key[VK_F2]=0;
-        }
-	}
-
-	// check alt+f4 if enabled
-	if (enableAltF4) {
-		if (GetAsyncKeyState(VK_MENU)&0x8000) {
-			if (key[VK_F4]) {
-				PostMessage(myWnd, WM_QUIT, 0, 0);
-			}
-		}
-	}
-	
-	// speedKeys doesn't include slow because slow is too slow to be useful
-	// to a non-debugger. Those people can change the CPU speed in config instead.
-	// ... someone will complain someday. ;) 5/5/2021
-	if (enableSpeedKeys) {
-		// CPU normal
-		if (key[VK_F6]) {
-			key[VK_F6]=0;
-			SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_NORMAL, 0);
-		}
-
-		// cpu overdrive
-		if (key[VK_F7]) {
-			key[VK_F7]=0;
-			SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_CPUOVERDRIVE, 0);
-		}
-
-		// system maximum
-		if (key[VK_F8]) {
-			key[VK_F8]=0;
-			SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_SYSTEMMAXIMUM, 0);
-		}
-
-		// toggle turbo
-		if (key[VK_F11]) {
-			key[VK_F11] = 0;
-
-			if (ThrottleMode == THROTTLE_SYSTEMMAXIMUM) {
-				// running in fast forward, return to normal
-				ThrottleMode = THROTTLE_NORMAL;
-				DoPlay();
-			}
-			else {
-				DoFastForward();
-			}
+			nopFrame = true;
 		}
-	} // speedkeys
+	}
 
-	// Control keys - active only with the debug view open in PS/2 mode
+	// host input and hotkeys
+	if ((bServiceTick) || (bInputEveryOp) || ((!bFreeRun) && (cycles_left <= 0))) {
+		if (ServiceHostInput(nopFrame)) {
+			return;
+		}
+	}
+
+	// breakpoint maps are only touched on this thread
+	if (bBreakMapDirty) RebuildBreakpointMaps();
+
+	// breakpoint handling - only when the debugger is open and something is armed
 	// nopFrame must be set before now!
-	if ((!gDisableDebugKeys) && (NULL != dbgWnd) && (!nopFrame)) {
-		// breakpoint handling
+	if ((!gDisableDebugKeys) && (NULL != dbgWnd) && (!nopFrame) && ((nBreakPoints > 0) || (bStepOver))) {
 		if ((max_cpf > 0) && (nStepCount == 0)) {
 			// used for timing
 			static unsigned long nFirst=0;
@@ -3395,7 +4038,9 @@ void do1()
 			static unsigned long nTotal=0;
 			Word PC = pCurrentCPU->GetPC();
 
-			for (int idx=0; idx<nBreakPoints; idx++) {
+			// only scan if something is set at this PC
+			int nScan = TestBreakMap(bpCpuPC, PC) ? nBreakPoints : 0;
+			for (int idx=0; idx<nScan; idx++) {
 				switch (BreakPoints[idx].Type) {
 					case BREAK_PC:
 						if (CheckRange(idx, PC)) {
@@ -3460,129 +4105,10 @@ void do1()
 				}
 			}
 		}
-
-		// pause/play
-		if (key[VK_F1]) {
-            // in the case where the current CPU can not break but the other can, just
-            // hold onto this key...
-            if (!pCurrentCPU->enableDebug) {
-                if ((pCPU->enableDebug)||(pGPU->enableDebug)) {
-                    // just wait for the context switch
-                    return;
-                } else {
-                    // no debugging, so discard the key
-                    debug_write("Neither processor is enabled to breakpoint!");
-        			key[VK_F1]=0;
-                    return;
-                }
-            }
-
-			if (0 == max_cpf) {
-				// already paused, restore
-				DoPlay();
-			} else {
-				// running normal, so pause
-				DoPause();
-			}
-			key[VK_F1]=0;
-		}
-		
-		// step
-		if (key[VK_F2]) {
-			DoStep();
-			key[VK_F2]=0;
-		}
-
-		// step over
-		if (key[VK_F3]) {
-			DoStepOver();
-			key[VK_F3]=0;
-		}
-
-		// do automatic screenshot, unfiltered (ctrl), or set CPU slow (normal)
-		if (key[VK_F5]) {
-			key[VK_F5]=0;
-
-			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-				SaveScreenshot(true, false);
-			} else {
-				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_CPUSLOW, 0);
-			}
-		}
-
-		// auto screenshot, filtered (ctrl), or CPU normal (normal)
-		if (key[VK_F6]) {
-			key[VK_F6]=0;
-
-			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-				SaveScreenshot(true, true);
-			} else {
-				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_NORMAL, 0);
-			}
-		}
-
-		// toggle sprites (ctrl) / cpu overdrive (normal)
-		if (key[VK_F7]) {
-			key[VK_F7]=0;
-
-			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-				SendMessage(myWnd, WM_COMMAND, ID_LAYERS_DISABLESPRITES, 0);
-			} else {
-				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_CPUOVERDRIVE, 0);
-			}
-		}
-
-		// toggle background (ctrl) / system maximum (normal)
-		if (key[VK_F8]) {
-			key[VK_F8]=0;
-
-			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-				SendMessage(myWnd, WM_COMMAND, ID_LAYERS_DISABLEBACKGROUND, 0);
-			} else {
-				SendMessage(myWnd, WM_COMMAND, ID_CPUTHROTTLING_SYSTEMMAXIMUM, 0);
-			}
-		}
-
-		// tell VDP to draw character set
-		if (key[VK_F9]) {
-			VDPDebug=!VDPDebug;
-			key[VK_F9]=0;
-			redraw_needed=REDRAW_LINES;
-		}
-
-		// dump main memory
-		if (key[VK_F10]) {
-			key[VK_F10]=0;
-			DoMemoryDump();
-		}
-		
-		// toggle turbo (same as speedkeys)
-		if (key[VK_F11]) {
-			key[VK_F11] = 0;
-
-			if (ThrottleMode == THROTTLE_SYSTEMMAXIMUM) {
-				// running in fast forward, return to normal
-				DoPlay();
-			}
-			else {
-				DoFastForward();
-			}
-		}
-
-		// LOAD interrupt or RESET (ctrl)
-		if (key[VK_F12]) {
-			key[VK_F12]=0;
-			
-			if (GetAsyncKeyState(VK_CONTROL)&0x8000) {
-				SendMessage(myWnd, WM_COMMAND, ID_FILE_RESET, 0);
-			} else {
-				DoLoadInterrupt();
-			}
-		}
 	}
 
 	bool bOperate = true;
-	if (cycles_left <= 0) bOperate=false;
+	if ((!bFreeRun) && (cycles_left <= 0)) bOperate=false;
 	// force run of the other CPU if we're stepping
 	if ((cycles_left == 1) && (!pCurrentCPU->enableDebug)) bOperate=true;
 
@@ -3691,6 +4217,9 @@ void do1()
 			if ((nCurrentDSR == 1) && (nDSRBank[1] == 0) && (pCurrentCPU->GetPC() >= 0x4800) && (pCurrentCPU->GetPC() <= 0x5FEF)) {
 				Word WP = pCurrentCPU->GetWP();
 				bool bRet = HandleDisk();
+				// the DSR writes VDP directly
+				VDPMemoryWrittenAll();
+				RewindDirtyAll();
 				// the disk system may have switched in the TI disk controller, in which case we
 				// will actually execute code instead of faking in. So in that case, don't return!
 				if (nDSRBank[1] == 0) {
@@ -3707,10 +4236,15 @@ void do1()
 				return;
 			}
 			// turn off TI disk DSR if no longer active
-			if ((nDSRBank[1] > 0) && ((nCurrentDSR != 1)||(pCurrentCPU->GetPC() < 0x4000))) nDSRBank[1] = 0;
+			if ((nDSRBank[1] > 0) && ((nCurrentDSR != 1)||(pCurrentCPU->GetPC() < 0x4000))) {
+				nDSRBank[1] = 0;
+				InvalidateMemoryMap();
+			}
 			// check for sector access hook
 			if ((nCurrentDSR == 1) && (nDSRBank[1] > 0) && (pCurrentCPU->GetPC() == 0x40e8)) {
 				HandleTICCSector();
+				VDPMemoryWrittenAll();
+				RewindDirtyAll();
 			}
 		}
         // Check for TIPISim access hook
@@ -3719,6 +4253,8 @@ void do1()
 		if ((nCurrentDSR == 2) && (pCurrentCPU->GetPC() >= 0x4800) && (pCurrentCPU->GetPC() <= 0x5FF8)) {
 			Word WP = pCurrentCPU->GetWP();
 			bool bRet = HandleTIPI();
+			VDPMemoryWrittenAll();
+			RewindDirtyAll();
 			if (bRet) {
 				// if all goes well, increment address by 2
 				// Note the powerup routine won't do that :)
@@ -3747,19 +4283,12 @@ void do1()
 			// will fill in cycles below
 		}
 
-		// disasm running log
-        // TODO: doesn't support GPU run - we can add that with a second file handle
-        EnterCriticalSection(&csDisasm);
-            if ((NULL != fpDisasm) && (pCurrentCPU == pCPU)) {
-                int pc = pCurrentCPU->GetPC();
-                if ((disasmLogType == 0) || (pc >= 0x2000)) {
-			        char buf[1024];
-			        sprintf(buf, "%04X   ", pc);
-			        Dasm9900(&buf[5], pCurrentCPU->GetPC(), xbBank);
-			        fprintf(fpDisasm, "(%d) %s\n", xbBank, buf);
-                }
-            }
-        LeaveCriticalSection(&csDisasm);
+		// disasm running log - just records the words, decoded later with -tracedump
+		if (bTraceActive) {
+			if ((pCurrentCPU == pGPU) || (disasmLogType == 0) || (pCurrentCPU->GetPC() >= 0x2000)) {
+				TraceInstruction(pCurrentCPU, xbBank);
+			}
+		}
 
 		// TODO: is this true? Is the LOAD interrupt disabled when the READY line is blocked?
 		if ((pCurrentCPU == pCPU) && (!nopFrame)) {
@@ -3774,7 +4303,38 @@ void do1()
 
         Word oldWP = pCurrentCPU->GetWP();
         Word oldST = pCurrentCPU->GetST();
-		Word in = pCurrentCPU->ExecuteOpcode(nopFrame);
+		Word in;
+
+		// remember where the instruction came from for the profiler
+		bool bProfileThis = (bProfileActive) && (pCurrentCPU == pCPU) && (!nopFrame);
+		Word nProfilePC = 0;
+		int nProfileBank = 0;
+		if (bProfileThis) {
+			nProfilePC = pCurrentCPU->GetPC();
+			nProfileBank = xbBank;
+		}
+
+		// In System Maximum, straight-line code can run as a basic block, and
+		// everything below happens once for the block. The patches above are
+		// all keyed on PC, so we only start a block where none can apply, and
+		// anything the debugger watches drops back to single instructions.
+		int nBlockCount = 0;
+		if ((bFreeRun) && (bBlockTier) && (!bInputEveryOp) && (pCurrentCPU == pCPU) && (!nopFrame) && (NULL == dbgWnd) &&
+			(0 == nBreakPoints) && (0 == nStepCount) && (!bStepOver) && (!cycleCountOn) && (!bTraceActive) && (!bProfileActive) &&
+			(NULL == PasteString) && (0 == skip_interrupt) && (!doLoadInt) && (0 == pCurrentCPU->GetX()) &&
+			((pCurrentCPU->GetPC() < 0x4000) || (pCurrentCPU->GetPC() > 0x5fff))) {
+			nBlockCount = pCurrentCPU->ExecuteBlock(BLOCK_MAX_INSTRUCTIONS);
+		}
+		if (nBlockCount > 0) {
+			in = pCurrentCPU->in;		// last opcode of the block
+			cpucount += nBlockCount-1;
+		} else {
+			in = pCurrentCPU->ExecuteOpcode(nopFrame);
+		}
+
+		if (bProfileThis) {
+			ProfileInstruction(nProfilePC, nProfileBank, in, oldWP, pCurrentCPU->GetCycleCount());
+		}
 
         if (pCurrentCPU == pCPU) {
             updateTape(pCurrentCPU->GetCycleCount());
@@ -3840,9 +4400,15 @@ void do1()
 
 		if (pCurrentCPU == pCPU) {
 			int nLocalCycleCount = pCurrentCPU->GetCycleCount();
-			InterlockedExchangeAdd((LONG*)&cycles_left, -nLocalCycleCount);
 			unsigned long old=total_cycles;
-			InterlockedExchangeAdd((LONG*)&total_cycles, nLocalCycleCount);
+			if (bFreeRun) {
+				// only the CPU thread touches the budget in run-to-completion
+				nFreeCycles -= nLocalCycleCount;
+				total_cycles += nLocalCycleCount;
+			} else {
+				InterlockedExchangeAdd((LONG*)&cycles_left, -nLocalCycleCount);
+				InterlockedExchangeAdd((LONG*)&total_cycles, nLocalCycleCount);
+			}
 			if ((old&0x80000000)&&(!(total_cycles&0x80000000))) {
 				total_cycles_looped=true;
 				speech_cycles=total_cycles;
@@ -3888,7 +4454,8 @@ void do1()
         // check for breakpoints on WP and ST
         Word newWP = pCurrentCPU->GetWP();
         Word newST = pCurrentCPU->GetST();
-		for (int idx=0; idx<nBreakPoints; idx++) {
+		int nScan = (nBreakWPST > 0) ? nBreakPoints : 0;
+		for (int idx=0; idx<nScan; idx++) {
 			switch (BreakPoints[idx].Type) {
 				case BREAK_WP:
 				    if ((newWP != oldWP) && ((pCurrentCPU->GetWP()&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
@@ -3958,6 +4525,127 @@ void verifyCallFiles() {
 	}
 }
 
+//////////////////////////////////////////////////////
+// CPU read dispatch table
+// Every 1k page of CPU space either points straight at the host
+// memory behind it, or is NULL and goes through the full decode
+// in rcpubyte. It's only rebuilt when the mapping changes - SAMS
+// registers or mode, cartridge bank, DSR selection or bank, or a
+// new ROM load.
+//////////////////////////////////////////////////////
+extern HWND hHeatMap;
+
+void InvalidateMemoryMap(bool bRomChanged) {
+	if (bRomChanged) {
+		bRomMapDirty = true;
+		RewindDirtyAll();		// new ROM or cartridge, memory may have been loaded behind our backs
+	}
+	bMemMapDirty = true;
+}
+
+static void RebuildMemoryMap() {
+	// clear first, so a change that comes in while we work is not lost
+	bMemMapDirty = false;
+
+	if (bRomMapDirty) {
+		bRomMapDirty = false;
+		++nCodeCacheEpoch;		// ROM contents may have changed under the same pointers
+		for (int p=0; p<64; ++p) {
+			int nCnt = 0;
+			for (int idx=0; idx<1024; ++idx) {
+				if (ROMMAP[(p<<10)+idx]) ++nCnt;
+			}
+			nRomMapPage[p] = (nCnt == 0) ? 0 : ((nCnt == 1024) ? 1 : 2);
+		}
+	}
+
+	for (int p=0; p<64; ++p) {
+		Word adr = p<<10;
+		Byte *pBase = NULL;
+		pMemReadPage[p] = NULL;
+		nMemReadMask[p] = 0x3ff;
+		nMemReadWait[p] = 4;
+
+		switch (adr & 0xe000) {
+			case 0x0000:			// console ROM, no wait states
+				nMemReadWait[p] = 0;
+				pBase = staticCPU + adr;
+				break;
+
+			case 0x8000:			// only the scratchpad, and only the >83xx mirror
+				if (adr == 0x8000) {
+					nMemReadWait[p] = 0;
+					nMemReadMask[p] = 0xff;
+					pBase = staticCPU + 0x8300;
+				}
+				break;
+
+			case 0xe000:
+#ifdef USE_GIGAFLASH
+				break;				// readE000 wants to see everything
+#endif
+				// fall through
+			case 0x2000:
+			case 0xa000:
+			case 0xc000:			// RAM, possibly through the AMS mapper
+				if (nRomMapPage[p] == 0) {
+					pBase = GetMemoryPagePointer(adr);
+					if (NULL != pBase) pBase += (adr & 0x0fff);
+				}
+				break;
+
+			case 0x4000:			// DSR ROM
+				if (nRomMapPage[p] == 1) {
+					pBase = staticCPU + adr;		// ROM loaded over the DSR space
+					break;
+				}
+				if (nRomMapPage[p] != 0) break;
+				if ((nCurrentDSR < 0) || (nCurrentDSR > 0xf)) break;
+				if ((nCurrentDSR == 0xe) || (nCurrentDSR == 0x3)) break;		// SAMS registers and RS232 are all I/O
+				if (adr >= 0x5800) {
+					// pages with memory-mapped registers near the top
+					if (nCurrentDSR == 0xf) break;											// P-Code GROM ports
+					if ((nCurrentDSR == 0x01) && (nDSRBank[1] > 0) && (adr == 0x5c00)) break;	// TICC registers
+					if ((nCurrentDSR == 0x00) && (csCf7Bios.GetLength() > 0) && (adr == 0x5c00)) break;	// CF7
+				}
+				pBase = &DSR[nCurrentDSR][adr - (nDSRBank[nCurrentDSR] ? 0x2000 : 0x4000)];
+				break;
+
+			case 0x6000:			// cartridge ROM
+#ifdef USE_GIGAFLASH
+				break;
+#endif
+#ifdef USE_BIG_ARRAY
+				if ((BIGARRAYSIZE > 0) && ((adr == 0x6000) || (adr == 0x7c00))) break;
+#endif
+				if (bUsesMBX) break;
+				if (xb) {
+					pBase = &CPU2[(xbBank<<13) + (adr - 0x6000)];
+				} else {
+					pBase = staticCPU + adr;
+				}
+				break;
+		}
+
+		pMemReadPage[p] = pBase;
+	}
+}
+
+// Used by the CPU decode cache to fetch an opcode without the full
+// decode. Returns the host memory behind the (even) address x and
+// the wait states the fetch costs, or NULL if the fetch must go
+// through romword (side effects, or something is watching).
+const Byte *GetDirectCodePointer(Word x, int *pWait) {
+	if ((g_bCheckUninit) || (NULL != hHeatMap)) return NULL;
+	if ((TestBreakMap(bpCpuRead, x)) || (TestBreakMap(bpCpuRead, x+1))) return NULL;
+	if (nBreakAmsRead > 0) return NULL;		// the mapped page is only checked in ReadMemoryByte
+	if (bMemMapDirty) RebuildMemoryMap();
+	Byte *pPage = pMemReadPage[x>>10];
+	if (NULL == pPage) return NULL;
+	*pWait = nMemReadWait[x>>10];
+	return pPage + (x & nMemReadMask[x>>10]);
+}
+
 //////////////////////////////////////////////////////
 // Read a single byte from CPU memory
 //////////////////////////////////////////////////////
@@ -3982,10 +4670,25 @@ Byte rcpubyte(Word x,READACCESSTYPE rmw) {
 //        TriggerBreakPoint();
 //    }
 
+	// direct path - plain memory with nothing watching it is a single load
+	// Debugger (free) reads can come from other threads, so they don't
+	// get to rebuild the table. AMS read breakpoints are on the mapped
+	// address, which only ReadMemoryByte works out, so they turn it off.
+	if ((rmw != ACCESS_FREE) && (!TestBreakMap(bpCpuRead, x)) && (0 == nBreakAmsRead) && (!g_bCheckUninit) && (NULL == hHeatMap)) {
+		if (bMemMapDirty) RebuildMemoryMap();
+		Byte *pPage = pMemReadPage[x>>10];
+		if (NULL != pPage) {
+			if ((x & 0x01) == 0) {
+				pCurrentCPU->AddCycleCount(nMemReadWait[x>>10]);
+			}
+			return pPage[x & nMemReadMask[x>>10]];
+		}
+	}
+
 	// no matter what kind of access, update the heat map
 	UpdateHeatmap(x);
 
-	if (rmw == ACCESS_READ) {
+	if ((rmw == ACCESS_READ) && (TestBreakMap(bpCpuRead, x))) {
 		// Check for read or access breakpoints
 		for (int idx=0; idx<nBreakPoints; idx++) {
 			switch (BreakPoints[idx].Type) {
@@ -4208,12 +4911,18 @@ void wcpubyte(Word x, Byte c)
 	// no matter what kind of access, update the heat map
 	UpdateHeatmap(x);
 
+	// memory writes go in the trace after the instruction that made them
+	if (bTraceWrites && bTraceActive) {
+		TraceEvent(TRACE_WRITE, x, c);
+	}
+
 //    if ((x>=0x6000)&&(x<0x8000)) {
 //        debug_write("Cartridge bank switch >%04X = >%02X", x, c);
 //    }
 
 	// Check for write or access breakpoints
-	for (int idx=0; idx<nBreakPoints; idx++) {
+	int nScan = TestBreakMap(bpCpuWrite, x) ? nBreakPoints : 0;
+	for (int idx=0; idx<nScan; idx++) {
 		switch (BreakPoints[idx].Type) {
 			case BREAK_ACCESS:
 			case BREAK_WRITE:
@@ -4274,6 +4983,7 @@ void wcpubyte(Word x, Byte c)
 			} else {
 				xbBank=(((bits)>>1)&xb);		// XB bank switch, up to 4096 banks
 			}
+			InvalidateMemoryMap();
 			goto checkmem;
 		}
 		// else it's RAM there
@@ -4441,7 +5151,7 @@ void wcpubyte(Word x, Byte c)
 
 checkmem:
 	// check breakpoints against what was written to where
-	for (int idx=0; idx<nBreakPoints; idx++) {
+	for (int idx=0; idx<nScan; idx++) {
 		switch (BreakPoints[idx].Type) {
 			case BREAK_EQUALS_BYTE:
 				if ((CheckRange(idx, x)) && ((c&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
@@ -4517,64 +5227,15 @@ void SpeechUpdate(int nSamples) {
 		return;
 	}
 
-	if (nSpeechTmpPos+nSamples >= SPEECHRATE*2) {
-		// in theory, this should not happen, though it may if we
-		// run the 9900 very fast
-//			debug_write("Speech buffer full... dropping");
-		return;
-	}
-
-	EnterCriticalSection(&csSpeechBuf);
-	SpeechProcess((unsigned char*)&SpeechTmp[nSpeechTmpPos], nSamples);
-	nSpeechTmpPos+=nSamples;
-	LeaveCriticalSection(&csSpeechBuf);
-}
-
-// this is called 60 times per second
-void SpeechBufferCopy() {
-	DWORD iRead, iWrite;
-	Byte *ptr1, *ptr2;
-	DWORD len1, len2;
-	static DWORD lastWrite=0;
-
-	// mixing with the main audio buffer
-	return;
-
-	if (nSpeechTmpPos == 0) {
-		// no data to write
-		return;
-	}
-
-	EnterCriticalSection(&csSpeechBuf);
-
-	// just for statistics
-	speechbuf->GetCurrentPosition(&iRead, &iWrite);
-	if (iWrite > lastWrite) {
-		debug_write("Speech write gap of %d (read=%d, write=%d, expected %d)", iWrite-lastWrite, iRead, iWrite, lastWrite);
-	} else if (iWrite < lastWrite) {
-		debug_write("Speech write over of %d (read=%d, write=%d, expected %d)", lastWrite-iWrite, iRead, iWrite, lastWrite);
-	} else {
-		debug_write("Speech write ok");
-	}
-	lastWrite=iWrite+nSpeechTmpPos*2;	// this is where we ENDED last write
-
-	// Note: flags make lock ignore the write cursor, but it should be about the same
-	if (SUCCEEDED(speechbuf->Lock(iWrite, nSpeechTmpPos*2, (void**)&ptr1, &len1, (void**)&ptr2, &len2, 0 /*DSBLOCK_FROMWRITECURSOR*/))) 
-	{
-		memcpy(ptr1, SpeechTmp, len1);
-		if (len2 > 0) {							// handle wraparound
-			memcpy(ptr2, &SpeechTmp[len1/2], len2);
-		}
-		speechbuf->Unlock(ptr1, len1, ptr2, len2);	
-		
-		// reset the buffer
-		nSpeechTmpPos=0;
-	} else {
-//		debug_write("Speech buffer lock failed");
-		// don't reset the buffer, we may get it next time
+	// generate in small chunks straight into the speech ring - no lock needed,
+	// the ring counts (and drops) anything that doesn't fit if we run the 9900 very fast
+	INT16 tmp[64];
+	while (nSamples > 0) {
+		int n = (nSamples > 64) ? 64 : nSamples;
+		SpeechProcess((unsigned char*)tmp, n);
+		PushSpeechSamples(tmp, n);
+		nSamples -= n;
 	}
-
-	LeaveCriticalSection(&csSpeechBuf);
 }
 
 //////////////////////////////////////////////////////
@@ -4746,7 +5407,7 @@ Byte rvdpbyte(Word x, READACCESSTYPE rmw)
 		RealVDP = GetRealVDP();
 		UpdateHeatVDP(RealVDP);
 
-		if (rmw == ACCESS_READ) {
+		if ((rmw == ACCESS_READ) && (TestBreakMap(bpVdpRead, VDPADD-1))) {
 			// Check for breakpoints
 			for (int idx=0; idx<nBreakPoints; idx++) {
 				switch (BreakPoints[idx].Type) {
@@ -5024,6 +5685,8 @@ void wvdpbyte(Word x, Byte c)
 		UpdateHeatVDP(RealVDP);
 		VDP[RealVDP]=c;
 		VDPMemInited[RealVDP]=1;
+		RewindDirtyVdp[RealVDP>>REWIND_PAGE_SHIFT]=1;
+		VDPMemoryWritten(RealVDP);
 
 		// before the breakpoint, check and emit debug if we messed up the disk buffers
 		{
@@ -5044,7 +5707,8 @@ void wvdpbyte(Word x, Byte c)
 		}
 
 		// check breakpoints against what was written to where - still assume internal address
-		for (int idx=0; idx<nBreakPoints; idx++) {
+		int nScan = TestBreakMap(bpVdpWrite, VDPADD) ? nBreakPoints : 0;
+		for (int idx=0; idx<nScan; idx++) {
 			switch (BreakPoints[idx].Type) {
 				case BREAK_EQUALS_VDP:
 					if ((CheckRange(idx, VDPADD)) && ((c&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
@@ -5069,7 +5733,6 @@ void wvdpbyte(Word x, Byte c)
 		vdpprefetchuninited = true;		// is it? you are reading back what you wrote. Probably not deliberate
 
 		increment_vdpadd();
-		redraw_needed=REDRAW_LINES;
 	}
 }
 
@@ -5088,7 +5751,8 @@ void wVDPreg(Byte r, Byte v)
 	VDPREG[r]=v;
 
 	// check breakpoints against what was written to where
-	for (int idx=0; idx<nBreakPoints; idx++) {
+	int nScan = (nBreakVdpRegs > 0) ? nBreakPoints : 0;
+	for (int idx=0; idx<nScan; idx++) {
 		switch (BreakPoints[idx].Type) {
 			case BREAK_EQUALS_VDPREG:
 				if ((r == BreakPoints[idx].A) && ((v&BreakPoints[idx].Mask) == BreakPoints[idx].Data)) {
@@ -5131,10 +5795,11 @@ void wVDPreg(Byte r, Byte v)
 // Write a byte to the sound chip
 // Nice notes at http://www.smspower.org/maxim/docs/SN76489.txt
 ////////////////////////////////////////////////////////////////
+int oldFreq[4]={0,0,0,0};							// tone generator frequencies (with room for the noise channel latch)
+
 void wsndbyte(Byte c)
 {
 	unsigned int x, idx;								// temp variable
-	static int oldFreq[3]={0,0,0};						// tone generator frequencies
 
 	if (NULL == lpds) return;
 
@@ -5218,6 +5883,128 @@ void wsndbyte(Byte c)
 // GROM base 0 (console GROMS) manage all address operations
 //////////////////////////////////////////////////////////////////
 
+//////////////////////////////////////////////////////////////////
+// GROM prefetch - every base latches the byte at the new address
+// on every access, but most of the 16 bases are empty in any
+// given setup. So only bases with something in them (or that have
+// been written as GRAM) are prefetched, and the rest are read
+// straight out of the array at the prefetch address if anyone
+// asks, which gives the same byte since nothing changed them.
+//////////////////////////////////////////////////////////////////
+static int nGromPrefetchBase[PCODEGROMBASE];		// populated bases, in order
+static int nGromPrefetchCount = 0;
+static bool bGromPopulated[PCODEGROMBASE];			// whether each base is in the list
+static Word nGromPrefetchAddress = 0;				// address of the last prefetch
+
+// rebuild the list of populated bases, optionally bringing their latches
+// up to date (a state restore brings its own latches)
+static void BuildGromPrefetchList(bool bLatch) {
+	nGromPrefetchCount = 0;
+	for (int idx=0; idx<PCODEGROMBASE; idx++) {
+		// base 0 is the console and is always there
+		bool bUsed = (idx == 0);
+		if (!bUsed) {
+			const DWORD *p = (const DWORD*)GROMBase[idx].GROM;
+			for (int i2=0; i2<(int)(sizeof(GROMBase[idx].GROM)/sizeof(DWORD)); i2++) {
+				if (p[i2]) {
+					bUsed = true;
+					break;
+				}
+			}
+		}
+		bGromPopulated[idx] = bUsed;
+		if (bUsed) {
+			nGromPrefetchBase[nGromPrefetchCount++] = idx;
+			if (bLatch) {
+				// bring its latch up to date, it may have been skipped
+				GROMBase[idx].grmdata = GROMBase[idx].GROM[nGromPrefetchAddress];
+			}
+		}
+	}
+}
+
+// call after loading GROM data
+void UpdateGromPrefetchList() {
+	BuildGromPrefetchList(true);
+	debug_write("GROM prefetch active on %d of %d bases", nGromPrefetchCount, PCODEGROMBASE);
+}
+
+// call after restoring GROM state - GRAM contents may have changed which
+// bases are populated, and the prefetch address has to follow GRMADD.
+// The restored latches are left alone. The last prefetch was from the
+// address before the increment, which stays inside the 8k bank.
+void RestoreGromPrefetch() {
+	Word adr = GROMBase[0].GRMADD;
+	nGromPrefetchAddress = ((adr-1)&0x1fff) | (adr&0xe000);
+	BuildGromPrefetchList(false);
+}
+
+// add a single base to the list (ie: it was just written as GRAM)
+static void AddGromPrefetchBase(int nBase) {
+	if (!bGromPopulated[nBase]) {
+		bGromPopulated[nBase] = true;
+		nGromPrefetchBase[nGromPrefetchCount++] = nBase;
+	}
+}
+
+// prefetch the byte at adr into every populated base
+// (-headless -gromtest compares this against the old loop over every base)
+static inline void PrefetchGrom(Word adr) {
+	nGromPrefetchAddress = adr;
+	for (int idx=0; idx<nGromPrefetchCount; idx++) {
+		int nBase = nGromPrefetchBase[idx];
+		GROMBase[nBase].grmdata = GROMBase[nBase].GROM[adr];
+	}
+}
+
+// GROM prefetch micro-benchmark (headless -gromtest)
+// Walks the whole GROM address space a number of times, like a
+// long GPL read, once through PrefetchGrom and once through the
+// old loop over every base. Must be called on the CPU thread. The
+// latches are put back afterwards, so the run carries on as normal.
+void GromPrefetchBenchmark() {
+	const int nPasses = 256;				// 16M prefetches each way
+	LARGE_INTEGER nFreq, nT0, nT1, nT2;
+	Word nOldAdr = nGromPrefetchAddress;
+	Byte nSink = 0;
+
+	QueryPerformanceFrequency(&nFreq);
+
+	QueryPerformanceCounter(&nT0);
+	for (int nPass=0; nPass<nPasses; nPass++) {
+		for (int adr=0; adr<0x10000; adr++) {
+			PrefetchGrom((Word)adr);
+		}
+		nSink ^= GROMBase[0].grmdata;
+	}
+	QueryPerformanceCounter(&nT1);
+	for (int nPass=0; nPass<nPasses; nPass++) {
+		for (int adr=0; adr<0x10000; adr++) {
+			for (int idx=0; idx<PCODEGROMBASE; idx++) {
+				GROMBase[idx].grmdata=GROMBase[idx].GROM[adr];
+			}
+		}
+		nSink ^= GROMBase[0].grmdata;
+	}
+	QueryPerformanceCounter(&nT2);
+
+	// restore the latches to where the emulation left them
+	for (int idx=0; idx<PCODEGROMBASE; idx++) {
+		GROMBase[idx].grmdata=GROMBase[idx].GROM[nOldAdr];
+	}
+	nGromPrefetchAddress = nOldAdr;
+
+	double nCount = (double)nPasses * 0x10000;
+	double nNew = (double)(nT1.QuadPart - nT0.QuadPart) * 1000000000.0 / (double)nFreq.QuadPart / nCount;
+	double nOld = (double)(nT2.QuadPart - nT1.QuadPart) * 1000000000.0 / (double)nFreq.QuadPart / nCount;
+
+	char buf[256];
+	sprintf(buf, "GROM prefetch: %d of %d bases, %.2fns per access (all bases %.2fns) [%02X]\n",
+		nGromPrefetchCount, PCODEGROMBASE, nNew, nOld, nSink);
+	debug_write("%s", buf);
+	fputs(buf, stdout);
+}
+
 //////////////////////////////////////////////////////////////////
 // Increment the GROM address - handle wraparound
 //////////////////////////////////////////////////////////////////
@@ -5280,7 +6067,13 @@ Byte ReadValidGrom(int nBase, Word x) {
         GROMBase[0].LastBase = nBase;
 
 		GROMBase[0].grmaccess=2;
-		z=GROMBase[nBase].grmdata;
+		++nGromReads;
+		if (bGromPopulated[nBase]) {
+			z=GROMBase[nBase].grmdata;
+		} else {
+			// not prefetched, fetch it now from the same address
+			z=GROMBase[nBase].GROM[nGromPrefetchAddress];
+		}
 
 		// a test for the Distorter project - special cases - GROM base is always 0 for console GROMs!
 		if (bMpdActive) {
@@ -5292,9 +6085,7 @@ Byte ReadValidGrom(int nBase, Word x) {
 		}
 
 		// update all bases prefetch
-		for (int idx=0; idx<PCODEGROMBASE; idx++) {
-			GROMBase[idx].grmdata=GROMBase[idx].GROM[GROMBase[0].GRMADD];
-		}
+		PrefetchGrom(GROMBase[0].GRMADD);
 
         // TODO: This is not correct emulation for the gigacart, which ACTUALLY maintains
         // an 8-bit address latch and a 1 bit select (for GROM >8000)
@@ -5330,7 +6121,7 @@ Byte rgrmbyte(Word x, READACCESSTYPE rmw)
 		nBank=0;
 	}
 
-	if (rmw == ACCESS_READ) {
+	if ((rmw == ACCESS_READ) && (TestBreakMap(bpGromRead, (Word)(GROMBase[0].GRMADD-1)))) {
 		// Check for breakpoints
 		for (int idx=0; idx<nBreakPoints; idx++) {
 			switch (BreakPoints[idx].Type) {
@@ -5377,9 +6168,7 @@ void WriteValidGrom(int nBase, Word x, Byte c) {
 			}
 
 			// update all bases prefetch
-			for (int idx=0; idx<PCODEGROMBASE; idx++) {
-				GROMBase[idx].grmdata=GROMBase[idx].GROM[GROMBase[0].GRMADD];
-			}
+			PrefetchGrom(GROMBase[0].GRMADD);
 
             // TODO: This is not correct emulation for the gigacart, which ACTUALLY maintains
             // an 8-bit address latch and a 1 bit select (for GROM >8000)
@@ -5399,7 +6188,8 @@ void WriteValidGrom(int nBase, Word x, Byte c) {
 		UpdateHeatGROM(GROMBase[0].GRMADD);
 
 		// Check for breakpoints
-		for (int idx=0; idx<nBreakPoints; idx++) {
+		int nScan = TestBreakMap(bpGromWrite, (Word)(GROMBase[0].GRMADD-1)) ? nBreakPoints : 0;
+		for (int idx=0; idx<nScan; idx++) {
 			switch (BreakPoints[idx].Type) {
 				case BREAK_WRITEGROM:
 					if (CheckRange(idx, GROMBase[0].GRMADD-1)) {
@@ -5428,11 +6218,11 @@ void WriteValidGrom(int nBase, Word x, Byte c) {
 		if (GROMBase[0].bWritable[(nRealAddress&0xE000)>>13]) {
 			// Allow it! The user is crazy! :)
 			GROMBase[nBase].GROM[nRealAddress]=c;
+			// and it needs to be prefetched from now on
+			AddGromPrefetchBase(nBase);
 		}
 		// update all bases prefetch
-		for (int idx=0; idx<PCODEGROMBASE; idx++) {
-			GROMBase[idx].grmdata=GROMBase[idx].GROM[GROMBase[0].GRMADD];
-		}
+		PrefetchGrom(GROMBase[0].GRMADD);
         // TODO: This is not correct emulation for the gigacart, which ACTUALLY maintains
         // an 8-bit address latch and a 1 bit select (for GROM >8000)
         // But it's enough to let me test some theories...
@@ -5587,6 +6377,7 @@ void SetSuperBank() {
 		xbBank=7;
 	}
 	xbBank&=xb;
+	InvalidateMemoryMap();
 
 	// debug helper for me
 //	TriggerBreakPoint();
@@ -5617,6 +6408,7 @@ void SetSuperBank2() {
 		xbBank=7;
 	}
 	xbBank&=xb;
+	InvalidateMemoryMap();
 
 	// debug helper for me
 //	TriggerBreakPoint();
@@ -5688,6 +6480,7 @@ void wcru(Word ad, int bt)
 				}
 				nCurrentDSR=nTmp;
                 nLastSetDSR=pCurrentCPU->GetPC();
+				InvalidateMemoryMap();
 //				debug_write("Enabling DSR at >%04x", ad);
 				// there may also be device-dependent behaviour! Don't exit.
 			}
@@ -5718,6 +6511,7 @@ void wcru(Word ad, int bt)
 					// bank switch
 					debug_write("Switching P-Code to bank 2");
 					nDSRBank[0xf]=1;
+					InvalidateMemoryMap();
 				}
 				break;
 
@@ -5730,6 +6524,7 @@ void wcru(Word ad, int bt)
 			if ((ad&0xff) == 0) {
 				if (((ad>>8)&0xf) == nCurrentDSR) {
 					nCurrentDSR=-1;
+					InvalidateMemoryMap();
 //					debug_write("Disabling DSR at >%04x", ad);
 					// may be device-dependent behaviour, don't exit
 				}
@@ -5762,6 +6557,7 @@ void wcru(Word ad, int bt)
 					// bank switch
 					debug_write("Switching P-Code to bank 1");
 					nDSRBank[0xf]=0;
+					InvalidateMemoryMap();
 				}
 				break;
 
@@ -6410,7 +7206,6 @@ void __cdecl SpeechBufThread(void *) {
 // less accurate on a small scale but about the same
 // over time.
 //////////////////////////////////////////////////////////////
-extern int dac_pos;
 extern double dacupdatedistance;
 void __cdecl TimerThread(void *)
 {
@@ -6475,7 +7270,10 @@ void __cdecl TimerThread(void *)
 					// Do not set nVDPFrames to 0 here
 					break;
 				case THROTTLE_SYSTEMMAXIMUM:
-					// We do the exchange here since the loop below may not run
+					// The CPU thread runs free and owns its own budget (see RunFreeFrame),
+					// we only keep time here for the housekeeping below. We still top up
+					// cycles_left for stepping out of a breakpoint.
+					WaitForSingleObject(timer, 1000);
 					InterlockedExchange((LONG*)&cycles_left, max_cpf*100);
 					nVDPFrames = 0;
 					break;
@@ -6540,14 +7338,14 @@ void __cdecl TimerThread(void *)
 				// very very fast machines may someday break this loop
 			}
 
-			// copy over the speech buffer -- only need to do this once
-			// if our timing is right this should always work out about right
-			SpeechBufferCopy();
-
 			// This set the VDP processing rate. This is based on CPU cycles except
 			// in overdrive, which tries to maintain approximately real time despite
 			// CPU cycle count.
-			if (ThrottleMode != THROTTLE_OVERDRIVE) {
+			if ((ThrottleMode == THROTTLE_SYSTEMMAXIMUM) && (max_cpf > 0)) {
+				// the CPU thread calls Counting() itself on emulated frame boundaries
+				old_total_cycles=total_cycles;
+				bDrawDebug=true;
+			} else if (ThrottleMode != THROTTLE_OVERDRIVE) {
 				// this side is used in normal mode
 				while (old_total_cycles+(hzRate==HZ50?DEFAULT_50HZ_CPF:DEFAULT_60HZ_CPF) <= total_cycles) {
 					Counting();					// update counters & VDP interrupt
@@ -6565,13 +7363,6 @@ void __cdecl TimerThread(void *)
 				}
 			}
 
-            // TODO: a hack of sorts, but DAC and sound update can end up running at different rates,
-            // leading to out of sync audio. So empty the dac buffer, no matter how much we used
-//            if (dac_pos < 100) {
-//                debug_write("dac_pos at %d", dac_pos);
-//                dac_pos = 0;
-//            }
-
 			if ((bDrawDebug)&&(dbgWnd)) {
 				if (max_cpf > 0) {
 					draw_debug();
@@ -6737,9 +7528,9 @@ void TriggerBreakPoint(bool bForce, bool openDebugger) {
 		return;
 	}
 
-    if (NULL != fpDisasm) {
+    if (bTraceActive) {
         if ((disasmLogType == 0) || (pCurrentCPU->GetPC() > 0x2000)) {
-            fprintf(fpDisasm, "**** Breakpoint triggered\n");
+            TraceEvent(TRACE_BREAK, pCurrentCPU->GetPC(), 0);
         }
     }
 
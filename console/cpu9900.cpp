@@ -63,11 +63,16 @@
 #define WIN32_LEAN_AND_MEAN
 #define _WIN32_WINNT 0x0500
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <vector>
 #include "tiemul.h"
 #include "cpu9900.h"
+#include "..\addons\ams.h"
 #include "..\addons\F18A.h"
+#include "..\debugger\trace.h"
+#include "..\debugger\profiler.h"
+#include "rewind.h"
 #include "..\resource.h"
 
 extern bool BreakOnIllegal;                         // true if we should trigger a breakpoint on bad opcode
@@ -75,9 +80,7 @@ extern int enableDebugOpcodes;
 extern CPU9900 * volatile pCurrentCPU;
 extern CPU9900 *pCPU, *pGPU;
 extern int bInterleaveGPU;
-extern FILE *fpDisasm;          // file pointer for logging disassembly, if active
 extern int disasmLogType;
-extern CRITICAL_SECTION csDisasm;
 
 // we set skip_interrupt to 2 because it's decremented after every instruction - including
 // the one that sets it!
@@ -171,21 +174,24 @@ Word BStatusLookup[256];
 /////////////////////////////////////////////////////////////////////
 // Inlines for getting source and destination addresses
 /////////////////////////////////////////////////////////////////////
-#define FormatI { Td=(in&0x0c00)>>10; Ts=(in&0x0030)>>4; D=(in&0x03c0)>>6; S=(in&0x000f); B=(in&0x1000)>>12; fixS(); }
-#define FormatII { D=(in&0x00ff); }
-#define FormatIII { Td=0; Ts=(in&0x0030)>>4; D=(in&0x03c0)>>6; S=(in&0x000f); B=0; fixS(); }
-#define FormatIV { D=(in&0x03c0)>>6; Ts=(in&0x0030)>>4; S=(in&0x000f); B=(D<9); fixS(); }           // No destination (CRU ops)
-#define FormatV { D=(in&0x00f0)>>4; S=(in&0x000f); S=WP+(S<<1); }
-#define FormatVI { Ts=(in&0x0030)>>4; S=in&0x000f; B=0; fixS(); }                                   // No destination (single argument instructions)
+// the fields come from fld, which is filled in along with 'in' (see DecodeOpFields)
+#define FormatI { Td=fld.nTd; Ts=fld.nTs; D=fld.nD; S=fld.nS; B=fld.nB; fixS(); }
+#define FormatII { D=fld.nDisp; }
+#define FormatIII { Td=0; Ts=fld.nTs; D=fld.nD; S=fld.nS; B=0; fixS(); }
+#define FormatIV { D=fld.nD; Ts=fld.nTs; S=fld.nS; B=(D<9); fixS(); }                               // No destination (CRU ops)
+#define FormatV { D=fld.nD4; S=fld.nS; S=WP+(S<<1); }
+#define FormatVI { Ts=fld.nTs; S=fld.nS; B=0; fixS(); }                                              // No destination (single argument instructions)
 #define FormatVII {}                                                                                // no argument
-#define FormatVIII_0 { D=(in&0x000f); D=WP+(D<<1); }
-#define FormatVIII_1 { D=(in&0x000f); D=WP+(D<<1); S=ROMWORD(PC); ADDPC(2); }
-#define FormatIX  { D=(in&0x03c0)>>6; Ts=(in&0x0030)>>4; S=(in&0x000f); B=0; fixS(); }              // No destination here (dest calc'd after call) (DIV, MUL, XOP)
+#define FormatVIII_0 { D=fld.nS; D=WP+(D<<1); }
+#define FormatVIII_1 { D=fld.nS; D=WP+(D<<1); S=ROMWORD(PC); ADDPC(2); }
+#define FormatIX  { D=fld.nD; Ts=fld.nTs; S=fld.nS; B=0; fixS(); }                                   // No destination here (dest calc'd after call) (DIV, MUL, XOP)
 
 CPU9900::CPU9900() {
     buildcpu();
     pType="9900";
     enableDebug=true;
+    pDecodeCache=NULL;
+    nDecodeEpoch=0;
 }
 
 void CPU9900::reset() {
@@ -398,16 +404,11 @@ void CPU9900::TriggerInterrupt(Word vector, Byte level) {
     //  Read PC
 
     // debug helper if logging
-    EnterCriticalSection(&csDisasm);
-        if (NULL != fpDisasm) {
-            if ((disasmLogType == 0) || (pCurrentCPU->GetPC() > 0x2000)) {
-                fprintf(fpDisasm, "**** Interrupt Trigger, vector >%04X (%s), level %d\n",
-                    vector, 
-                    (vector==0)?"reset":(vector==4)?"console":(vector=0xfffc)?"load":"unknown",
-                    level);
-            }
+    if (bTraceActive) {
+        if ((disasmLogType == 0) || (pCurrentCPU->GetPC() > 0x2000)) {
+            TraceEvent(TRACE_INTERRUPT, vector, level);
         }
-    LeaveCriticalSection(&csDisasm);
+    }
 
     // no more idling!
     StopIdle();
@@ -428,6 +429,10 @@ void CPU9900::TriggerInterrupt(Word vector, Byte level) {
 
     Word NewPC = ROMWORD(vector+2);
 
+    if ((bProfileActive) && (this == pCPU)) {
+        ProfileInterrupt(NewPC, PC, WP);
+    }
+
     /* now load the correct workspace, and perform a branch and link to the address */
     SetWP(NewWP);
     SetPC(NewPC);
@@ -471,12 +476,33 @@ void CPU9900::SetX(Word x) {
 Word CPU9900::ExecuteOpcode(bool nopFrame) {
     if (nopFrame) {
         in = 0x1000;                // JMP $ - NOP, but because we don't ADDPC below it doesn't move ;)
+        DecodeOpFields(in, &fld);
         // note, I was confused that a nop should step back, but 0x10FF is a jump to itself forever
         // this was breaking the HALT code because we didn't step back to ourselves. Because we
         // didn't do the ADDPC, we were actually moving backwards in memory for the duration of the
         // halt...
+    } else if (NULL != pDecodeCache) {
+        // try the decode cache - only used when the fetch has no side effects
+        int nWait;
+        const Byte *pHost = GetDirectCodePointer(PC, &nWait);
+        if (NULL != pHost) {
+            DecodedOp *pOp = GetDecodedOp(pHost);
+            // the fetch costs the same as romword would have charged
+            if (nWait) AddCycleCount(nWait);
+            in = pOp->in;
+            fld = pOp->fld;
+            ADDPC(2);
+
+            CALL_MEMBER_FN(this, pOp->fn)();
+
+            return in;
+        }
+        in=ROMWORD(PC);
+        DecodeOpFields(in, &fld);
+        ADDPC(2);
     } else {
         in=ROMWORD(PC);
+        DecodeOpFields(in, &fld);
         ADDPC(2);
     }
 
@@ -485,6 +511,138 @@ Word CPU9900::ExecuteOpcode(bool nopFrame) {
     return in;
 }
 
+// Returns the decode cache entry for the opcode at PC, which the caller
+// has already found at pHost, decoding it again if it's missing or stale.
+DecodedOp *CPU9900::GetDecodedOp(const Byte *pHost) {
+    if (nDecodeEpoch != nCodeCacheEpoch) {
+        FlushDecodeCache();
+    }
+    DecodedOp *pOp = &pDecodeCache[PC>>1];
+    if ((pOp->pHost != pHost) || ((NULL != pOp->pGen) && (*pOp->pGen != pOp->nGen))) {
+        // miss or stale - decode it again
+        pOp->pHost = pHost;
+        pOp->pGen = GetCodeBlockGen(pHost);
+        pOp->nGen = (NULL != pOp->pGen) ? *pOp->pGen : 0;
+        pOp->in = (pHost[0]<<8) | pHost[1];
+        DecodeOpFields(pOp->in, &pOp->fld);
+        pOp->fn = opcode[pOp->in];
+        pOp->nBlock = ClassifyBlockOp(pOp->in, pOp->fn);
+    }
+    return pOp;
+}
+
+// Basic block tier - runs straight-line code from the decode cache
+// without returning to do1 between instructions, so the caller does
+// the per-instruction housekeeping (interrupts, VDP, timers, cycle
+// budget) once for the whole block. Blocks only contain instructions
+// that touch nothing but the workspace and the code stream, and end
+// after a jump, B, BL, LWPI or RTWP. Anything else ends the block
+// before it runs and goes through ExecuteOpcode as normal.
+// Returns the number of instructions executed, 0 if no block could
+// start here. Cycles are left in the cycle count as usual.
+int CPU9900::ExecuteBlock(int nMax) {
+    int nWait;
+
+    if (NULL == pDecodeCache) return 0;
+
+    // registers have to be plain memory too, or a register access is I/O
+    if ((NULL == GetDirectCodePointer(WP, &nWait)) || (NULL == GetDirectCodePointer(WP+30, &nWait))) {
+        return 0;
+    }
+
+    int nCount = 0;
+    while (nCount < nMax) {
+        const Byte *pHost = GetDirectCodePointer(PC, &nWait);
+        if (NULL == pHost) break;
+
+        DecodedOp *pOp = GetDecodedOp(pHost);
+        if (BLOCK_STOP == pOp->nBlock) break;
+
+        if (nWait) AddCycleCount(nWait);
+        in = pOp->in;
+        fld = pOp->fld;
+        ADDPC(2);
+
+        CALL_MEMBER_FN(this, pOp->fn)();
+
+        ++nCount;
+        if (BLOCK_END == pOp->nBlock) break;
+    }
+
+    return nCount;
+}
+
+// Decide how an opcode can take part in a basic block. The decision
+// is by handler, plus the addressing modes for the ones that have them,
+// since only register mode (0) is guaranteed not to touch memory.
+Byte CPU9900::ClassifyBlockOp(Word op, CPU990Fctn fn) {
+    int ts = (op&0x0030)>>4;
+    int td = (op&0x0c00)>>10;
+
+    // flow control ends the block
+    if ((fn == &CPU9900::op_jmp) || (fn == &CPU9900::op_jlt) || (fn == &CPU9900::op_jle) ||
+        (fn == &CPU9900::op_jeq) || (fn == &CPU9900::op_jhe) || (fn == &CPU9900::op_jgt) ||
+        (fn == &CPU9900::op_jne) || (fn == &CPU9900::op_jnc) || (fn == &CPU9900::op_joc) ||
+        (fn == &CPU9900::op_jno) || (fn == &CPU9900::op_jl)  || (fn == &CPU9900::op_jh)  ||
+        (fn == &CPU9900::op_jop)) {
+        return BLOCK_END;
+    }
+    // B and BL only calculate their address, they don't read it
+    if ((fn == &CPU9900::op_b) || (fn == &CPU9900::op_bl)) {
+        return BLOCK_END;
+    }
+    // these change the workspace, so the next block has to check it again
+    if ((fn == &CPU9900::op_lwpi) || (fn == &CPU9900::op_rtwp)) {
+        return BLOCK_END;
+    }
+
+    // immediates and status
+    if ((fn == &CPU9900::op_li) || (fn == &CPU9900::op_ai) || (fn == &CPU9900::op_andi) ||
+        (fn == &CPU9900::op_ori) || (fn == &CPU9900::op_ci) || (fn == &CPU9900::op_stwp) ||
+        (fn == &CPU9900::op_stst)) {
+        return BLOCK_BODY;
+    }
+    // shifts always work on a register (count 0 reads R0)
+    if ((fn == &CPU9900::op_sra) || (fn == &CPU9900::op_srl) || (fn == &CPU9900::op_sla) ||
+        (fn == &CPU9900::op_src)) {
+        return BLOCK_BODY;
+    }
+    // single operand, and format III/IX with a register destination
+    if ((fn == &CPU9900::op_clr) || (fn == &CPU9900::op_seto) || (fn == &CPU9900::op_inv) ||
+        (fn == &CPU9900::op_neg) || (fn == &CPU9900::op_abs) || (fn == &CPU9900::op_swpb) ||
+        (fn == &CPU9900::op_inc) || (fn == &CPU9900::op_inct) || (fn == &CPU9900::op_dec) ||
+        (fn == &CPU9900::op_dect) || (fn == &CPU9900::op_coc) || (fn == &CPU9900::op_czc) ||
+        (fn == &CPU9900::op_xor) || (fn == &CPU9900::op_mpy) || (fn == &CPU9900::op_div)) {
+        return (ts == 0) ? BLOCK_BODY : BLOCK_STOP;
+    }
+    // two operand
+    if ((fn == &CPU9900::op_a) || (fn == &CPU9900::op_ab) || (fn == &CPU9900::op_c) ||
+        (fn == &CPU9900::op_cb) || (fn == &CPU9900::op_s) || (fn == &CPU9900::op_sb) ||
+        (fn == &CPU9900::op_soc) || (fn == &CPU9900::op_socb) || (fn == &CPU9900::op_szc) ||
+        (fn == &CPU9900::op_szcb) || (fn == &CPU9900::op_mov) || (fn == &CPU9900::op_movb)) {
+        return ((ts == 0) && (td == 0)) ? BLOCK_BODY : BLOCK_STOP;
+    }
+
+    // everything else - X, BLWP, XOP, CRU, LIMI, IDLE and friends, illegal and debug opcodes
+    return BLOCK_STOP;
+}
+
+// Turn on the decoded instruction cache for this CPU. Only valid for
+// a CPU whose ROMWORD is the console romword, so not the GPU.
+void CPU9900::EnableDecodeCache() {
+    if (NULL == pDecodeCache) {
+        pDecodeCache = (DecodedOp*)malloc(sizeof(DecodedOp) * 32768);
+    }
+    FlushDecodeCache();
+}
+
+void CPU9900::FlushDecodeCache() {
+    if (NULL != pDecodeCache) {
+        memset(pDecodeCache, 0, sizeof(DecodedOp) * 32768);
+    }
+    nDecodeEpoch = nCodeCacheEpoch;
+}
+
 ////////////////////////////////////////////////////////////////////
 // Classic99 - 9900 CPU opcodes
 // Opcode functions follow
@@ -1535,6 +1693,7 @@ void CPU9900::op_x()
 
     FormatVI;
     in=ROMWORD(S);      // read source
+    DecodeOpFields(in, &fld);
 
     X_flag=PC;          // set flag and save true post-X address for the JMPs (AFTER X's oprands but BEFORE the instruction's oprands, if any)
 
@@ -3022,6 +3181,7 @@ void CPU9900::op_spioutF18(){
     // This is needed so the FormatIV instruction correctly interprets
     // this as a byte operation in all cases.
     in = (in&(~0x03c0)) | (8<<6);
+    fld.nD = 8;
 
     FormatIV;
     x1=RCPUBYTE(S);
@@ -3045,6 +3205,7 @@ void CPU9900::op_spiinF18(){
     // This is needed so the FormatIV instruction correctly interprets
     // this as a byte operation in all cases.
     in = (in&(~0x03c0)) | (8<<6);
+    fld.nD = 8;
 
     FormatIV;
     
@@ -3652,7 +3813,8 @@ void GPUF18A::WCPUBYTE(Word dest, Byte c) {
     UpdateHeatVDP(dest);        // todo: maybe GPU vdp writes can be a different color
     VDP[dest]=c;
     VDPMemInited[dest]=1;
-    if (dest < 0x4000) redraw_needed=REDRAW_LINES;      // to avoid redrawing because of GPU R0-R15 registers changing
+    RewindDirtyVdp[dest>>REWIND_PAGE_SHIFT]=1;
+    if (dest < 0x4000) VDPMemoryWritten(dest);      // to avoid redrawing because of GPU R0-R15 registers changing
 }
 
 Word GPUF18A::ROMWORD(Word src, READACCESSTYPE rmw=ACCESS_READ) {
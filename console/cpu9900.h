@@ -61,6 +61,49 @@ class CPU9900;
 typedef void (CPU9900::*CPU990Fctn)(void);			// now function pointers are just "CPU9900Fctn" type
 #define CALL_MEMBER_FN(object, ptr) ((object)->*(ptr))
 
+// The fields of an opcode word, pulled out once when it's decoded. The
+// modes and register numbers are fixed by the opcode - only the address
+// they resolve to (fixS/fixD) depends on the registers at the time, so
+// that part is still done by the handler.
+struct OpFields {
+	Byte nTs;											// source mode (bits 4-5)
+	Byte nTd;											// destination mode (bits 10-11)
+	Byte nS;											// source register (bits 0-3)
+	Byte nD;											// destination register or CRU count (bits 6-9)
+	Byte nB;											// byte operation (bit 12)
+	Byte nD4;											// shift count (bits 4-7)
+	Byte nDisp;											// jump displacement or CRU bit (bits 0-7)
+};
+
+inline void DecodeOpFields(Word op, OpFields *pFld) {
+	pFld->nTs = (op&0x0030)>>4;
+	pFld->nTd = (op&0x0c00)>>10;
+	pFld->nS = op&0x000f;
+	pFld->nD = (op&0x03c0)>>6;
+	pFld->nB = (op&0x1000)>>12;
+	pFld->nD4 = (op&0x00f0)>>4;
+	pFld->nDisp = op&0x00ff;
+}
+
+// One entry of the decoded instruction cache, indexed by PC/2. An entry is
+// good as long as PC still maps to the same host memory (so bank and AMS
+// page are part of the key) and nothing has written to that memory since.
+struct DecodedOp {
+	const Byte *pHost;									// host memory the opcode was fetched from, NULL if empty
+	const DWord *pGen;									// write generation of that memory, NULL for ROM
+	DWord nGen;											// value of *pGen when we decoded it
+	CPU990Fctn fn;										// handler from the opcode table
+	Word in;											// the opcode itself
+	OpFields fld;										// its operand fields
+	Byte nBlock;										// BLOCK_xxx - how this opcode may be used in a basic block
+};
+
+// Basic block classes for ExecuteBlock
+#define BLOCK_STOP	0									// never part of a block, run through the normal path
+#define BLOCK_BODY	1									// register-only straight-line code
+#define BLOCK_END	2									// runs as the last instruction of a block (jumps, B, BL, LWPI, RTWP)
+#define BLOCK_MAX_INSTRUCTIONS 64						// cap so the frame budget and interrupts aren't held off too long
+
 // we need more than one of these now - time for a class
 class CPU9900 {
 public:		// type protection later. Make work today.
@@ -70,11 +113,14 @@ public:		// type protection later. Make work today.
 	Word X_flag;										// Set during an 'X' instruction, 0 if not active, else address of PC after the X (ignoring arguments if any)
 	Word ST;											// Status register
 	Word in,D,S,Td,Ts,B;								// Opcode interpretation
+	OpFields fld;										// fields of 'in' - from the decode cache, or decoded on fetch
 	int nCycleCount;									// Used in CPU throttle
 	Byte nPostInc[2];									// Register number to increment, ORd with 0x80 for 2, or 0x40 for 1
 	const char *pType;
 
 	CPU990Fctn opcode[65536];							// CPU Opcode address table
+	DecodedOp *pDecodeCache;							// decoded instruction cache (32k entries), NULL if not used
+	unsigned int nDecodeEpoch;							// nCodeCacheEpoch the cache was filled under
 
 	int idling;											// set when an IDLE occurs
 	int halted;											// set when the CPU is halted by external hardware (in this emulation, we spin NOPs)
@@ -139,6 +185,11 @@ public:		// type protection later. Make work today.
 	Word GetX();
 	void SetX(Word x);
 	Word ExecuteOpcode(bool nopFrame);
+	int  ExecuteBlock(int nMax);
+	void EnableDecodeCache();
+	void FlushDecodeCache();
+	DecodedOp *GetDecodedOp(const Byte *pHost);
+	Byte ClassifyBlockOp(Word op, CPU990Fctn fn);
 
 	////////////////////////////////////////////////////////////////////
 	// Classic99 - 9900 CPU opcodes
@@ -0,0 +1,612 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Rewind buffer
+//
+// Each frame becomes one record in a ring: a list of segments, each
+// a header and a run length packed block. In a keyframe the blocks
+// are the data itself, in a delta they are the XOR against the frame
+// before. The shadow copies hold memory as of the newest record, so a
+// delta only needs the dirty pages compared against them.
+//
+// Stepping back decodes forward from the nearest keyframe into the
+// shadow copies, then copies those onto the machine. That's one
+// keyframe plus at most nRewindKeyframe deltas, whatever the distance.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "tiemul.h"
+#include "..\addons\ams.h"
+#include "savestate.h"
+#include "rewind.h"
+
+#define REWIND_FRAMES_PER_SECOND	60		// NTSC, PAL just reaches a little further back
+#define REWIND_VDP_SIZE				(REWIND_VDP_PAGES<<REWIND_PAGE_SHIFT)
+
+// segment types
+#define SEG_STATE		0			// machine state, XOR against the last one
+#define SEG_STATE_RAW	1			// machine state stored whole (keyframes, or the size changed)
+#define SEG_CPU			2			// 4k pages of each memory
+#define SEG_VDP			3
+#define SEG_AMS			4
+
+// StoreRecord results
+#define STORE_OK		0
+#define STORE_TOO_BIG	1			// bigger than the whole ring
+#define STORE_NEED_KEY	2			// a delta, but room was made by dropping everything it builds on
+
+// worst case size of a packed block - one control byte per 128 literals
+#define PACK_WORST(n)	((n) + (n)/128 + 2)
+
+struct RewindSegment {
+	Byte nType;
+	Byte nPad;
+	Word nPage;
+	DWord nLen;						// unpacked bytes
+	DWord nPacked;					// packed bytes following the header
+};
+
+struct RewindEntry {
+	int nOffset;					// into pRing
+	int nSize;
+	bool bKey;
+};
+
+Byte RewindDirtyCpu[REWIND_CPU_PAGES];
+Byte RewindDirtyVdp[REWIND_VDP_PAGES];
+Byte RewindDirtyAms[REWIND_AMS_PAGES];
+volatile bool bRewindDirtyAll = true;
+volatile bool bRewindFrame = false;
+bool bRewindHeld = false;
+
+int bRewindEnabled = 1;
+int nRewindSeconds = 30;
+int nRewindMB = 32;
+int nRewindKeyframe = 60;
+
+// the packed history - records are contiguous, and the write
+// position wraps to the start when the next one won't fit
+static Byte *pRing = NULL;
+static int nRingSize = 0;
+static int nRingHead = 0;			// where the next record goes
+static RewindEntry *pEntries = NULL;
+static int nMaxEntries = 0;
+static int nFirst = 0;				// index of the oldest entry
+static int nEntries = 0;
+static int nSinceKey = 0;			// records since (and including) the last keyframe
+
+// the machine as of the newest record
+static MachineState PrevState, CurState;
+static Byte *pShadowCpu = NULL;
+static Byte *pShadowVdp = NULL;
+static Byte *pShadowAms[REWIND_AMS_PAGES];	// allocated as AMS pages come into use, NULL reads as zeros
+
+// scratch
+static Byte *pRecord = NULL;		// record being built
+static int nRecordSize = 0;
+static int nRecordAlloc = 0;
+static Byte *pWork = NULL;			// machine state being XORed or rebuilt
+static int nWork = 0;
+static int nWorkAlloc = 0;
+static DWord XorPage[REWIND_PAGE_SIZE/sizeof(DWord)];
+
+// Pack runs of zeros. A control byte below 0x80 is followed by that
+// many plus one literal bytes, otherwise it and the next byte hold a
+// 15 bit count (less one) of zeros. Runs of one or two zeros are
+// cheaper left in the literals.
+static int PackRun(const Byte *pIn, int nLen, Byte *pOut) {
+	int nPos = 0;
+	int nOut = 0;
+
+	while (nPos < nLen) {
+		int nZero = 0;
+		while ((nPos+nZero < nLen) && (pIn[nPos+nZero] == 0) && (nZero < 0x8000)) {
+			++nZero;
+		}
+		if ((nZero >= 3) || ((nZero > 0) && (nPos+nZero == nLen))) {
+			pOut[nOut++] = 0x80 | ((nZero-1)>>8);
+			pOut[nOut++] = (nZero-1)&0xff;
+			nPos += nZero;
+			continue;
+		}
+
+		// literals, up to the next run worth packing
+		int nLit = 0;
+		while ((nPos+nLit < nLen) && (nLit < 128)) {
+			if ((nPos+nLit+2 < nLen) && (pIn[nPos+nLit] == 0) && (pIn[nPos+nLit+1] == 0) && (pIn[nPos+nLit+2] == 0)) {
+				break;
+			}
+			++nLit;
+		}
+		pOut[nOut++] = nLit-1;
+		memcpy(pOut+nOut, pIn+nPos, nLit);
+		nOut += nLit;
+		nPos += nLit;
+	}
+
+	return nOut;
+}
+
+// unpack into pOut, or XOR into it - in which case zero runs are left alone
+static bool UnpackRun(const Byte *pIn, int nPacked, Byte *pOut, int nLen, bool bXor) {
+	int nIn = 0;
+	int nPos = 0;
+
+	while (nIn < nPacked) {
+		int c = pIn[nIn++];
+		if (c & 0x80) {
+			if (nIn >= nPacked) return false;
+			int n = (((c&0x7f)<<8) | pIn[nIn++]) + 1;
+			if (nPos+n > nLen) return false;
+			if (!bXor) {
+				memset(pOut+nPos, 0, n);
+			}
+			nPos += n;
+		} else {
+			int n = c+1;
+			if ((nIn+n > nPacked) || (nPos+n > nLen)) return false;
+			if (bXor) {
+				for (int idx=0; idx<n; idx++) {
+					pOut[nPos+idx] ^= pIn[nIn+idx];
+				}
+			} else {
+				memcpy(pOut+nPos, pIn+nIn, n);
+			}
+			nIn += n;
+			nPos += n;
+		}
+	}
+
+	return (nPos == nLen);
+}
+
+// grow one of the scratch buffers, keeping what's in it
+static bool GrowBuffer(Byte **ppBuf, int *pAlloc, int nNeed) {
+	if (nNeed <= *pAlloc) return true;
+
+	int nNew = (*pAlloc > 0) ? *pAlloc : 64*1024;
+	while (nNew < nNeed) nNew *= 2;
+	Byte *pNew = (Byte*)realloc(*ppBuf, nNew);
+	if (NULL == pNew) return false;
+	*ppBuf = pNew;
+	*pAlloc = nNew;
+	return true;
+}
+
+// append a packed segment to the record being built
+static bool AddSegment(int nType, int nPage, const Byte *pData, int nLen) {
+	if (!GrowBuffer(&pRecord, &nRecordAlloc, nRecordSize + (int)sizeof(RewindSegment) + PACK_WORST(nLen))) {
+		return false;
+	}
+
+	RewindSegment seg;
+	seg.nType = nType;
+	seg.nPad = 0;
+	seg.nPage = nPage;
+	seg.nLen = nLen;
+	seg.nPacked = PackRun(pData, nLen, pRecord + nRecordSize + sizeof(seg));
+	memcpy(pRecord + nRecordSize, &seg, sizeof(seg));
+	nRecordSize += sizeof(seg) + seg.nPacked;
+	return true;
+}
+
+// add one memory page and bring its shadow up to date
+static bool AddPage(int nType, int nPage, const Byte *pMem, Byte *pShadow, bool bKey) {
+	if (bKey) {
+		memcpy(pShadow, pMem, REWIND_PAGE_SIZE);
+		return AddSegment(nType, nPage, pMem, REWIND_PAGE_SIZE);
+	}
+
+	const DWord *pA = (const DWord*)pMem;
+	const DWord *pB = (const DWord*)pShadow;
+	DWord nAny = 0;
+	for (int idx=0; idx<REWIND_PAGE_SIZE/(int)sizeof(DWord); idx++) {
+		XorPage[idx] = pA[idx] ^ pB[idx];
+		nAny |= XorPage[idx];
+	}
+	if (0 == nAny) {
+		// written, but back to what it was
+		return true;
+	}
+
+	memcpy(pShadow, pMem, REWIND_PAGE_SIZE);
+	return AddSegment(nType, nPage, (const Byte*)XorPage, REWIND_PAGE_SIZE);
+}
+
+static RewindEntry *GetEntry(int n) {
+	return &pEntries[(nFirst + n) % nMaxEntries];
+}
+
+// drop the oldest frame - and the deltas after it, which are
+// no use without their keyframe
+static void DropOldest() {
+	do {
+		nFirst = (nFirst+1) % nMaxEntries;
+		--nEntries;
+	} while ((nEntries > 0) && (!pEntries[nFirst].bKey));
+}
+
+// copy the finished record into the ring, making room as needed
+// The ring must always start with a keyframe, so a delta that only
+// fits by dropping every older record is refused, and the caller
+// builds the frame again as a keyframe.
+static int StoreRecord(bool bKey) {
+	if (nRecordSize > nRingSize) {
+		debug_write("A frame needs %dk of rewind buffer, more than the %dMB it has. Rewind is off.", nRecordSize/1024, nRewindMB);
+		return STORE_TOO_BIG;
+	}
+
+	int nPos = nRingHead;
+	if (nPos + nRecordSize > nRingSize) {
+		// wrap - the frames in the space left at the end are the oldest
+		while ((nEntries > 0) && (pEntries[nFirst].nOffset >= nRingHead)) {
+			DropOldest();
+		}
+		nPos = 0;
+	}
+	while (nEntries > 0) {
+		RewindEntry *pOld = GetEntry(0);
+		if ((nEntries < nMaxEntries) && ((pOld->nOffset >= nPos + nRecordSize) || (pOld->nOffset + pOld->nSize <= nPos))) {
+			break;
+		}
+		DropOldest();
+	}
+
+	// DropOldest leaves a keyframe first, or nothing at all
+	if ((!bKey) && ((0 == nEntries) || (!GetEntry(0)->bKey))) {
+		return STORE_NEED_KEY;
+	}
+
+	memcpy(pRing + nPos, pRecord, nRecordSize);
+	if (0 == nEntries) {
+		nFirst = 0;
+	}
+	RewindEntry *pNew = GetEntry(nEntries);
+	pNew->nOffset = nPos;
+	pNew->nSize = nRecordSize;
+	pNew->bKey = bKey;
+	++nEntries;
+	nRingHead = nPos + nRecordSize;
+	return STORE_OK;
+}
+
+static void ClearDirty() {
+	memset(RewindDirtyCpu, 0, sizeof(RewindDirtyCpu));
+	memset(RewindDirtyVdp, 0, sizeof(RewindDirtyVdp));
+	memset(RewindDirtyAms, 0, sizeof(RewindDirtyAms));
+	bRewindDirtyAll = false;
+}
+
+static int GetAmsPages() {
+	int nPages = systemMemorySize >> REWIND_PAGE_SHIFT;
+	if (nPages > REWIND_AMS_PAGES) nPages = REWIND_AMS_PAGES;
+	return nPages;
+}
+
+// build the record for the frame in CurState and memory into pRecord
+static bool BuildRecord(bool bKey) {
+	bool bAll = bKey || bRewindDirtyAll;
+	bool bOk = true;
+
+	nRecordSize = 0;
+	if ((bKey) || (CurState.nSize != PrevState.nSize)) {
+		bOk = AddSegment(SEG_STATE_RAW, 0, CurState.pData, CurState.nSize);
+	} else {
+		bOk = GrowBuffer(&pWork, &nWorkAlloc, CurState.nSize);
+		if (bOk) {
+			for (int idx=0; idx<CurState.nSize; idx++) {
+				pWork[idx] = CurState.pData[idx] ^ PrevState.pData[idx];
+			}
+			bOk = AddSegment(SEG_STATE, 0, pWork, CurState.nSize);
+		}
+	}
+
+	for (int idx=0; (bOk) && (idx<REWIND_CPU_PAGES); idx++) {
+		if ((bAll) || (RewindDirtyCpu[idx])) {
+			bOk = AddPage(SEG_CPU, idx, staticCPU + (idx<<REWIND_PAGE_SHIFT), pShadowCpu + (idx<<REWIND_PAGE_SHIFT), bKey);
+		}
+	}
+	for (int idx=0; (bOk) && (idx<REWIND_VDP_PAGES); idx++) {
+		if ((bAll) || (RewindDirtyVdp[idx])) {
+			bOk = AddPage(SEG_VDP, idx, VDP + (idx<<REWIND_PAGE_SHIFT), pShadowVdp + (idx<<REWIND_PAGE_SHIFT), bKey);
+		}
+	}
+
+	// AMS pages that were never prepared hold nothing worth keeping
+	int nAmsPages = GetAmsPages();
+	for (int idx=0; (bOk) && (idx<nAmsPages); idx++) {
+		if (!AmsPageReady(idx)) {
+			if ((bKey) && (NULL != pShadowAms[idx])) {
+				// restoring from this keyframe won't have it either
+				free(pShadowAms[idx]);
+				pShadowAms[idx] = NULL;
+			}
+			continue;
+		}
+		if ((bAll) || (RewindDirtyAms[idx])) {
+			if (NULL == pShadowAms[idx]) {
+				pShadowAms[idx] = (Byte*)calloc(1, REWIND_PAGE_SIZE);
+				if (NULL == pShadowAms[idx]) {
+					bOk = false;
+					break;
+				}
+			}
+			bOk = AddPage(SEG_AMS, idx, systemMemory + (idx<<REWIND_PAGE_SHIFT), pShadowAms[idx], bKey);
+		}
+	}
+
+	return bOk;
+}
+
+// record the frame that just finished
+static void RewindCapture() {
+	bool bKey = (0 == nEntries) || (nSinceKey >= nRewindKeyframe);
+
+	CurState.bNoMemory = true;
+	if (!CaptureMachineState(&CurState)) {
+		RewindReset();
+		return;
+	}
+
+	bool bOk = BuildRecord(bKey);
+	int nStored = STORE_OK;
+	if (bOk) {
+		nStored = StoreRecord(bKey);
+		if (STORE_NEED_KEY == nStored) {
+			// the shadows are already up to date, so this just stores them whole
+			bKey = true;
+			bOk = BuildRecord(true);
+			if (bOk) {
+				nStored = StoreRecord(true);
+			}
+		}
+	}
+
+	if (!bOk) {
+		debug_write("Out of memory for rewind - history cleared.");
+		RewindReset();
+		return;
+	}
+	if (STORE_OK != nStored) {
+		RewindShutdown();
+		return;
+	}
+
+	nSinceKey = bKey ? 1 : nSinceKey+1;
+	MachineState tmp = PrevState;
+	PrevState = CurState;
+	CurState = tmp;
+	ClearDirty();
+}
+
+// decode one record into the shadow copies and pWork
+static bool ApplyRecord(const RewindEntry *pEntry, bool bKey) {
+	const Byte *pIn = pRing + pEntry->nOffset;
+	int nLeft = pEntry->nSize;
+
+	if (bKey) {
+		// anything the keyframe doesn't have wasn't there
+		memset(pShadowVdp, 0, REWIND_VDP_SIZE);
+		for (int idx=0; idx<REWIND_AMS_PAGES; idx++) {
+			if (NULL != pShadowAms[idx]) {
+				free(pShadowAms[idx]);
+				pShadowAms[idx] = NULL;
+			}
+		}
+	}
+
+	while (nLeft > 0) {
+		RewindSegment seg;
+		if (nLeft < (int)sizeof(seg)) return false;
+		memcpy(&seg, pIn, sizeof(seg));
+		pIn += sizeof(seg);
+		nLeft -= sizeof(seg);
+		if ((int)seg.nPacked > nLeft) return false;
+
+		Byte *pOut = NULL;
+		bool bXor = !bKey;
+		switch (seg.nType) {
+			case SEG_STATE_RAW:
+				if (!GrowBuffer(&pWork, &nWorkAlloc, seg.nLen)) return false;
+				nWork = seg.nLen;
+				pOut = pWork;
+				bXor = false;
+				break;
+
+			case SEG_STATE:
+				if ((bKey) || ((int)seg.nLen != nWork)) return false;
+				pOut = pWork;
+				break;
+
+			case SEG_CPU:
+				if (seg.nPage >= REWIND_CPU_PAGES) return false;
+				pOut = pShadowCpu + (seg.nPage<<REWIND_PAGE_SHIFT);
+				break;
+
+			case SEG_VDP:
+				if (seg.nPage >= REWIND_VDP_PAGES) return false;
+				pOut = pShadowVdp + (seg.nPage<<REWIND_PAGE_SHIFT);
+				break;
+
+			case SEG_AMS:
+				if (seg.nPage >= REWIND_AMS_PAGES) return false;
+				if (NULL == pShadowAms[seg.nPage]) {
+					pShadowAms[seg.nPage] = (Byte*)calloc(1, REWIND_PAGE_SIZE);
+					if (NULL == pShadowAms[seg.nPage]) return false;
+				}
+				pOut = pShadowAms[seg.nPage];
+				break;
+
+			default:
+				return false;
+		}
+		if ((seg.nType >= SEG_CPU) && (seg.nLen != REWIND_PAGE_SIZE)) return false;
+
+		if (!UnpackRun(pIn, seg.nPacked, pOut, seg.nLen, bXor)) return false;
+		pIn += seg.nPacked;
+		nLeft -= seg.nPacked;
+	}
+
+	return true;
+}
+
+// put the machine back to record n (0 is the oldest)
+static bool RewindRestore(int n) {
+	int nKey = n;
+	while ((nKey > 0) && (!GetEntry(nKey)->bKey)) {
+		--nKey;
+	}
+	if (!GetEntry(nKey)->bKey) return false;
+
+	nWork = 0;
+	for (int idx=nKey; idx<=n; idx++) {
+		if (!ApplyRecord(GetEntry(idx), idx == nKey)) return false;
+	}
+
+	if (!RestoreMachineState(pWork, nWork)) return false;
+	memcpy(staticCPU, pShadowCpu, 0x10000);
+	memcpy(VDP, pShadowVdp, REWIND_VDP_SIZE);
+	int nAmsPages = GetAmsPages();
+	for (int idx=0; idx<nAmsPages; idx++) {
+		if (NULL != pShadowAms[idx]) {
+			memcpy(systemMemory + (idx<<REWIND_PAGE_SHIFT), pShadowAms[idx], REWIND_PAGE_SIZE);
+			SetAmsPageReady(idx);
+		}
+	}
+
+	// the machine and the shadows agree again
+	PrevState.nSize = 0;
+	PrevState.bError = false;
+	StateWrite(&PrevState, pWork, nWork);
+	if (PrevState.bError) return false;
+	nSinceKey = n - nKey + 1;
+	ClearDirty();
+	return true;
+}
+
+// one frame back, dropping the frame we left - it's a future that won't happen now
+static void RewindStepBack() {
+	if (0 == nEntries) return;
+
+	int nTarget = (nEntries > 1) ? nEntries-2 : 0;
+	if (!RewindRestore(nTarget)) {
+		debug_write("Rewind failed - history cleared.");
+		RewindReset();
+		return;
+	}
+
+	nEntries = nTarget+1;
+	RewindEntry *pLast = GetEntry(nTarget);
+	nRingHead = pLast->nOffset + pLast->nSize;
+	redraw_needed = REDRAW_LINES;
+}
+
+// called from the emulation thread once a frame has completed
+void RewindFrame() {
+	bRewindFrame = false;
+	if (NULL == pRing) return;
+
+	if (bRewindHeld) {
+		RewindStepBack();
+	} else {
+		RewindCapture();
+	}
+}
+
+// forget the history - the next frame is a keyframe
+void RewindReset() {
+	nEntries = 0;
+	nFirst = 0;
+	nRingHead = 0;
+	nSinceKey = 0;
+	PrevState.nSize = 0;
+	bRewindDirtyAll = true;
+}
+
+bool RewindInit() {
+	RewindShutdown();
+	if ((!bRewindEnabled) || (bHeadless)) return false;
+
+	if (nRewindSeconds < 1) nRewindSeconds = 1;
+	if (nRewindSeconds > 600) nRewindSeconds = 600;
+	if (nRewindMB < 1) nRewindMB = 1;
+	if (nRewindMB > 1024) nRewindMB = 1024;
+	if (nRewindKeyframe < 1) nRewindKeyframe = 1;
+	if (nRewindKeyframe > 600) nRewindKeyframe = 600;
+
+	nRingSize = nRewindMB*1024*1024;
+	nMaxEntries = nRewindSeconds*REWIND_FRAMES_PER_SECOND + 1;		// +1 for the frame we're stepping back from
+	pRing = (Byte*)malloc(nRingSize);
+	pEntries = (RewindEntry*)malloc(nMaxEntries*sizeof(RewindEntry));
+	pShadowCpu = (Byte*)calloc(1, 0x10000);
+	pShadowVdp = (Byte*)calloc(1, REWIND_VDP_SIZE);
+	if ((NULL == pRing) || (NULL == pEntries) || (NULL == pShadowCpu) || (NULL == pShadowVdp)) {
+		debug_write("Not enough memory for a %dMB rewind buffer.", nRewindMB);
+		RewindShutdown();
+		return false;
+	}
+
+	RewindReset();
+	debug_write("Rewind buffer %dMB, up to %d seconds, keyframe every %d frames.", nRewindMB, nRewindSeconds, nRewindKeyframe);
+	return true;
+}
+
+void RewindShutdown() {
+	if (NULL != pRing) { free(pRing); pRing = NULL; }
+	if (NULL != pEntries) { free(pEntries); pEntries = NULL; }
+	if (NULL != pShadowCpu) { free(pShadowCpu); pShadowCpu = NULL; }
+	if (NULL != pShadowVdp) { free(pShadowVdp); pShadowVdp = NULL; }
+	for (int idx=0; idx<REWIND_AMS_PAGES; idx++) {
+		if (NULL != pShadowAms[idx]) {
+			free(pShadowAms[idx]);
+			pShadowAms[idx] = NULL;
+		}
+	}
+	if (NULL != pRecord) { free(pRecord); pRecord = NULL; }
+	if (NULL != pWork) { free(pWork); pWork = NULL; }
+	nRecordAlloc = 0;
+	nWorkAlloc = 0;
+	nRingSize = 0;
+	nMaxEntries = 0;
+	FreeMachineState(&PrevState);
+	FreeMachineState(&CurState);
+	RewindReset();
+}
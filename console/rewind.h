@@ -0,0 +1,79 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Rewind buffer
+//
+// At the end of every frame the machine is captured and stored as
+// its difference from the frame before - XORed against the last
+// capture, so unchanged bytes are zero, and then run length packed.
+// Every nRewindKeyframe frames a whole keyframe is stored instead,
+// so going back any distance decodes one keyframe and the deltas
+// after it, never the whole history.
+//
+// Memory (CPU, VDP and AMS) is compared in 4k pages, and only the
+// pages written since the last frame are looked at. The writers
+// mark the pages; anything that writes memory behind their backs
+// (DSRs, the debugger) calls RewindDirtyAll() instead.
+//
+
+#define REWIND_PAGE_SHIFT	12
+#define REWIND_PAGE_SIZE	(1<<REWIND_PAGE_SHIFT)
+#define REWIND_CPU_PAGES	(0x10000>>REWIND_PAGE_SHIFT)
+#define REWIND_VDP_PAGES	((128*1024)>>REWIND_PAGE_SHIFT)
+#define REWIND_AMS_PAGES	0x2000				// MaxMapperPages in ams.cpp
+
+// pages written since the last capture
+extern Byte RewindDirtyCpu[REWIND_CPU_PAGES];
+extern Byte RewindDirtyVdp[REWIND_VDP_PAGES];
+extern Byte RewindDirtyAms[REWIND_AMS_PAGES];
+extern volatile bool bRewindDirtyAll;			// compare everything next frame
+inline void RewindDirtyAll() { bRewindDirtyAll = true; }
+
+extern volatile bool bRewindFrame;				// set by the VDP when a frame completes
+extern bool bRewindHeld;						// set by the hotkey check while rewind is held
+
+// configuration
+extern int bRewindEnabled;						// keep a rewind buffer at all
+extern int nRewindSeconds;						// how far back it goes
+extern int nRewindMB;							// memory for the packed history
+extern int nRewindKeyframe;						// frames between keyframes
+
+// emulation thread
+bool RewindInit();
+void RewindShutdown();
+void RewindReset();
+void RewindFrame();
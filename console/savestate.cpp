@@ -0,0 +1,648 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Machine save states
+//
+// Everything is copied out whole. The biggest pieces are the 64k of
+// CPU memory, the VDP memory, and any AMS pages that have been used,
+// so even a loaded 1MB card is only a memcpy away. Host side things
+// (the frame ring, the audio rings, DirectSound) are not saved, they
+// catch up on their own within a frame.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <atlstr.h>
+
+#include "tiemul.h"
+#include "cpu9900.h"
+#include "sound.h"
+#include "..\addons\ams.h"
+#include "..\disk\diskclass.h"
+#include "savestate.h"
+#include "rewind.h"
+
+#define STATE_INITIAL_ALLOC	(256*1024)	// grows by doubling
+#define STATE_TIMEOUT		5000		// ms to wait for the emulation to take a request
+
+#define STATE_REQ_NONE		0
+#define STATE_REQ_SAVE		1
+#define STATE_REQ_LOAD		2
+#define STATE_REQ_BUSY		3			// the emulation thread has claimed it
+
+// references into C99
+extern CPU9900 *pCPU, *pGPU;
+extern Byte mbx_ram[1024];
+extern int CRUTimerTicks;
+extern int timer9901, timer9901Read, starttimer9901, timer9901IntReq;
+extern bool CPUSpeechHalt;
+extern Byte CPUSpeechHaltByte;
+extern int nSystem;
+extern int (*SpeechSaveState)(Byte *pBuf, int nMax);
+extern bool (*SpeechLoadState)(const Byte *pBuf, int nLen);
+
+// the request being handed to the emulation thread
+volatile LONG nStateRequest = STATE_REQ_NONE;
+static MachineState *pRequestState = NULL;
+static const Byte *pRequestData = NULL;
+static int nRequestSize = 0;
+static bool bRequestResult = false;
+static HANDLE hStateDone = NULL;
+
+// The configuration chunk. A state only goes back onto the machine
+// it came from - same system, same cartridge, same memory card.
+struct StateConfig {
+	int nSystem;
+	int xb;
+	int nAmsMode;
+	DWord nRomHash;				// every ROM byte in CPU space, the banked cartridge ROM, and GROM
+};
+
+////////////////////////////////////////////////////////////
+// Chunk writing
+////////////////////////////////////////////////////////////
+Byte *StateReserve(MachineState *pState, int nLen) {
+	if (pState->bError) {
+		return NULL;
+	}
+
+	if (pState->nSize + nLen > pState->nAlloc) {
+		int nNew = (pState->nAlloc > 0) ? pState->nAlloc : STATE_INITIAL_ALLOC;
+		while (pState->nSize + nLen > nNew) {
+			nNew *= 2;
+		}
+		Byte *pNew = (Byte*)realloc(pState->pData, nNew);
+		if (NULL == pNew) {
+			debug_write("Out of memory for save state (%d bytes)", nNew);
+			pState->bError = true;
+			return NULL;
+		}
+		pState->pData = pNew;
+		pState->nAlloc = nNew;
+	}
+
+	Byte *pRet = pState->pData + pState->nSize;
+	pState->nSize += nLen;
+	return pRet;
+}
+
+void StateWrite(MachineState *pState, const void *pData, int nLen) {
+	Byte *pOut = StateReserve(pState, nLen);
+	if (NULL != pOut) {
+		memcpy(pOut, pData, nLen);
+	}
+}
+
+// fill in the length of the chunk we were writing, if any
+static void StateEndChunk(MachineState *pState) {
+	if ((pState->nChunk >= 0) && (!pState->bError)) {
+		StateChunkHeader *pHdr = (StateChunkHeader*)(pState->pData + pState->nChunk);
+		pHdr->nSize = pState->nSize - pState->nChunk - sizeof(StateChunkHeader);
+	}
+	pState->nChunk = -1;
+}
+
+void StateBeginChunk(MachineState *pState, const char *pTag) {
+	StateChunkHeader hdr;
+
+	StateEndChunk(pState);
+	memcpy(hdr.szTag, pTag, sizeof(hdr.szTag));
+	hdr.nSize = 0;
+	pState->nChunk = pState->nSize;
+	StateWrite(pState, &hdr, sizeof(hdr));
+}
+
+void StateRead(StateReader *pRead, void *pData, int nLen) {
+	if ((!pRead->bOk) || (nLen > pRead->nLeft)) {
+		pRead->bOk = false;
+		return;
+	}
+	memcpy(pData, pRead->pPos, nLen);
+	pRead->pPos += nLen;
+	pRead->nLeft -= nLen;
+}
+
+void FreeMachineState(MachineState *pState) {
+	free(pState->pData);
+	pState->pData = NULL;
+	pState->nSize = 0;
+	pState->nAlloc = 0;
+	pState->nChunk = -1;
+	pState->bError = false;
+}
+
+////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////
+
+// FNV-1a, just to tell one set of ROMs from another
+static DWord HashBytes(DWord nHash, const Byte *pData, int nLen) {
+	for (int idx=0; idx<nLen; idx++) {
+		nHash ^= pData[idx];
+		nHash *= 16777619;
+	}
+	return nHash;
+}
+
+static void GetStateConfig(StateConfig *pConfig) {
+	// the rewind buffer asks every frame, so only hash when a ROM is loaded
+	static DWord nHash = 0;
+	static unsigned int nHashSeq = 0;
+	static bool bHashed = false;
+
+	memset(pConfig, 0, sizeof(*pConfig));
+	pConfig->nSystem = nSystem;
+	pConfig->xb = xb;
+	pConfig->nAmsMode = MemoryEmulationMode();
+
+	if ((!bHashed) || (nHashSeq != nRomLoadSeq)) {
+		nHashSeq = nRomLoadSeq;
+		bHashed = true;
+
+		// which bytes of CPU space are ROM, and what's in them - console,
+		// cartridge (bank 0 as mapped) and anything else loaded as ROM
+		nHash = HashBytes(2166136261, ROMMAP, sizeof(ROMMAP));
+		for (int idx=0; idx<0x10000; idx++) {
+			if (ROMMAP[idx]) {
+				nHash = HashBytes(nHash, &staticCPU[idx], 1);
+			}
+		}
+		for (int seg=0; seg<8; seg++) {
+			// skip GRAM, it's expected to change
+			if (!GROMBase[0].bWritable[seg]) {
+				nHash = HashBytes(nHash, &GROMBase[0].GROM[seg*0x2000], 0x2000);
+			}
+		}
+		if (NULL != CPU2) {
+			// every bank of a banked cartridge
+			nHash = HashBytes(nHash, CPU2, (xb+1)*0x2000);
+		}
+	}
+	pConfig->nRomHash = nHash;
+}
+
+static void SaveCpuState(MachineState *pState, const char *pTag, CPU9900 *pCpu) {
+	StateBeginChunk(pState, pTag);
+	STATE_PUT(pState, pCpu->PC);
+	STATE_PUT(pState, pCpu->WP);
+	STATE_PUT(pState, pCpu->X_flag);
+	STATE_PUT(pState, pCpu->ST);
+	STATE_PUT(pState, pCpu->nCycleCount);
+	STATE_PUT(pState, pCpu->nPostInc);
+	STATE_PUT(pState, pCpu->idling);
+	STATE_PUT(pState, pCpu->halted);
+}
+
+static void LoadCpuState(StateReader *pRead, CPU9900 *pCpu) {
+	STATE_GET(pRead, pCpu->PC);
+	STATE_GET(pRead, pCpu->WP);
+	STATE_GET(pRead, pCpu->X_flag);
+	STATE_GET(pRead, pCpu->ST);
+	STATE_GET(pRead, pCpu->nCycleCount);
+	STATE_GET(pRead, pCpu->nPostInc);
+	STATE_GET(pRead, pCpu->idling);
+	STATE_GET(pRead, pCpu->halted);
+}
+
+static void SaveGromState(MachineState *pState) {
+	StateBeginChunk(pState, "GROM");
+	for (int base=0; base<17; base++) {
+		GROMType *pGrom = &GROMBase[base];
+		STATE_PUT(pState, pGrom->bWritable);
+		STATE_PUT(pState, pGrom->GRMADD);
+		STATE_PUT(pState, pGrom->grmaccess);
+		STATE_PUT(pState, pGrom->grmdata);
+		STATE_PUT(pState, pGrom->LastRead);
+		STATE_PUT(pState, pGrom->LastBase);
+		// GROM doesn't change, but GRAM does
+		for (int seg=0; seg<8; seg++) {
+			if (pGrom->bWritable[seg]) {
+				StateWrite(pState, &pGrom->GROM[seg*0x2000], 0x2000);
+			}
+		}
+	}
+}
+
+static void LoadGromState(StateReader *pRead) {
+	for (int base=0; (base<17) && (pRead->bOk); base++) {
+		GROMType *pGrom = &GROMBase[base];
+		bool bWritable[8];
+		STATE_GET(pRead, bWritable);
+		STATE_GET(pRead, pGrom->GRMADD);
+		STATE_GET(pRead, pGrom->grmaccess);
+		STATE_GET(pRead, pGrom->grmdata);
+		STATE_GET(pRead, pGrom->LastRead);
+		STATE_GET(pRead, pGrom->LastBase);
+		for (int seg=0; seg<8; seg++) {
+			if (bWritable[seg]) {
+				if (!pGrom->bWritable[seg]) {
+					// GRAM in the state, GROM here - don't touch it
+					pRead->bOk = false;
+					return;
+				}
+				StateRead(pRead, &pGrom->GROM[seg*0x2000], 0x2000);
+			}
+		}
+	}
+
+	// the prefetch list and address belong to the GROM state too
+	if (pRead->bOk) {
+		RestoreGromPrefetch();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Capture the whole machine into pState. Emulation thread
+// only, between instructions. The buffer in pState is reused.
+////////////////////////////////////////////////////////////
+bool CaptureMachineState(MachineState *pState) {
+	StateHeader hdr;
+	StateConfig config;
+
+	pState->nSize = 0;
+	pState->nChunk = -1;
+	pState->bError = false;
+
+	memcpy(hdr.szMagic, STATE_MAGIC, sizeof(hdr.szMagic));
+	hdr.nVersion = STATE_VERSION;
+	hdr.nSize = 0;
+	StateWrite(pState, &hdr, sizeof(hdr));
+
+	// must be first, so a restore can refuse before it changes anything
+	GetStateConfig(&config);
+	StateBeginChunk(pState, "CONF");
+	STATE_PUT(pState, config);
+
+	SaveCpuState(pState, "CPU ", pCPU);
+	SaveCpuState(pState, "GPU ", pGPU);
+
+	if (!pState->bNoMemory) {
+		StateBeginChunk(pState, "RAM ");
+		StateWrite(pState, staticCPU, 0x10000);
+	}
+
+	int nBank = xbBank;
+	StateBeginChunk(pState, "CART");
+	STATE_PUT(pState, nBank);
+	STATE_PUT(pState, mbx_ram);
+
+	StateBeginChunk(pState, "DSR ");
+	STATE_PUT(pState, nCurrentDSR);
+	STATE_PUT(pState, nDSRBank);
+
+	StateBeginChunk(pState, "CRU ");
+	STATE_PUT(pState, CRU);
+	STATE_PUT(pState, timer9901);
+	STATE_PUT(pState, timer9901Read);
+	STATE_PUT(pState, starttimer9901);
+	STATE_PUT(pState, timer9901IntReq);
+	STATE_PUT(pState, CRUTimerTicks);
+	STATE_PUT(pState, skip_interrupt);
+	STATE_PUT(pState, doLoadInt);
+	STATE_PUT(pState, CPUSpeechHalt);
+	STATE_PUT(pState, CPUSpeechHaltByte);
+
+	SaveGromState(pState);
+	SaveAmsState(pState);
+	SaveVdpState(pState);
+	SaveSoundState(pState);
+
+	if (NULL != SpeechSaveState) {
+		int nLen = SpeechSaveState(NULL, 0);
+		if (nLen > 0) {
+			StateBeginChunk(pState, "SPCH");
+			Byte *pOut = StateReserve(pState, nLen);
+			if (NULL != pOut) {
+				SpeechSaveState(pOut, nLen);
+			}
+		}
+	}
+
+	EnterCriticalSection(&csDriveType);
+	for (int idx=0; idx<MAX_DRIVES; idx++) {
+		if (NULL != pDriveType[idx]) {
+			char szTag[5];
+			sprintf(szTag, "DK%02d", idx);
+			StateBeginChunk(pState, szTag);
+			pDriveType[idx]->SaveOpenFiles(pState);
+		}
+	}
+	LeaveCriticalSection(&csDriveType);
+
+	StateEndChunk(pState);
+	if (pState->bError) {
+		return false;
+	}
+	((StateHeader*)pState->pData)->nSize = pState->nSize;
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// Put a captured state back on the machine. Emulation thread
+// only. The state is checked before anything is changed, and
+// false is returned if it was refused or any part of it was
+// damaged (in which case the machine may be partly restored).
+////////////////////////////////////////////////////////////
+bool RestoreMachineState(const Byte *pData, int nSize) {
+	StateConfig config, saved;
+	const StateHeader *pHdr = (const StateHeader*)pData;
+	bool bDrive[MAX_DRIVES] = { false };
+	bool bRet = true;
+
+	if ((nSize < (int)sizeof(StateHeader)) || (0 != memcmp(pHdr->szMagic, STATE_MAGIC, sizeof(pHdr->szMagic)))) {
+		debug_write("Not a save state.");
+		return false;
+	}
+	if (pHdr->nVersion != STATE_VERSION) {
+		debug_write("Save state version %d is not supported (need %d).", pHdr->nVersion, STATE_VERSION);
+		return false;
+	}
+	if (pHdr->nSize != (DWord)nSize) {
+		debug_write("Save state is truncated.");
+		return false;
+	}
+
+	// walk the chunks first, so we know they all fit
+	int nPos = sizeof(StateHeader);
+	while (nPos < nSize) {
+		const StateChunkHeader *pChunk = (const StateChunkHeader*)(pData + nPos);
+		if ((nPos + (int)sizeof(StateChunkHeader) > nSize) || (pChunk->nSize > (DWord)(nSize - nPos - sizeof(StateChunkHeader)))) {
+			debug_write("Save state is damaged at offset %d.", nPos);
+			return false;
+		}
+		nPos += sizeof(StateChunkHeader) + pChunk->nSize;
+	}
+
+	// and make sure it's for this machine
+	const StateChunkHeader *pFirst = (const StateChunkHeader*)(pData + sizeof(StateHeader));
+	GetStateConfig(&config);
+	if ((nSize < (int)(sizeof(StateHeader) + sizeof(StateChunkHeader) + sizeof(StateConfig))) ||
+		(0 != memcmp(pFirst->szTag, "CONF", 4)) || (pFirst->nSize != sizeof(StateConfig))) {
+		debug_write("Save state has no configuration.");
+		return false;
+	}
+	memcpy(&saved, pFirst+1, sizeof(saved));
+	if (0 != memcmp(&saved, &config, sizeof(config))) {
+		debug_write("Save state is for a different system, cartridge or memory card - not loaded.");
+		return false;
+	}
+
+	EnterCriticalSection(&csDriveType);
+
+	nPos = sizeof(StateHeader);
+	while (nPos < nSize) {
+		const StateChunkHeader *pChunk = (const StateChunkHeader*)(pData + nPos);
+		StateReader read;
+		read.pPos = pData + nPos + sizeof(StateChunkHeader);
+		read.nLeft = pChunk->nSize;
+		read.bOk = true;
+		nPos += sizeof(StateChunkHeader) + pChunk->nSize;
+
+		if (0 == memcmp(pChunk->szTag, "CONF", 4)) {
+			continue;
+		} else if (0 == memcmp(pChunk->szTag, "CPU ", 4)) {
+			LoadCpuState(&read, pCPU);
+		} else if (0 == memcmp(pChunk->szTag, "GPU ", 4)) {
+			LoadCpuState(&read, pGPU);
+		} else if (0 == memcmp(pChunk->szTag, "RAM ", 4)) {
+			// only the RAM comes back - the ROM that's loaded now stays put
+			static Byte RamTmp[0x10000];
+			StateRead(&read, RamTmp, 0x10000);
+			if (read.bOk) {
+				for (int idx=0; idx<0x10000; idx++) {
+					if (!ROMMAP[idx]) {
+						staticCPU[idx] = RamTmp[idx];
+					}
+				}
+			}
+		} else if (0 == memcmp(pChunk->szTag, "CART", 4)) {
+			int nBank = 0;
+			STATE_GET(&read, nBank);
+			STATE_GET(&read, mbx_ram);
+			if (read.bOk) {
+				xbBank = nBank;
+			}
+		} else if (0 == memcmp(pChunk->szTag, "DSR ", 4)) {
+			STATE_GET(&read, nCurrentDSR);
+			STATE_GET(&read, nDSRBank);
+		} else if (0 == memcmp(pChunk->szTag, "CRU ", 4)) {
+			STATE_GET(&read, CRU);
+			STATE_GET(&read, timer9901);
+			STATE_GET(&read, timer9901Read);
+			STATE_GET(&read, starttimer9901);
+			STATE_GET(&read, timer9901IntReq);
+			STATE_GET(&read, CRUTimerTicks);
+			STATE_GET(&read, skip_interrupt);
+			STATE_GET(&read, doLoadInt);
+			STATE_GET(&read, CPUSpeechHalt);
+			STATE_GET(&read, CPUSpeechHaltByte);
+		} else if (0 == memcmp(pChunk->szTag, "GROM", 4)) {
+			LoadGromState(&read);
+		} else if (0 == memcmp(pChunk->szTag, "AMS ", 4)) {
+			LoadAmsState(&read);
+		} else if (0 == memcmp(pChunk->szTag, "VDP ", 4)) {
+			LoadVdpState(&read);
+		} else if (0 == memcmp(pChunk->szTag, "SND ", 4)) {
+			LoadSoundState(&read);
+		} else if (0 == memcmp(pChunk->szTag, "SPCH", 4)) {
+			if ((NULL == SpeechLoadState) || (!SpeechLoadState(read.pPos, read.nLeft))) {
+				debug_write("Speech state could not be restored.");
+			} else {
+				resetSpeechBuffer();
+			}
+		} else if ((pChunk->szTag[0] == 'D') && (pChunk->szTag[1] == 'K')) {
+			int nDrive = (pChunk->szTag[2]-'0')*10 + (pChunk->szTag[3]-'0');
+			if ((nDrive >= 0) && (nDrive < MAX_DRIVES) && (NULL != pDriveType[nDrive])) {
+				pDriveType[nDrive]->RestoreOpenFiles(&read);
+				bDrive[nDrive] = true;
+			}
+		} else {
+			debug_write("Skipping unknown save state chunk '%.4s'", pChunk->szTag);
+		}
+
+		if (!read.bOk) {
+			debug_write("Save state chunk '%.4s' is damaged.", pChunk->szTag);
+			bRet = false;
+		}
+	}
+
+	// any drive the state didn't know about had nothing open
+	for (int idx=0; idx<MAX_DRIVES; idx++) {
+		if ((!bDrive[idx]) && (NULL != pDriveType[idx])) {
+			pDriveType[idx]->CloseAllFiles();
+		}
+	}
+
+	LeaveCriticalSection(&csDriveType);
+
+	// memory, banks and the mapper all changed under the decode caches
+	InvalidateMemoryMap(true);
+	bDebugDirty = true;
+
+	return bRet;
+}
+
+////////////////////////////////////////////////////////////
+// Emulation thread - pick up a request from another thread.
+// Called between instructions whenever nStateRequest is set.
+////////////////////////////////////////////////////////////
+void ServiceStateRequest() {
+	LONG nRequest = nStateRequest;
+
+	if ((nRequest != STATE_REQ_SAVE) && (nRequest != STATE_REQ_LOAD)) {
+		return;
+	}
+	if (nRequest != InterlockedCompareExchange(&nStateRequest, STATE_REQ_BUSY, nRequest)) {
+		// withdrawn while we looked
+		return;
+	}
+
+	if (nRequest == STATE_REQ_SAVE) {
+		bRequestResult = CaptureMachineState(pRequestState);
+	} else {
+		bRequestResult = RestoreMachineState(pRequestData, nRequestSize);
+		// the rewind history belongs to the machine we just replaced
+		RewindReset();
+	}
+
+	MemoryBarrier();
+	InterlockedExchange(&nStateRequest, STATE_REQ_NONE);
+	SetEvent(hStateDone);
+}
+
+// Hand a request to the emulation thread and wait for it. If the
+// emulation doesn't take it in time, it's withdrawn.
+static bool RunStateRequest(LONG nRequest, MachineState *pState, const Byte *pData, int nSize) {
+	if (NULL == hStateDone) {
+		hStateDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (NULL == hStateDone) {
+			return false;
+		}
+	}
+
+	pRequestState = pState;
+	pRequestData = pData;
+	nRequestSize = nSize;
+	bRequestResult = false;
+	ResetEvent(hStateDone);
+	MemoryBarrier();
+
+	if (STATE_REQ_NONE != InterlockedCompareExchange(&nStateRequest, nRequest, STATE_REQ_NONE)) {
+		debug_write("A save state request is already running.");
+		return false;
+	}
+
+	if (WAIT_OBJECT_0 != WaitForSingleObject(hStateDone, STATE_TIMEOUT)) {
+		if (nRequest == InterlockedCompareExchange(&nStateRequest, STATE_REQ_NONE, nRequest)) {
+			debug_write("Emulation is not running - save state request cancelled.");
+			return false;
+		}
+		// it was picked up just as we gave up, so let it finish
+		WaitForSingleObject(hStateDone, INFINITE);
+	}
+
+	MemoryBarrier();
+	return bRequestResult;
+}
+
+////////////////////////////////////////////////////////////
+// Any thread but the emulation - state files
+////////////////////////////////////////////////////////////
+bool SaveStateFile(const char *pFile) {
+	MachineState state;
+	bool bRet = false;
+
+	if (RunStateRequest(STATE_REQ_SAVE, &state, NULL, 0)) {
+		FILE *fp = fopen(pFile, "wb");
+		if (NULL == fp) {
+			debug_write("Can't open %s to save state.", pFile);
+		} else {
+			bRet = (fwrite(state.pData, 1, state.nSize, fp) == (size_t)state.nSize);
+			if (0 != fclose(fp)) {
+				bRet = false;
+			}
+			if (bRet) {
+				debug_write("Saved state to %s (%d bytes)", pFile, state.nSize);
+			} else {
+				debug_write("Failed writing state to %s", pFile);
+			}
+		}
+	}
+
+	FreeMachineState(&state);
+	return bRet;
+}
+
+bool LoadStateFile(const char *pFile) {
+	FILE *fp = fopen(pFile, "rb");
+	if (NULL == fp) {
+		debug_write("Can't open state file %s", pFile);
+		return false;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	int nSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (nSize <= 0) {
+		fclose(fp);
+		debug_write("State file %s is empty.", pFile);
+		return false;
+	}
+
+	Byte *pData = (Byte*)malloc(nSize);
+	if (NULL == pData) {
+		fclose(fp);
+		debug_write("Out of memory loading state file %s", pFile);
+		return false;
+	}
+	bool bRet = (fread(pData, 1, nSize, fp) == (size_t)nSize);
+	fclose(fp);
+
+	if (bRet) {
+		bRet = RunStateRequest(STATE_REQ_LOAD, NULL, pData, nSize);
+	}
+	if (bRet) {
+		debug_write("Loaded state from %s", pFile);
+	} else {
+		debug_write("Failed to load state from %s", pFile);
+	}
+
+	free(pData);
+	return bRet;
+}
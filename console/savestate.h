@@ -0,0 +1,110 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Machine save states
+//
+// A state is a header followed by tagged chunks, one per piece of
+// hardware. Each chunk is a 4 character tag and a length, so a
+// loader skips chunks it doesn't know and leaves hardware alone
+// when its chunk is missing. Bump STATE_VERSION when the layout of
+// an existing chunk changes.
+//
+// Capture and restore run on the emulation thread, between
+// instructions. Other threads go through SaveStateFile and
+// LoadStateFile, which hand the work over and wait for it.
+//
+
+#define STATE_MAGIC "C99STATE"
+#define STATE_VERSION 2
+
+struct StateHeader {
+	char szMagic[8];				// STATE_MAGIC
+	DWord nVersion;					// STATE_VERSION
+	DWord nSize;					// whole state, including this header
+};
+
+struct StateChunkHeader {
+	char szTag[4];
+	DWord nSize;					// bytes of data after this header
+};
+
+// A captured state. The buffer is kept between captures so that
+// taking one every frame doesn't keep going back to the heap.
+struct MachineState {
+	MachineState() : pData(NULL), nSize(0), nAlloc(0), nChunk(-1), bError(false), bNoMemory(false) { }
+
+	Byte *pData;
+	int nSize;						// bytes in use
+	int nAlloc;						// bytes allocated
+	int nChunk;						// offset of the chunk being written, -1 if none
+	bool bError;					// set if we ran out of memory, the state is no good
+	bool bNoMemory;					// leave out CPU, VDP and AMS memory (the rewind buffer keeps its own)
+};
+
+// Reading side of one chunk
+struct StateReader {
+	const Byte *pPos;
+	int nLeft;
+	bool bOk;						// cleared if the chunk was shorter than expected
+};
+
+// chunk writing and reading, for the hardware save/load functions
+void StateBeginChunk(MachineState *pState, const char *pTag);
+void StateWrite(MachineState *pState, const void *pData, int nLen);
+Byte *StateReserve(MachineState *pState, int nLen);		// for data that's written in place, NULL on error
+void StateRead(StateReader *pRead, void *pData, int nLen);
+#define STATE_PUT(pState, x) StateWrite(pState, &(x), sizeof(x))
+#define STATE_GET(pRead, x) StateRead(pRead, &(x), sizeof(x))
+
+// emulation thread only
+bool CaptureMachineState(MachineState *pState);
+bool RestoreMachineState(const Byte *pData, int nSize);
+void FreeMachineState(MachineState *pState);
+void ServiceStateRequest();
+extern volatile LONG nStateRequest;
+
+// any other thread
+bool SaveStateFile(const char *pFile);
+bool LoadStateFile(const char *pFile);
+
+// per hardware, in the file that owns it
+void SaveVdpState(MachineState *pState);
+void LoadVdpState(StateReader *pRead);
+void SaveAmsState(MachineState *pState);
+void LoadAmsState(StateReader *pRead);
+void SaveSoundState(MachineState *pState);
+void LoadSoundState(StateReader *pRead);
@@ -137,6 +137,7 @@ From Matt - check this decrement:
 #include <stdio.h>
 #include "sound.h"
 #include "tiemul.h"
+#include "savestate.h"
 
 // some Classic99 stuff
 extern LPDIRECTSOUNDBUFFER soundbuf;						// sound chip audio buffer
@@ -148,18 +149,133 @@ extern int max_cpf;
 extern void WriteAudioFrame(void *pData, int nLen);
 void rampVolume(LPDIRECTSOUNDBUFFER ds, long newVol);       // to reduce up/down clicks
 
+// Sample rings between the emulation and the audio thread. The CPU thread
+// is the only one that moves nHead and the audio timer thread is the only
+// one that moves nTail, both free running and masked on use, so neither
+// side ever waits on the other. Each push also records the emulated cycle
+// it was made at, so the reader can tell how far behind the emulation the
+// sample it is playing is.
+#define AUDIO_RING_STAMPS 256		// MUST be a power of 2
+struct AudioRing {
+	INT16 *pData;					// samples (size is nMask+1, a power of 2)
+	LONG nMask;
+	volatile LONG nHead;			// next sample to write (producer only)
+	volatile LONG nTail;			// next sample to read (consumer only)
+	volatile LONG nStampHead;		// next stamp to write (producer only)
+	LONG nStampTail;				// next stamp to check (consumer only)
+	LONG nStampPos[AUDIO_RING_STAMPS];		// value of nHead after each push
+	DWord nStampCycle[AUDIO_RING_STAMPS];	// emulated cycle of each push
+	DWord nPlayedCycle;				// cycle stamp of the newest push the reader has reached
+	double fPos;					// fractional read position for the resampler
+	INT16 nLast;					// last sample read, held when we run dry
+};
+
 // hack for now - a little DAC buffer for cassette ticks and CPU modulation
-// fixed size for now
+// Samples are 0-255 levels at the output sample rate
 extern double nDACLevel;
-unsigned char dac_buffer[1024*1024];
-int dac_pos = 0;
+static INT16 dacRingData[1<<16];	// almost 3 seconds at 22khz
+static AudioRing dacRing = { dacRingData, (1<<16)-1 };
 double dacupdatedistance = 0.0;
 double dacramp = 0.0;       // a little slider to ramp in the DAC volume so it doesn't click so loudly at reset
 
-// more hack for speech to use the sound jitter buffer
-extern INT16 SpeechTmp[SPEECHRATE*2];				// two seconds worth of buffer
-extern int nSpeechTmpPos;
-extern CRITICAL_SECTION csSpeechBuf;
+// more hack for speech to use the sound jitter buffer - samples at SPEECHRATE
+static INT16 speechRingData[1<<14];	// two seconds worth of buffer
+static AudioRing speechRing = { speechRingData, (1<<14)-1 };
+
+extern volatile unsigned long total_cycles;
+AudioCounters audioCounters;
+int nAudioLatency = 66;				// in ms - about 4 frames, which is what the old jitter buffer started at
+
+// number of samples waiting in a ring
+static inline LONG RingFill(const AudioRing *pRing) {
+	return pRing->nHead - pRing->nTail;
+}
+
+// producer: add samples, or drop them (and count it) if there's no room
+static void RingPush(AudioRing *pRing, const INT16 *pSamples, INT16 nFill, int nCount) {
+	LONG nHead = pRing->nHead;
+	if (nHead - pRing->nTail + nCount > pRing->nMask + 1) {
+		InterlockedExchangeAdd(&audioCounters.nOverruns, nCount);
+		return;
+	}
+	for (int idx=0; idx<nCount; idx++) {
+		pRing->pData[(nHead+idx) & pRing->nMask] = (NULL == pSamples) ? nFill : pSamples[idx];
+	}
+	nHead += nCount;
+
+	// stamps are spread evenly over the ring so they never get lapped
+	LONG nStamp = pRing->nStampHead;
+	bool bStamp = (nHead - pRing->nStampPos[(nStamp-1) & (AUDIO_RING_STAMPS-1)] >= (pRing->nMask+1)/AUDIO_RING_STAMPS);
+	if (bStamp) {
+		pRing->nStampPos[nStamp & (AUDIO_RING_STAMPS-1)] = nHead;
+		pRing->nStampCycle[nStamp & (AUDIO_RING_STAMPS-1)] = total_cycles;
+	}
+
+	// publish the samples before the new head
+	MemoryBarrier();
+	pRing->nHead = nHead;
+	if (bStamp) {
+		pRing->nStampHead = nStamp+1;
+	}
+}
+
+// consumer: work out the step for this update. The base rate is adjusted by
+// up to half a percent to steer the ring towards nTarget samples, which is
+// inaudible but keeps the latency where it was asked to be instead of
+// drifting until it over- or underflows. If the ring got far too deep
+// (running unthrottled, say), skip the excess outright.
+static double RingStep(AudioRing *pRing, double fBase, LONG nTarget) {
+	LONG nFill = RingFill(pRing);
+	if (nFill > nTarget*4) {
+		LONG nSkip = nFill - nTarget;
+		InterlockedExchangeAdd(&audioCounters.nOverruns, nSkip);
+		pRing->nTail += nSkip;
+		pRing->fPos = 0.0;
+		nFill = nTarget;
+	}
+	if (nTarget < 1) nTarget = 1;
+	double fAdjust = (double)(nFill - nTarget) / (double)nTarget * 0.005;
+	if (fAdjust > 0.005) fAdjust = 0.005;
+	if (fAdjust < -0.005) fAdjust = -0.005;
+	return fBase * (1.0 + fAdjust);
+}
+
+// consumer: fetch the next sample and advance by fStep. Returns false
+// (and holds the last sample) if the ring has run dry.
+static inline bool RingRead(AudioRing *pRing, double fStep, INT16 &nOut) {
+	if (RingFill(pRing) <= 0) {
+		nOut = pRing->nLast;
+		return false;
+	}
+	nOut = pRing->nLast = pRing->pData[pRing->nTail & pRing->nMask];
+	pRing->fPos += fStep;
+	int nWhole = (int)pRing->fPos;
+	if (nWhole > 0) {
+		LONG nAvail = RingFill(pRing);
+		if (nWhole > nAvail) nWhole = nAvail;
+		pRing->fPos -= (int)pRing->fPos;
+		// make sure we're done with the data before handing the space back
+		MemoryBarrier();
+		pRing->nTail += nWhole;
+	}
+	return true;
+}
+
+// consumer: find the emulated cycle of the newest push we've reached
+static void RingUpdateStamp(AudioRing *pRing) {
+	LONG nStampHead = pRing->nStampHead;
+	MemoryBarrier();
+	while (pRing->nStampTail != nStampHead) {
+		int nIdx = pRing->nStampTail & (AUDIO_RING_STAMPS-1);
+		if (pRing->nStampPos[nIdx] - pRing->nTail > 0) break;		// not played yet
+		pRing->nPlayedCycle = pRing->nStampCycle[nIdx];
+		pRing->nStampTail++;
+	}
+	// stamps the producer lapped are gone, just catch up
+	if (nStampHead - pRing->nStampTail > AUDIO_RING_STAMPS) {
+		pRing->nStampTail = nStampHead - AUDIO_RING_STAMPS;
+	}
+}
 
 // external debug helper
 void debug_write(char *s, ...);
@@ -214,6 +330,40 @@ int sms_volume_table[16]={
 };
 double nVolumeTable[16];
 
+// Register writes are queued with the DAC ring position they happened at
+// (that's the emulated time, in output samples) and sound_update applies
+// them when playback reaches that sample, so tone changes land where the
+// CPU made them instead of wherever the audio thread happened to be.
+#define SOUND_EVENTS 4096				// MUST be a power of 2
+struct SoundEvent {
+	LONG nPos;							// dacRing.nHead at the time of the write
+	int nChan;							// 0-3 for frequency, 4-7 for volume
+	int nValue;
+};
+static SoundEvent soundEvents[SOUND_EVENTS];
+static volatile LONG nSoundEventHead = 0;		// CPU thread only
+static volatile LONG nSoundEventTail = 0;		// audio thread only
+static volatile LONG bSoundResync = 0;			// set when the queue overflowed
+
+// Generator state, only touched by the audio thread. Counters are 16.16 fixed
+// point clock/16 ticks, so we know where in a sample each edge lands.
+static int nSynthReg[4]={0,0,0,0};				// frequency registers as applied
+static int nSynthVol[4]={0,0,0,0};				// volume attenuation as applied
+static int nSynthCounter[4]={0,0,0,1<<16};		// countdown timers
+static float nSynthOut[4]={1.0f,1.0f,1.0f,1.0f};	// output level
+static float nSynthFade[4]={1.0f,1.0f,1.0f,1.0f};	// drift back to 0, see nFade
+static int nSynthNoisePos=1;
+static unsigned short nSynthLFSR=0x4000;
+
+// rate dependent values, only recalculated when the rate changes
+static int nSynthClock=0, nSynthRate=0;
+static int nTicksPerSample;						// clock/16 ticks per output sample, 16.16
+static float nFadePerSample;
+static int nHighToneLimit;						// tone registers at or below this are above nyquist
+
+// render a block at a time, or up to the next register write
+#define SOUND_SPAN 256
+
 // return 1 or 0 depending on odd parity of set bits
 // function by Dave aka finaldave. Input value should
 // be no more than 16 bits.
@@ -255,34 +405,43 @@ void sound_init(int freq) {
 	}
 }
 
+// CPU thread - queue a register write for the generator
+static void QueueSoundEvent(int nChan, int nValue) {
+	LONG nHead = nSoundEventHead;
+	if (nHead - nSoundEventTail >= SOUND_EVENTS) {
+		// the audio thread isn't keeping up (or isn't running), it will
+		// take the registers as they stand once it catches up
+		InterlockedExchange(&bSoundResync, 1);
+		return;
+	}
+	SoundEvent *pEvt = &soundEvents[nHead & (SOUND_EVENTS-1)];
+	pEvt->nPos = dacRing.nHead;
+	pEvt->nChan = nChan;
+	pEvt->nValue = nValue;
+
+	// publish the event before the new head
+	MemoryBarrier();
+	nSoundEventHead = nHead+1;
+}
+
 // change the frequency counter on a channel
 // chan - channel 0-3 (3 is noise)
 // freq - frequency counter (0-1023) or noise code (0-7)
+// Called from the CPU thread. nRegister and nVolume are updated right away
+// for the debugger and the DAC, the generator itself picks the write up
+// from the event queue when playback reaches it.
 void setfreq(int chan, int freq) {
 	if ((chan < 0)||(chan > 3)) return;
 
 	if (chan==3) {
 		// limit noise 
 		freq&=0x07;
-		nRegister[3]=freq;
-
-		// reset shift register
-		LFSR=0x4000;	//	(15 bit)
-		switch (nRegister[3]&0x03) {
-			// these values work but check the datasheet dividers
-			case 0: nCounter[3]=0x10; break;
-			case 1: nCounter[3]=0x20; break;
-			case 2: nCounter[3]=0x40; break;
-			// even when the count is zero, the noise shift still counts
-			// down, so counting down from 0 is the same as wrapping up to 0x400
-			case 3: nCounter[3]=(nRegister[2]?nRegister[2]:0x400); break;		// is never zero!
-		}
 	} else {
 		// limit freq
 		freq&=0x3ff;
-		nRegister[chan]=freq;
-		// don't update the counters, let them run out on their own
 	}
+	nRegister[chan]=freq;
+	QueueSoundEvent(chan, freq);
 }
 
 // change the volume on a channel
@@ -292,102 +451,217 @@ void setvol(int chan, int vol) {
 	if ((chan < 0)||(chan > 3)) return;
 
 	nVolume[chan]=vol&0xf;
+	QueueSoundEvent(chan+4, vol&0xf);
+}
+
+// Save states - the registers as the CPU last wrote them, and the
+// latch state for the next write. The generator isn't saved, it
+// picks the registers up again as ordinary writes.
+extern int latch_byte;
+extern int oldFreq[4];
+
+void SaveSoundState(MachineState *pState) {
+	StateBeginChunk(pState, "SND ");
+	STATE_PUT(pState, nRegister);
+	STATE_PUT(pState, nVolume);
+	STATE_PUT(pState, latch_byte);
+}
+
+void LoadSoundState(StateReader *pRead) {
+	int nReg[4], nVol[4];
+
+	STATE_GET(pRead, nReg);
+	STATE_GET(pRead, nVol);
+	STATE_GET(pRead, latch_byte);
+	if (!pRead->bOk) {
+		return;
+	}
+
+	for (int idx=0; idx<4; idx++) {
+		setfreq(idx, nReg[idx]);
+		setvol(idx, nVol[idx]);
+		oldFreq[idx] = nRegister[idx];
+	}
 }
 
 // this #if is here for the Apple2 experiment...
 #if 1
-// fill the output audio buffer with signed 16-bit values
-// nAudioIn contains a fixed value to add to all samples (used to mix in the casette audio)
-// (this emu doesn't run speech through there, though, speech gets its own buffer for now)
-// TODO: I don't use this anymore and I think it needs to be removed.... (what did I mean by this??)
-void sound_update(short *buf, double nAudioIn, int nSamples) {
+static inline int NoisePeriod() {
+	switch (nSynthReg[3]&0x03) {
+		// these values work but check the datasheet dividers
+		case 0: return 0x10;
+		case 1: return 0x20;
+		case 2: return 0x40;
+		// even when the count is zero, the noise shift still counts
+		// down, so counting down from 0 is the same as wrapping up to 0x400
+		default: return (nSynthReg[2]?nSynthReg[2]:0x400);		// is never zero!
+	}
+}
+
+static void ApplySoundEvent(int nChan, int nValue) {
+	if (nChan >= 4) {
+		nSynthVol[nChan-4]=nValue;
+	} else {
+		nSynthReg[nChan]=nValue;
+		if (nChan == 3) {
+			// reset shift register
+			nSynthLFSR=0x4000;	//	(15 bit)
+			nSynthCounter[3]=NoisePeriod()<<16;
+		}
+		// tones don't update the counters, let them run out on their own
+	}
+}
+
+// audio thread - apply every write that playback has reached
+static void ApplyDueSoundEvents() {
+	LONG nHead = nSoundEventHead;
+	MemoryBarrier();
+	while (nSoundEventTail != nHead) {
+		SoundEvent *pEvt = &soundEvents[nSoundEventTail & (SOUND_EVENTS-1)];
+		if (pEvt->nPos - dacRing.nTail > 0) break;		// not there yet
+		ApplySoundEvent(pEvt->nChan, pEvt->nValue);
+		nSoundEventTail++;
+	}
+	if ((bSoundResync) && (nSoundEventTail == nHead)) {
+		// we lost writes somewhere, so just take the current registers
+		InterlockedExchange(&bSoundResync, 0);
+		for (int idx=0; idx<4; idx++) {
+			if (nSynthReg[idx] != nRegister[idx]) ApplySoundEvent(idx, nRegister[idx]);
+			nSynthVol[idx] = nVolume[idx];
+		}
+	}
+}
+
+static void UpdateSynthRate() {
+	if ((nSynthClock == nClock) && (nSynthRate == AudioSampleRate)) return;
+
 	// nClock is the input clock frequency, which runs through a divide by 16 counter
-	// The frequency does not divide exactly by 16
-	// AudioSampleRate is the frequency at which we actually output bytes
-	// multiplying values by 1000 to improve accuracy of the final division (so ms instead of sec)
-	double nTimePerClock=1000.0/(nClock/16.0);
-	double nTimePerSample=1000.0/(double)AudioSampleRate;
-	int nClocksPerSample = (int)(nTimePerSample / nTimePerClock + 0.5);		// +0.5 to round up if needed
-	int newdacpos = 0;
-	int inSamples = nSamples;
-	double nSpeechOut = 0;
-	double nSpeechCnt = (double)SPEECHRATE / (double)AudioSampleRate;		// ratio of speech samples to output samples
+	// The frequency does not divide exactly by 16, so keep the fraction - it used to
+	// be rounded to a whole number of ticks, which played everything about 1.4% flat
+	nSynthClock = nClock;
+	nSynthRate = AudioSampleRate;
+	nTicksPerSample = (int)(((double)nClock/16.0) / (double)AudioSampleRate * 65536.0 + 0.5);
+	nFadePerSample = (float)(FADECLKTICK * nTicksPerSample / 65536.0);
+	nHighToneLimit = (int)(111860.0/(double)(AudioSampleRate/2));
+}
 
-	while (nSamples) {
+// Render a tone channel for nCount samples. Each sample is the average of the
+// square wave over that sample's time, so edges between samples come out as
+// partial levels instead of aliasing. Whole cycles average to nothing and are
+// skipped, so there is at most a couple of edges to walk per sample.
+static void RenderTone(int idx, float *pOut, int nCount) {
+	const int nPeriod = (nSynthReg[idx]?nSynthReg[idx]:0x400)<<16;
+	const int nStep = nTicksPerSample;
+	int nCounter = nSynthCounter[idx];
+	float nOut = nSynthOut[idx];
+	float nFade = nSynthFade[idx];
+
+	// Further Testing with the chip that SMS Power's doc covers (SN76489)
+	// 0 outputs a 1024 count tone, just like the TI, but 1 DOES output a flat line.
+	// On the TI (SN76494, I think), 1 outputs the highest pitch (count of 1)
+	// However, my 99/4 pics show THAT machine with an SN76489! 
+	// My plank TI has an SN94624 (early name? TMS9919 -> SN94624 -> SN76494 -> SN76489)
+	// And my 2.2 QI console has an SN76494!
+	// So maybe we can't say with certainty which chip is in which machine?
+	// Myths and legends:
+	// - SN76489 grows volume from 2.5v down to 0 (matches my old scopes of the 494), but SN76489A grows volume from 0 up.
+	// - SN76496 is the same as the SN7689A but adds the Audio In pin (all TI used chips have this, even the older ones)
+	// So right now, I believe there are two main versions, differing largely by the behaviour of count 0x001:
+	// Original (high frequency): TMS9919, SN94624, SN76494?
+	// New (flat line): SN76489, SN76489A, SN76496
+
+	// A little check to eliminate high frequency tones
+	// If the frequency is greater than 1/2 the sample rate, it's played
+	// through the DAC channel instead (see updateDACBuffer), so mute it
+	// here and just keep the counter running.
+	if ((nSynthReg[idx] != 0) && (nSynthReg[idx] <= nHighToneLimit)) {
+		__int64 nLeft = (__int64)nCounter - (__int64)nStep*nCount;
+		if (nLeft <= 0) {
+			__int64 nEdges = (-nLeft)/nPeriod + 1;
+			nLeft += nEdges*nPeriod;
+			if (nEdges&1) nOut = -nOut;
+		}
+		nSynthCounter[idx] = (int)nLeft;
+		nSynthOut[idx] = nOut;
+		nSynthFade[idx] = 0.0f;
+		memset(pOut, 0, nCount*sizeof(float));
+		return;
+	}
+
+	const float nScale = (float)nVolumeTable[nSynthVol[idx]] / (float)nStep;
+	for (int i=0; i<nCount; i++) {
 		// emulate drift to zero
-		for (int idx=0; idx<4; idx++) {
-			if (nFade[idx] > 0.0) {
-				nFade[idx]-=FADECLKTICK*nClocksPerSample;
-				if (nFade[idx] < 0.0) nFade[idx]=0.0;
-			} else {
-				nFade[idx]=0.0;
+		nFade -= nFadePerSample;
+		if (nFade < 0.0f) nFade = 0.0f;
+
+		float nArea;
+		if (nCounter > nStep) {
+			// no edge in this sample
+			nCounter -= nStep;
+			nArea = nOut*nStep;
+		} else {
+			int nRem = nStep - nCounter;
+			nArea = nOut*nCounter;
+			nOut = -nOut;
+			nCounter = nPeriod;
+			if (nRem >= 2*nPeriod) nRem %= 2*nPeriod;
+			while (nCounter <= nRem) {
+				nArea += nOut*nCounter;
+				nRem -= nCounter;
+				nOut = -nOut;
 			}
+			nCounter -= nRem;
+			nArea += nOut*nRem;
+			nFade = 1.0f;
 		}
+		pOut[i] = nArea * nFade * nScale;
+	}
 
-		// tone channels
+	nSynthCounter[idx] = nCounter;
+	nSynthOut[idx] = nOut;
+	nSynthFade[idx] = nFade;
+}
 
-		for (int idx=0; idx<3; idx++) {
-            // Further Testing with the chip that SMS Power's doc covers (SN76489)
-            // 0 outputs a 1024 count tone, just like the TI, but 1 DOES output a flat line.
-            // On the TI (SN76494, I think), 1 outputs the highest pitch (count of 1)
-            // However, my 99/4 pics show THAT machine with an SN76489! 
-            // My plank TI has an SN94624 (early name? TMS9919 -> SN94624 -> SN76494 -> SN76489)
-            // And my 2.2 QI console has an SN76494!
-            // So maybe we can't say with certainty which chip is in which machine?
-            // Myths and legends:
-            // - SN76489 grows volume from 2.5v down to 0 (matches my old scopes of the 494), but SN76489A grows volume from 0 up.
-            // - SN76496 is the same as the SN7689A but adds the Audio In pin (all TI used chips have this, even the older ones)
-            // So right now, I believe there are two main versions, differing largely by the behaviour of count 0x001:
-            // Original (high frequency): TMS9919, SN94624, SN76494?
-            // New (flat line): SN76489, SN76489A, SN76496
-			nCounter[idx]-=nClocksPerSample;
-			while (nCounter[idx] <= 0) {    // TODO: should be able to do this without a loop, it would be faster (well, in the rare cases it needs to loop)!
-				nCounter[idx]+=(nRegister[idx]?nRegister[idx]:0x400);
-				nOutput[idx]*=-1.0;
-				nFade[idx]=1.0;
-			}
-			// A little check to eliminate high frequency tones
-			// If the frequency is greater than 1/2 the sample rate,
-			// then mute it (we'll do that with the nFade value.) 
-			// Noises can't get higher than audible frequencies (even with high user defined rates),
-			// so we don't need to worry about them.
-			if ((nRegister[idx] != 0) && (nRegister[idx] <= (int)(111860.0/(double)(AudioSampleRate/2)))) {
-				// this would be too high a frequency, so we'll merge it into the DAC channel (elsewhere)
-				// and kill this channel. The reason is that the high frequency ends up
-				// creating artifacts with the lower frequency output rate, and you don't
-				// get an inaudible tone but awful noise
-				nFade[idx]=0.0;
-				//nAudioIn += nVolumeTable[nVolume[idx]];	// not strictly right, the high frequency output adds some distortion. But close enough.
-				//if (nAudioIn >= 1.0) nAudioIn = 1.0;	// clip
-			}
+// Render the noise channel for nCount samples, averaged the same way as the tones
+static void RenderNoise(float *pOut, int nCount) {
+	const int nPeriod = NoisePeriod()<<16;
+	const int nStep = nTicksPerSample;
+	const float nScale = (float)nVolumeTable[nSynthVol[3]] / (float)nStep;
+	int nCounter = nSynthCounter[3];
+	float nOut = nSynthOut[3];
+	float nFade = nSynthFade[3];
+
+	for (int i=0; i<nCount; i++) {
+		// emulate drift to zero
+		nFade -= nFadePerSample;
+		if (nFade < 0.0f) nFade = 0.0f;
+
+		if (nCounter > nStep) {
+			nCounter -= nStep;
+			pOut[i] = nOut * nStep * nFade * nScale;
+			continue;
 		}
 
-		// noise channel 
-		nCounter[3]-=nClocksPerSample;
-		while (nCounter[3] <= 0) {
-			switch (nRegister[3]&0x03) {
-				case 0: nCounter[3]+=0x10; break;
-				case 1: nCounter[3]+=0x20; break;
-				case 2: nCounter[3]+=0x40; break;
-				// even when the count is zero, the noise shift still counts
-				// down, so counting down from 0 is the same as wrapping up to 0x400
-				// same is with the tone above :)
-				case 3: nCounter[3]+=(nRegister[2]?nRegister[2]:0x400); break;		// is never zero!
-			}
-			nNoisePos*=-1;
-			double nOldOut=nOutput[3];
+		int nRem = nStep;
+		float nArea = 0.0f;
+		while (nCounter <= nRem) {
+			nArea += nOut*nCounter;
+			nRem -= nCounter;
+			nCounter = nPeriod;
+
+			nSynthNoisePos*=-1;
+			float nOldOut=nOut;
 			// Shift register is only kicked when the 
 			// Noise output sign goes from negative to positive
-			if (nNoisePos > 0) {
+			if (nSynthNoisePos > 0) {
 				int in=0;
-				if (nRegister[3]&0x4) {
+				if (nSynthReg[3]&0x4) {
 					// white noise - actual tapped bits uncertain?
 					// This doesn't currently look right.. need to
 					// sample a full sequence of TI white noise at
 					// a known rate and study the pattern.
-					if (parity(LFSR&nTappedBits)) in=0x4000;
-					if (LFSR&0x01) {
-#if 1
+					if (parity(nSynthLFSR&nTappedBits)) in=0x4000;
+					if (nSynthLFSR&0x01) {
 						// the SMSPower documentation says it never goes negative,
 						// but (my very old) recordings say white noise does goes negative,
 						// and periodic noise doesn't. Need to sit down and record these
@@ -396,94 +670,120 @@ void sound_update(short *buf, double nAudioIn, int nSamples) {
 						// the tone channels. 
 						// TODO: I need to verify noise vs tone on a clean system.
 						// need to test for 0 because periodic noise sets it
-						if (nOutput[3] == 0.0) {
-							nOutput[3] = 1.0;
+						if (nOut == 0.0f) {
+							nOut = 1.0f;
 						} else {
-							nOutput[3]*=-1.0;
+							nOut = -nOut;
 						}
-#else
-						nOutput[3]=1.0;
-					} else {
-						nOutput[3]=0.0;
-#endif
 					}
 				} else {
 					// periodic noise - tap bit 0 (again, BBC Micro)
 					// Compared against TI samples, this looks right
-					if (LFSR&0x0001) {
+					if (nSynthLFSR&0x0001) {
 						in=0x4000;	// (15 bit shift)
 						// TODO: verify periodic noise as well as white noise
 						// always positive
-						nOutput[3]=1.0;
+						nOut=1.0f;
 					} else {
-						nOutput[3]=0.0;
+						nOut=0.0f;
 					}
 				}
-				LFSR>>=1;
-				LFSR|=in;
+				nSynthLFSR>>=1;
+				nSynthLFSR|=in;
 			}
-			if (nOldOut != nOutput[3]) {
-				nFade[3]=1.0;
+			if (nOldOut != nOut) {
+				nFade=1.0f;
 			}
 		}
+		nCounter -= nRem;
+		nArea += nOut*nRem;
+		pOut[i] = nArea * nFade * nScale;
+	}
 
-		// write sample
-		nSamples--;
-		double output;
+	nSynthCounter[3] = nCounter;
+	nSynthOut[3] = nOut;
+	nSynthFade[3] = nFade;
+}
 
-		// using division (single voices are quiet!)
-		// write out one sample
-		output = nOutput[0]*nVolumeTable[nVolume[0]]*nFade[0] +
-				nOutput[1]*nVolumeTable[nVolume[1]]*nFade[1] +
-				nOutput[2]*nVolumeTable[nVolume[2]]*nFade[2] +
-				nOutput[3]*nVolumeTable[nVolume[3]]*nFade[3] +
-				((dac_buffer[newdacpos++] / 255.0)*dacramp) +
-				(SpeechTmp[(int)nSpeechOut] / 32767.0);
-		// output is now between 0.0 and 6.0, may be positive or negative
-		output/=6.0;	// you aren't supposed to do this when mixing. Sorry. :)
-		if (newdacpos >= dac_pos) {
-			// not enough DAC samples!
-			newdacpos--;
+// fill the output audio buffer with signed 16-bit values
+// nAudioIn contains a fixed value to add to all samples (used to mix in the casette audio)
+// (this emu doesn't run speech through there, though, speech gets its own buffer for now)
+// TODO: I don't use this anymore and I think it needs to be removed.... (what did I mean by this??)
+// Each channel is rendered a span at a time into its own buffer and then
+// mixed in one pass - the loops are kept simple so the compiler can
+// vectorize them.
+void sound_update(short *buf, double nAudioIn, int nSamples) {
+	float nChan[4][SOUND_SPAN];
+	float nMix[SOUND_SPAN];
+	bool bDacStarved = false;
+
+	UpdateSynthRate();
+
+	// the rings are filled a frame at a time, so aim to keep one frame in each
+	double nDacStep = RingStep(&dacRing, 1.0, AudioSampleRate/hzRate);
+	double nSpeechCnt = RingStep(&speechRing, (double)SPEECHRATE / (double)AudioSampleRate, SPEECHRATE/hzRate);	// ratio of speech samples to output samples
+
+	ApplyDueSoundEvents();
+	while (nSamples > 0) {
+		// render up to the next register write
+		int nSpan = (nSamples > SOUND_SPAN) ? SOUND_SPAN : nSamples;
+		if (nSoundEventTail != nSoundEventHead) {
+			LONG nUntil = soundEvents[nSoundEventTail & (SOUND_EVENTS-1)].nPos - dacRing.nTail;
+			if (nUntil < nSpan) nSpan = nUntil;
+			if (nSpan < 1) nSpan = 1;
+		}
+
+		for (int idx=0; idx<3; idx++) {
+			RenderTone(idx, nChan[idx], nSpan);
 		}
-		nSpeechOut += nSpeechCnt;
-		if ((int)nSpeechOut >= nSpeechTmpPos) {
-			nSpeechOut--;
+		RenderNoise(nChan[3], nSpan);
+
+		// DAC and speech come from the rings
+		float nDacScale = (float)(dacramp / 255.0);
+		for (int i=0; i<nSpan; i++) {
+			INT16 nDac, nSpeech;
+			if (!RingRead(&dacRing, nDacStep, nDac)) {
+				// not enough DAC samples!
+				bDacStarved = true;
+				InterlockedIncrement(&audioCounters.nStarved);
+			}
+			RingRead(&speechRing, nSpeechCnt, nSpeech);
+			nMix[i] = nDac*nDacScale + nSpeech*(1.0f/32767.0f);
 		}
 
-		short nSample=(short)((double)0x7fff*output); 
-		*(buf++)=nSample; 
+		// using division (single voices are quiet!)
+		// output is between 0.0 and 6.0, may be positive or negative
+		// you aren't supposed to do this when mixing. Sorry. :)
+		const float nOutScale = (float)0x7fff / 6.0f;
+		for (int i=0; i<nSpan; i++) {
+			float output = nChan[0][i] + nChan[1][i] + nChan[2][i] + nChan[3][i] + nMix[i];
+			buf[i] = (short)(output * nOutScale);
+		}
 
 #if 0
 		static FILE *fp=NULL;
 		if (NULL == fp) {
 			fp=fopen("C:\\new\\audio.raw", "wb");
 		}
-		fwrite(&nSample, 2, 1, fp);
+		fwrite(buf, 2, nSpan, fp);
 #endif
 
+		buf += nSpan;
+		nSamples -= nSpan;
+		ApplyDueSoundEvents();
 	}
-	// roll the dac output buffer
-	EnterCriticalSection(&csAudioBuf);
-	if (inSamples < dac_pos) {
-		memmove(dac_buffer, &dac_buffer[newdacpos], dac_pos-newdacpos);
-		dac_pos-=newdacpos;
+
+	// ramp the DAC in once it's keeping up
+	if (!bDacStarved) {
         if (dacramp < 1.0) {
             dacramp+=0.01;  // slow, slow ramp in
             if (dacramp > 1.0) dacramp = 1.0;
         }
-	} else {
-		dac_pos = 0;
-	}
-	LeaveCriticalSection(&csAudioBuf);
-	// same with speech
-	EnterCriticalSection(&csSpeechBuf);
-	if ((int)nSpeechOut < nSpeechTmpPos) {
-		memmove(SpeechTmp, &SpeechTmp[(int)nSpeechOut], (nSpeechTmpPos-(int)nSpeechOut)*2);
-		nSpeechTmpPos -= (int)nSpeechOut;
-	} else {
-		nSpeechTmpPos = 0;
 	}
-	LeaveCriticalSection(&csSpeechBuf);
+
+	// and note how far behind the emulation we are playing
+	RingUpdateStamp(&dacRing);
+	audioCounters.nDacBehind = (LONG)(total_cycles - dacRing.nPlayedCycle);
 }
 
 #else
@@ -813,15 +1113,33 @@ void rampVolume(LPDIRECTSOUNDBUFFER ds, long newVol) {
 void resetDAC() { 
 	// empty the buffer and reset the pointers
     MuteAudio();
+	// the audio thread only reads the ring while holding this, so it's
+	// safe to move both ends here
 	EnterCriticalSection(&csAudioBuf);
-		memset(&dac_buffer[0], (unsigned char)(nDACLevel*255), sizeof(dac_buffer));
-		dac_pos=0;
+		dacRing.nTail = dacRing.nHead;
+		dacRing.nStampTail = dacRing.nStampHead;
+		dacRing.fPos = 0.0;
+		dacRing.nLast = (INT16)(nDACLevel*255);
 		dacupdatedistance=0.0;
         dacramp=0.0;
 	LeaveCriticalSection(&csAudioBuf);
     SetSoundVolumes();
 }
 
+void resetSpeechBuffer() {
+	EnterCriticalSection(&csAudioBuf);
+		speechRing.nTail = speechRing.nHead;
+		speechRing.nStampTail = speechRing.nStampHead;
+		speechRing.fPos = 0.0;
+		speechRing.nLast = 0;
+	LeaveCriticalSection(&csAudioBuf);
+}
+
+// called from the CPU thread with freshly generated speech
+void PushSpeechSamples(const INT16 *pSamples, int nSamples) {
+	RingPush(&speechRing, pSamples, 0, nSamples);
+}
+
 void updateDACBuffer(int nCPUCycles) {
 	static int totalCycles = 0;
 
@@ -841,13 +1159,6 @@ void updateDACBuffer(int nCPUCycles) {
 
 	int distance = (int)dacupdatedistance;
 	dacupdatedistance -= distance;
-	if (dac_pos + distance >= sizeof(dac_buffer)) {
-        if (ThrottleMode == THROTTLE_NORMAL) {
-    		debug_write("DAC Buffer overflow...");
-        }
-		dac_pos=0;
-		return;
-	}
 	int average = 1;
 	double value = nDACLevel;
 
@@ -867,10 +1178,8 @@ void updateDACBuffer(int nCPUCycles) {
 	}
 	value /= average;
 	unsigned char out = (unsigned char)(value * 255);
-	EnterCriticalSection(&csAudioBuf);
-		memset(&dac_buffer[dac_pos], out, distance);
-		dac_pos+=distance;
-	LeaveCriticalSection(&csAudioBuf);
+	// if the ring is full this counts as an overrun and is dropped
+	RingPush(&dacRing, NULL, out, distance);
 }
 
 void UpdateSoundBuf(LPDIRECTSOUNDBUFFER soundbuf, void (*sound_update)(short *,double,int), StreamData *pDat) {
@@ -890,7 +1199,7 @@ void UpdateSoundBuf(LPDIRECTSOUNDBUFFER soundbuf, void (*sound_update)(short *,d
 		pDat->nLastWrite=iWrite;
 	}
 	
-	// arbitrary - try to use a dynamic jitter buffer
+	// how far ahead of the play cursor we have written
 	int nWriteAhead;
 	if (pDat->nLastWrite<iRead) {
 		nWriteAhead=pDat->nLastWrite+CalculatedAudioBufferSize-iRead;
@@ -900,39 +1209,35 @@ void UpdateSoundBuf(LPDIRECTSOUNDBUFFER soundbuf, void (*sound_update)(short *,d
 	nWriteAhead/=CalculatedAudioBufferSize/(hzRate);
 	
 	if (nWriteAhead > 29) {
-		// this more likely means we actually fell behind!
-		if (pDat->nMinJitterFrames < 10) {
-#ifdef _DEBUG
-			debug_write("Fell behind, increasing minimum jitter to %d", pDat->nMinJitterFrames);
-#endif
-			pDat->nMinJitterFrames++;
-		} 
-		if (pDat->nJitterFrames < pDat->nMinJitterFrames) {
-			pDat->nJitterFrames=pDat->nMinJitterFrames;
-		}
+		// this more likely means we actually fell behind - the play cursor
+		// passed our write position. Start again from the write cursor.
+		InterlockedIncrement(&audioCounters.nUnderruns);
 		nWriteAhead=0;
 		pDat->nLastWrite=iWrite;
 	}
 
 //	debug_write("WriteAhead at %d - lastwrite %5d, iread %5d", nWriteAhead, pDat->nLastWrite, iRead);
 
-	// update jitter buffer if we fall behind, but no more than 15 frames (that would only be 4 updates a second!)
-	if ((nWriteAhead < 1) && (pDat->nJitterFrames < 15)) {
-		pDat->nJitterFrames++;
-#ifdef _DEBUG
-		debug_write("Grow jitter buffer to %d frames (writeahead %d)", pDat->nJitterFrames, nWriteAhead);
-#endif
-	} else if ((nWriteAhead > pDat->nJitterFrames+1) && (pDat->nJitterFrames > pDat->nMinJitterFrames)) {
-		// maybe we can shrink the buffer?
-		pDat->nJitterFrames--;
-#ifdef _DEBUG
-		debug_write("Shrink jitter buffer to %d frames (writeahead %d)", pDat->nJitterFrames, nWriteAhead);
-#endif
-	} else if ((nWriteAhead > pDat->nMinJitterFrames/2+1) && (pDat->nMinJitterFrames > 2)) {
-		pDat->nMinJitterFrames--;
-#ifdef _DEBUG
-		debug_write("Shrink min jitter frames to %d (writeahead %d)", pDat->nMinJitterFrames, nWriteAhead);
-#endif
+	// keep the configured latency written ahead, at least two frames so a late tick doesn't click
+	int nTargetFrames = (nAudioLatency * hzRate + 999) / 1000;
+	if (nTargetFrames < 2) nTargetFrames = 2;
+	if (nTargetFrames > 15) nTargetFrames = 15;
+	if (soundbuf == ::soundbuf) {		// only the sound chip stream carries the rings
+		audioCounters.nLatencyMs = nWriteAhead * 1000 / hzRate;
+
+		// report now and then if anything went wrong
+		static int nReportCount = 0;
+		static LONG nLastUnderruns = 0, nLastOverruns = 0;
+		if (++nReportCount >= hzRate*10) {
+			nReportCount = 0;
+			if ((audioCounters.nUnderruns != nLastUnderruns) || (audioCounters.nOverruns != nLastOverruns)) {
+				debug_write("Audio: %d underruns, %d samples dropped, %d starved, latency %dms (DAC %d cycles behind)",
+					audioCounters.nUnderruns, audioCounters.nOverruns, audioCounters.nStarved, 
+					audioCounters.nLatencyMs, audioCounters.nDacBehind);
+				nLastUnderruns = audioCounters.nUnderruns;
+				nLastOverruns = audioCounters.nOverruns;
+			}
+		}
 	}
 
 	// check AVI buffer size is sufficient
@@ -947,7 +1252,7 @@ void UpdateSoundBuf(LPDIRECTSOUNDBUFFER soundbuf, void (*sound_update)(short *,d
 	// doing it all right here limits the CPU's ability to interact
 	// but luckily we should NORMALLY only do one frame at a time
 	// as noted, the goal is to get it on a per-scanline basis
-	while (nWriteAhead < pDat->nJitterFrames) {
+	while (nWriteAhead < nTargetFrames) {
 		if (SUCCEEDED(soundbuf->Lock(pDat->nLastWrite, CalculatedAudioBufferSize/(hzRate), (void**)&ptr1, &len1, (void**)&ptr2, &len2, 0))) {
 			if (len1 > 0) {
 				sound_update(ptr1, nDACLevel, len1/2);		// divide by 2 for 16 bit samples
@@ -984,13 +1289,6 @@ void UpdateSoundBuf(LPDIRECTSOUNDBUFFER soundbuf, void (*sound_update)(short *,d
 			break;
 		}
 		nWriteAhead++;
-		
-#if 0
-		if (nWriteAhead < pDat->nJitterFrames) {
-			soundbuf->GetCurrentPosition(&iRead, &iWrite);
-//			debug_write("Read/Write sound buf: %5d/%5d", iRead, iWrite);
-		}
-#endif
 	}
 
 	LeaveCriticalSection(&csAudioBuf);
@@ -49,15 +49,22 @@ typedef unsigned __int32 DWord;
 struct StreamData {
 	StreamData() {
 		nLastWrite=0xffffffff;
-		nJitterFrames=4;		// jitter buffer (increments on first entry, then if we fall behind!)
-		nMinJitterFrames=4;		// minimum jitter buffer, increases only if we fall behind!
 	};
 
 	DWORD nLastWrite;
-	int nJitterFrames;			// jitter buffer (increments on first entry, then if we fall behind!)
-	int nMinJitterFrames;		// minimum jitter buffer, increases only if we fall behind!
 };
 
+// Audio health, updated by the audio thread (and the CPU thread for overruns)
+struct AudioCounters {
+	volatile LONG nUnderruns;		// times the play cursor caught up with what we had written
+	volatile LONG nStarved;			// output samples mixed without fresh DAC data
+	volatile LONG nOverruns;		// samples dropped because a ring was full or too far behind
+	volatile LONG nLatencyMs;		// output write-ahead at the last update
+	volatile LONG nDacBehind;		// emulated cycles between the newest DAC sample and the one playing
+};
+extern AudioCounters audioCounters;
+extern int nAudioLatency;			// target output latency in ms (configurable)
+
 extern CRITICAL_SECTION csAudioBuf;
 
 void sound_init(int freq);
@@ -69,6 +76,8 @@ void MuteAudio();
 void UpdateSoundBuf(LPDIRECTSOUNDBUFFER soundbuf, void (*sound_update)(short *,double,int), StreamData *pDat);
 void resetDAC();
 void updateDACBuffer(int nCPUCycles);
+void resetSpeechBuffer();
+void PushSpeechSamples(const INT16 *pSamples, int nSamples);
 
 // SID DLL interface
 extern void (*InitSid)();
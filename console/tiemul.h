@@ -64,7 +64,8 @@ typedef unsigned __int32 DWord;
 #define SLOW_CPF (10)
 #define SPEECHRATE 8000	
 #define SPEECHBUFFER 16000
-#define MAX_BREAKPOINTS 10
+#define MAX_BREAKPOINTS 4096
+#define BREAK_AMS_PAGES 0x2000		// 4k pages of AMS memory covered by the AMS breakpoint maps
 #define MAXROMSPERCART	32
 #define MAXUSERCARTS 1000
 #define MAX_MRU 10
@@ -179,6 +180,7 @@ struct history {
 // Variables
 #define REDRAW_LINES 262
 extern int redraw_needed;							// redraw flag
+extern int nSkippedLines;							// scanlines reused from the previous frame, last frame
 extern int end_of_frame;							// end of frame flag
 extern int skip_interrupt;							// flag for some instructions
 extern int doLoadInt;								// flag for LOAD interrupt
@@ -213,6 +215,12 @@ extern int bF18Enabled;
 extern HANDLE Video_hdl[2];							// Handles for Display/Blit events
 extern unsigned int *framedata;						// The actual pixel data
 extern unsigned int *framedata2;					// Filtered frame data
+#define FRAME_RING_SIZE 3									// buffers in the frame ring (triple buffered)
+#define FRAME_FRESH 0x80									// nFrameReady flag: newest frame not taken yet
+extern unsigned int *pBlitFrame;					// completed frame the video thread is showing
+extern int nFrameLatencyAvg;						// frame publish to consumed, microseconds
+extern int nFrameLatencyMax;
+extern int nFramesDropped;							// frames replaced before the video thread took them
 extern int FilterMode;								// Current filter mode
 extern int nDefaultScreenScale;						// default screen scaling multiplier
 extern int nXSize, nYSize;							// custom sizing
@@ -251,12 +259,20 @@ struct GROMType {
 
 extern struct GROMType GROMBase[17];				// support 16 GROM bases (there is room for 256 of them!), plus 1 for PCODE
 #define PCODEGROMBASE 16							// which base we'll use for PCODE (highest + 1)
+void UpdateGromPrefetchList();						// rebuild the list of bases that need GROM prefetch
+void RestoreGromPrefetch();							// same, after a state restore put the latches back
+void GromPrefetchBenchmark();						// time the GROM prefetch against the old all-bases loop
 
 void memrnd(void *pRnd, int nCnt);
 
 extern int PauseInactive;							// what to do when the window is inactive
 extern int SpeechEnabled;							// whether or not speech is enabled
 extern volatile int ThrottleMode;					// system throttling mode
+extern bool bHeadless;								// batch mode - no visible window, no audio, no throttle
+extern int nHeadlessFrames;							// frames to run in headless mode before exiting (0 = forever)
+extern char szHeadlessDump[MAX_PATH];				// optional BMP to receive the last headless frame
+extern bool bSpanCheck;								// headless: draw every line with both renderers and compare
+extern int nSpanCheckLines;							// lines where the span and per-pixel renderers disagreed
 
 extern char lines[34][DEBUGLEN];					// debug lines
 extern bool bDebugDirty;
@@ -285,15 +301,36 @@ enum READACCESSTYPE {
     ACCESS_FREE         // internal access, do not count or breakpoint
 };
 
+// Breakpoint maps - a bit per address (per 4k page for AMS) for each kind of
+// access. A set bit means a breakpoint might apply there, the scan of
+// BreakPoints[] still makes the decision.
+extern Byte bpCpuRead[65536/8];
+extern Byte bpCpuWrite[65536/8];
+extern Byte bpCpuPC[65536/8];
+extern Byte bpVdpRead[128*1024/8];
+extern Byte bpVdpWrite[128*1024/8];
+extern Byte bpGromRead[65536/8];
+extern Byte bpGromWrite[65536/8];
+extern Byte bpAmsRead[BREAK_AMS_PAGES/8];
+extern Byte bpAmsWrite[BREAK_AMS_PAGES/8];
+extern int nBreakRegisters;
+extern int nBreakVdpRegs;
+extern int nBreakWPST;
+extern volatile bool bBreakMapDirty;
+#define TestBreakMap(map, x) ((map)[((x)>>3)&(sizeof(map)-1)] & (1<<((x)&7)))
+
 // Function prototypes
 bool CheckRange(int nBreak, int x);
+void RebuildBreakpointMaps();
 
 int InitAvi(bool bWithAudio);
-void WriteFrame();
+void WriteFrame(unsigned int *pFrame);
 void WriteAudioFrame(void *pData, int nLen);
 void CloseAVI();
 void ConfigAVI();
 void SaveScreenshot(bool bAuto, bool bFiltered);
+bool SaveFrameBMP(const char *pFile);
+void HeadlessFrameComplete();
 void SetupSams(int sams_mode, int sams_size);
 
 int getCharsPerLine();
@@ -322,6 +359,13 @@ void debug_write(char *s, ...);
 void doBlit(void);
 void RenderFont(void);
 void DrawSprites(int scanline);
+bool AllocateFrameRing();
+void PublishFrame();
+bool AcquireFrame();
+void FrameConsumed();
+void VDPMemoryWritten(int nAddr);
+void VDPMemoryWrittenAll();
+void InvalidateSpriteLists();
 void SetupDirectDraw(bool fullscreen);
 void takedownDirectDraw();
 int ResizeBackBuffer(int w, int h);
@@ -339,6 +383,8 @@ INT_PTR CALLBACK GramBoxProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 void LaunchDebugWindow();
 void pixel(int x, int y, int col);
 void pixel80(int x, int y, int col);
+void patternspan(int x, int y, int t, int fgc, int bgc, int n);
+void patternspan80(int x, int y, int t, int fgc, int bgc, int n);
 void bigpixel(int x, int y, int col);
 void spritepixel(int x, int y, int c);
 // Added by RasmusM
@@ -367,6 +413,10 @@ void opcode2(Word);
 void opcode3(Word);
 Byte rcpubyte(Word,READACCESSTYPE rmw=ACCESS_READ);
 void wcpubyte(Word,Byte);
+void InvalidateMemoryMap(bool bRomChanged=false);
+const Byte *GetDirectCodePointer(Word x, int *pWait);
+extern volatile unsigned int nCodeCacheEpoch;
+extern volatile unsigned int nRomLoadSeq;
 void increment_vdpadd();
 Byte rvdpbyte(Word,READACCESSTYPE);
 void wvdpbyte(Word,Byte);
@@ -456,9 +506,11 @@ void op_src(void);
 void op_bad(void);
 
 int Dasm9900 (char *buffer, int pc, int nBank);
+int Dasm9900Words(char *buffer, int pc, int bank, const Word *pWords);
 
 void InitDiskDSR();
 bool HandleDisk();
+void ServiceDiskCache(bool bForce);
 void updateCallFiles(int newTop);
 void verifyCallFiles();
 
@@ -44,6 +44,7 @@
 #define _WIN32_WINNT 0x0500
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <ddraw.h>
 #include <commctrl.h>
@@ -56,6 +57,8 @@
 #include "..\2xSaI\2xSaI.h"
 #include "..\FilterDLL\sms_ntsc.h"
 #include "cpu9900.h"
+#include "savestate.h"
+#include "rewind.h"
 #include "../RemoteControl/RemoteControlManager.h"
 
 // 16-bit 0rrrrrgggggbbbbb values
@@ -220,12 +223,24 @@ int CTsize;									// Color Table size in Bitmap Mode
 int PDTsize;								// Pattern Descriptor Table size in Bitmap Mode
 
 Byte VDP[128*1024];							// Video RAM (16k, except for now we are faking the rest of the VDP address space for F18A (todo: only 18k on real chip))
-Byte SprColBuf[256][192];					// Sprite Collision Buffer
+unsigned int SprColLine[256/32];			// Sprite Collision mask for the current scanline, one bit per pixel
+Byte SprLineList[192][32];					// sprites on each scanline, in priority order
+Byte SprLineCount[192];						// number of entries in SprLineList per scanline
+signed char SprLine5th[192];				// first sprite dropped on each scanline by the limit, or -1
+int SprHighest = -1;						// last sprite before the >D0 terminator
+int bSpriteListDirty = 1;					// sprite lists need to be rebuilt (2 if the SAL itself was written)
+unsigned int nSpriteListKey = 0;			// registers the sprite lists were built with
+Byte LineDirty[192];						// active display lines that must be redrawn even if redraw_needed is 0
+int nLinesSkipped = 0;						// lines reused from the last frame so far this frame
+int nSkippedLines = 0;						// lines reused from the last frame, for the whole previous frame
 Byte HeatMap[256*256*3];					// memory access heatmap (red/green/blue = CPU/VDP/GROM)
 int SprColFlag;								// Sprite collision flag
 int bF18AActive = 0;						// was the F18 activated?
 int bF18Enabled = 1;						// is it even enabled?
 int bInterleaveGPU = 1;						// whether to run the GPU and the CPU together (impedes debug - temporary option)
+int bSpanRender = 1;						// draw whole pattern bytes per span instead of pixel() per dot
+int nSpanCheckLines = 0;					// lines where the span and per-pixel renderers disagreed (-spancheck)
+unsigned int PatternMask[256][8];			// per pattern byte, all ones where each pixel is foreground
 
 IDirectDraw7 *lpdd=NULL;					// DirectDraw object
 LPDIRECTDRAWSURFACE7 lpdds=NULL;			// Primary surface
@@ -275,6 +290,18 @@ void (*hq4x_process)(unsigned char *pBufIn, unsigned char *pBufOut);
 HANDLE Video_hdl[2];						// Handles for Display/Blit events
 unsigned int *framedata;					// The actual pixel data
 unsigned int *framedata2;					// Filtered pixel data
+unsigned int *pFrameRing[FRAME_RING_SIZE];	// completed frames handed from the emulation thread to the video thread
+LARGE_INTEGER nFramePublished[FRAME_RING_SIZE];	// when each completed frame was published (emulated vsync)
+unsigned int nFrameRingSeq[FRAME_RING_SIZE];	// frame number of each completed frame
+volatile LONG nFrameReady = 1;				// ring slot holding the newest frame, with FRAME_FRESH if nobody took it yet
+int nFrameBack = 0;							// ring slot the emulation thread copies into next (emulation thread only)
+int nFrameFront = 2;						// ring slot the video thread is showing (video thread only)
+unsigned int nFramePublishSeq = 0;			// frames published (emulation thread only)
+unsigned int nFrameConsumeSeq = 0;			// last frame consumed (video thread only)
+unsigned int *pBlitFrame;					// the frame the video thread is showing - read this, not framedata
+int nFrameLatencyAvg = 0;					// publish to consumed, microseconds, average over the last second
+int nFrameLatencyMax = 0;					// publish to consumed, microseconds, worst over the last second
+int nFramesDropped = 0;						// frames that were replaced before the video thread got to them
 BITMAPINFO myInfo;							// Bitmapinfo header for the DIB functions
 BITMAPINFO myInfo2;							// Bitmapinfo header for the DIB functions
 BITMAPINFO myInfo32;						// Bitmapinfo header for the DIB functions
@@ -453,6 +480,102 @@ void vdpReset(bool isCold) {
     bF18AActive = false;
 	redraw_needed = REDRAW_LINES;
     memset(VDPREG, 0, sizeof(VDPREG));
+    InvalidateSpriteLists();
+
+    // expand every pattern byte once for the span renderer
+    for (int idx=0; idx<256; idx++) {
+        for (int bit=0; bit<8; bit++) {
+            PatternMask[idx][bit] = (idx & (0x80>>bit)) ? 0xffffffff : 0;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////
+// Frame ring - the emulation thread renders into framedata
+// as the beam goes, and copies each completed frame into a
+// ring of three buffers. The video thread takes the newest
+// one when it's ready for it. Each side owns one buffer and
+// they trade the third through nFrameReady, so neither the
+// blit, the filters, AVI nor RemoteControl ever hold up the
+// emulation, and they never see a half drawn frame.
+////////////////////////////////////////////////////////////
+bool AllocateFrameRing()
+{
+	for (int idx=0; idx<FRAME_RING_SIZE; idx++) {
+		pFrameRing[idx] = (unsigned int*)calloc((512+16)*(192+16), 4);
+		if (NULL == pFrameRing[idx]) {
+			return false;
+		}
+	}
+	pBlitFrame = pFrameRing[nFrameFront];
+	return true;
+}
+
+// emulation thread, once per frame
+void PublishFrame()
+{
+	int nSize;
+
+	if (NULL == pFrameRing[nFrameBack]) {
+		return;
+	}
+
+	int reg0 = gettables(0);
+	if ((reg0&0x04)&&(VDPREG[1]&0x10)&&(bEnable80Columns)) {
+		nSize=(512+16)*(192+16);	// 80 column text uses the wide buffer
+	} else {
+		nSize=(256+16)*(192+16);
+	}
+	memcpy(pFrameRing[nFrameBack], framedata, nSize*4);
+	QueryPerformanceCounter(&nFramePublished[nFrameBack]);
+	nFrameRingSeq[nFrameBack] = ++nFramePublishSeq;
+
+	// hand it over and take back whichever buffer was waiting
+	nFrameBack = InterlockedExchange(&nFrameReady, nFrameBack|FRAME_FRESH) & ~FRAME_FRESH;
+}
+
+// video thread - returns true if there was a new frame
+bool AcquireFrame()
+{
+	if ((nFrameReady & FRAME_FRESH) == 0) {
+		return false;
+	}
+	nFrameFront = InterlockedExchange(&nFrameReady, nFrameFront) & ~FRAME_FRESH;
+	pBlitFrame = pFrameRing[nFrameFront];
+	return true;
+}
+
+// video thread, when everyone has had the new frame
+void FrameConsumed()
+{
+	static LARGE_INTEGER nFreq = { 0 };
+	static __int64 nTotal = 0;
+	static int nCount = 0, nMax = 0, nDropped = 0;
+	LARGE_INTEGER nNow;
+
+	if (0 == nFreq.QuadPart) {
+		QueryPerformanceFrequency(&nFreq);
+	}
+	QueryPerformanceCounter(&nNow);
+
+	int nLatency = (int)((nNow.QuadPart - nFramePublished[nFrameFront].QuadPart) * 1000000 / nFreq.QuadPart);
+	nTotal += nLatency;
+	if (nLatency > nMax) nMax = nLatency;
+	if (nFrameConsumeSeq != 0) {
+		nDropped += nFrameRingSeq[nFrameFront] - nFrameConsumeSeq - 1;
+	}
+	nFrameConsumeSeq = nFrameRingSeq[nFrameFront];
+
+	// latch the stats about once a second
+	if (++nCount >= hzRate) {
+		nFrameLatencyAvg = (int)(nTotal / nCount);
+		nFrameLatencyMax = nMax;
+		nFramesDropped = nDropped;
+		nTotal = 0;
+		nCount = 0;
+		nMax = 0;
+		nDropped = 0;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -463,6 +586,31 @@ void VDPmain()
 	DWORD ret;
 	HDC myDC;
 
+	if (bHeadless) {
+		// No window, no DirectDraw and no filters. The CPU thread still renders
+		// into framedata, we just pass completed frames on to RemoteControl.
+		// There's no doBlit() to share it with, so we don't need VideoCS here.
+		BlitEvent=CreateEvent(NULL, false, false, NULL);
+		if (NULL == BlitEvent)
+			debug_write("Blit Event Creation failed");
+
+		debug_write("Starting headless video loop");
+		redraw_needed=REDRAW_LINES;
+
+		while (quitflag==0) {
+			RCManager.getInput();
+			if (WAIT_OBJECT_0 == WaitForSingleObject(BlitEvent, 100)) {
+				if (AcquireFrame()) {
+					RCManager.sendOutput(256+16, 192+16, (UINT8*)pBlitFrame);
+					FrameConsumed();
+				}
+			}
+		}
+
+		CloseHandle(BlitEvent);
+		return;
+	}
+
 	Init_2xSaI(888);
 
 	// load the Filter DLL
@@ -573,9 +721,30 @@ void VDPmain()
 				ret=GetLastError();
 
 			if (WAIT_OBJECT_0 == ret) {
+				// take the newest completed frame, if there is one - otherwise we just show the last one again
+				EnterCriticalSection(&VideoCS);
+				bool bNewFrame = AcquireFrame();
+				LeaveCriticalSection(&VideoCS);
+
 				doBlit();
 				// RIK: Send output to RemoteControl
-				RCManager.sendOutput(256+16, 192+16, (UINT8*)framedata);
+				RCManager.sendOutput(256+16, 192+16, (UINT8*)pBlitFrame);
+
+				if (bNewFrame) {
+					// AVI gets one frame per emulated frame, so repeat this one for any we missed
+					if (Recording) {
+						// (nothing to count from until a frame has been consumed, like FrameConsumed)
+						unsigned int nFrames = 1;
+						if (nFrameConsumeSeq != 0) {
+							nFrames = nFrameRingSeq[nFrameFront] - nFrameConsumeSeq;
+						}
+						if (nFrames > 10) nFrames = 10;
+						while (nFrames--) {
+							WriteFrame(pBlitFrame);
+						}
+					}
+					FrameConsumed();
+				}
                 continue;
 			}
 
@@ -717,16 +886,23 @@ void VDPdisplay(int scanline)
 	DWORD *plong;
 	int nMax;
 
-	// reduce noisy lines
-	EnterCriticalSection(&VideoCS);
-
+	// no lock needed - the video thread only ever reads completed frames out of the frame ring
 	int reg0 = gettables(0);
 
 	int gfxline = scanline - 27;	// skip top border
 
-	if (redraw_needed) {
+	// lines touched by a VDP RAM write are redrawn even outside a full redraw
+	bool bLineDirty = false;
+	if ((gfxline >= 0) && (gfxline < 192) && (LineDirty[gfxline])) {
+		bLineDirty = true;
+	}
+
+	if ((redraw_needed) || (bLineDirty)) {
 		// count down scanlines to redraw
-		--redraw_needed;
+		if (redraw_needed) --redraw_needed;
+		if ((gfxline >= 0) && (gfxline < 192)) {
+			LineDirty[gfxline] = 0;
+		}
 
 		// draw blanking area
 		if ((vdpscanline >= 0) && (vdpscanline < 192+27+24)) {
@@ -755,7 +931,6 @@ void VDPdisplay(int scanline)
 
 		if (!bDisableBlank) {
 			if (!(VDPREG[1] & 0x40)) {	// Disable display
-				LeaveCriticalSection(&VideoCS);
 				return;
 			}
 		}
@@ -803,6 +978,11 @@ void VDPdisplay(int scanline)
 			}
 		}
 	} else {
+		// nothing feeding this line changed, so the last frame's output stands
+		if ((gfxline >= 0) && (gfxline < 192)) {
+			++nLinesSkipped;
+		}
+
 		// we have to redraw the sprites even if the screen didn't change, so that collisions are updated
 		// as the CPU may have cleared the collision bit
 		// as long as mode bit 2 (text) is not set, and the display is enabled, sprites are okay
@@ -812,8 +992,65 @@ void VDPdisplay(int scanline)
 			}
 		}
 	}
+}
 
-	LeaveCriticalSection(&VideoCS);
+//////////////////////////////////////////////////////////
+// Span renderer regression check (headless -spancheck)
+// Draws each active line with the per-pixel renderer, then again
+// from the same state with the span renderer, and compares the two.
+// The status register and redraw counters are put back between the
+// passes so the second one sees exactly what the first did - sprite
+// drawing only depends on those and VDP RAM, so both passes produce
+// the same flags too. Every line is forced dirty so all of them get
+// compared, not just the ones that changed.
+//////////////////////////////////////////////////////////
+static void SpanCheckLine(int scanline)
+{
+	static unsigned int RefLine[512+16];
+	int gfxline = scanline - 27;
+
+	if ((gfxline < 0) || (gfxline >= 192)) {
+		VDPdisplay(scanline);
+		return;
+	}
+
+	int nOldSpan = bSpanRender;
+	int nOldRedraw = redraw_needed;
+	int nOldSkipped = nLinesSkipped;
+	Byte nOldVDPS = VDPS;
+
+	// reference pass
+	bSpanRender = 0;
+	LineDirty[gfxline] = 1;
+	VDPdisplay(scanline);
+
+	// same row and width as VDPdisplay's blanking fill
+	int nWidth = 256+16;
+	if ((gettables(0)&0x04) && (VDPREG[1]&0x10) && (bEnable80Columns)) {
+		nWidth = 512+16;
+	}
+	unsigned int *pRow = &framedata[(199-gfxline)*nWidth];
+	memcpy(RefLine, pRow, nWidth*sizeof(unsigned int));
+
+	// span pass
+	bSpanRender = 1;
+	redraw_needed = nOldRedraw;
+	nLinesSkipped = nOldSkipped;
+	VDPS = nOldVDPS;
+	LineDirty[gfxline] = 1;
+	VDPdisplay(scanline);
+	bSpanRender = nOldSpan;
+
+	for (int idx=0; idx<nWidth; idx++) {
+		if (pRow[idx] != RefLine[idx]) {
+			if (nSpanCheckLines < 10) {
+				debug_write("Span check: frame %d line %d x %d - span %06X, pixel %06X",
+					statusFrameCount, gfxline, idx-8, pRow[idx]&0xffffff, RefLine[idx]&0xffffff);
+			}
+			++nSpanCheckLines;
+			break;
+		}
+	}
 }
 
 //////////////////////////////////////////////////////////
@@ -888,7 +1125,15 @@ void updateVDP(int cycleCount)
 			statusFrameCount++;
 		} else if (vdpscanline > 261) {
 			vdpscanline = 0;
+			InvalidateSpriteLists();	// catch any VDP RAM changes that bypassed the ports
+			nSkippedLines = nLinesSkipped;
+			nLinesSkipped = 0;
+			PublishFrame();
+			bRewindFrame = true;
 			SetEvent(BlitEvent);
+			if (bHeadless) {
+				HeadlessFrameComplete();
+			}
 		}
 		// update the GPU
 		// first GPU scanline is first line of active display
@@ -910,7 +1155,11 @@ void updateVDP(int cycleCount)
 		// are we off the screen?
 		if (vdpscanline < 192+27+24) {
 			// nope, we can process this one
-			VDPdisplay(vdpscanline);
+			if (bSpanCheck) {
+				SpanCheckLine(vdpscanline);
+			} else {
+				VDPdisplay(vdpscanline);
+			}
 		}
 		newCycles -= cyclesPerLine;
 
@@ -1018,14 +1267,7 @@ void VDPgraphics(int scanline, int isLayer2)
                         }
 			        }
                 } else {
-    			    pixel(i2,i1+i3,(t&0x80 ? fgc : bgc ));
-				    pixel(i2+1,i1+i3,(t&0x40 ? fgc : bgc ));
-				    pixel(i2+2,i1+i3,(t&0x20 ? fgc : bgc ));
-				    pixel(i2+3,i1+i3,(t&0x10 ? fgc : bgc ));
-				    pixel(i2+4,i1+i3,(t&0x08 ? fgc : bgc ));
-				    pixel(i2+5,i1+i3,(t&0x04 ? fgc : bgc ));
-				    pixel(i2+6,i1+i3,(t&0x02 ? fgc : bgc ));
-				    pixel(i2+7,i1+i3,(t&0x01 ? fgc : bgc ));
+                    patternspan(i2,i1+i3,t,fgc,bgc,8);
                 }
 			}
 		}
@@ -1095,16 +1337,7 @@ void VDPgraphicsII(int scanline, int isLayer2)
 	    			bgc=fgc&0x0f;
     				fgc>>=4;
                 }
-				{
-					pixel(i2,i1+i3,(t&0x80 ? fgc : bgc ));
-					pixel(i2+1,i1+i3,(t&0x40 ? fgc : bgc ));
-					pixel(i2+2,i1+i3,(t&0x20 ? fgc : bgc ));
-					pixel(i2+3,i1+i3,(t&0x10 ? fgc : bgc ));
-					pixel(i2+4,i1+i3,(t&0x08 ? fgc : bgc ));
-					pixel(i2+5,i1+i3,(t&0x04 ? fgc : bgc ));
-					pixel(i2+6,i1+i3,(t&0x02 ? fgc : bgc ));
-					pixel(i2+7,i1+i3,(t&0x01 ? fgc : bgc ));
-				}
+				patternspan(i2,i1+i3,t,fgc,bgc,8);
 			}
 		}
 	}
@@ -1179,12 +1412,7 @@ void VDPtext(int scanline, int isLayer2)
     //			for (i3=0; i3<8; i3++)		// 6 pixels wide
 			    {	
 				    t=VDP[p_add];
-				    pixel(i2,i1+i3,  (t&0x80 ? fgc : bgc ));
-				    pixel(i2+1,i1+i3,(t&0x40 ? fgc : bgc ));
-				    pixel(i2+2,i1+i3,(t&0x20 ? fgc : bgc ));
-				    pixel(i2+3,i1+i3,(t&0x10 ? fgc : bgc ));
-				    pixel(i2+4,i1+i3,(t&0x08 ? fgc : bgc ));
-				    pixel(i2+5,i1+i3,(t&0x04 ? fgc : bgc ));
+				    patternspan(i2,i1+i3,t,fgc,bgc,6);
 			    }
             }
 		}
@@ -1260,12 +1488,7 @@ void VDPtextII(int scanline, int isLayer2)
     //			for (i3=0; i3<8; i3++)		// 6 pixels wide
 			    {	
 				    t=VDP[p_add];
-				    pixel(i2,i1+i3,(t&0x80 ?   fgc : bgc ));
-				    pixel(i2+1,i1+i3,(t&0x40 ? fgc : bgc ));
-				    pixel(i2+2,i1+i3,(t&0x20 ? fgc : bgc ));
-				    pixel(i2+3,i1+i3,(t&0x10 ? fgc : bgc ));
-				    pixel(i2+4,i1+i3,(t&0x08 ? fgc : bgc ));
-				    pixel(i2+5,i1+i3,(t&0x04 ? fgc : bgc ));
+				    patternspan(i2,i1+i3,t,fgc,bgc,6);
 			    }
             }
 		}
@@ -1337,12 +1560,7 @@ void VDPtext80(int scanline, int isLayer2)
                 //			for (i3=0; i3<8; i3++)		// 6 pixels wide
 			    {	
 				    t=VDP[p_add];
-				    pixel80(i2,i1+i3,(t&0x80   ? fgc : bgc ));
-				    pixel80(i2+1,i1+i3,(t&0x40 ? fgc : bgc ));
-				    pixel80(i2+2,i1+i3,(t&0x20 ? fgc : bgc ));
-				    pixel80(i2+3,i1+i3,(t&0x10 ? fgc : bgc ));
-				    pixel80(i2+4,i1+i3,(t&0x08 ? fgc : bgc ));
-				    pixel80(i2+5,i1+i3,(t&0x04 ? fgc : bgc ));
+				    patternspan80(i2,i1+i3,t,fgc,bgc,6);
 			    }
             }
 		}
@@ -1396,12 +1614,7 @@ void VDPillegal(int scanline, int isLayer2)
             } else {
     //			for (i3=0; i3<8; i3++)				// 6 pixels wide
 			    {	
-				    pixel(i2,i1+i3  ,fgc);
-				    pixel(i2+1,i1+i3,fgc);
-				    pixel(i2+2,i1+i3,fgc);
-				    pixel(i2+3,i1+i3,fgc);
-				    pixel(i2+4,i1+i3,bgc);
-				    pixel(i2+5,i1+i3,bgc);
+				    patternspan(i2,i1+i3,0xf0,fgc,bgc,6);		// 4 foreground, 2 background
 			    }
             }
 		}
@@ -1466,16 +1679,7 @@ void VDPmulticolor(int scanline, int isLayer2)
 			        }
                 } else {
     //				for (i4=0; i4<4; i4++) 
-				    {
-					    pixel(i2,i1+i3+i4,fgc);
-					    pixel(i2+1,i1+i3+i4,fgc);
-					    pixel(i2+2,i1+i3+i4,fgc);
-					    pixel(i2+3,i1+i3+i4,fgc);
-					    pixel(i2+4,i1+i3+i4,bgc);
-					    pixel(i2+5,i1+i3+i4,bgc);
-					    pixel(i2+6,i1+i3+i4,bgc);
-					    pixel(i2+7,i1+i3+i4,bgc);
-				    }
+				    patternspan(i2,i1+i3+i4,0xf0,fgc,bgc,8);		// 4 foreground, 4 background
                 }
 			}
 		}
@@ -1556,16 +1760,7 @@ void VDPmulticolorII(int scanline, int isLayer2)
 			        }
                 } else {
     //				for (i4=0; i4<4; i4++) 
-				    {
-					    pixel(i2,i1+i3+i4,fgc);
-					    pixel(i2+1,i1+i3+i4,fgc);
-					    pixel(i2+2,i1+i3+i4,fgc);
-					    pixel(i2+3,i1+i3+i4,fgc);
-					    pixel(i2+4,i1+i3+i4,bgc);
-					    pixel(i2+5,i1+i3+i4,bgc);
-					    pixel(i2+6,i1+i3+i4,bgc);
-					    pixel(i2+7,i1+i3+i4,bgc);
-				    }
+				    patternspan(i2,i1+i3+i4,0xf0,fgc,bgc,8);		// 4 foreground, 4 background
                 }
 			}
 		}
@@ -1635,7 +1830,7 @@ void doBlit()
 		}
 		// draw digits
 		for (int i2=0; i2<5; i2++) {
-			unsigned int *pDat = framedata + (256+16)*(6-i2);
+			unsigned int *pDat = pBlitFrame + (256+16)*(6-i2);
 			for (int idx = 0; idx<(signed)strlen(buf); idx++) {
                 int digit = buf[idx] - '0';
                 pDat = drawTextLine(pDat, digpat[digit][i2]);
@@ -1702,7 +1897,7 @@ void doBlit()
 		char buf[32];
 
 		for (int i2=0; i2<5; i2++) {
-			unsigned int *pDat = framedata + (256+16)*(6-i2)+20;
+			unsigned int *pDat = pBlitFrame + (256+16)*(6-i2)+20;
 
             if (capslock) {
                 drawTextLine(pDat, caps[i2]);
@@ -1770,7 +1965,7 @@ void doBlit()
 		}
 
         for (int i2=0; i2<8; i2++) {
-			unsigned int *pDat = framedata + (256+16)*(9-i2)+220;
+			unsigned int *pDat = pBlitFrame + (256+16)*(9-i2)+220;
             for (int mask=1; mask<0x100; mask<<=1) {
                 *(pDat++) = (ticols[i2]&mask) ? 0xffffff : 0;
                 *(pDat++) = 0xffffff;
@@ -1825,7 +2020,7 @@ void doBlit()
 	// TODO: hacky city - 80-column mode doesn't filter or anything, cause we'd have to change ALL the stuff below.
 	if ((bEnable80Columns)&&(VDPREG[0]&0x04)&&(VDPREG[1]&0x10)) {
 		// render 80 columns to the screen using DIB blit
-		StretchDIBits(myDC, rect1.left, rect1.top, rect1.right-rect1.left, rect1.bottom-rect1.top, 0, 0, 512+16, 192+16, framedata, &myInfo80Col, 0, SRCCOPY);
+		StretchDIBits(myDC, rect1.left, rect1.top, rect1.right-rect1.left, rect1.bottom-rect1.top, 0, 0, 512+16, 192+16, pBlitFrame, &myInfo80Col, 0, SRCCOPY);
 		ReleaseDC(myWnd, myDC);
 		LeaveCriticalSection(&VideoCS);
 		return;
@@ -1856,18 +2051,18 @@ void doBlit()
 	// Do the filtering - we throw away the top and bottom 3 scanlines due to some garbage there - it's border anyway
 	switch (FilterMode) {
 	case 1: // 2xSaI
-		_2xSaI((uint8*) framedata+((256+16)*4), ((256+16)*4), NULL, (uint8*)framedata2, (512+32)*4, 256+16, 191+16);
+		_2xSaI((uint8*) pBlitFrame+((256+16)*4), ((256+16)*4), NULL, (uint8*)framedata2, (512+32)*4, 256+16, 191+16);
 		break;
 	case 2: // Super2xSaI
-		Super2xSaI((uint8*) framedata+((256+16)*4), ((256+16)*4), NULL, (uint8*)framedata2, (512+32)*4, 256+16, 191+16);
+		Super2xSaI((uint8*) pBlitFrame+((256+16)*4), ((256+16)*4), NULL, (uint8*)framedata2, (512+32)*4, 256+16, 191+16);
 		break;
 	case 3: // SuperEagle
-		SuperEagle((uint8*) framedata+((256+16)*4), ((256+16)*4), NULL, (uint8*)framedata2, (512+32)*4, 256+16, 191+16);
+		SuperEagle((uint8*) pBlitFrame+((256+16)*4), ((256+16)*4), NULL, (uint8*)framedata2, (512+32)*4, 256+16, 191+16);
 		break;
 	case 4:	// TV filter
 		// This filter outputs 602 pixels for 256 in. What we should do is resize the window
 		// we eventually produce a TV_WIDTH x 384+29 image (leaving vertical the same)
-		sms_ntsc_blit(&tvFilter, framedata, 256+16, 256+16, 192+16, framedata2, (TV_WIDTH)*2*4);
+		sms_ntsc_blit(&tvFilter, pBlitFrame, 256+16, 256+16, 192+16, framedata2, (TV_WIDTH)*2*4);
 		if (TVScanLines) {
 			sms_ntsc_scanlines(framedata2, TV_WIDTH, (TV_WIDTH)*4, 384+29);
 		} else {
@@ -1880,7 +2075,7 @@ void doBlit()
 	case 5:	// HQ4x filter - super hi-def!
 		{
 			if (NULL != hq4x_process) {
-				hq4x_process((unsigned char*)framedata, (unsigned char*)framedata2);
+				hq4x_process((unsigned char*)pBlitFrame, (unsigned char*)framedata2);
 			}
 		}
 	}
@@ -1889,7 +2084,7 @@ void doBlit()
 	case STRETCH_DIB:	// DIB
 		switch (FilterMode) {
 		case 0:		// none
-			StretchDIBits(myDC, rect1.left, rect1.top, rect1.right-rect1.left, rect1.bottom-rect1.top, 0, 0, 256+16, 192+16, framedata, &myInfo, 0, SRCCOPY);
+			StretchDIBits(myDC, rect1.left, rect1.top, rect1.right-rect1.left, rect1.bottom-rect1.top, 0, 0, 256+16, 192+16, pBlitFrame, &myInfo, 0, SRCCOPY);
 			break;
 
 		case 4:		// TV
@@ -1927,7 +2122,7 @@ void doBlit()
 			switch (FilterMode) {
 				case 0:
 					// original buffer
-					SetDIBitsToDevice(tmpDC, 0, 0, 256+16, 192+16, 0, 0, 0, 192+16, framedata, &myInfo, DIB_RGB_COLORS);
+					SetDIBitsToDevice(tmpDC, 0, 0, 256+16, 192+16, 0, 0, 0, 192+16, pBlitFrame, &myInfo, DIB_RGB_COLORS);
 					break;
 
 				case 4:
@@ -1987,7 +2182,7 @@ void doBlit()
 		if (DD_OK == ddsBack->GetDC(&tmpDC)) {	// color depth translation
 			switch (FilterMode) {
 				case 0:		// none
-					SetDIBitsToDevice(tmpDC, 0, 0, 256+16, 192+16, 0, 0, 0, 192+16, framedata, &myInfo, DIB_RGB_COLORS);
+					SetDIBitsToDevice(tmpDC, 0, 0, 256+16, 192+16, 0, 0, 0, 192+16, pBlitFrame, &myInfo, DIB_RGB_COLORS);
 					break;
 
 				case 4:		// tv
@@ -2032,7 +2227,7 @@ void doBlit()
 		case 0:		// none
 			x=(rect1.right-rect1.left-(256+16))/2;
 			y=(rect1.bottom-rect1.top-(192+16))/2;
-			x=SetDIBitsToDevice(myDC, x, y, 256+16, 192+16, 0, 0, 0, 192+16, framedata, &myInfo, DIB_RGB_COLORS);
+			x=SetDIBitsToDevice(myDC, x, y, 256+16, 192+16, 0, 0, 0, 192+16, pBlitFrame, &myInfo, DIB_RGB_COLORS);
 			y=GetLastError();
 			break;
 		
@@ -2063,19 +2258,302 @@ void doBlit()
 	LeaveCriticalSection(&VideoCS);
 }
 
+//////////////////////////////////////////////////////////
+// Flag scanlines of the active display for redraw
+//////////////////////////////////////////////////////////
+static void MarkLines(int nFirst, int nCount)
+{
+	if (nFirst < 0) {
+		nCount += nFirst;
+		nFirst = 0;
+	}
+	if (nFirst + nCount > 192) {
+		nCount = 192 - nFirst;
+	}
+	if (nCount > 0) {
+		memset(&LineDirty[nFirst], 1, nCount);
+	}
+}
+
+// the same pixel row of every character row
+static void MarkPatternRow(int nRow)
+{
+	for (int idx=nRow; idx<192; idx+=8) {
+		LineDirty[idx] = 1;
+	}
+}
+
+// every line that currently has a sprite on it
+static void MarkSpriteLines()
+{
+	for (int idx=0; idx<192; idx++) {
+		if (SprLineCount[idx]) {
+			LineDirty[idx] = 1;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////
+// Sprite evaluation - work out which sprites land on
+// each scanline once, instead of rescanning the whole
+// sprite table for every line drawn. The lists depend
+// only on the sprite attribute list and a few registers,
+// so they are rebuilt when the SAL is written, when one
+// of those registers changes, and once per frame to catch
+// anyone poking VDP RAM directly (disk DSRs, debugger).
+// Pattern data (SDT) is still read live when the line
+// is drawn, so writes there don't need to flush anything.
+//////////////////////////////////////////////////////////
+static void BuildSpriteLists()
+{
+	int i1, yy, t, row, curSAL;
+	char nLines[192];
+
+	// everything the lists depend on besides the SAL itself
+	unsigned int nKey = (SAL) | ((VDPREG[1]&0x03)<<14) | (F18AECModeSprite<<16) | 
+						(bF18AActive?0x40000:0) | (bUse5SpriteLimit?0x80000:0) | (VDPREG[0x33]<<20);
+
+	if ((!bSpriteListDirty) && (nKey == nSpriteListKey)) {
+		return;
+	}
+	// if a sprite moved, the lines it was on need their background back
+	bool bMarkLines = (bSpriteListDirty == 2);
+	if (bMarkLines) {
+		MarkSpriteLines();
+	}
+	bSpriteListDirty = 0;
+	nSpriteListKey = nKey;
+
+	memset(nLines, 0, sizeof(nLines));
+	memset(SprLineCount, 0, sizeof(SprLineCount));
+	memset(SprLine5th, -1, sizeof(SprLine5th));
+
+	SprHighest=31;
+
+	// find the highest active sprite
+	for (i1=0; i1<32; i1++)			// 32 sprites 
+	{
+		yy=VDP[SAL+(i1<<2)];
+		if (yy==0xd0)
+		{
+			SprHighest=i1-1;
+			break;
+		}
+	}
+
+	// number of sprite scanlines counted against the per-line limit
+	int nLimitRows=8;
+	if (VDPREG[1] & 0x2) {			 // TODO: Handle F18A ECM where sprites are doubled individually
+		// double-sized
+		nLimitRows*=2;
+	}
+	if (VDPREG[1]&0x01)	{
+		// magnified sprites
+		nLimitRows*=2;
+	}
+    int max = 5;                    // 9918A - fifth sprite is lost
+    if (bF18AActive) {
+        max = VDPREG[0x33];         // F18A - configurable value
+        if (max == 0) max = 5;      // assume jumper set to 9918A mode
+    }
+
+	// walk the table in priority order, so each line's list ends up in priority order too
+	for (i1=0; i1<=SprHighest; i1++) {
+		curSAL=SAL+(i1<<2);
+		yy=VDP[curSAL]+1;				// sprite Y, it's stupid, cause 255 is line 0 
+		if (yy>225) yy-=256;			// fade in from top: TODO: is this right??
+
+		// number of scanlines actually drawn - in ECM the size bit is per sprite
+		int dblSize = F18AECModeSprite ? VDP[curSAL+3] & 0x10 : VDPREG[1] & 0x2;
+		int nDrawRows = dblSize ? 16 : 8;
+		if (VDPREG[1]&0x01) {
+			nDrawRows*=2;
+		}
+
+		int nRows = (nDrawRows > nLimitRows) ? nDrawRows : nLimitRows;
+		for (row=0, t=yy; row<nRows; row++, t++) {
+			if ((t<0) || (t>191)) continue;
+
+			bool bSkip = false;
+			if ((bUse5SpriteLimit) && (row < nLimitRows)) {
+				// a hacky, but effective 4-sprite-per-line limitation emulation
+				nLines[t]++;
+				if (nLines[t]>=max) {
+					if (SprLine5th[t] == -1) SprLine5th[t]=i1;
+					bSkip = true;
+				}
+			}
+			if ((!bSkip) && (row < nDrawRows)) {
+				SprLineList[t][SprLineCount[t]++] = i1;
+			}
+		}
+	}
+
+	// and the lines it is on now
+	if (bMarkLines) {
+		MarkSpriteLines();
+	}
+}
+
+//////////////////////////////////////////////////////////
+// Work out which scanlines a VDP RAM write can change,
+// so the rest of the frame can be reused as it stands.
+// Only the plain 9918A modes are worked out - anything
+// else (F18A, 80 columns, the undocumented modes) just
+// redraws the whole screen like it always did. Writes
+// that miss every table don't redraw anything.
+//////////////////////////////////////////////////////////
+// A bitmap pattern or color byte is one pixel row of one character in one third
+// of the screen, but the name table decides which cells use that character - any
+// of them might. So take that pixel row in every character row of the third.
+static void MarkBitmapThirdRow(int nThird, int nRow)
+{
+	for (int r=0; r<8; r++) {
+		MarkLines(nThird*64 + r*8 + nRow, 1);
+	}
+}
+
+void VDPMemoryWritten(int nAddr)
+{
+	int off;
+	int reg0 = VDPREG[0];
+
+	if (nSystem == 0) {
+		// disable bitmap for 99/4
+		reg0&=~0x02;
+	}
+
+	if ((bF18AActive) || ((bEnable80Columns) && (reg0&0x04))) {
+		bSpriteListDirty = 2;
+		redraw_needed=REDRAW_LINES;
+		return;
+	}
+
+	if ((VDPREG[1]&0x10) == 0) {
+		// sprites are only shown outside of text modes
+		if ((nAddr >= SAL) && (nAddr < SAL+128)) {
+			bSpriteListDirty = 2;
+		}
+		if ((nAddr >= SDT) && (nAddr < SDT+2048)) {
+			MarkSpriteLines();
+		}
+	}
+
+	if (((VDPREG[1]&0x18) == 0x18) || ((reg0&0x02) && (VDPREG[1]&0x18))) {
+		// illegal, bitmap text and bitmap multicolor - not worth the trouble
+		redraw_needed=REDRAW_LINES;
+		return;
+	}
+
+	if (VDPREG[1]&0x10) {
+		// 40 column text - 24 rows of 40 characters, colors come from VR7
+		off = nAddr - SIT;
+		if ((off >= 0) && (off < 960)) {
+			MarkLines((off/40)*8, 8);
+		}
+		off = nAddr - PDT;
+		if ((off >= 0) && (off < 2048)) {
+			MarkPatternRow(off&7);
+		}
+		return;
+	}
+
+	off = nAddr - SIT;
+	if ((off >= 0) && (off < 768)) {
+		MarkLines((off>>5)*8, 8);
+	}
+
+	if (VDPREG[1]&0x08) {
+		// multicolor - each pattern byte is two 4-line blocks, just take all of them
+		off = nAddr - PDT;
+		if ((off >= 0) && (off < 2048)) {
+			MarkLines(0, 192);
+		}
+		return;
+	}
+
+	if (reg0&0x02) {
+		// bitmap - each third of the screen has its own pattern and color tables, unless
+		// the masks fold them together, then we just take everything
+		off = nAddr - PDT;
+		if ((off >= 0) && (off < 0x1800)) {
+			if ((PDTsize&0x1fff) == 0x1fff) {
+				MarkBitmapThirdRow(off>>11, off&7);
+			} else {
+				MarkLines(0, 192);
+			}
+		}
+		off = nAddr - CT;
+		if ((off >= 0) && (off < 0x1800)) {
+			if ((CTsize&0x1fff) == 0x1fff) {
+				MarkBitmapThirdRow(off>>11, off&7);
+			} else {
+				MarkLines(0, 192);
+			}
+		}
+		return;
+	}
+
+	// graphics mode - a pattern byte is the same row of every character cell,
+	// and a color byte is 8 characters that could be anywhere
+	off = nAddr - PDT;
+	if ((off >= 0) && (off < 2048)) {
+		MarkPatternRow(off&7);
+	}
+	off = nAddr - CT;
+	if ((off >= 0) && (off < 32)) {
+		MarkLines(0, 192);
+	}
+}
+
+//////////////////////////////////////////////////////////
+// VDP RAM was written without going through the ports
+// (the disk and TIPI DSRs copy straight into VDP[]), so
+// nothing is known about what changed - redraw it all.
+//////////////////////////////////////////////////////////
+void VDPMemoryWrittenAll()
+{
+	bSpriteListDirty = 2;
+	redraw_needed = REDRAW_LINES;
+}
+
+//////////////////////////////////////////////////////////
+// Flush the sprite lists unconditionally (once per frame)
+//////////////////////////////////////////////////////////
+void InvalidateSpriteLists()
+{
+	// don't lose a pending SAL write, that one still has lines to mark
+	if (!bSpriteListDirty) {
+		bSpriteListDirty = 1;
+	}
+}
+
+//////////////////////////////////////////////////////////
+// Draw one pattern byte of a sprite on this scanline
+// nStep is 2 for magnified sprites
+//////////////////////////////////////////////////////////
+static void spritebyte(int x, int y, int t, int F18ASpriteColorLine[], int paletteBase, int col, int nStep)
+{
+	for (int bit=0; bit<8; bit++, x+=nStep) {
+		if (t & (0x80>>bit)) {
+			int c = F18AECModeSprite ? paletteBase + F18ASpriteColorLine[bit] : col;
+			if (nStep == 2) {
+				bigpixel(x, y, c);
+			} else {
+				spritepixel(x, y, c);
+			}
+		}
+	}
+}
+
 //////////////////////////////////////////////////////////
 // Draw Sprites into the backbuffer
 //////////////////////////////////////////////////////////
 void DrawSprites(int scanline)
 {
-	int i1, i2, i3, xx, yy, pat, col, p_add, t, sc;
-	int highest;
+	int i1, idx, xx, yy, pat, col, p_add, t, row;
 	int curSAL;
 
-	// a hacky, but effective 4-sprite-per-line limitation emulation
-	// We can do this right when we have scanline based VDP (TODO: or even later)
-	char nLines[192];
-	char bSkipScanLine[32][32];		// 32 sprites, 32 lines max
 	// fifth sprite on a scanline, or last sprite processed in table
 	// note that this value counts up as
 	// it processes the sprite list (or at least,
@@ -2110,7 +2588,6 @@ void DrawSprites(int scanline)
 	// reproduce this very well without a line-by-line VDP.
 	//
 	// TODO: fix Miner2049 without a hack.
-	// TODO: and do all the above properly, now that we're scanline based
 	int b5OnLine=-1;
 
 	if (bDisableSprite) {
@@ -2122,265 +2599,63 @@ void DrawSprites(int scanline)
 		b5OnLine = VDPS & 0x1f;
 	}
 
-	memset(nLines, 0, sizeof(nLines));
-	memset(bSkipScanLine, 0, sizeof(bSkipScanLine));
+	BuildSpriteLists();
 
-	// set up the draw
-	memset(SprColBuf, 0, 256*192);
+	// set up the draw - collisions only ever happen within this scanline
+	memset(SprColLine, 0, sizeof(SprColLine));
 	SprColFlag=0;
-	
-	highest=31;
 
-	// find the highest active sprite
-	for (i1=0; i1<32; i1++)			// 32 sprites 
-	{
-		yy=VDP[SAL+(i1<<2)];
-		if (yy==0xd0)
-		{
-			highest=i1-1;
-			break;
+	if ((scanline >= 0) && (scanline < 192)) {
+		if (b5OnLine == -1) {
+			b5OnLine = SprLine5th[scanline];
 		}
-	}
-	
-	if (bUse5SpriteLimit) {
-		// go through the sprite table and check if any scanlines are obliterated by 4-per-line
-		i3=8;							// number of sprite scanlines
-		if (VDPREG[1] & 0x2) {			 // TODO: Handle F18A ECM where sprites are doubled individually
-			// double-sized
-			i3*=2;
-		}
-		if (VDPREG[1]&0x01)	{
-			// magnified sprites
-			i3*=2;
-		}
-        int max = 5;                    // 9918A - fifth sprite is lost
-        if (bF18AActive) {
-            max = VDPREG[0x33];         // F18A - configurable value
-            if (max == 0) max = 5;      // assume jumper set to 9918A mode
-        }
-		for (i1=0; i1<=highest; i1++) {
+
+		// draw lowest priority first
+		for (idx=SprLineCount[scanline]-1; idx>=0; idx--)
+		{
+			i1=SprLineList[scanline][idx];
 			curSAL=SAL+(i1<<2);
-			yy=VDP[curSAL]+1;				// sprite Y, it's stupid, cause 255 is line 0 
-			if (yy>225) yy-=256;			// fade in from top
-			t=yy;
-			for (i2=0; i2<i3; i2++,t++) {
-				if ((t>=0) && (t<=191)) {
-					nLines[t]++;
-					if (nLines[t]>=max) {
-						if (t == scanline) {
-							if (b5OnLine == -1) b5OnLine=i1;
-						}
-						bSkipScanLine[i1][i2]=1;
-					}
-				}
+			yy=VDP[curSAL++]+1;				// sprite Y, it's stupid, cause 255 is line 0 
+			if (yy>225) yy-=256;			// fade in from top: TODO: is this right??
+			xx=VDP[curSAL++];				// sprite X 
+			pat=VDP[curSAL++];				// sprite pattern
+			int dblSize = F18AECModeSprite ? VDP[curSAL] & 0x10 : VDPREG[1] & 0x2;
+			if (dblSize) {
+				pat=pat&0xfc;				// if double-sized, it must be a multiple of 4
 			}
-		}
-	}
-
-	// now draw
-	for (i1=highest; i1>=0; i1--)	
-	{	
-		curSAL=SAL+(i1<<2);
-		yy=VDP[curSAL++]+1;				// sprite Y, it's stupid, cause 255 is line 0 
-		if (yy>225) yy-=256;			// fade in from top: TODO: is this right??
-		xx=VDP[curSAL++];				// sprite X 
-		pat=VDP[curSAL++];				// sprite pattern
-		int dblSize = F18AECModeSprite ? VDP[curSAL] & 0x10 : VDPREG[1] & 0x2;
-		if (dblSize) {
-			pat=pat&0xfc;				// if double-sized, it must be a multiple of 4
-		}
-		col=VDP[curSAL]&0xf;			// sprite color 
-	
-		if (VDP[curSAL++]&0x80)	{		// early clock
-			xx-=32;
-		}
-
-		// Even transparent sprites get drawn into the collision buffer
-		p_add=SDT+(pat<<3);
-		sc=0;						// current scanline
+			col=VDP[curSAL]&0xf;			// sprite color 
 		
-		// Added by Rasmus M
-		// TODO: For ECM 1 we need one more bit from R24 (Mike: is that ECM? I think it's always!)
-		int paletteBase = F18AECModeSprite ? (col >> (F18AECModeSprite - 2)) * F18ASpritePaletteSize : 0;
-		int F18ASpriteColorLine[8]; // Colors indices for each of the 8 pixels in a sprite scan line
+			if (VDP[curSAL++]&0x80)	{		// early clock
+				xx-=32;
+			}
 
-		if (VDPREG[1]&0x01)	{		// magnified sprites
-			for (i3=0; i3<16; i3++)
-			{	
-				t = pixelMask(p_add, F18ASpriteColorLine);	// Modified by RasmusM. Sets up the F18ASpriteColorLine[] array.
-
-				if ((!bSkipScanLine[i1][sc]) && (yy+i3 == scanline)) {
-					if (t&0x80) 
-						bigpixel(xx, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-					if (t&0x40)
-						bigpixel(xx+2, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-					if (t&0x20)
-						bigpixel(xx+4, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-					if (t&0x10)
-						bigpixel(xx+6, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-					if (t&0x08)
-						bigpixel(xx+8, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-					if (t&0x04)
-						bigpixel(xx+10, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-					if (t&0x02)
-						bigpixel(xx+12, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-					if (t&0x01)
-						bigpixel(xx+14, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-				}
+			// Even transparent sprites get drawn into the collision buffer
+			p_add=SDT+(pat<<3);
 
-				if (dblSize)		// double-size sprites, need to draw 3 more chars 
-				{	
-					t = pixelMask(p_add + 8, F18ASpriteColorLine);	// Modified by RasmusM
-	
-					if ((!bSkipScanLine[i1][sc+16]) && (yy+i3+16 == scanline)) {
-						if (t&0x80)
-							bigpixel(xx, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-						if (t&0x40)
-							bigpixel(xx+2, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-						if (t&0x20)
-							bigpixel(xx+4, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-						if (t&0x10)
-							bigpixel(xx+6, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-						if (t&0x08)
-							bigpixel(xx+8, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-						if (t&0x04)
-							bigpixel(xx+10, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-						if (t&0x02)
-							bigpixel(xx+12, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-						if (t&0x01)
-							bigpixel(xx+14, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-
-						t = pixelMask(p_add + 24, F18ASpriteColorLine);	// Modified by RasmusM
-						if (t&0x80)
-							bigpixel(xx+16, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-						if (t&0x40)
-							bigpixel(xx+18, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-						if (t&0x20)
-							bigpixel(xx+20, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-						if (t&0x10)
-							bigpixel(xx+22, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-						if (t&0x08)
-							bigpixel(xx+24, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-						if (t&0x04)
-							bigpixel(xx+26, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-						if (t&0x02)
-							bigpixel(xx+28, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-						if (t&0x01)
-							bigpixel(xx+30, yy+i3+16, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-					}
+			// Added by Rasmus M
+			// TODO: For ECM 1 we need one more bit from R24 (Mike: is that ECM? I think it's always!)
+			int paletteBase = F18AECModeSprite ? (col >> (F18AECModeSprite - 2)) * F18ASpritePaletteSize : 0;
+			int F18ASpriteColorLine[8]; // Colors indices for each of the 8 pixels in a sprite scan line
 
-					if ((!bSkipScanLine[i1][sc]) && (yy+i3 == scanline)) {
-						t = pixelMask(p_add + 16, F18ASpriteColorLine);	// Modified by RasmusM
-						if (t&0x80)
-							bigpixel(xx+16, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-						if (t&0x40)
-							bigpixel(xx+18, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-						if (t&0x20)
-							bigpixel(xx+20, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-						if (t&0x10)	
-							bigpixel(xx+22, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-						if (t&0x08)
-							bigpixel(xx+24, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-						if (t&0x04)
-							bigpixel(xx+26, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-						if (t&0x02)
-							bigpixel(xx+28, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-						if (t&0x01)
-							bigpixel(xx+30, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-					}
-				}
-				sc++;
-				p_add += i3&0x01;
+			// row within the sprite - the left column is pattern bytes 0-15, the right 16-31
+			row = scanline - yy;
+			int nStep = 1;
+			if (VDPREG[1]&0x01)	{		// magnified sprites
+				row >>= 1;
+				nStep = 2;
 			}
-		} else {
-			for (i3=0; i3<8; i3++)
-			{	
-				t = pixelMask(p_add++, F18ASpriteColorLine);	// Modified by RasmusM
-
-				if ((!bSkipScanLine[i1][sc]) && (yy+i3 == scanline)) {
-					if (t&0x80)
-						spritepixel(xx, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-					if (t&0x40)
-						spritepixel(xx+1, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-					if (t&0x20)
-						spritepixel(xx+2, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-					if (t&0x10)
-						spritepixel(xx+3, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-					if (t&0x08)
-						spritepixel(xx+4, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-					if (t&0x04)
-						spritepixel(xx+5, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-					if (t&0x02)
-						spritepixel(xx+6, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-					if (t&0x01)
-						spritepixel(xx+7, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-				}
 
-				if (dblSize)		// double-size sprites, need to draw 3 more chars 
-				{	
-					t = pixelMask(p_add + 7, F18ASpriteColorLine);	// Modified by RasmusM
-
-					if ((!bSkipScanLine[i1][sc+8]) && (yy+i3+8 == scanline)) {
-						if (t&0x80)
-							spritepixel(xx, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-						if (t&0x40)
-							spritepixel(xx+1, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-						if (t&0x20)
-							spritepixel(xx+2, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-						if (t&0x10)
-							spritepixel(xx+3, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-						if (t&0x08)
-							spritepixel(xx+4, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-						if (t&0x04)
-							spritepixel(xx+5, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-						if (t&0x02)
-							spritepixel(xx+6, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-						if (t&0x01)
-							spritepixel(xx+7, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-
-						t = pixelMask(p_add + 23, F18ASpriteColorLine);	// Modified by RasmusM
-						if (t&0x80)
-							spritepixel(xx+8, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-						if (t&0x40)
-							spritepixel(xx+9, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-						if (t&0x20)
-							spritepixel(xx+10, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-						if (t&0x10)
-							spritepixel(xx+11, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-						if (t&0x08)
-							spritepixel(xx+12, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-						if (t&0x04)
-							spritepixel(xx+13, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-						if (t&0x02)
-							spritepixel(xx+14, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-						if (t&0x01)
-							spritepixel(xx+15, yy+i3+8, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-					}
+			t = pixelMask(p_add + row, F18ASpriteColorLine);	// Modified by RasmusM. Sets up the F18ASpriteColorLine[] array.
+			spritebyte(xx, scanline, t, F18ASpriteColorLine, paletteBase, col, nStep);
 
-					if ((!bSkipScanLine[i1][sc]) && (yy+i3 == scanline)) {
-						t = pixelMask(p_add + 15, F18ASpriteColorLine);	// Modified by RasmusM
-						if (t&0x80)
-							spritepixel(xx+8, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[0] : col);
-						if (t&0x40)
-							spritepixel(xx+9, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[1] : col);
-						if (t&0x20)
-							spritepixel(xx+10, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[2] : col);
-						if (t&0x10)	
-							spritepixel(xx+11, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[3] : col);
-						if (t&0x08)
-							spritepixel(xx+12, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[4] : col);
-						if (t&0x04)
-							spritepixel(xx+13, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[5] : col);
-						if (t&0x02)
-							spritepixel(xx+14, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[6] : col);
-						if (t&0x01)
-							spritepixel(xx+15, yy+i3, F18AECModeSprite ? paletteBase + F18ASpriteColorLine[7] : col);
-					}
-				}
-				sc++;
+			if (dblSize)		// double-size sprites, need the right column too
+			{	
+				t = pixelMask(p_add + 16 + row, F18ASpriteColorLine);	// Modified by RasmusM
+				spritebyte(xx+8*nStep, scanline, t, F18ASpriteColorLine, paletteBase, col, nStep);
 			}
 		}
 	}
+
 	// Set the VDP collision bit
 	if (SprColFlag) {
 		VDPS|=VDPS_SCOL;
@@ -2395,7 +2670,7 @@ void DrawSprites(int scanline)
 		// having 5 on a line anywhere will be 0? (0x1f+1)=0x20 -> 0x20&0x1f = 0!
 		// The correct behaviour is probably to count in realtime - that goes in with
 		// the scanline code.
-		VDPS|=(highest+1)&(~(VDPS_INT|VDPS_5SPR|VDPS_SCOL));
+		VDPS|=(SprHighest+1)&(~(VDPS_INT|VDPS_5SPR|VDPS_SCOL));
 	}
 }
 
@@ -2419,6 +2694,54 @@ void pixel80(int x, int y, int c)
 	framedata[((199-y)<<9)+((199-y)<<4)+x+8]=GETPALETTEVALUE(c);
 }
 
+////////////////////////////////////////////////////////////
+// Draw up to 8 pixels of one pattern byte (MSB first) onto the
+// backbuffer surface. The colors are looked up once and the bits
+// are expanded through PatternMask, so this writes the span in
+// one pass. Same output as calling pixel() for each dot, which it
+// still does if SpanRender is off so dumps can be compared.
+////////////////////////////////////////////////////////////
+void patternspan(int x, int y, int t, int fgc, int bgc, int n)
+{
+	if (!bSpanRender) {
+		for (int idx=0; idx<n; idx++) {
+			pixel(x+idx, y, (t&(0x80>>idx)) ? fgc : bgc);
+		}
+		return;
+	}
+
+	unsigned int fg = GETPALETTEVALUE(fgc);
+	unsigned int bg = GETPALETTEVALUE(bgc);
+	unsigned int *pDest = &framedata[((199-y)<<8)+((199-y)<<4)+x+8];
+	const unsigned int *pMask = PatternMask[t&0xff];
+
+	for (int idx=0; idx<n; idx++) {
+		pDest[idx] = (fg & pMask[idx]) | (bg & ~pMask[idx]);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Same as patternspan, for the 80 column layout
+////////////////////////////////////////////////////////////
+void patternspan80(int x, int y, int t, int fgc, int bgc, int n)
+{
+	if (!bSpanRender) {
+		for (int idx=0; idx<n; idx++) {
+			pixel80(x+idx, y, (t&(0x80>>idx)) ? fgc : bgc);
+		}
+		return;
+	}
+
+	unsigned int fg = GETPALETTEVALUE(fgc);
+	unsigned int bg = GETPALETTEVALUE(bgc);
+	unsigned int *pDest = &framedata[((199-y)<<9)+((199-y)<<4)+x+8];
+	const unsigned int *pMask = PatternMask[t&0xff];
+
+	for (int idx=0; idx<n; idx++) {
+		pDest[idx] = (fg & pMask[idx]) | (bg & ~pMask[idx]);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // Draw a range-checked pixel onto the backbuffer surface
 ////////////////////////////////////////////////////////////
@@ -2433,10 +2756,10 @@ void spritepixel(int x, int y, int c)
         if ((x>=248)||(x<8)) return;
     }
 	
-	if (SprColBuf[x][y]) {
+	if (SprColLine[x>>5] & (1u<<(x&31))) {
 		SprColFlag=1;
 	} else {
-		SprColBuf[x][y]=1;
+		SprColLine[x>>5] |= (1u<<(x&31));
 	}
 
 	if (!(F18AECModeSprite ? c % F18ASpritePaletteSize : c)) return;		// don't DRAW transparent, Modified by RasmusM
@@ -2795,7 +3118,7 @@ void SaveScreenshot(bool bAuto, bool bFiltered) {
 			case 0:		// none
 				nX=256+16;
 				nY=192+16;
-				pBuf=(unsigned char*)framedata;
+				pBuf=(unsigned char*)pBlitFrame;
 				nBits=32;
 				break;
 			
@@ -2823,7 +3146,7 @@ void SaveScreenshot(bool bAuto, bool bFiltered) {
 		} else {
 			nX=256+16;
 			nY=192+16;
-			pBuf=(unsigned char*)framedata;
+			pBuf=(unsigned char*)pBlitFrame;
 			nBits=32;
 		}
 
@@ -2902,6 +3225,59 @@ void SaveScreenshot(bool bAuto, bool bFiltered) {
 	}
 }
 
+// Writes the raw (unfiltered) frame buffer to a 24-bit BMP without any UI
+// Used by headless mode to capture the final frame of a batch run
+bool SaveFrameBMP(const char *pFile) {
+	int nX, nY;
+	int reg0 = gettables(0);
+
+	if ((reg0&0x04)&&(VDPREG[1]&0x10)&&(bEnable80Columns)) {
+		nX=512+16;		// 80 column text uses the wide buffer
+	} else {
+		nX=256+16;
+	}
+	nY=192+16;
+
+	FILE *fp=fopen(pFile, "wb");
+	if (NULL == fp) {
+		debug_write("Failed to open frame dump file '%s'", pFile);
+		return false;
+	}
+
+	// same v1 header as SaveScreenshot
+	int tmp;
+	fputc('B', fp);
+	fputc('M', fp);
+	tmp=nX*nY*3+26;
+	fwrite(&tmp, 4, 1, fp);		// size of file
+	tmp=0;
+	fwrite(&tmp, 4, 1, fp);		// reserved
+	tmp=26;
+	fwrite(&tmp, 4, 1, fp);		// offset to data
+	tmp=12;
+	fwrite(&tmp, 4, 1, fp);		// size of the header (v1)
+	fwrite(&nX, 2, 1, fp);		// width in pixels
+	fwrite(&nY, 2, 1, fp);		// height in pixels
+	tmp=1;
+	fwrite(&tmp, 2, 1, fp);		// number of planes (1)
+	tmp=24;
+	fwrite(&tmp, 2, 1, fp);		// bits per pixel
+
+	// framedata is already bottom-up 0BGR, just like the BMP wants it
+	EnterCriticalSection(&VideoCS);
+	unsigned char *pBuf=(unsigned char*)framedata;
+	for (int idx=0; idx<nX*nY; idx++) {
+		fputc(pBuf[0], fp);
+		fputc(pBuf[1], fp);
+		fputc(pBuf[2], fp);
+		pBuf+=4;
+	}
+	LeaveCriticalSection(&VideoCS);
+
+	fclose(fp);
+	return true;
+}
+
 // F18A Status registers
 // This function must only be called when the register is not 0
 // and F18A is active
@@ -3004,3 +3380,71 @@ CString captureScreen(int offset) {
 }
 
 
+
+//////////////////////////////////////////////////////////
+// Save states - the VDP chunk. Only the memory the VDP can
+// actually address in this configuration is saved.
+//////////////////////////////////////////////////////////
+void SaveVdpState(MachineState *pState) {
+	int nVdpSize = (bEnable128k ? 128 : 16) * 1024;
+
+	if (pState->bNoMemory) {
+		// 0 means the memory is kept somewhere else
+		nVdpSize = 0;
+	}
+	StateBeginChunk(pState, "VDP ");
+	STATE_PUT(pState, nVdpSize);
+	StateWrite(pState, VDP, nVdpSize);
+	STATE_PUT(pState, VDPREG);
+	STATE_PUT(pState, VDPS);
+	STATE_PUT(pState, VDPADD);
+	STATE_PUT(pState, vdpaccess);
+	STATE_PUT(pState, vdpwroteaddress);
+	STATE_PUT(pState, vdpscanline);
+	STATE_PUT(pState, vdpprefetch);
+	STATE_PUT(pState, vdpprefetchuninited);
+	STATE_PUT(pState, SprColFlag);
+	STATE_PUT(pState, bF18AActive);
+	STATE_PUT(pState, F18AStatusRegisterNo);
+	STATE_PUT(pState, F18AECModeSprite);
+	STATE_PUT(pState, F18ASpritePaletteSize);
+	STATE_PUT(pState, bF18ADataPortMode);
+	STATE_PUT(pState, bF18AAutoIncPaletteReg);
+	STATE_PUT(pState, F18APaletteRegisterNo);
+	STATE_PUT(pState, F18APaletteRegisterData);
+	STATE_PUT(pState, F18APalette);
+}
+
+void LoadVdpState(StateReader *pRead) {
+	int nVdpSize = 0;
+
+	STATE_GET(pRead, nVdpSize);
+	if ((nVdpSize < 0) || (nVdpSize > (int)sizeof(VDP))) {
+		pRead->bOk = false;
+		return;
+	}
+	StateRead(pRead, VDP, nVdpSize);
+	STATE_GET(pRead, VDPREG);
+	STATE_GET(pRead, VDPS);
+	STATE_GET(pRead, VDPADD);
+	STATE_GET(pRead, vdpaccess);
+	STATE_GET(pRead, vdpwroteaddress);
+	STATE_GET(pRead, vdpscanline);
+	STATE_GET(pRead, vdpprefetch);
+	STATE_GET(pRead, vdpprefetchuninited);
+	STATE_GET(pRead, SprColFlag);
+	STATE_GET(pRead, bF18AActive);
+	STATE_GET(pRead, F18AStatusRegisterNo);
+	STATE_GET(pRead, F18AECModeSprite);
+	STATE_GET(pRead, F18ASpritePaletteSize);
+	STATE_GET(pRead, bF18ADataPortMode);
+	STATE_GET(pRead, bF18AAutoIncPaletteReg);
+	STATE_GET(pRead, F18APaletteRegisterNo);
+	STATE_GET(pRead, F18APaletteRegisterData);
+	STATE_GET(pRead, F18APalette);
+
+	// nothing drawn so far matches the new memory (and if the
+	// memory isn't in the state, the caller is about to restore it)
+	bSpriteListDirty = 2;
+	redraw_needed = REDRAW_LINES;
+}
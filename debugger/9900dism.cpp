@@ -83,8 +83,20 @@ Byte GetSafeCpuByte(int x, int bank) {
 
 extern CPU9900 * volatile pCurrentCPU;
 extern CPU9900 *pGPU, *pCPU;
-#define RDOP(A, bank) ((bank) == -1 ? pGPU->GetSafeWord(A, bank) : pCPU->GetSafeWord(A, bank) )
-#define RDWORD(A, bank) ((bank) == -1 ? pGPU->GetSafeWord(A, bank) : pCPU->GetSafeWord(A, bank) )
+
+// The trace decoder has no machine to read from, so it hands us the
+// instruction words it recorded instead (see Dasm9900Words)
+static const Word *pDasmWords = NULL;
+static int nDasmWordsPC = 0;
+static Word ReadDasmWord(int A, int bank) {
+	if (NULL != pDasmWords) {
+		int idx = ((A - nDasmWordsPC) & 0xffff) >> 1;
+		return (idx < 3) ? pDasmWords[idx] : 0;
+	}
+	return (bank == -1) ? pGPU->GetSafeWord(A, bank) : pCPU->GetSafeWord(A, bank);
+}
+#define RDOP(A, bank) ReadDasmWord(A, bank)
+#define RDWORD(A, bank) ReadDasmWord(A, bank)
 
 #define BITS_0to3	((OP>>12) & 0xf)
 #define BITS_2to5	((OP>>10) & 0xf)
@@ -249,7 +261,7 @@ int Dasm9900 (char *buffer, int pc, int bank)
 	myPC = pc;
 	OP = RDOP(myPC, bank); myPC+=2;
 
-	if (pCurrentCPU == pGPU) {
+	if ((NULL != pDasmWords) ? (bank == -1) : (pCurrentCPU == pGPU)) {
 		offset=32;
 	} else {
 		offset=0;
@@ -395,3 +407,14 @@ int Dasm9900 (char *buffer, int pc, int bank)
 
 	return myPC - pc;
 }
+
+// Disassemble from the three words at pc (opcode and up to two operands)
+// rather than from memory. bank is -1 for the GPU, like Dasm9900.
+int Dasm9900Words(char *buffer, int pc, int bank, const Word *pWords)
+{
+	pDasmWords = pWords;
+	nDasmWordsPC = pc;
+	int nRet = Dasm9900(buffer, pc, bank);
+	pDasmWords = NULL;
+	return nRet;
+}
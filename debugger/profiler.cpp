@@ -0,0 +1,700 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Execution profiler
+//
+// Every CPU instruction adds its cycles to a counter for where it
+// came from. Cartridge ROM is counted per bank and mapped AMS RAM
+// per page, so paged code that shares an address is kept apart.
+// Time spent in the console ROM is also charged to the GROM address
+// the GPL interpreter is reading, which is where GPL programs spend
+// their time. The call tree follows BL, BLWP, XOP and interrupts,
+// and pops a frame when execution comes back to its return address
+// and workspace, however the code gets there.
+// Nothing here runs unless bProfileActive is set.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <windows.h>
+
+#include "tiemul.h"
+#include "cpu9900.h"
+#include "..\addons\ams.h"
+#include "profiler.h"
+
+#define PROFILE_BANKS		4096		// cartridge banks tracked, MUST be a power of 2
+#define PROFILE_AMS_PAGES	0x2000		// AMS pages tracked, MUST be a power of 2
+#define PROFILE_MAX_DEPTH	64			// deeper calls are charged to the deepest frame
+#define PROFILE_MAX_NODES	65536		// call tree size limit
+#define PROFILE_TOP			200			// lines in the flat report
+#define PROFILE_TOP_FUNCS	100			// functions in the call graph report
+
+// location encoding - the PC in the low 16 bits, bank or page above it
+#define PROFILE_LOC_BANK	0x40000000
+#define PROFILE_LOC_AMS		0x80000000
+#define PROFILE_LOC_ROOT	0xffffffff
+
+extern CPU9900 *pCPU;
+
+volatile bool bProfileActive = false;
+static volatile bool bProfileBusy = false;		// CPU thread is inside the profiler
+
+typedef unsigned __int64 ProfileCount;
+
+struct ProfileNode {
+	DWord nLoc;					// function entry (PROFILE_LOC_ROOT for the root)
+	int nParent;
+	int nChild;					// first child
+	int nSibling;				// next child of our parent
+	bool bInterrupt;			// entered by an interrupt
+	ProfileCount nSelf;			// cycles spent directly in this node
+	ProfileCount nTotal;		// self plus children, filled in for the report
+};
+
+struct ProfileFrame {
+	int nNode;
+	Word nReturnPC;
+	Word nReturnWP;
+};
+
+struct ProfileSymbol {
+	Word nAddress;
+	char szName[32];
+};
+
+static char szProfileBase[MAX_PATH];
+static ProfileCount *pFlatCycles = NULL;						// [0x10000] by PC
+static ProfileCount *pBankCycles[PROFILE_BANKS];				// [0x1000] by word, allocated on use
+static ProfileCount *pPageCycles[PROFILE_AMS_PAGES];			// [0x800] by word, allocated on use
+static ProfileCount *pGromCycles = NULL;						// [0x10000] by GROM address
+static ProfileCount nTotalCycles = 0;
+static ProfileCount nTotalInstructions = 0;
+static ProfileCount nGplCycles = 0;
+
+static ProfileNode *pNodes = NULL;
+static int nNodes = 0;
+static ProfileFrame Frames[PROFILE_MAX_DEPTH];
+static int nDepth = 0;					// frames in use
+static int nCurrentNode = 0;
+
+static ProfileSymbol *pSymbols = NULL;
+static int nSymbols = 0;
+
+// work out where an instruction lives
+static inline DWord ProfileLocation(Word nPC, int nBank) {
+	if ((nPC >= 0x6000) && (nPC < 0x8000)) {
+		return PROFILE_LOC_BANK | ((nBank & (PROFILE_BANKS-1)) << 16) | nPC;
+	}
+	int nPage = GetMappedAmsPage(nPC);
+	if (nPage >= 0) {
+		return PROFILE_LOC_AMS | ((nPage & (PROFILE_AMS_PAGES-1)) << 16) | nPC;
+	}
+	return nPC;
+}
+
+// counter for a location, or NULL if we couldn't get the memory
+static ProfileCount *ProfileSlot(DWord nLoc) {
+	int nIdx = (nLoc >> 16) & 0x1fff;
+
+	if (nLoc & PROFILE_LOC_AMS) {
+		if (NULL == pPageCycles[nIdx]) {
+			pPageCycles[nIdx] = (ProfileCount*)calloc(0x800, sizeof(ProfileCount));
+			if (NULL == pPageCycles[nIdx]) return NULL;
+		}
+		return &pPageCycles[nIdx][(nLoc & 0x0fff) >> 1];
+	}
+	if (nLoc & PROFILE_LOC_BANK) {
+		if (NULL == pBankCycles[nIdx]) {
+			pBankCycles[nIdx] = (ProfileCount*)calloc(0x1000, sizeof(ProfileCount));
+			if (NULL == pBankCycles[nIdx]) return NULL;
+		}
+		return &pBankCycles[nIdx][(nLoc & 0x1fff) >> 1];
+	}
+	return &pFlatCycles[nLoc & 0xffff];
+}
+
+// find or create the child of the current node for a call to nLoc
+static int ProfileChild(DWord nLoc, bool bInterrupt) {
+	for (int idx = pNodes[nCurrentNode].nChild; idx != -1; idx = pNodes[idx].nSibling) {
+		if ((pNodes[idx].nLoc == nLoc) && (pNodes[idx].bInterrupt == bInterrupt)) {
+			return idx;
+		}
+	}
+	if (nNodes >= PROFILE_MAX_NODES) {
+		return nCurrentNode;
+	}
+
+	ProfileNode *pNew = &pNodes[nNodes];
+	pNew->nLoc = nLoc;
+	pNew->nParent = nCurrentNode;
+	pNew->nChild = -1;
+	pNew->nSibling = pNodes[nCurrentNode].nChild;
+	pNew->bInterrupt = bInterrupt;
+	pNew->nSelf = 0;
+	pNew->nTotal = 0;
+	pNodes[nCurrentNode].nChild = nNodes;
+	return nNodes++;
+}
+
+static void ProfilePush(Word nNewPC, int nBank, Word nReturnPC, Word nReturnWP, bool bInterrupt) {
+	if (nDepth >= PROFILE_MAX_DEPTH) {
+		return;
+	}
+	Frames[nDepth].nNode = nCurrentNode;
+	Frames[nDepth].nReturnPC = nReturnPC;
+	Frames[nDepth].nReturnWP = nReturnWP;
+	++nDepth;
+	nCurrentNode = ProfileChild(ProfileLocation(nNewPC, nBank), bInterrupt);
+}
+
+// charge one executed instruction, then follow any call or return it made
+void ProfileInstruction(Word nPC, int nBank, Word nOp, Word nOldWP, int nCycles) {
+	bProfileBusy = true;
+	MemoryBarrier();
+	if (!bProfileActive) {
+		bProfileBusy = false;
+		return;
+	}
+
+	ProfileCount *pSlot = ProfileSlot(ProfileLocation(nPC, nBank));
+	if (NULL != pSlot) {
+		*pSlot += nCycles;
+	}
+	if (nPC < 0x2000) {
+		// console ROM - most likely the GPL interpreter
+		pGromCycles[GROMBase[0].GRMADD] += nCycles;
+		nGplCycles += nCycles;
+	}
+	pNodes[nCurrentNode].nSelf += nCycles;
+	nTotalCycles += nCycles;
+	++nTotalInstructions;
+
+	Word nNewPC = pCPU->GetPC();
+	Word nNewWP = pCPU->GetWP();
+	if ((nOp & 0xffc0) == 0x0680) {
+		// BL - return address is in the new R11
+		ProfilePush(nNewPC, xbBank, pCPU->GetSafeWord(nNewWP+22, xbBank), nOldWP, false);
+	} else if (((nOp & 0xffc0) == 0x0400) || ((nOp & 0xfc00) == 0x2c00)) {
+		// BLWP and XOP - return address is in the new R14
+		ProfilePush(nNewPC, xbBank, pCPU->GetSafeWord(nNewWP+28, xbBank), nOldWP, false);
+	} else if (nDepth > 0) {
+		if ((nNewPC == Frames[nDepth-1].nReturnPC) && (nNewWP == Frames[nDepth-1].nReturnWP)) {
+			nCurrentNode = Frames[--nDepth].nNode;
+		} else if ((nOp == 0x0380) || ((nOp & 0xffc0) == 0x0440)) {
+			// RTWP or B - may be returning past frames that never returned themselves
+			for (int idx = nDepth-2; idx >= 0; idx--) {
+				if ((nNewPC == Frames[idx].nReturnPC) && (nNewWP == Frames[idx].nReturnWP)) {
+					nDepth = idx;
+					nCurrentNode = Frames[idx].nNode;
+					break;
+				}
+			}
+		}
+	}
+
+	bProfileBusy = false;
+}
+
+// called by the CPU as it takes an interrupt, before it switches context
+void ProfileInterrupt(Word nNewPC, Word nReturnPC, Word nReturnWP) {
+	bProfileBusy = true;
+	MemoryBarrier();
+	if (bProfileActive) {
+		ProfilePush(nNewPC, xbBank, nReturnPC, nReturnWP, true);
+	}
+	bProfileBusy = false;
+}
+
+//////////////////////////////////////////////////////////
+// Symbols
+//////////////////////////////////////////////////////////
+
+static int CompareSymbols(const void *p1, const void *p2) {
+	return (int)((const ProfileSymbol*)p1)->nAddress - (int)((const ProfileSymbol*)p2)->nAddress;
+}
+
+// Accepts anything with a label and a hex value on one line, which
+// covers EQU lists (LABEL EQU >A000) and most assembler symbol dumps.
+// Hex values need a > or $ or 0x prefix.
+static void LoadProfileSymbols(const char *pFile) {
+	FILE *fp = fopen(pFile, "r");
+	if (NULL == fp) {
+		debug_write("Can't open symbol file %s", pFile);
+		return;
+	}
+
+	int nMax = 0;
+	char buf[256];
+	while (NULL != fgets(buf, sizeof(buf), fp)) {
+		char *pName = NULL;
+		int nAddress = -1;
+
+		for (char *pTok = strtok(buf, " \t\r\n,:="); NULL != pTok; pTok = strtok(NULL, " \t\r\n,:=")) {
+			if ((pTok[0] == '>') || (pTok[0] == '$')) {
+				if (nAddress == -1) nAddress = strtol(pTok+1, NULL, 16);
+			} else if ((pTok[0] == '0') && ((pTok[1] == 'x') || (pTok[1] == 'X'))) {
+				if (nAddress == -1) nAddress = strtol(pTok+2, NULL, 16);
+			} else if ((NULL == pName) && (isalpha((unsigned char)pTok[0]) || (pTok[0] == '_')) && (0 != _stricmp(pTok, "EQU"))) {
+				pName = pTok;
+			}
+		}
+		if ((NULL == pName) || (nAddress < 0) || (nAddress > 0xffff)) {
+			continue;
+		}
+
+		if (nSymbols >= nMax) {
+			nMax += 1024;
+			ProfileSymbol *pNew = (ProfileSymbol*)realloc(pSymbols, nMax * sizeof(ProfileSymbol));
+			if (NULL == pNew) break;
+			pSymbols = pNew;
+		}
+		pSymbols[nSymbols].nAddress = (Word)nAddress;
+		strncpy(pSymbols[nSymbols].szName, pName, sizeof(pSymbols[nSymbols].szName));
+		pSymbols[nSymbols].szName[sizeof(pSymbols[nSymbols].szName)-1] = '\0';
+		++nSymbols;
+	}
+	fclose(fp);
+
+	if (nSymbols > 0) {
+		qsort(pSymbols, nSymbols, sizeof(ProfileSymbol), CompareSymbols);
+	}
+	debug_write("Loaded %d symbols from %s", nSymbols, pFile);
+}
+
+// the last symbol at or before nAddress, or NULL
+static ProfileSymbol *FindSymbol(Word nAddress) {
+	int nLow = 0, nHigh = nSymbols-1;
+	ProfileSymbol *pBest = NULL;
+
+	while (nLow <= nHigh) {
+		int nMid = (nLow + nHigh) / 2;
+		if (pSymbols[nMid].nAddress <= nAddress) {
+			pBest = &pSymbols[nMid];
+			nLow = nMid + 1;
+		} else {
+			nHigh = nMid - 1;
+		}
+	}
+	return pBest;
+}
+
+//////////////////////////////////////////////////////////
+// Reports
+//////////////////////////////////////////////////////////
+
+// short name for a location, using a symbol if there is one exactly there
+// (no spaces or semicolons, so it works as a flamegraph frame)
+static void ProfileName(DWord nLoc, char *pBuf) {
+	Word nPC = nLoc & 0xffff;
+	char szPrefix[16] = "";
+
+	if (nLoc == PROFILE_LOC_ROOT) {
+		strcpy(pBuf, "[top]");
+		return;
+	}
+	if (nLoc & PROFILE_LOC_AMS) {
+		sprintf(szPrefix, "AMS%03X:", (nLoc >> 16) & 0x1fff);
+	} else if (nLoc & PROFILE_LOC_BANK) {
+		sprintf(szPrefix, "(%d)", (nLoc >> 16) & 0x1fff);
+	}
+
+	ProfileSymbol *pSym = FindSymbol(nPC);
+	if ((NULL != pSym) && (pSym->nAddress == nPC)) {
+		sprintf(pBuf, "%s%s", szPrefix, pSym->szName);
+	} else {
+		sprintf(pBuf, "%s>%04X", szPrefix, nPC);
+	}
+}
+
+// disassemble from the memory the location names, even if it's paged out now
+static void ProfileDasm(DWord nLoc, char *pBuf) {
+	Word nPC = nLoc & 0xfffe;
+	Word nWords[3];
+
+	for (int idx = 0; idx < 3; idx++) {
+		Word nAdr = nPC + idx*2;
+		if (nLoc & PROFILE_LOC_AMS) {
+			int nAms = (((nLoc >> 16) & 0x1fff) << 12) | (nAdr & 0x0fff);
+			nWords[idx] = (ReadRawAMS(nAms) << 8) | ReadRawAMS(nAms+1);
+		} else {
+			nWords[idx] = pCPU->GetSafeWord(nAdr, (nLoc >> 16) & 0x1fff);
+		}
+	}
+	Dasm9900Words(pBuf, nPC, 0, nWords);
+}
+
+struct ProfileEntry {
+	DWord nLoc;
+	ProfileCount nCycles;
+};
+
+static int CompareEntries(const void *p1, const void *p2) {
+	ProfileCount n1 = ((const ProfileEntry*)p1)->nCycles;
+	ProfileCount n2 = ((const ProfileEntry*)p2)->nCycles;
+	return (n1 < n2) ? 1 : (n1 > n2) ? -1 : 0;
+}
+
+static int CompareLocations(const void *p1, const void *p2) {
+	DWord n1 = ((const ProfileEntry*)p1)->nLoc;
+	DWord n2 = ((const ProfileEntry*)p2)->nLoc;
+	return (n1 > n2) ? 1 : (n1 < n2) ? -1 : 0;
+}
+
+static double Percent(ProfileCount n) {
+	return (nTotalCycles > 0) ? (n * 100.0 / nTotalCycles) : 0.0;
+}
+
+// collect the non-zero counters of an array into pList
+static void GatherCounts(ProfileCount *pCounts, int nCount, DWord nBase, int nShift, ProfileEntry *pList, int &nList) {
+	for (int idx = 0; idx < nCount; idx++) {
+		if (pCounts[idx]) {
+			pList[nList].nLoc = nBase + (idx << nShift);
+			pList[nList].nCycles = pCounts[idx];
+			++nList;
+		}
+	}
+}
+
+static void WriteFlatReport(FILE *fp) {
+	int nMax = 0x10000;
+	for (int idx = 0; idx < PROFILE_BANKS; idx++) if (pBankCycles[idx]) nMax += 0x1000;
+	for (int idx = 0; idx < PROFILE_AMS_PAGES; idx++) if (pPageCycles[idx]) nMax += 0x800;
+
+	ProfileEntry *pList = (ProfileEntry*)malloc(nMax * sizeof(ProfileEntry));
+	if (NULL == pList) {
+		fprintf(fp, "Out of memory for the flat report\n");
+		return;
+	}
+
+	// by bank and page first, while we gather the instructions
+	int nList = 0;
+	GatherCounts(pFlatCycles, 0x10000, 0, 0, pList, nList);
+
+	fprintf(fp, "\n== Cartridge banks ==\n");
+	for (int idx = 0; idx < PROFILE_BANKS; idx++) {
+		if (NULL == pBankCycles[idx]) continue;
+		int nFirst = nList;
+		GatherCounts(pBankCycles[idx], 0x1000, PROFILE_LOC_BANK | (idx << 16) | 0x6000, 1, pList, nList);
+		ProfileCount nSum = 0;
+		for (int i2 = nFirst; i2 < nList; i2++) nSum += pList[i2].nCycles;
+		fprintf(fp, "  bank %4d  %14I64u %6.2f%%\n", idx, nSum, Percent(nSum));
+	}
+
+	fprintf(fp, "\n== AMS pages ==\n");
+	for (int idx = 0; idx < PROFILE_AMS_PAGES; idx++) {
+		if (NULL == pPageCycles[idx]) continue;
+		int nFirst = nList;
+		// the CPU address within the 4k page isn't known any more, so the
+		// location keeps the offset and the report shows the page
+		GatherCounts(pPageCycles[idx], 0x800, PROFILE_LOC_AMS | (idx << 16), 1, pList, nList);
+		ProfileCount nSum = 0;
+		for (int i2 = nFirst; i2 < nList; i2++) nSum += pList[i2].nCycles;
+		fprintf(fp, "  page >%03X  %14I64u %6.2f%%\n", idx, nSum, Percent(nSum));
+	}
+
+	qsort(pList, nList, sizeof(ProfileEntry), CompareEntries);
+
+	fprintf(fp, "\n== Instructions (top %d) ==\n", PROFILE_TOP);
+	fprintf(fp, "        cycles      %%   location      disassembly                      symbol\n");
+	for (int idx = 0; (idx < nList) && (idx < PROFILE_TOP); idx++) {
+		char szLoc[64], szDasm[256], szSym[64] = "";
+		DWord nLoc = pList[idx].nLoc;
+		Word nPC = nLoc & 0xffff;
+
+		if (nLoc & PROFILE_LOC_AMS) {
+			sprintf(szLoc, "AMS%03X:x%03X", (nLoc >> 16) & 0x1fff, nPC & 0xfff);
+		} else if (nLoc & PROFILE_LOC_BANK) {
+			sprintf(szLoc, "(%d)>%04X", (nLoc >> 16) & 0x1fff, nPC);
+		} else {
+			sprintf(szLoc, ">%04X", nPC);
+		}
+		ProfileDasm(nLoc, szDasm);
+		if (0 == (nLoc & PROFILE_LOC_AMS)) {
+			ProfileSymbol *pSym = FindSymbol(nPC);
+			if ((NULL != pSym) && (nPC - pSym->nAddress < 0x400)) {
+				if (nPC == pSym->nAddress) {
+					sprintf(szSym, "%s", pSym->szName);
+				} else {
+					sprintf(szSym, "%s+>%X", pSym->szName, nPC - pSym->nAddress);
+				}
+			}
+		}
+		fprintf(fp, "%14I64u %6.2f%%  %-13s %-32s %s\n", pList[idx].nCycles, Percent(pList[idx].nCycles), szLoc, szDasm, szSym);
+	}
+
+	// GPL
+	nList = 0;
+	GatherCounts(pGromCycles, 0x10000, 0, 0, pList, nList);
+	qsort(pList, nList, sizeof(ProfileEntry), CompareEntries);
+	fprintf(fp, "\n== Console ROM time by GROM address (GPL, top %d) ==\n", PROFILE_TOP);
+	fprintf(fp, "  total in console ROM %14I64u %6.2f%%\n", nGplCycles, Percent(nGplCycles));
+	for (int idx = 0; (idx < nList) && (idx < PROFILE_TOP); idx++) {
+		fprintf(fp, "  G>%04X  %14I64u %6.2f%%\n", pList[idx].nLoc, pList[idx].nCycles, Percent(pList[idx].nCycles));
+	}
+
+	free(pList);
+}
+
+// Functions are summed over every place they appear in the call tree.
+// Totals skip nodes that are inside another call of the same function,
+// so recursion isn't counted twice.
+static void WriteCallGraph(FILE *fp) {
+	// children are always created after their parents, so one pass
+	// backwards fills in the totals
+	for (int idx = 0; idx < nNodes; idx++) pNodes[idx].nTotal = pNodes[idx].nSelf;
+	for (int idx = nNodes-1; idx > 0; idx--) pNodes[pNodes[idx].nParent].nTotal += pNodes[idx].nTotal;
+
+	ProfileEntry *pFuncs = (ProfileEntry*)malloc(nNodes * sizeof(ProfileEntry));
+	ProfileCount *pSelf = (ProfileCount*)malloc(nNodes * sizeof(ProfileCount));
+	if ((NULL == pFuncs) || (NULL == pSelf)) {
+		fprintf(fp, "Out of memory for the call graph\n");
+		free(pFuncs);
+		free(pSelf);
+		return;
+	}
+
+	// group the nodes by function
+	for (int idx = 1; idx < nNodes; idx++) {
+		pFuncs[idx-1].nLoc = pNodes[idx].nLoc;
+		pFuncs[idx-1].nCycles = idx;
+	}
+	qsort(pFuncs, nNodes-1, sizeof(ProfileEntry), CompareLocations);
+
+	int nFuncs = 0;
+	for (int idx = 0; idx < nNodes-1; idx++) {
+		int nNode = (int)pFuncs[idx].nCycles;
+		DWord nLoc = pNodes[nNode].nLoc;
+		bool bNested = false;
+		for (int nUp = pNodes[nNode].nParent; nUp > 0; nUp = pNodes[nUp].nParent) {
+			if (pNodes[nUp].nLoc == nLoc) {
+				bNested = true;
+				break;
+			}
+		}
+		if ((0 == nFuncs) || (pFuncs[nFuncs-1].nLoc != nLoc)) {
+			// safe to reuse the list in place, we never write ahead of idx
+			pFuncs[nFuncs].nLoc = nLoc;
+			pFuncs[nFuncs].nCycles = 0;
+			pSelf[nFuncs] = 0;
+			++nFuncs;
+		}
+		if (!bNested) pFuncs[nFuncs-1].nCycles += pNodes[nNode].nTotal;
+		pSelf[nFuncs-1] += pNodes[nNode].nSelf;
+	}
+
+	// sorting would lose the self counts, so sort an index instead
+	ProfileEntry *pOrder = (ProfileEntry*)malloc((nFuncs+1) * sizeof(ProfileEntry));
+	if (NULL == pOrder) {
+		fprintf(fp, "Out of memory for the call graph\n");
+		free(pFuncs);
+		free(pSelf);
+		return;
+	}
+	for (int idx = 0; idx < nFuncs; idx++) {
+		pOrder[idx].nLoc = idx;
+		pOrder[idx].nCycles = pFuncs[idx].nCycles;
+	}
+	qsort(pOrder, nFuncs, sizeof(ProfileEntry), CompareEntries);
+
+	fprintf(fp, "\n== Functions (top %d by total, entered by BL/BLWP/XOP/interrupt) ==\n", PROFILE_TOP_FUNCS);
+	fprintf(fp, "  not in any call  %14I64u %6.2f%%\n", pNodes[0].nSelf, Percent(pNodes[0].nSelf));
+	for (int idx = 0; (idx < nFuncs) && (idx < PROFILE_TOP_FUNCS); idx++) {
+		int nFunc = pOrder[idx].nLoc;
+		DWord nLoc = pFuncs[nFunc].nLoc;
+		char szName[64];
+
+		ProfileName(nLoc, szName);
+		fprintf(fp, "\n%-24s total %14I64u %6.2f%%  self %14I64u %6.2f%%\n", szName,
+			pFuncs[nFunc].nCycles, Percent(pFuncs[nFunc].nCycles), pSelf[nFunc], Percent(pSelf[nFunc]));
+
+		// callees, summed over every call site
+		ProfileEntry Callees[32];
+		int nCallees = 0;
+		for (int i2 = 1; i2 < nNodes; i2++) {
+			if (pNodes[pNodes[i2].nParent].nLoc != nLoc) continue;
+			int i3;
+			for (i3 = 0; i3 < nCallees; i3++) {
+				if (Callees[i3].nLoc == pNodes[i2].nLoc) break;
+			}
+			if (i3 == nCallees) {
+				if (nCallees >= 32) continue;
+				Callees[i3].nLoc = pNodes[i2].nLoc;
+				Callees[i3].nCycles = 0;
+				++nCallees;
+			}
+			Callees[i3].nCycles += pNodes[i2].nTotal;
+		}
+		qsort(Callees, nCallees, sizeof(ProfileEntry), CompareEntries);
+		for (int i2 = 0; i2 < nCallees; i2++) {
+			ProfileName(Callees[i2].nLoc, szName);
+			fprintf(fp, "    -> %-24s %14I64u %6.2f%%\n", szName, Callees[i2].nCycles, Percent(Callees[i2].nCycles));
+		}
+	}
+
+	free(pOrder);
+	free(pSelf);
+	free(pFuncs);
+}
+
+// one line per call stack: "frame;frame;frame cycles"
+static void WriteFoldedStacks(FILE *fp) {
+	int nStack[PROFILE_MAX_DEPTH+1];
+
+	for (int idx = 0; idx < nNodes; idx++) {
+		if (0 == pNodes[idx].nSelf) continue;
+
+		int nCount = 0;
+		for (int nUp = idx; (nUp > 0) && (nCount < PROFILE_MAX_DEPTH+1); nUp = pNodes[nUp].nParent) {
+			nStack[nCount++] = nUp;
+		}
+		if (0 == nCount) {
+			fprintf(fp, "[top] %I64u\n", pNodes[idx].nSelf);
+			continue;
+		}
+		while (nCount > 0) {
+			char szName[64];
+			int nNode = nStack[--nCount];
+			ProfileName(pNodes[nNode].nLoc, szName);
+			fprintf(fp, "%s%s%c", pNodes[nNode].bInterrupt ? "[int]" : "", szName, (nCount > 0) ? ';' : ' ');
+		}
+		fprintf(fp, "%I64u\n", pNodes[idx].nSelf);
+	}
+}
+
+static void FreeProfile() {
+	free(pFlatCycles);
+	pFlatCycles = NULL;
+	free(pGromCycles);
+	pGromCycles = NULL;
+	for (int idx = 0; idx < PROFILE_BANKS; idx++) {
+		free(pBankCycles[idx]);
+		pBankCycles[idx] = NULL;
+	}
+	for (int idx = 0; idx < PROFILE_AMS_PAGES; idx++) {
+		free(pPageCycles[idx]);
+		pPageCycles[idx] = NULL;
+	}
+	free(pNodes);
+	pNodes = NULL;
+	free(pSymbols);
+	pSymbols = NULL;
+	nSymbols = 0;
+}
+
+// Start counting. The reports go to pBaseName.txt and pBaseName.folded
+// when the profile is stopped. pSymbolFile may be NULL.
+bool StartProfile(const char *pBaseName, const char *pSymbolFile) {
+	if (bProfileActive) {
+		StopProfile();
+	}
+
+	pFlatCycles = (ProfileCount*)calloc(0x10000, sizeof(ProfileCount));
+	pGromCycles = (ProfileCount*)calloc(0x10000, sizeof(ProfileCount));
+	pNodes = (ProfileNode*)malloc(PROFILE_MAX_NODES * sizeof(ProfileNode));
+	if ((NULL == pFlatCycles) || (NULL == pGromCycles) || (NULL == pNodes)) {
+		FreeProfile();
+		return false;
+	}
+
+	strncpy(szProfileBase, pBaseName, sizeof(szProfileBase));
+	szProfileBase[sizeof(szProfileBase)-1] = '\0';
+	if ((NULL != pSymbolFile) && (pSymbolFile[0] != '\0')) {
+		LoadProfileSymbols(pSymbolFile);
+	}
+
+	nTotalCycles = 0;
+	nTotalInstructions = 0;
+	nGplCycles = 0;
+	pNodes[0].nLoc = PROFILE_LOC_ROOT;
+	pNodes[0].nParent = -1;
+	pNodes[0].nChild = -1;
+	pNodes[0].nSibling = -1;
+	pNodes[0].bInterrupt = false;
+	pNodes[0].nSelf = 0;
+	nNodes = 1;
+	nDepth = 0;
+	nCurrentNode = 0;
+
+	MemoryBarrier();
+	bProfileActive = true;
+	debug_write("Profiling started");
+	return true;
+}
+
+// Stop counting and write the reports
+void StopProfile() {
+	if (!bProfileActive) {
+		return;
+	}
+
+	// wait for the CPU thread to be out of the profiler
+	bProfileActive = false;
+	MemoryBarrier();
+	while (bProfileBusy) {
+		Sleep(1);
+	}
+
+	char szFile[MAX_PATH+16];
+	sprintf(szFile, "%s.txt", szProfileBase);
+	FILE *fp = fopen(szFile, "w");
+	if (NULL == fp) {
+		debug_write("Can't write profile to %s", szFile);
+	} else {
+		fprintf(fp, "Classic99 profile - %I64u instructions, %I64u cycles\n", nTotalInstructions, nTotalCycles);
+		if (nNodes >= PROFILE_MAX_NODES) {
+			fprintf(fp, "(call tree was full - later calls were charged to their callers)\n");
+		}
+		WriteFlatReport(fp);
+		WriteCallGraph(fp);
+		fclose(fp);
+	}
+
+	sprintf(szFile, "%s.folded", szProfileBase);
+	fp = fopen(szFile, "w");
+	if (NULL == fp) {
+		debug_write("Can't write profile to %s", szFile);
+	} else {
+		WriteFoldedStacks(fp);
+		fclose(fp);
+	}
+
+	debug_write("Profile of %I64u cycles written to %s.txt and %s.folded", nTotalCycles, szProfileBase, szProfileBase);
+	FreeProfile();
+}
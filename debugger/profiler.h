@@ -0,0 +1,50 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Execution profiler - counts the cycles of every CPU instruction
+// against its address (and cartridge bank or AMS page), the GROM
+// address the GPL interpreter is working on, and a call tree built
+// from BL, BLWP, XOP, interrupts and their returns. When stopped it
+// writes a text report and a folded stack file for flamegraph.pl.
+//
+
+extern volatile bool bProfileActive;	// the CPU is being profiled
+
+bool StartProfile(const char *pBaseName, const char *pSymbolFile);
+void StopProfile();
+void ProfileInstruction(Word nPC, int nBank, Word nOp, Word nOldWP, int nCycles);
+void ProfileInterrupt(Word nNewPC, Word nReturnPC, Word nReturnWP);
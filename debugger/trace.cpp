@@ -0,0 +1,410 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Binary execution trace
+//
+// The emulation thread fills in fixed size records in a ring, and a
+// writer thread drains the ring to disk in large blocks. Nothing is
+// disassembled or formatted while running - DecodeTraceFile does that
+// afterwards from the words captured with each instruction.
+// Only the emulation thread writes the ring. Events raised on other
+// threads (the UI halting or resetting the CPU) are parked and written
+// by the emulation thread before its next record. If the writer falls
+// behind, records are dropped and counted rather than stalling the
+// emulation, and a TRACE_DROPPED record marks the gap.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <process.h>
+
+#include "tiemul.h"
+#include "cpu9900.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE (1<<20)		// records, MUST be a power of 2 (18MB)
+#define TRACE_CHUNK (1<<14)			// wake the writer every this many records
+#define TRACE_PENDING 16			// events parked from other threads
+
+extern CPU9900 *pGPU;
+extern volatile unsigned long total_cycles;
+
+volatile bool bTraceActive = false;
+bool bTraceWrites = false;
+
+static TraceRecord *pTraceRing = NULL;
+static volatile LONG nTraceHead = 0;		// emulation thread only
+static volatile LONG nTraceTail = 0;		// writer thread only
+static FILE *fpTrace = NULL;
+static HANDLE hTraceWake = NULL;			// auto-reset, wakes the writer
+static HANDLE hTraceDone = NULL;			// writer has exited
+static volatile bool bTraceQuit = false;
+static unsigned long nTraceLastCycles = 0;
+static unsigned int nTraceRecords = 0;
+static DWORD nTraceThread = 0;				// the emulation thread
+static volatile LONG nTraceDropped = 0;		// records lost this trace
+static DWord nTraceDropPending = 0;			// lost since the last TRACE_DROPPED record
+static CRITICAL_SECTION csTracePending;
+static bool bTracePendingInit = false;
+static TraceRecord TracePending[TRACE_PENDING];
+static volatile LONG nTracePending = 0;
+static volatile LONG nTraceReset = 0;		// set by StartTrace, cleared by the emulation thread once the ring is empty
+
+// write out everything that has been committed so far
+static void TraceDrain() {
+	if (nTraceReset) {
+		// the emulation thread hasn't emptied the ring for this trace yet
+		return;
+	}
+	LONG nHead = nTraceHead;
+	MemoryBarrier();
+	while (nTraceTail != nHead) {
+		LONG nStart = nTraceTail & (TRACE_RING_SIZE-1);
+		LONG nCount = nHead - nTraceTail;
+		if (nStart + nCount > TRACE_RING_SIZE) {
+			nCount = TRACE_RING_SIZE - nStart;
+		}
+		if (fwrite(&pTraceRing[nStart], sizeof(TraceRecord), nCount, fpTrace) != (size_t)nCount) {
+			debug_write("Trace file write failed - stopping trace.");
+			bTraceActive = false;
+		}
+		nTraceRecords += nCount;
+		// done with the records before handing the space back
+		MemoryBarrier();
+		nTraceTail += nCount;
+	}
+}
+
+static void __cdecl TraceWriterThread(void *) {
+	while (!bTraceQuit) {
+		WaitForSingleObject(hTraceWake, 100);
+		TraceDrain();
+	}
+	TraceDrain();
+	SetEvent(hTraceDone);
+}
+
+// publish the record from TraceAlloc
+static inline void TraceCommit() {
+	MemoryBarrier();
+	LONG nHead = nTraceHead + 1;
+	nTraceHead = nHead;
+	if (0 == (nHead & (TRACE_CHUNK-1))) {
+		SetEvent(hTraceWake);
+	}
+}
+
+// Empty the ring for a new trace. Only the emulation thread moves the head,
+// and the writer leaves the tail alone until nTraceReset is clear, so this
+// is the one place both can be zeroed. Anything left over from the last
+// trace (like a record that was being finished when it stopped) goes too.
+static void TraceApplyReset() {
+	nTraceHead = 0;
+	nTraceTail = 0;
+	nTraceDropPending = 0;
+	nTraceLastCycles = total_cycles;
+	MemoryBarrier();
+	nTraceReset = 0;
+}
+
+// get the next free record, or NULL (and count it) if the ring is full
+static inline TraceRecord *TraceAlloc() {
+	if (nTraceReset) {
+		TraceApplyReset();
+	}
+	// if records were lost, keep a slot for the record saying so
+	LONG nNeed = nTraceDropPending ? 2 : 1;
+	if (nTraceHead - nTraceTail > TRACE_RING_SIZE - nNeed) {
+		InterlockedIncrement(&nTraceDropped);
+		++nTraceDropPending;
+		SetEvent(hTraceWake);
+		return NULL;
+	}
+	if (nTraceDropPending) {
+		TraceRecord *pRec = &pTraceRing[nTraceHead & (TRACE_RING_SIZE-1)];
+		memset(pRec, 0, sizeof(TraceRecord));
+		pRec->nFlags = TRACE_DROPPED;
+		pRec->nOp[0] = (Word)(nTraceDropPending & 0xffff);
+		pRec->nOp[1] = (Word)(nTraceDropPending >> 16);
+		TraceCommit();
+		nTraceDropPending = 0;
+	}
+	return &pTraceRing[nTraceHead & (TRACE_RING_SIZE-1)];
+}
+
+// write out anything parked by the other threads - emulation thread only
+static void TraceFlushPending() {
+	EnterCriticalSection(&csTracePending);
+	for (int idx=0; idx<nTracePending; idx++) {
+		TraceRecord *pRec = TraceAlloc();
+		if (NULL == pRec) continue;
+		*pRec = TracePending[idx];
+		TraceCommit();
+	}
+	nTracePending = 0;
+	LeaveCriticalSection(&csTracePending);
+}
+
+static inline Word TraceCycles() {
+	unsigned long nNow = total_cycles;
+	unsigned long nDiff = nNow - nTraceLastCycles;
+	nTraceLastCycles = nNow;
+	return (Word)((nDiff > 0xffff) ? 0xffff : nDiff);
+}
+
+bool StartTrace(const char *pFile, bool bWithWrites) {
+	if (bTraceActive) {
+		StopTrace();
+	}
+
+	fpTrace = fopen(pFile, "wb");
+	if (NULL == fpTrace) {
+		return false;
+	}
+
+	TraceHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.szMagic, TRACE_MAGIC, sizeof(hdr.szMagic));
+	hdr.nVersion = TRACE_VERSION;
+	hdr.nRecordSize = sizeof(TraceRecord);
+	fwrite(&hdr, sizeof(hdr), 1, fpTrace);
+
+	if (NULL == pTraceRing) {
+		// kept for the life of the program, the emulation may still be
+		// finishing a record when a trace is stopped
+		pTraceRing = (TraceRecord*)malloc(sizeof(TraceRecord) * TRACE_RING_SIZE);
+		hTraceWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+		hTraceDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (NULL == pTraceRing) {
+			fclose(fpTrace);
+			fpTrace = NULL;
+			return false;
+		}
+	}
+
+	// the ring belongs to the emulation thread, so ask it to empty it at its
+	// next record rather than touching the head from here. The old writer has
+	// exited, and the new one waits for that before it writes anything.
+	InterlockedExchange(&nTraceReset, 1);
+	nTraceRecords = 0;
+	nTraceDropped = 0;
+	if (bTracePendingInit) {
+		EnterCriticalSection(&csTracePending);
+		nTracePending = 0;
+		LeaveCriticalSection(&csTracePending);
+	}
+	bTraceQuit = false;
+	ResetEvent(hTraceDone);
+	if (-1 == _beginthread(TraceWriterThread, 0, NULL)) {
+		fclose(fpTrace);
+		fpTrace = NULL;
+		return false;
+	}
+
+	bTraceWrites = bWithWrites;
+	bTraceActive = true;
+	debug_write("Tracing to %s", pFile);
+	return true;
+}
+
+void StopTrace() {
+	if (NULL == fpTrace) {
+		return;
+	}
+
+	bTraceActive = false;
+	bTraceQuit = true;
+	SetEvent(hTraceWake);
+	WaitForSingleObject(hTraceDone, INFINITE);
+
+	fclose(fpTrace);
+	fpTrace = NULL;
+	debug_write("Trace closed, %u records written", nTraceRecords);
+	if (nTraceDropped) {
+		debug_write("Trace writer fell behind, %u records were dropped", nTraceDropped);
+	}
+}
+
+// called once from the emulation thread, the only one allowed to write the ring
+void TraceSetThread() {
+	if (!bTracePendingInit) {
+		InitializeCriticalSection(&csTracePending);
+		bTracePendingInit = true;
+	}
+	nTraceThread = GetCurrentThreadId();
+	if (nTraceReset) {
+		TraceApplyReset();
+	}
+}
+
+// record the instruction the CPU is about to execute
+void TraceInstruction(CPU9900 *pCpu, int nBank) {
+	if (nTracePending) {
+		TraceFlushPending();
+	}
+
+	TraceRecord *pRec = TraceAlloc();
+	if (NULL == pRec) return;
+
+	Word PC = pCpu->GetPC();
+	pRec->nPC = PC;
+	pRec->nOp[0] = pCpu->GetSafeWord(PC, nBank);
+	pRec->nOp[1] = pCpu->GetSafeWord(PC+2, nBank);
+	pRec->nOp[2] = pCpu->GetSafeWord(PC+4, nBank);
+	pRec->nWP = pCpu->GetWP();
+	pRec->nST = pCpu->GetST();
+	pRec->nFlags = (pCpu == pGPU) ? TRACE_GPU : 0;
+	pRec->nBank = (Word)nBank;
+	pRec->nCycles = TraceCycles();
+
+	TraceCommit();
+}
+
+// record an interrupt, breakpoint or memory write
+void TraceEvent(Byte nFlags, Word nAddress, Word nData) {
+	if (GetCurrentThreadId() != nTraceThread) {
+		// not the emulation thread - park it for the emulation thread to write
+		if (!bTracePendingInit) return;
+		EnterCriticalSection(&csTracePending);
+		if (nTracePending < TRACE_PENDING) {
+			TraceRecord *pRec = &TracePending[nTracePending];
+			memset(pRec, 0, sizeof(TraceRecord));
+			pRec->nPC = nAddress;
+			pRec->nOp[0] = nData;
+			pRec->nFlags = nFlags;
+			++nTracePending;
+		} else {
+			InterlockedIncrement(&nTraceDropped);
+		}
+		LeaveCriticalSection(&csTracePending);
+		return;
+	}
+
+	if (nTracePending) {
+		TraceFlushPending();
+	}
+
+	TraceRecord *pRec = TraceAlloc();
+	if (NULL == pRec) return;
+
+	memset(pRec, 0, sizeof(TraceRecord));
+	pRec->nPC = nAddress;
+	pRec->nOp[0] = nData;
+	pRec->nFlags = nFlags;
+	pRec->nCycles = TraceCycles();
+
+	TraceCommit();
+}
+
+// Convert a trace file to text. Output goes to stdout if pOut is NULL.
+// Returns 0 on success, like a command line tool.
+int DecodeTraceFile(const char *pIn, const char *pOut) {
+	FILE *fp = fopen(pIn, "rb");
+	if (NULL == fp) {
+		printf("Can't open trace file '%s'\n", pIn);
+		return 1;
+	}
+
+	TraceHeader hdr;
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) || (0 != memcmp(hdr.szMagic, TRACE_MAGIC, sizeof(hdr.szMagic)))) {
+		printf("'%s' is not a Classic99 trace file\n", pIn);
+		fclose(fp);
+		return 1;
+	}
+	if ((hdr.nVersion != TRACE_VERSION) || (hdr.nRecordSize != sizeof(TraceRecord))) {
+		printf("'%s' is trace version %d, expected %d\n", pIn, hdr.nVersion, TRACE_VERSION);
+		fclose(fp);
+		return 1;
+	}
+
+	FILE *fo = stdout;
+	if (NULL != pOut) {
+		fo = fopen(pOut, "w");
+		if (NULL == fo) {
+			printf("Can't create '%s'\n", pOut);
+			fclose(fp);
+			return 1;
+		}
+	}
+
+	TraceRecord rec;
+	unsigned __int64 nCycles = 0;
+	unsigned int nCount = 0;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		nCycles += rec.nCycles;
+
+		if (rec.nFlags & TRACE_INTERRUPT) {
+			fprintf(fo, "**** Interrupt Trigger, vector >%04X (%s), level %d\n",
+				rec.nPC,
+				(rec.nPC==0)?"reset":(rec.nPC==4)?"console":(rec.nPC==0xfffc)?"load":"unknown",
+				rec.nOp[0]);
+			continue;
+		}
+		if (rec.nFlags & TRACE_BREAK) {
+			fprintf(fo, "**** Breakpoint triggered\n");
+			continue;
+		}
+		if (rec.nFlags & TRACE_DROPPED) {
+			fprintf(fo, "**** %u records dropped, the trace writer fell behind\n", rec.nOp[0] | ((DWord)rec.nOp[1]<<16));
+			continue;
+		}
+		if (rec.nFlags & TRACE_WRITE) {
+			fprintf(fo, "           >%04X <- >%02X\n", rec.nPC, rec.nOp[0]&0xff);
+			continue;
+		}
+
+		char buf[1024];
+		int nBank = (rec.nFlags & TRACE_GPU) ? -1 : rec.nBank;
+		sprintf(buf, "%04X   ", rec.nPC);
+		Dasm9900Words(&buf[5], rec.nPC, nBank, rec.nOp);
+		if (rec.nFlags & TRACE_GPU) {
+			fprintf(fo, "(GPU) %-36s WP=%04X ST=%04X %I64u\n", buf, rec.nWP, rec.nST, nCycles);
+		} else {
+			fprintf(fo, "(%d) %-38s WP=%04X ST=%04X %I64u\n", rec.nBank, buf, rec.nWP, rec.nST, nCycles);
+		}
+		++nCount;
+	}
+
+	if (NULL != pOut) {
+		fclose(fo);
+		printf("Decoded %u instructions from '%s' to '%s'\n", nCount, pIn, pOut);
+	}
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,88 @@
+//
+// (C) 2009 Mike Brent aka Tursi aka HarmlessLion.com
+// This software is provided AS-IS. No warranty
+// express or implied is provided.
+//
+// This notice defines the entire license for this code.
+// All rights not explicity granted here are reserved by the
+// author.
+//
+// You may redistribute this software provided the original
+// archive is UNCHANGED and a link back to my web page,
+// http://harmlesslion.com, is provided as the author's site.
+// It is acceptable to link directly to a subpage at harmlesslion.com
+// provided that page offers a URL for that purpose
+//
+// Source code, if available, is provided for educational purposes
+// only. You are welcome to read it, learn from it, mock
+// it, and hack it up - for your own use only.
+//
+// Please contact me before distributing derived works or
+// ports so that we may work out terms. I don't mind people
+// using my code but it's been outright stolen before. In all
+// cases the code must maintain credit to the original author(s).
+//
+// -COMMERCIAL USE- Contact me first. I didn't make
+// any money off it - why should you? ;) If you just learned
+// something from this, then go ahead. If you just pinched
+// a routine or two, let me know, I'll probably just ask
+// for credit. If you want to derive a commercial tool
+// or use large portions, we need to talk. ;)
+//
+// If this, itself, is a derived work from someone else's code,
+// then their original copyrights and licenses are left intact
+// and in full force.
+//
+// http://harmlesslion.com - visit the web page for contact info
+//
+// Binary execution trace - a fixed size record per instruction,
+// queued to a ring and written out by a background thread, so
+// tracing costs a few stores per instruction instead of a
+// disassembly and a formatted write. Use "-tracedump" on the
+// command line to turn a trace file back into text.
+//
+
+class CPU9900;
+
+#define TRACE_MAGIC "C99TRACE"
+#define TRACE_VERSION 3
+
+// record flags
+#define TRACE_GPU		0x01	// executed by the F18A GPU
+#define TRACE_INTERRUPT	0x02	// interrupt taken - nPC is the vector, nOp[0] the level
+#define TRACE_BREAK		0x04	// breakpoint triggered at nPC
+#define TRACE_WRITE		0x08	// CPU memory write - nPC is the address, nOp[0] the byte
+#define TRACE_DROPPED	0x10	// the writer fell behind - nOp[0..1] is the count of records lost (low word first)
+
+#pragma pack(push, 1)
+struct TraceHeader {
+	char szMagic[8];			// TRACE_MAGIC
+	Word nVersion;				// TRACE_VERSION
+	Word nRecordSize;			// sizeof(TraceRecord)
+	DWord nFlags;				// reserved
+};
+
+struct TraceRecord {
+	Word nPC;					// address of the instruction
+	Word nOp[3];				// the opcode and the two words after it
+	Word nWP;
+	Word nST;
+	Byte nFlags;				// TRACE_xxx
+	Byte nReserved;				// keeps the words after it aligned
+	Word nBank;					// cartridge bank
+	Word nCycles;				// CPU cycles since the previous record
+};
+#pragma pack(pop)
+
+// the file format and the ring size both depend on this
+static_assert(sizeof(TraceRecord) == 18, "TraceRecord must stay 18 bytes");
+
+extern volatile bool bTraceActive;		// an instruction trace is being written
+extern bool bTraceWrites;				// also record CPU memory writes
+
+bool StartTrace(const char *pFile, bool bWithWrites);
+void StopTrace();
+void TraceSetThread();
+void TraceInstruction(CPU9900 *pCpu, int nBank);
+void TraceEvent(Byte nFlags, Word nAddress, Word nData);
+int DecodeTraceFile(const char *pIn, const char *pOut);
@@ -41,10 +41,32 @@
 #include <io.h>
 #include <atlstr.h>
 #include <time.h>
+#include <map>
+#include <vector>
 #include "tiemul.h"
 #include "diskclass.h"
 #include "fiaddisk.h"
 
+// Directory index - every host file in the folder, with what DetectImageType
+// found in its header. An entry is only read again when the host file's size or
+// write time changes, and the folder is only swept again when Windows tells us
+// something in it changed (or every time, if it can't tell us, like some network
+// shares). This serves the catalog and the header lookups for open.
+struct FiadIndexEntry {
+	DWORD nSizeLow, nSizeHigh;
+	FILETIME ftWrite;
+	FileInfo info;							// csName is the host filename
+};
+
+struct FiadIndex {
+	CString csPath;							// folder the index is for
+	HANDLE hChange;							// change notification, INVALID_HANDLE_VALUE if none
+	bool bNoNotify;							// the folder can't give us one, don't keep asking
+	bool bValid;							// the last sweep was complete
+	std::map<CString, FiadIndexEntry> files;	// keyed by upper case host filename
+	std::vector<CString> order;				// the order FindFirstFile returned them, for the catalog
+};
+
 // on the day this changes (for instance, we support
 // direct access to RAW files, etc), add a headersize
 // variable to FileInfo and make sure the detection code
@@ -71,19 +93,14 @@ FiadDisk::FiadDisk() {
 	bEnableLongFilenames = false;
 	bAllowMore127Files = false;
 
-	nCachedDrive=-1;
-	pCachedFiles=NULL;
-	tCachedTime=(time_t)0;
-	nCachedCount=0;
+	pIndex=NULL;
+	bSweeping=false;
 }
 
 FiadDisk::~FiadDisk() {
-	if (NULL != pCachedFiles) {
-		// this should placement delete through the array...
-		// really we should array new the whole thing.
-		free(pCachedFiles);
-		pCachedFiles=NULL;
-	}
+	DropIndex();
+	delete pIndex;
+	pIndex=NULL;
 }
 
 // powerup routine
@@ -101,6 +118,12 @@ const char *FiadDisk::GetPath() {
 
 // handle options
 void FiadDisk::SetOption(int nOption, int nValue) {
+	// most of these change how files are detected
+	if (NULL != pIndex) {
+		pIndex->bValid = false;
+		pIndex->files.clear();
+	}
+
 	switch (nOption) {
 		case OPT_FIAD_WRITEV9T9:	
 			bWriteV9T9 = nValue?true:false;
@@ -351,6 +374,7 @@ bool FiadDisk::CreateOutputFile(FileInfo *pFile) {
 	}
 
 	// see if we can open the file at all
+	ForgetHostIndex(csFileName);
 	fp=fopen(csFileName, "wb");
 	if (NULL == fp) {
 		// No, we failed
@@ -409,45 +433,53 @@ bool FiadDisk::TryOpenFile(FileInfo *pFile) {
 	FILE *fp=NULL;
 	FileInfo lclInfo;
 
-	switch (nMode) {
-		case FLAG_UPDATE:
-			pMode="update";
-			fp=fopen(csFileName, "r+b");
-			break;
+	// there should be no data to copy as we are just opening the file
+	lclInfo.CopyFileInfo(pFile, false);
 
-		case FLAG_APPEND:
-			pMode="append";
-            // we have to check explicitly for existence first, because 'append' will always create
-            // the file for us, but we behave slightly differently when we create it! We need to fail
-            // in this case so our caller will create a new file
-            if (PathFileExists(csFileName)) {
-    			fp=fopen(csFileName, "ab");
-            }
-			break;
+	// for input, the directory index can usually vouch for the file and its
+	// header, so we don't need to open it to check it's there and then again
+	// to read the header
+	bool bIndexed = (nMode == FLAG_INPUT) && (lclInfo.csOptions.IsEmpty()) && (FindInIndex(&lclInfo, csFileName));
 
-		case FLAG_INPUT:
-			pMode="input";
-			fp=fopen(csFileName, "rb");
-			break;
+	if (!bIndexed) {
+		switch (nMode) {
+			case FLAG_UPDATE:
+				pMode="update";
+				fp=fopen(csFileName, "r+b");
+				break;
 
-		default:
-			debug_write("Unknown mode - can't open.");
-			pMode="unknown";
-	}
+			case FLAG_APPEND:
+				pMode="append";
+	            // we have to check explicitly for existence first, because 'append' will always create
+	            // the file for us, but we behave slightly differently when we create it! We need to fail
+	            // in this case so our caller will create a new file
+	            if (PathFileExists(csFileName)) {
+	    			fp=fopen(csFileName, "ab");
+	            }
+				break;
 
-	if (NULL == fp) {
-		debug_write("Can't open %s for %s, errno %d.", (LPCSTR)csFileName, pMode, errno);
-		pFile->LastError = ERR_FILEERROR;
-		return false;
-	}
+			case FLAG_INPUT:
+				pMode="input";
+				fp=fopen(csFileName, "rb");
+				break;
 
-	// we got the file, but we need to read the header and determine the
-	// filetype. For that we close and let the universal function handle it.
-	fclose(fp);
+			default:
+				debug_write("Unknown mode - can't open.");
+				pMode="unknown";
+		}
+
+		if (NULL == fp) {
+			debug_write("Can't open %s for %s, errno %d.", (LPCSTR)csFileName, pMode, errno);
+			pFile->LastError = ERR_FILEERROR;
+			return false;
+		}
+
+		// we got the file, but we need to read the header and determine the
+		// filetype. For that we close and let the universal function handle it.
+		fclose(fp);
 	
-	// there should be no data to copy as we are just opening the file
-	lclInfo.CopyFileInfo(pFile, false);
-	DetectImageType(&lclInfo, csFileName);
+		DetectImageType(&lclInfo, csFileName);
+	}
 
 	if (lclInfo.ImageType == IMAGE_UNKNOWN) {
 		debug_write("%s is an unknown file type - can not open.", (LPCSTR)lclInfo.csName);
@@ -522,6 +554,11 @@ void FiadDisk::DetectImageType(FileInfo *pFile, CString csFileName) {
 		}
 	}
 
+	// headers the directory index already has don't need the file opened
+	if ((pFile->csOptions.IsEmpty()) && (FindInIndex(pFile, csFileName))) {
+		return;
+	}
+
 	// there are four options currently supported here:
 	// TIFILES, V9T9, Windows Text, and Windows image
 	// Configuration switches may disable any of these!
@@ -872,6 +909,16 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 		pFile->pData = (unsigned char*)malloc(pFile->nDataSize);
 	}
 
+	// Index where each record sits in the host file as we go, so that a
+	// flush can write back only what changed. The index is only kept if
+	// the whole file reads back cleanly.
+	FreeRecordIndex(pFile);
+	int nAlloc = (pFile->Status & FLAG_VARIABLE) ? 100 : pFile->NumberRecords+1;
+	RecordSpan *pRecords = (RecordSpan*)malloc(nAlloc*sizeof(RecordSpan));
+	int nPos = HEADERSIZE;			// host file offset we are reading from
+	int nTailPos = 0;				// where the next new record would go
+	int nTailSector = 0;
+
 	idx=0;							// count up the records read
 	nSector=256;					// bytes left in this sector
 	fseek(fp, HEADERSIZE, SEEK_SET);// skip the header
@@ -882,6 +929,8 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 		if (feof(fp)) {
 			debug_write("Premature EOF - truncating read at record %d.", idx);
 			pFile->NumberRecords = idx;
+			free(pRecords);
+			pRecords = NULL;
 			break;
 		}
 
@@ -891,13 +940,20 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 			if (EOF == nLen) {
 				debug_write("Corrupt file - truncating read at record %d.", idx);
 				pFile->NumberRecords = idx;
+				free(pRecords);
+				pRecords = NULL;
 				break;
 			}
 
 			nSector--;
+			nPos++;
 			if (nLen==0xff) {
 				// end of sector indicator, no record read, skip rest of sector
+				// (a new record would replace the marker, so remember where it is)
+				nTailPos = nPos-1;
+				nTailSector = nSector+1;
 				fread(tmpbuf, 1, nSector, fp);
+				nPos += nSector;
 				nSector=256;
 				pFile->NumberRecords--;
 				// are we done?
@@ -916,6 +972,7 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
                     if (NULL == pTmp) {
                         debug_write("BufferFIAD failed to allocate memory for data, failing.");
                         pFile->LastError = ERR_FILEERROR;
+                        free(pRecords);
                         fclose(fp);
                         return false;
                     }
@@ -923,6 +980,17 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 
 					pData = pFile->pData + nOffset;
 				}
+
+				// and the index (it's only an optimization, so just drop it if this fails)
+				if ((NULL != pRecords) && (idx >= nAlloc)) {
+					nAlloc += 100;
+					RecordSpan *pTmp = (RecordSpan*)realloc(pRecords, nAlloc*sizeof(RecordSpan));
+					if (NULL == pTmp) {
+						debug_write("Failed to grow record index for %s, it will be rewritten in full.", (LPCSTR)csFileName);
+						free(pRecords);
+					}
+					pRecords = pTmp;
+				}
 				
 				// clear buffer
 				memset(pData, 0, pFile->RecordLength+2);
@@ -931,9 +999,19 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 				if (nSector < nLen) {
 					debug_write("Corrupted file - truncating read.");
 					pFile->NumberRecords = idx;
+					free(pRecords);
+					pRecords = NULL;
 					break;
 				}
 
+				if (NULL != pRecords) {
+					// the length on disk, even if we trim it below
+					pRecords[idx].nOffset = nPos;
+					pRecords[idx].nLength = nLen;
+					pRecords[idx].bDirty = false;
+				}
+				nPos += nLen;
+
 				// we got some data, read it in and count off the record
 				// verify it (don't get screwed up by a bad file)
 				if (nLen > pFile->RecordLength) {
@@ -965,6 +1043,8 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 		} else {
 			// are we done?
 			if (idx >= pFile->NumberRecords) {
+				nTailPos = nPos;
+				nTailSector = nSector;
 				break;
 			}
 
@@ -975,13 +1055,20 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 			if (nSector < pFile->RecordLength) {
 				// not enough room for another record, skip to the next sector
 				fread(tmpbuf, 1, nSector, fp);
+				nPos += nSector;
 				nSector=256;
 			} else {
 				// a little simpler, we just need to read the data
 				*(unsigned short*)pData = pFile->RecordLength;
 				pData+=2;
 
+				if (NULL != pRecords) {
+					pRecords[idx].nOffset = nPos;
+					pRecords[idx].nLength = pFile->RecordLength;
+					pRecords[idx].bDirty = false;
+				}
 				fread(pData, 1, pFile->RecordLength, fp);
+				nPos += pFile->RecordLength;
 				nSector -= pFile->RecordLength;
 				idx++;
 				pData += pFile->RecordLength;
@@ -989,6 +1076,22 @@ bool FiadDisk::BufferFiadFile(FileInfo *pFile) {
 		}
 	}
 
+	if (NULL != pRecords) {
+		// only trust the index if the file ends right where the records say it does
+		fseek(fp, 0, SEEK_END);
+		int nSize = ftell(fp);
+		if (nSize == nTailPos + nTailSector) {
+			pFile->pRecords = pRecords;
+			pFile->nIndexed = pFile->NumberRecords;
+			pFile->nTailPos = nTailPos;
+			pFile->nTailSector = nTailSector;
+			pFile->nHostSize = nSize;
+		} else {
+			debug_write("%s doesn't end at its last sector, it will be rewritten in full.", (LPCSTR)csFileName);
+			free(pRecords);
+		}
+	}
+
 	fclose(fp);
 	debug_write("%s read %d records", (LPCSTR)csFileName, pFile->NumberRecords);
 	return true;
@@ -1223,38 +1326,55 @@ bool FiadDisk::Flush(FileInfo *pFile) {
 		return true;
 	}
 
+	// whatever we write, the index's copy of the header is stale
+	ForgetIndexEntry(BuildFilename(pFile));
+
 	// figure out what we are writing and call the appropriate code
 	// It doesn't matter what the file was read as, we can write it as
 	// whatever is configured.
+	if (WantsTextOutput(pFile)) {
+		return FlushWindowsText(pFile);
+	}
+
+	// if the host file still looks the way we read it, only write what changed
+	if (FlushFiadChanges(pFile)) {
+		return true;
+	}
 
+	return FlushFiad(pFile);
+}
+
+// Check whether a flush would write this file out as Windows text
+bool FiadDisk::WantsTextOutput(FileInfo *pFile) {
 	// The only real test here is whether it's going to be Windows or not,
 	// and that's only valid for display type files.
 	if ((pFile->Status & FLAG_INTERNAL) == 0) {
 		// Check for Windows output override
 		if (pFile->csOptions.Find('W') != -1) {
-			return FlushWindowsText(pFile);
+			return true;
 		} else {
 			// display type
 			if (pFile->Status & FLAG_VARIABLE) {
 				// DV
 				if ((bWriteAllDVAsText) || ((bWriteDV80AsText) && (pFile->RecordLength==80))) {
-					return FlushWindowsText(pFile);
+					return true;
 				}
 			} else {
 				// DF
 				if ((bWriteAllDFAsText) || ((bWriteDF80AsText) && (pFile->RecordLength==80))) {
-					return FlushWindowsText(pFile);
+					return true;
 				}
 			}
 		}
 	}
 
-	return FlushFiad(pFile);
+	return false;
 }
 
 // Write out a display file as normal Windows text (\r\n ending)
 bool FiadDisk::FlushWindowsText(FileInfo *pFile) {
 	CString csFileName = BuildFilename(pFile);
+	ForgetHostIndex(csFileName);
 	FILE *fp = fopen(csFileName, "wb");		// note we still use binary mode, just in case
 	if (NULL == fp) {
 		debug_write("Unable to write file %s", (LPCSTR)csFileName);
@@ -1294,6 +1414,74 @@ bool FiadDisk::FlushWindowsText(FileInfo *pFile) {
 	return true;
 }
 
+// Write back only the records that changed since the host file was read
+// or last flushed - rewritten records go back in place, and new ones are
+// added after the last one. This needs the record index, and returns
+// false without writing anything if the file can't be updated that way
+// (no index, the host file changed since, a variable record changed
+// length and would move everything after it, or the header type is being
+// converted). The caller then rewrites the whole file instead.
+bool FiadDisk::FlushFiadChanges(FileInfo *pFile) {
+	if ((NULL == pFile->pRecords) || (NULL == pFile->pData) || (pFile->NumberRecords < pFile->nIndexed)) {
+		return false;
+	}
+
+	// a requested V9T9/TIFILES conversion needs a new header
+	if ((pFile->csOptions.Find('V') != -1) && (pFile->ImageType != IMAGE_V9T9)) {
+		return false;
+	}
+	if ((pFile->csOptions.Find('T') != -1) && (pFile->ImageType != IMAGE_TIFILES)) {
+		return false;
+	}
+
+	int nWritten = 0;
+	for (int idx=0; idx<pFile->nIndexed; idx++) {
+		if (pFile->pRecords[idx].bDirty) {
+			int nLen = *(unsigned short*)(pFile->pData + idx*(pFile->RecordLength+2));
+			if (nLen != pFile->pRecords[idx].nLength) {
+				// only happens on variable files
+				return false;
+			}
+			nWritten++;
+		}
+	}
+	int nAdded = pFile->NumberRecords - pFile->nIndexed;
+
+	CString csFileName = BuildFilename(pFile);
+	FILE *fp = fopen(csFileName, "r+b");
+	if (NULL == fp) {
+		return false;
+	}
+
+	// make sure nothing else rewrote it under us
+	fseek(fp, 0, SEEK_END);
+	if (ftell(fp) != pFile->nHostSize) {
+		debug_write("%s changed size since it was read, rewriting it.", (LPCSTR)csFileName);
+		fclose(fp);
+		return false;
+	}
+
+	for (int idx=0; idx<pFile->nIndexed; idx++) {
+		if (pFile->pRecords[idx].bDirty) {
+			fseek(fp, pFile->pRecords[idx].nOffset, SEEK_SET);
+			fwrite(pFile->pData + idx*(pFile->RecordLength+2) + 2, 1, pFile->pRecords[idx].nLength, fp);
+			pFile->pRecords[idx].bDirty = false;
+		}
+	}
+
+	// new records carry on from the end of the last one, and change the header
+	if (nAdded > 0) {
+		WriteFiadRecords(pFile, fp, pFile->nIndexed, pFile->nTailPos, pFile->nTailSector);
+		WriteFileHeader(pFile, fp);
+	}
+
+	fclose(fp);
+	debug_write("Flushed %s in place (%d records rewritten, %d added)", (LPCSTR)csFileName, nWritten, nAdded);
+	pFile->bDirty = false;
+
+	return true;
+}
+
 // write out the file as a FIAD, including appropriate header
 // Warning: used by Makecart EA#3, don't access nDrive or nIndex members
 bool FiadDisk::FlushFiad(FileInfo *pFile) {
@@ -1304,6 +1492,8 @@ bool FiadDisk::FlushFiad(FileInfo *pFile) {
 	}
 
 	CString csFileName = BuildFilename(pFile);  // handles the -1 drive for makecart
+	ForgetHostIndex(csFileName);
+	FreeRecordIndex(pFile);
 	FILE *fp = fopen(csFileName, "wb");
 	if (NULL == fp) {
 		debug_write("Unable to write file %s", (LPCSTR)csFileName);
@@ -1315,99 +1505,126 @@ bool FiadDisk::FlushFiad(FileInfo *pFile) {
 	// sadly. This could screw up software that tries to read the
 	// file information before the file is closed, but tough. We
 	// don't need to support that.
-	unsigned char *pData = pFile->pData;
-	if (NULL == pData) {
+	if (NULL == pFile->pData) {
 		// not really a big deal when the file is first created
 		debug_write("Warning: no data to flush.");
 	} else {
-		// while going through here, we need to update the header records
-		// for LengthSectors, and BytesInLastSector
-		int nSector;
+		WriteFiadRecords(pFile, fp, 0, HEADERSIZE, 256);
+	}
 
-		// seek past the (currently empty) header
-		fseek(fp, HEADERSIZE, SEEK_SET);
+	// write the header before we are done
+	WriteFileHeader(pFile, fp);
 
-		pFile->LengthSectors = 1;		// at least one so far
+	fclose(fp);
+	debug_write("Flushed %s (%d records) as %s FIAD", (LPCSTR)csFileName, pFile->NumberRecords, pFile->ImageType == IMAGE_V9T9?"V9T9":"TIFILES");
+	pFile->bDirty = false;
 
-		nSector=256;
-		for (int idx=0; idx<pFile->NumberRecords; idx++) {
-			if (pData-pFile->pData >= pFile->nDataSize) {
-				break;
-			}
-			int nLen = *(unsigned short*)pData;
-			pData+=2;
+	return true;
+}
 
-			if (pFile->Status & FLAG_VARIABLE) {
-				// write a variable record
-				// first, check it if will fit
-				if (nSector < nLen+2) {		// 1 byte for record length, one for end of sector marker if needed
-					// pad the sector out
-					fputc(0xff, fp);
-					nSector--;
-					while (nSector > 0) {
-						fputc(0, fp);
-						nSector--;
-					}
-					nSector=256;
-					pFile->LengthSectors++;
-				}
-				
-				// write the length byte
-				fputc(nLen&0xff, fp);
-				nSector--;
-				// write the data
-				fwrite(pData, 1, nLen, fp);
-				nSector-=nLen;
-			} else {
-				// write a fixed length record
-				// first, check if it will fit
-				if (nSector < pFile->RecordLength) {
-					// pad the sector out
-					while (nSector > 0) {
-						fputc(0, fp);
-						nSector--;
-					}
-					nSector=256;
-					pFile->LengthSectors++;
-				}
+// Write records nFirst and up out of the buffer, starting at host file
+// offset nPos with nSector bytes left in that sector, and close off the
+// last sector. Updates LengthSectors and BytesInLastSector for the header.
+// For an open file, the record index is updated to match what was written.
+void FiadDisk::WriteFiadRecords(FileInfo *pFile, FILE *fp, int nFirst, int nPos, int nSector) {
+	unsigned char *pData = pFile->pData + nFirst*(pFile->RecordLength+2);
+	int idx;
 
-				// write the data
-				if (nLen != pFile->RecordLength) {
-					debug_write("Internal inconsistency - fixed record doesn't match record length");
-					// this may crash? But it shouldn't happen, don't crash anyway
-					nLen=pFile->RecordLength;
-				}
-				fwrite(pData, 1, nLen, fp);
-				nSector-=nLen;
-			}
-			pData+=pFile->RecordLength;
+	if (pFile->bOpen) {
+		RecordSpan *pTmp = (RecordSpan*)realloc(pFile->pRecords, (pFile->NumberRecords+1)*sizeof(RecordSpan));
+		if (NULL == pTmp) {
+			debug_write("Failed to grow record index for %s, it will be rewritten in full.", (LPCSTR)pFile->csName);
+			FreeRecordIndex(pFile);
+		} else {
+			pFile->pRecords = pTmp;
 		}
+	}
 
-		// is this right? I guess it can't be on a new sector with 0 bytes...
-		// this goes BEFORE the >FF byte is written on variable files
-		pFile->BytesInLastSector = 256-nSector;
+	fseek(fp, nPos, SEEK_SET);
+
+	for (idx=nFirst; idx<pFile->NumberRecords; idx++) {
+		if (pData-pFile->pData >= pFile->nDataSize) {
+			break;
+		}
+		int nLen = *(unsigned short*)pData;
+		pData+=2;
 
 		if (pFile->Status & FLAG_VARIABLE) {
-			// done writing - if this is variable, then we need to close the sector
-			fputc(0xff, fp);
+			// write a variable record
+			// first, check it if will fit
+			if (nSector < nLen+2) {		// 1 byte for record length, one for end of sector marker if needed
+				// pad the sector out
+				fputc(0xff, fp);
+				nPos += nSector;
+				nSector--;
+				while (nSector > 0) {
+					fputc(0, fp);
+					nSector--;
+				}
+				nSector=256;
+			}
+			
+			// write the length byte
+			fputc(nLen&0xff, fp);
+			nPos++;
 			nSector--;
+		} else {
+			// write a fixed length record
+			// first, check if it will fit
+			if (nSector < pFile->RecordLength) {
+				// pad the sector out
+				nPos += nSector;
+				while (nSector > 0) {
+					fputc(0, fp);
+					nSector--;
+				}
+				nSector=256;
+			}
+
+			if (nLen != pFile->RecordLength) {
+				debug_write("Internal inconsistency - fixed record doesn't match record length");
+				// this may crash? But it shouldn't happen, don't crash anyway
+				nLen=pFile->RecordLength;
+			}
 		}
-		
-		// don't forget to pad the file to a full sector!
-		while (nSector > 0) {
-			fputc(0, fp);
-			nSector--;
+
+		// write the data
+		if (NULL != pFile->pRecords) {
+			pFile->pRecords[idx].nOffset = nPos;
+			pFile->pRecords[idx].nLength = nLen;
+			pFile->pRecords[idx].bDirty = false;
 		}
+		fwrite(pData, 1, nLen, fp);
+		nPos += nLen;
+		nSector -= nLen;
+		pData+=pFile->RecordLength;
 	}
 
-	// write the header before we are done
-	WriteFileHeader(pFile, fp);
+	// count every sector up to the end of this one
+	pFile->LengthSectors = (nPos + nSector - HEADERSIZE) / 256;
 
-	fclose(fp);
-	debug_write("Flushed %s (%d records) as %s FIAD", (LPCSTR)csFileName, pFile->NumberRecords, pFile->ImageType == IMAGE_V9T9?"V9T9":"TIFILES");
-	pFile->bDirty = false;
+	// is this right? I guess it can't be on a new sector with 0 bytes...
+	// this goes BEFORE the >FF byte is written on variable files
+	pFile->BytesInLastSector = 256-nSector;
 
-	return true;
+	if (NULL != pFile->pRecords) {
+		pFile->nIndexed = idx;
+		pFile->nTailPos = nPos;
+		pFile->nTailSector = nSector;
+		pFile->nHostSize = nPos + nSector;
+	}
+
+	if (pFile->Status & FLAG_VARIABLE) {
+		// done writing - if this is variable, then we need to close the sector
+		fputc(0xff, fp);
+		nSector--;
+	}
+	
+	// don't forget to pad the file to a full sector!
+	while (nSector > 0) {
+		fputc(0, fp);
+		nSector--;
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1911,6 +2128,8 @@ bool FiadDisk::Save(FileInfo *pFile) {
 
 	// there is no try on an output file -- do or do not!
 	debug_write("saving 0x%X bytes file %s", pFile->RecordNumber, csFileName);
+	ForgetIndexEntry(csFileName);
+	ForgetHostIndex(csFileName);
 
 	fp=fopen(csFileName, "wb");
 	if (NULL == fp) {
@@ -2001,99 +2220,224 @@ bool FiadDisk::ReadVIB(FileInfo *pFile) {
 	return true;
 }
 
+// Bring the directory index up to date. If the folder can give us change
+// notifications, we only sweep it when one has fired. If not, bSweep decides
+// whether to sweep anyway (the catalog wants that, a single lookup checks its
+// own file instead). Only files whose size or write time changed are re-read.
+// Returns false if there's no usable index.
+bool FiadDisk::RefreshIndex(bool bSweep) {
+	CString csPath = GetPath();
+
+	if (NULL == pIndex) {
+		pIndex = new FiadIndex;
+		pIndex->hChange = INVALID_HANDLE_VALUE;
+		pIndex->bNoNotify = false;
+		pIndex->bValid = false;
+	}
+	if (pIndex->csPath.CompareNoCase(csPath) != 0) {
+		DropIndex();
+		pIndex->csPath = csPath;
+	}
+
+	if (INVALID_HANDLE_VALUE == pIndex->hChange) {
+		if (!pIndex->bNoNotify) {
+			pIndex->hChange = FindFirstChangeNotification(csPath, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+			if (INVALID_HANDLE_VALUE == pIndex->hChange) {
+				debug_write("No change notification for %s, will check the folder on each catalog.", (LPCSTR)csPath);
+				pIndex->bNoNotify = true;
+			}
+		} else if ((pIndex->bValid) && (!bSweep)) {
+			return true;
+		}
+	} else if (pIndex->bValid) {
+		if (WAIT_OBJECT_0 != WaitForSingleObject(pIndex->hChange, 0)) {
+			// nothing has changed
+			return true;
+		}
+		// re-arm first, so nothing that happens during the sweep is missed
+		FindNextChangeNotification(pIndex->hChange);
+	}
+
+	WIN32_FIND_DATA myDat;
+	CString csSearchPath;
+	std::map<CString, FiadIndexEntry> files;
+	std::vector<CString> order;
+	int nRead = 0;
+
+	bSweeping = true;
+	csSearchPath.Format("%s*", (LPCSTR)csPath);
+	HANDLE fsrc=FindFirstFile(csSearchPath, &myDat);
+	if (INVALID_HANDLE_VALUE != fsrc) {
+		do {
+			if (myDat.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				continue;		// never a file we can read
+			}
+
+			// Make uppercase - do we still do this? (TODO: maybe another option?)
+			_strupr(myDat.cFileName);
+			CString csName = myDat.cFileName;
+
+			std::map<CString, FiadIndexEntry>::iterator it = pIndex->files.find(csName);
+			if ((it != pIndex->files.end()) &&
+				(it->second.nSizeLow == myDat.nFileSizeLow) && (it->second.nSizeHigh == myDat.nFileSizeHigh) &&
+				(0 == CompareFileTime(&it->second.ftWrite, &myDat.ftLastWriteTime))) {
+				// unchanged
+				files[csName] = it->second;
+			} else {
+				FiadIndexEntry &entry = files[csName];
+				entry.nSizeLow = myDat.nFileSizeLow;
+				entry.nSizeHigh = myDat.nFileSizeHigh;
+				entry.ftWrite = myDat.ftLastWriteTime;
+				entry.info = FileInfo();
+				entry.info.csName = csName;
+				csSearchPath.Format("%s%s", (LPCSTR)csPath, myDat.cFileName);
+				DetectImageType(&entry.info, csSearchPath);
+				++nRead;
+			}
+			order.push_back(csName);
+		} while (FindNextFile(fsrc, &myDat));
+		FindClose(fsrc);
+	}
+	bSweeping = false;
+
+	pIndex->files.swap(files);
+	pIndex->order.swap(order);
+	pIndex->bValid = true;
+
+	if (nRead > 0) {
+		debug_write("Indexed %d of %d files in %s", nRead, (int)pIndex->order.size(), (LPCSTR)csPath);
+	}
+	return true;
+}
+
+// Look a file up in the directory index, and if it's a TIFILES or V9T9 file
+// (the types that only depend on the header), fill in what DetectImageType would
+// have. Returns false if the caller needs to go to the file - it's not in this
+// folder, it has a translated name, it's another type, or it changed.
+bool FiadDisk::FindInIndex(FileInfo *pFile, CString csFileName) {
+	if (bSweeping) {
+		return false;
+	}
+
+	int idx = csFileName.ReverseFind('\\');
+	if ((-1 == idx) || (csFileName.Left(idx+1).CompareNoCase(GetPath()) != 0)) {
+		return false;
+	}
+	CString csName = csFileName.Mid(idx+1);
+	csName.MakeUpper();
+
+	if (!RefreshIndex(false)) {
+		return false;
+	}
+
+	std::map<CString, FiadIndexEntry>::iterator it = pIndex->files.find(csName);
+	if (it == pIndex->files.end()) {
+		return false;
+	}
+	const FiadIndexEntry &entry = it->second;
+	if ((IMAGE_TIFILES != entry.info.ImageType) && (IMAGE_V9T9 != entry.info.ImageType)) {
+		return false;
+	}
+
+	if (INVALID_HANDLE_VALUE == pIndex->hChange) {
+		// nobody tells us about changes, so check this one file
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		if ((!GetFileAttributesEx(csFileName, GetFileExInfoStandard, &attr)) ||
+			(attr.nFileSizeLow != entry.nSizeLow) || (attr.nFileSizeHigh != entry.nSizeHigh) ||
+			(0 != CompareFileTime(&attr.ftLastWriteTime, &entry.ftWrite))) {
+			return false;
+		}
+	}
+
+	pFile->ImageType = entry.info.ImageType;
+	pFile->LengthSectors = entry.info.LengthSectors;
+	pFile->FileType = entry.info.FileType;
+	pFile->RecordsPerSector = entry.info.RecordsPerSector;
+	pFile->BytesInLastSector = entry.info.BytesInLastSector;
+	pFile->RecordLength = entry.info.RecordLength;
+	pFile->NumberRecords = entry.info.NumberRecords;
+	pFile->Status = entry.info.Status;
+	return true;
+}
+
+// We're writing this file - the index has to read it again
+void FiadDisk::ForgetIndexEntry(CString csFileName) {
+	if ((NULL == pIndex) || (!pIndex->bValid)) {
+		return;
+	}
+	int idx = csFileName.ReverseFind('\\');
+	CString csName = csFileName.Mid(idx+1);
+	csName.MakeUpper();
+	pIndex->files.erase(csName);
+	// and the catalog needs to look at the folder again, even without a notification
+	pIndex->bValid = false;
+}
+
+// throw away the index (but keep the object)
+void FiadDisk::DropIndex() {
+	if (NULL == pIndex) {
+		return;
+	}
+	if (INVALID_HANDLE_VALUE != pIndex->hChange) {
+		FindCloseChangeNotification(pIndex->hChange);
+		pIndex->hChange = INVALID_HANDLE_VALUE;
+	}
+	pIndex->bNoNotify = false;
+	pIndex->bValid = false;
+	pIndex->files.clear();
+	pIndex->order.clear();
+}
+
 // Get a list of the files in the current directory (up to 127, unless bMoreThan127Files is set)
 // returns the count of files, and an allocated array at Filenames
 // The array is a list of FileInfo objects
 // Caller must free Filenames!
-// To reduce thrashing, we track the last used directory for 15 seconds :)
+// This comes from the directory index, so the host files are only read when they change.
 int FiadDisk::GetDirectory(FileInfo *pFile, FileInfo *&Filenames) {
 	int n;
-	HANDLE fsrc;
-	WIN32_FIND_DATA myDat;
-	CString csSearchPath;
 
-	// check cache first
-	if ((nCachedDrive == pFile->nDrive) &&
-		(pCachedFiles != NULL) &&
-		(time(NULL) < tCachedTime+15)) {
-			// just replay the cache
-			// It's okay to copy since these don't include any data
-			// But just to protect from later changes, we'll NULL the data pointers
-			Filenames = (FileInfo*)malloc(_msize(pCachedFiles));
-			memcpy(Filenames, pCachedFiles, _msize(pCachedFiles));
-			return nCachedCount;
-	} else {
-		// free any old cache
-		if (NULL != pCachedFiles) {
-			free(pCachedFiles);
-			pCachedFiles=NULL;
+	RefreshIndex(true);
+
+	// count first, so we only need the one allocation
+	n=0;
+	for (size_t idx=0; idx<pIndex->order.size(); idx++) {
+		if (IMAGE_UNKNOWN != pIndex->files[pIndex->order[idx]].info.ImageType) {
+			n++;
+			if ((n>126) && (!bAllowMore127Files)) {
+				break;
+			}
 		}
 	}
 
-	// I dislike realloc, but that's the best way to solve the dynamic size issue,
-	// besides counting twice (and that's not guaranteed not to change!)
-	Filenames = (FileInfo*)malloc(sizeof(FileInfo));	// get one
+	Filenames = (FileInfo*)malloc(sizeof(FileInfo)*(n+1));
 	if (NULL == Filenames) {
 		debug_write("Couldn't malloc memory for directory.");
 		return 0;
 	}
-	new(&Filenames[0]) FileInfo;
 
-	n=0;
-	csSearchPath.Format("%s*", (LPCSTR)pDriveType[pFile->nDrive]->GetPath());
-	fsrc=FindFirstFile(csSearchPath, &myDat);
-	if (INVALID_HANDLE_VALUE == fsrc) {
-		n=0;
-	} else {
-		do {
-			// Make uppercase - do we still do this? (TODO: maybe another option?)
-			_strupr(myDat.cFileName);
-			// get the path for the sake of collecting data
-			csSearchPath.Format("%s%s", (LPCSTR)pDriveType[pFile->nDrive]->GetPath(), myDat.cFileName);
-			// cache the fileinfo header too.
-			// This way we can automatically handle new filetypes without adding them here
-			Filenames[n].csName = myDat.cFileName;
-			DetectImageType(&Filenames[n], csSearchPath);
-
-			if (IMAGE_UNKNOWN != Filenames[n].ImageType) {
-				// it's a format we recognize, keep it
-				Filenames[n].csName = myDat.cFileName;
-				
-				// if it's got a TIAP or TIAC extension, fake it to
-				// _P or _C so TI apps recognize it. We fake it back
-				// again on load anyway. (Also my own _M)
-				if (Filenames[n].csName.Right(5).MakeUpper() == ".TIAP") {
-					Filenames[n].csName.Replace(".TIAP", "_P");
-				} else if (Filenames[n].csName.Right(5).MakeUpper() == ".TIAC") {
-					Filenames[n].csName.Replace(".TIAC", "_C");
-				} else if (Filenames[n].csName.Right(5).MakeUpper() == ".TIAM") {
-					Filenames[n].csName.Replace(".TIAM", "_M");
-				}
-
-				n++;
-				if ((n>126) && (!bAllowMore127Files)) {
-					break;
-				}
+	int nOut=0;
+	for (size_t idx=0; (idx<pIndex->order.size()) && (nOut<n); idx++) {
+		const FiadIndexEntry &entry = pIndex->files[pIndex->order[idx]];
+		if (IMAGE_UNKNOWN == entry.info.ImageType) {
+			continue;
+		}
 
-				// else, allocate the next entry
-				FileInfo* pTmp = (FileInfo*)realloc(Filenames, sizeof(FileInfo)*(n+1));	// get one more
-				if (NULL == pTmp) {
-					debug_write("Couldn't realloc memory for directory after %d entries.", n);
-					return 0;
-				}
-                Filenames = pTmp;
-				new(&Filenames[n]) FileInfo;
-			}
-		} while (FindNextFile(fsrc, &myDat));
-		FindClose(fsrc);
+		new(&Filenames[nOut]) FileInfo;
+		Filenames[nOut] = entry.info;
+
+		// if it's got a TIAP or TIAC extension, fake it to
+		// _P or _C so TI apps recognize it. We fake it back
+		// again on load anyway. (Also my own _M)
+		if (Filenames[nOut].csName.Right(5).MakeUpper() == ".TIAP") {
+			Filenames[nOut].csName.Replace(".TIAP", "_P");
+		} else if (Filenames[nOut].csName.Right(5).MakeUpper() == ".TIAC") {
+			Filenames[nOut].csName.Replace(".TIAC", "_C");
+		} else if (Filenames[nOut].csName.Right(5).MakeUpper() == ".TIAM") {
+			Filenames[nOut].csName.Replace(".TIAM", "_M");
+		}
+		nOut++;
 	}
-
-	// copy into the cache
-	pCachedFiles=(FileInfo*)malloc(_msize(Filenames));
-	memcpy(pCachedFiles, Filenames, _msize(Filenames));
-	nCachedDrive=pFile->nDrive;
-	time(&tCachedTime);
-	nCachedCount = n;
+	new(&Filenames[n]) FileInfo;	// keep the spare entry the old code always had
 
 	return n;
 }
@@ -2278,6 +2622,9 @@ bool FiadDisk::WriteFileSectors(FileInfo *pFile) {
 	FileInfo lclFile;
 	CString csFilename = BuildFilename(pFile);
 
+	ForgetIndexEntry(csFilename);
+	ForgetHostIndex(csFilename);
+
 	if (pFile->LengthSectors == 0) {
 		// Create File
 		fp=fopen(csFilename, "wb");
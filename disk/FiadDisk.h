@@ -37,6 +37,8 @@
 //
 #pragma once
 
+struct FiadIndex;		// directory index, see FiadDisk.cpp
+
 // FIAD style disk access
 class FiadDisk : public BaseDisk {
 public:
@@ -95,13 +97,20 @@ public:
 	virtual bool BufferFiadFile(FileInfo *pFile);
 	virtual bool BufferTextFile(FileInfo *pFile);
 	virtual bool BufferImgFile(FileInfo *pFile);
+	bool WantsTextOutput(FileInfo *pFile);
 	bool FlushWindowsText(FileInfo *pFile);
+	bool FlushFiadChanges(FileInfo *pFile);
 	bool FlushFiad(FileInfo *pFile);
+	void WriteFiadRecords(FileInfo *pFile, FILE *fp, int nFirst, int nPos, int nSector);
 	void WriteFileHeader(FileInfo *pFile, FILE *fp);
 	bool ReadVIB(FileInfo *pFile);
 	int  GetDirectory(FileInfo *pFile, FileInfo *&Filenames);
 	bool ReadFDR(FileInfo *pFile, FileInfo *Filenames);
 	const char* GetAttributes(int nType);
+	bool RefreshIndex(bool bSweep);
+	bool FindInIndex(FileInfo *pFile, CString csFileName);
+	void ForgetIndexEntry(CString csFileName);
+	void DropIndex();
 
 	// configuration data
 	bool bWriteV9T9;
@@ -118,10 +127,8 @@ public:
 	bool bEnableLongFilenames;
 	bool bAllowMore127Files;
 
-	// directory cache
-	int nCachedDrive;
-	FileInfo *pCachedFiles;
-	time_t tCachedTime;
-	int nCachedCount;
+	// directory index
+	FiadIndex *pIndex;
+	bool bSweeping;				// RefreshIndex is reading headers, don't look in the index
 };
 
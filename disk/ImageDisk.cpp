@@ -54,6 +54,13 @@
 // largest disk size
 #define MAX_SECTORS 1600
 
+// largest image we'll hold in memory - anything bigger goes to the file every time
+#define MAX_CACHED_IMAGE (16*1024*1024)
+// how long written sectors can wait before they go out to the host
+#define WRITEBACK_DELAY_MS 500
+
+volatile bool bImageCacheDirty = false;		// some ImageDisk is holding written sectors
+
 //********************************************************
 // ImageDisk
 //********************************************************
@@ -63,9 +70,24 @@
 // constructor
 ImageDisk::ImageDisk() {
 	bUseV9T9DSSD = false;
+	detected = false;
+
+	pImage = NULL;
+	pSectorOffset = NULL;
+	pSectorDirty = NULL;
+	DropImageCache();
 }
 
 ImageDisk::~ImageDisk() {
+	WriteBack(true);
+	DropImageCache();
+}
+
+// a new image (or none) - the old one goes back to the host first
+void ImageDisk::SetPath(const char *pszPath) {
+	WriteBack(true);
+	DropImageCache();
+	BaseDisk::SetPath(pszPath);
 }
 
 // powerup routine
@@ -192,12 +214,222 @@ bool ImageDisk::VerifyFormat(FILE *fp, bool &bIsPC99, int &Gap1, int &PreIDGap,
 }
 
 
+// forget the cached image (write it back first if you want the changes!)
+void ImageDisk::DropImageCache() {
+	if (NULL != pImage) free(pImage);
+	if (NULL != pSectorOffset) free(pSectorOffset);
+	if (NULL != pSectorDirty) free(pSectorDirty);
+	pImage = NULL;
+	pSectorOffset = NULL;
+	pSectorDirty = NULL;
+	nImageSize = 0;
+	nImageSectors = 0;
+	nImageVolume = 0;
+	nImageIndexHigh = 0;
+	nImageIndexLow = 0;
+	ftImageWrite.dwLowDateTime = 0;
+	ftImageWrite.dwHighDateTime = 0;
+	bImagePC99 = false;
+	nDirtyCount = 0;
+	nDirtyTime = 0;
+}
+
+// Make sure the cache holds the image open in fp - reads and parses it if
+// it's a different file, or the host changed it since we read it. Returns
+// false if it can't be cached, and the caller should go to the file.
+bool ImageDisk::LoadImageCache(FILE *fp) {
+	BY_HANDLE_FILE_INFORMATION info;
+	HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+	if ((INVALID_HANDLE_VALUE == hFile) || (!GetFileInformationByHandle(hFile, &info))) {
+		return false;
+	}
+
+	if (NULL != pImage) {
+		bool bSameFile = (info.dwVolumeSerialNumber == nImageVolume) && (info.nFileIndexHigh == nImageIndexHigh) && (info.nFileIndexLow == nImageIndexLow);
+		if (bSameFile) {
+			if ((info.nFileSizeHigh == 0) && ((int)info.nFileSizeLow == nImageSize) && (0 == CompareFileTime(&info.ftLastWriteTime, &ftImageWrite))) {
+				// nothing changed, this is the usual case
+				return true;
+			}
+			if (nDirtyCount > 0) {
+				// the computer has already seen our version, so that's the one we keep
+				debug_write("Disk image %s changed on the host while it had unwritten sectors - keeping the emulated copy.", GetPath());
+				return true;
+			}
+			debug_write("Disk image %s changed on the host, reloading.", GetPath());
+		}
+		WriteBack(true);
+		DropImageCache();
+	}
+
+	if ((info.nFileSizeHigh != 0) || (info.nFileSizeLow > MAX_CACHED_IMAGE) || (info.nFileSizeLow < 256)) {
+		return false;
+	}
+
+	// the format only needs to be worked out once now
+	bool bIsPC99;
+	int Gap1, PreIDGap, PreDatGap, SLength, SekTrack, TrkLen;
+	if (!VerifyFormat(fp, bIsPC99, Gap1, PreIDGap, PreDatGap, SLength, SekTrack, TrkLen)) {
+		return false;
+	}
+
+	int nSize = (int)info.nFileSizeLow;
+	unsigned char *pData = (unsigned char*)malloc(nSize);
+	if (NULL == pData) {
+		return false;
+	}
+	if ((fseek(fp, 0, SEEK_SET)) || (nSize != fread(pData, 1, nSize, fp))) {
+		debug_write("Can't read disk image %s for caching, errno %d", GetPath(), errno);
+		free(pData);
+		return false;
+	}
+
+	if (bIsPC99) {
+		// index the sectors by their ID fields - this is the search GetSectorFromDisk
+		// used to do for every read, each track is still assumed 40 tracks to a side
+		nImageSectors = SekTrack * 80;
+	} else {
+		nImageSectors = nSize / 256;
+	}
+	pSectorOffset = (int*)malloc(nImageSectors * sizeof(int));
+	pSectorDirty = (unsigned char*)calloc(nImageSectors, 1);
+	if ((NULL == pSectorOffset) || (NULL == pSectorDirty)) {
+		free(pData);
+		DropImageCache();
+		return false;
+	}
+
+	int nMissing = 0;
+	for (int nSector = 0; nSector < nImageSectors; ++nSector) {
+		if (!bIsPC99) {
+			pSectorOffset[nSector] = nSector * 256;
+			continue;
+		}
+
+		int Trk = nSector / SekTrack;
+		int DskSide = 0;
+		if (Trk > 39) {
+			Trk = 79-Trk;
+			DskSide = 1;
+		}
+		int nSec = nSector % SekTrack;
+		int nOffset = (TrkLen*40)*DskSide + Trk*TrkLen;
+
+		pSectorOffset[nSector] = -1;
+		if (nOffset + TrkLen > nSize) {
+			continue;		// single sided, or short image
+		}
+		const unsigned char *pTrk = pData + nOffset;
+		for (int tst=0; tst<SekTrack; tst++) {
+			int p = Gap1 + PreIDGap + (SLength * tst);
+			if ((pTrk[p] == Trk) && (pTrk[p+1] == DskSide) && (pTrk[p+2] == nSec) && (pTrk[p+3] == 1)) {
+				pSectorOffset[nSector] = nOffset + Gap1 + PreDatGap + (SLength * tst);
+				break;
+			}
+		}
+		if (pSectorOffset[nSector] == -1) ++nMissing;
+	}
+
+	pImage = pData;
+	nImageSize = nSize;
+	bImagePC99 = bIsPC99;
+	nImageVolume = info.dwVolumeSerialNumber;
+	nImageIndexHigh = info.nFileIndexHigh;
+	nImageIndexLow = info.nFileIndexLow;
+	ftImageWrite = info.ftLastWriteTime;
+	nDirtyCount = 0;
+
+	debug_write("Cached disk image %s (%d sectors%s)", GetPath(), nImageSectors, bIsPC99 ? ", PC99" : "");
+	if (nMissing > 0) {
+		debug_write("PC99 disk is missing %d sector IDs.", nMissing);
+	}
+	return true;
+}
+
+// return the offset of a sector's data in the cached image, or -1
+int ImageDisk::CachedSectorOffset(int nSector) {
+	if ((nSector < 0) || (nSector >= nImageSectors)) {
+		return -1;
+	}
+	int nOffset = pSectorOffset[nSector];
+	if ((nOffset < 0) || (nOffset + 256 > nImageSize)) {
+		return -1;
+	}
+	return nOffset;
+}
+
+// Write the dirty sectors back to the image file. Unless forced, only if they
+// have been waiting a little while, so a run of sector writes goes out together.
+void ImageDisk::WriteBack(bool bForce) {
+	if ((NULL == pImage) || (0 == nDirtyCount)) {
+		return;
+	}
+	if ((!bForce) && (GetTickCount() - nDirtyTime < WRITEBACK_DELAY_MS)) {
+		bImageCacheDirty = true;	// not yet, ask again
+		return;
+	}
+
+	FILE *fp = fopen(GetPath(), "r+b");
+	if (NULL == fp) {
+		debug_write("Can't open %s to write back %d sectors, will try again.", GetPath(), nDirtyCount);
+		nDirtyTime = GetTickCount();
+		bImageCacheDirty = true;
+		return;
+	}
+
+	int nWritten = 0;
+	for (int nSector = 0; nSector < nImageSectors; ++nSector) {
+		if (!pSectorDirty[nSector]) continue;
+
+		// join up runs of sectors that are next to each other in the file
+		int nOffset = pSectorOffset[nSector];
+		int nLen = 256;
+		pSectorDirty[nSector] = 0;
+		while ((nSector+1 < nImageSectors) && (pSectorDirty[nSector+1]) && (pSectorOffset[nSector+1] == nOffset + nLen)) {
+			++nSector;
+			pSectorDirty[nSector] = 0;
+			nLen += 256;
+		}
+
+		if ((fseek(fp, nOffset, SEEK_SET)) || (nLen != fwrite(pImage+nOffset, 1, nLen, fp))) {
+			debug_write("Write back to %s failed at offset %d, errno %d - corruption may have occurred.", GetPath(), nOffset, errno);
+		}
+		nWritten += nLen/256;
+	}
+	fflush(fp);
+
+	// remember our own write, so it doesn't look like the host changed it
+	BY_HANDLE_FILE_INFORMATION info;
+	HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+	if ((INVALID_HANDLE_VALUE != hFile) && (GetFileInformationByHandle(hFile, &info))) {
+		ftImageWrite = info.ftLastWriteTime;
+	}
+	fclose(fp);
+
+	nDirtyCount = 0;
+	debug_write("Wrote back %d sectors to %s", nWritten, GetPath());
+}
+
 // Read a sector from an open file - true on success, false
 // if an error occurs. buf must be at least 256 bytes!
 bool ImageDisk::GetSectorFromDisk(FILE *fp, int nSector, unsigned char *buf) {
 	if (NULL == fp) return false;
 	if (NULL == buf) return false;
 
+	if (LoadImageCache(fp)) {
+		if ((!bImagePC99) && (bUseV9T9DSSD) && (nSector >= 360) && (nSector <= 719)) {
+			debug_write("Note: using swapped V9T9 order for sector %d", nSector);
+			nSector = (719-nSector) + 360;
+		}
+		int nOffset = CachedSectorOffset(nSector);
+		if (nOffset < 0) {
+            debug_write("Read sector %d failed, not on the disk image", nSector);
+			return false;
+		}
+		memcpy(buf, pImage+nOffset, 256);
+		return true;
+	}
+
     bool bIsPC99;
     int Gap1, PreIDGap, PreDatGap, SLength, SekTrack, TrkLen;
 
@@ -268,12 +500,33 @@ bool ImageDisk::GetSectorFromDisk(FILE *fp, int nSector, unsigned char *buf) {
 // Write a sector to an open file - true on success, false
 // Note that the file must be open for read AND write!
 // if an error occurs. buf must be at least 256 bytes!
-// The image on disk is updated immediately and irrevocably!
+// The image is cached, so the write goes out to the host a little later - see WriteBack()
 bool ImageDisk::PutSectorToDisk(FILE *fp, int nSector, unsigned char *wrbuf) {
 	unsigned char buf[256];		// work buffer
 	if (NULL == fp) return false;
 	if (NULL == buf) return false;
 
+	if (LoadImageCache(fp)) {
+		if ((!bImagePC99) && (bUseV9T9DSSD) && (nSector >= 360) && (nSector <= 719)) {
+			debug_write("WNote: using swapped V9T9 order for sector %d", nSector);
+			nSector = (719-nSector) + 360;
+		}
+		int nOffset = CachedSectorOffset(nSector);
+		if (nOffset < 0) {
+            debug_write("Write sector %d failed, not on the disk image", nSector);
+			return false;
+		}
+		memcpy(pImage+nOffset, wrbuf, 256);
+		if (!pSectorDirty[nSector]) {
+			pSectorDirty[nSector] = 1;
+			if (0 == nDirtyCount++) {
+				nDirtyTime = GetTickCount();
+			}
+		}
+		bImageCacheDirty = true;
+		return true;
+	}
+
     bool bIsPC99;
     int Gap1, PreIDGap, PreDatGap, SLength, SekTrack, TrkLen;
 
@@ -2181,6 +2434,9 @@ bool ImageDisk::Flush(FileInfo *pFile) {
 	free(pBuffer);
 	fclose(fp);
 
+	// a closed file should be on the host disk
+	WriteBack(true);
+
 	if (ret) {
 		pFile->LastError = ERR_NOERROR;
 		debug_write("Flushed %s (%d records) to ImageDisk", (LPCSTR)csFileName, pFile->NumberRecords);
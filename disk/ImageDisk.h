@@ -48,10 +48,11 @@ public:
 //	virtual bool SetFiles(int n);						// base class ok
 
 	// emulation functions
-//	virtual void SetPath(const char *pszPath);			// base class ok
+	virtual void SetPath(const char *pszPath);
 	virtual int  GetDiskType() { return DISK_SECTOR; }	// return the disk type
 //	virtual bool CheckOpenFiles();						// base class ok
 //	virtual void CloseAllFiles();						// base class ok
+	virtual void WriteBack(bool bForce);
 	virtual void SetOption(int nOption, int nValue);
 	virtual bool GetOption(int nOption, int &nValue);
 //	virtual FileInfo *AllocateFileInfo();				// base class ok
@@ -105,9 +106,26 @@ public:
 	void FreePartialFile(FILE *fp, int fdr, int *sectorList, int sectorCnt);
     bool sortDirectory(FILE *fp, int newFDR);
     bool ReadFileSectorsToAddress(FileInfo *pFile, unsigned char *pAdr);
+	bool LoadImageCache(FILE *fp);
+	int  CachedSectorOffset(int nSector);
+	void DropImageCache();
 
 	// configuration data
 	bool bUseV9T9DSSD;			// use the reverse sector order for DSSD disks that V9T9 did
     bool detected;              // used to throttle the PC99 image detection debug a bit
+
+	// image cache - the whole image, read once and parsed once
+	unsigned char *pImage;		// image file contents, NULL if not cached
+	int nImageSize;
+	DWORD nImageVolume;			// which file it is (from GetFileInformationByHandle)
+	DWORD nImageIndexHigh, nImageIndexLow;
+	FILETIME ftImageWrite;		// last write time when we read (or wrote) it
+	bool bImagePC99;
+	int nImageSectors;			// sectors the image holds
+	int *pSectorOffset;			// offset of each sector's data in pImage, -1 if it's not there
+	unsigned char *pSectorDirty;	// 1 for each sector waiting to be written back
+	int nDirtyCount;
+	DWORD nDirtyTime;			// GetTickCount() of the first write since the last write back
 };
 
+extern volatile bool bImageCacheDirty;		// some ImageDisk has sectors waiting for WriteBack()
@@ -283,6 +283,7 @@ TICCDisk::~TICCDisk() {
 void TICCDisk::Startup() {
 	bCorruptDSKRAM=false;		// no matter what it was set to, if you are using this, you must NOT corrupt the disk ram! WE USE IT. ;)
 	nDSRBank[1] = 0;			// Classic99 disk access for the default setup
+	InvalidateMemoryMap();
 
 	ImageDisk::Startup();
 	BaseDisk::Startup();
@@ -292,6 +293,7 @@ void TICCDisk::Startup() {
 	unsigned short PC=DSR[1][0x2004]*256 + DSR[1][0x2005];	// hard coded assumptions - startup vector
 	if (PC == 0) {
 		nDSRBank[1] = 0;
+		InvalidateMemoryMap();
 	} else {
 		if ((DSR[1][0x2000+PC-0x4000]!=0)||(DSR[1][0x2000+PC+1-0x4000]!=0)) {
 			debug_write("Warning: linked power up vectors not honored!");
@@ -301,6 +303,7 @@ void TICCDisk::Startup() {
 		debug_write("Starting TICC powerup routine at 0x%04X - only happens once per boot!", PC);
 		nDSRBank[1] = 1;
 		nCurrentDSR = 1;	// this is usually not set here
+		InvalidateMemoryMap();
 		pCurrentCPU->SetPC(PC);
 	}
 }
@@ -310,6 +313,7 @@ void TICCDisk::Startup() {
 void TICCDisk::dsrlnk(int nDrive) {
 	// just switch it in and find the correct entry point
 	nDSRBank[1] = 1;
+	InvalidateMemoryMap();
 	char name[8];
 
 	if (nDrive == -1) {
@@ -333,6 +337,7 @@ void TICCDisk::dsrlnk(int nDrive) {
 		// somehow we didn't find it - this shouldn't happen - we won't get a proper error, either!
 		debug_write("Failed to find %s entry point in DSR - shouldn't happen!", name);
 		nDSRBank[1] = 0;	// switch back
+		InvalidateMemoryMap();
 		return;
 	}
 
@@ -348,6 +353,7 @@ void TICCDisk::sbrlnk(int nOpCode) {
 
 	// just switch it in and find the correct entry point
 	nDSRBank[1] = 1;
+	InvalidateMemoryMap();
 	char name[8];
 	name[0] = nOpCode;
 	name[1] = '\0';
@@ -365,6 +371,7 @@ void TICCDisk::sbrlnk(int nOpCode) {
 		// somehow we didn't find it - this shouldn't happen - we won't get a proper error, either!
 		debug_write("Failed to find SBRLNK(%d) entry point in DSR - shouldn't happen!", nOpCode);
 		nDSRBank[1] = 0;	// switch back
+		InvalidateMemoryMap();
 		return;
 	}
 
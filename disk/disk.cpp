@@ -153,6 +153,21 @@ void InitDiskDSR() {
 	LeaveCriticalSection(&csDriveType);
 }
 
+// Write back any disk images holding written sectors. Called every frame from the
+// CPU thread (only writes what has waited a while), and forced at shutdown.
+void ServiceDiskCache(bool bForce) {
+	if (!bImageCacheDirty) return;
+
+	EnterCriticalSection(&csDriveType);
+	bImageCacheDirty = false;		// WriteBack sets it again for anything it leaves
+	for (int idx=0; idx<MAX_DRIVES; idx++) {
+		if (NULL != pDriveType[idx]) {
+			pDriveType[idx]->WriteBack(bForce);
+		}
+	}
+	LeaveCriticalSection(&csDriveType);
+}
+
 // note: for future use -- allow mounting internal, TI, and Corcomp disk controller
 // at CRU >1100. If the user allows both internal and TI, we simply use the TI/Corcomp
 // DSR ROM for any drive not configured Classic99's DSR
@@ -1288,6 +1303,7 @@ void do_files(int n)				/* call files(n) */
 
 		debug_write("Found TICC, letting it handle FILES");
 		nDSRBank[1] = 1;		// switch in the TICC
+		InvalidateMemoryMap();
 
         // this is a Classic99 implementation, not a TI one. It's
         // always positive.
@@ -1313,6 +1329,7 @@ void do_files(int n)				/* call files(n) */
 			// somehow we didn't find it - this shouldn't happen - we won't get a proper error, either!
 			debug_write("Failed to find FILES subprogram (%d) in DSR - shouldn't happen!", n);
 			nDSRBank[1] = 0;	// switch back
+			InvalidateMemoryMap();
 			return;
 		}
 
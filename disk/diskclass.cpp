@@ -73,6 +73,7 @@
 #include <atlstr.h>
 #include "tiemul.h"
 #include "diskclass.h"
+#include "savestate.h"
 
 void WriteMemoryByte(Word address, Byte value, bool allowWrite);
 Byte ReadMemoryByte(Word address, READACCESSTYPE rmw);
@@ -147,6 +148,11 @@ s_FILEINFO::s_FILEINFO() {
 	nLocalData=0;
     initData = NULL;
     initDataSize = 0;
+	pRecords=NULL;
+	nIndexed=0;
+	nTailPos=0;
+	nTailSector=0;
+	nHostSize=0;
 	// warning: this is not atomic, but it will work here
 	nIndex=nCnt++;
 }
@@ -197,6 +203,14 @@ void s_FILEINFO::CopyFileInfo(FileInfo *p, bool bJustPAB) {
     p->initData = NULL;
     initDataSize = p->initDataSize;
     p->initDataSize = 0;
+	// the record index moves the same way
+	pRecords = p->pRecords;
+	p->pRecords = NULL;
+	nIndexed = p->nIndexed;
+	p->nIndexed = 0;
+	nTailPos = p->nTailPos;
+	nTailSector = p->nTailSector;
+	nHostSize = p->nHostSize;
 	// so we also nuke the open and dirty flags, since they aren't anymore
 	// no need to check if they WERE, faster to just clear them
 	p->bDirty = false;
@@ -352,10 +366,20 @@ bool BaseDisk::Close(FileInfo *pFile) {
         pFile->initData = NULL;
         pFile->initDataSize = 0;
     }
+	FreeRecordIndex(pFile);
 
 	return bRet;
 }
 
+// Drop the record index for a file - the next flush rewrites it in full
+void BaseDisk::FreeRecordIndex(FileInfo *pFile) {
+	if (NULL != pFile->pRecords) {
+		free(pFile->pRecords);
+		pFile->pRecords = NULL;
+	}
+	pFile->nIndexed = 0;
+}
+
 // Use 'Close()' to release it.
 // TODO: should we use m_nFiles to limit the number of open files??
 FileInfo *BaseDisk::AllocateFileInfo() {
@@ -387,6 +411,79 @@ FileInfo *BaseDisk::FindFileInfo(CString csFile) {
 	return NULL;
 }
 
+// Save states don't contain the host files, just which ones were open
+// and where each one was positioned. On restore, files that are still
+// open by the same name get their position back, files the state
+// doesn't know about are closed, and files that were open when the
+// state was taken but aren't now are reported (the program will get
+// an error when it next uses them).
+void BaseDisk::SaveOpenFiles(MachineState *pState) {
+	int nOpen = 0;
+
+	for (int idx=0; idx<MAX_FILES; idx++) {
+		if (m_sFiles[idx].bOpen) ++nOpen;
+	}
+	STATE_PUT(pState, nOpen);
+
+	for (int idx=0; idx<MAX_FILES; idx++) {
+		if (m_sFiles[idx].bOpen) {
+			int nLen = m_sFiles[idx].csName.GetLength();
+			STATE_PUT(pState, nLen);
+			StateWrite(pState, (const char*)m_sFiles[idx].csName, nLen);
+			STATE_PUT(pState, m_sFiles[idx].nCurrentRecord);
+			STATE_PUT(pState, m_sFiles[idx].RecordNumber);
+		}
+	}
+}
+
+void BaseDisk::RestoreOpenFiles(StateReader *pRead) {
+	bool bKeep[MAX_FILES] = { false };
+	int nOpen = 0;
+
+	STATE_GET(pRead, nOpen);
+	for (int idx=0; (idx<nOpen) && (pRead->bOk); idx++) {
+		char buf[256];
+		int nLen = 0, nCurrentRecord = 0, nRecordNumber = 0;
+
+		STATE_GET(pRead, nLen);
+		if ((nLen < 0) || (nLen >= (int)sizeof(buf))) {
+			pRead->bOk = false;
+			break;
+		}
+		StateRead(pRead, buf, nLen);
+		buf[nLen] = '\0';
+		STATE_GET(pRead, nCurrentRecord);
+		STATE_GET(pRead, nRecordNumber);
+
+		FileInfo *pFile = FindFileInfo(buf);
+		if ((NULL == pFile) || (!pFile->bOpen)) {
+			debug_write("Save state had %s open, it is not open now.", buf);
+			continue;
+		}
+		pFile->nCurrentRecord = nCurrentRecord;
+		pFile->RecordNumber = nRecordNumber;
+		bKeep[pFile - m_sFiles] = true;
+	}
+
+	for (int idx=0; idx<MAX_FILES; idx++) {
+		if ((m_sFiles[idx].bOpen) && (!bKeep[idx])) {
+			debug_write("Closing %s, it was not open in the save state.", (const char*)m_sFiles[idx].csName);
+			Close(&m_sFiles[idx]);
+		}
+	}
+}
+
+// Something is about to rewrite this host file, so the record index of
+// any open file on it won't describe it anymore. Those files still have
+// all their data buffered, they just have to write it all back.
+void BaseDisk::ForgetHostIndex(CString csFileName) {
+	for (int idx=0; idx<MAX_FILES; idx++) {
+		if ((NULL != m_sFiles[idx].pRecords) && (0 == BuildFilename(&m_sFiles[idx]).CompareNoCase(csFileName))) {
+			FreeRecordIndex(&m_sFiles[idx]);
+		}
+	}
+}
+
 // return a formatted local path name
 CString BaseDisk::BuildFilename(FileInfo *pFile) {
 	CString csTmp;
@@ -545,6 +642,11 @@ bool BaseDisk::Write(FileInfo *pFile) {
 	memcpy(pDat, &VDP[pFile->DataBuffer], pFile->CharCount);
 	debug_write("writing 0x%X bytes drive %d file %s (%s record %d) from >%04X", pFile->CharCount, pFile->nDrive, pFile->csName, (pFile->Status&FLAG_VARIABLE)?"Variable":"Fixed", pFile->nCurrentRecord, pFile->DataBuffer);
 
+	// if the host file already has this record, the flush only needs to put it back
+	if ((NULL != pFile->pRecords) && (pFile->nCurrentRecord < pFile->nIndexed)) {
+		pFile->pRecords[pFile->nCurrentRecord].bDirty = true;
+	}
+
 	// update the header (todo: do we need more?)
 	if (pFile->nCurrentRecord+1 > pFile->NumberRecords) {
 		pFile->NumberRecords = pFile->nCurrentRecord+1;
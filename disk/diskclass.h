@@ -52,6 +52,13 @@
 // forward reference
 typedef struct s_FILEINFO FileInfo;
 
+// where one record of an open file lives in the host file
+typedef struct s_RECORDSPAN {
+	int nOffset;		// offset of the record data in the host file
+	int nLength;		// number of data bytes in the record as stored there
+	bool bDirty;		// written since the host file last matched the buffer
+} RecordSpan;
+
 // Structures
 typedef struct s_FILEINFO {
 	s_FILEINFO();
@@ -103,6 +110,18 @@ typedef struct s_FILEINFO {
 	// and may be extended dynamically, so should not be used
 	// by multiple threads. nDataSize contains the size of the buffer.
 	// Not used by LOAD and SAVE operations, only OPEN files (except in the SBR_FILEOUT opcode...)
+	RecordSpan *pRecords;	// where each record lives in the host file, NULL if not known
+	int nIndexed;			// number of entries in pRecords - records after that are new
+	int nTailPos;			// host file offset where the next new record goes
+	int nTailSector;		// bytes left in the sector at nTailPos
+	int nHostSize;			// size of the host file when the index was made
+	// A driver that understands the host file layout can fill in the
+	// record index as it buffers a file (see FiadDisk::BufferFiadFile).
+	// Write() marks the records it changes, so a flush can put just those
+	// back in place and add any new ones after the last, instead of
+	// rewriting the whole file. Anything else that writes the host file
+	// calls ForgetHostIndex() first, so that any other open file on it
+	// goes back to a full rewrite.
 } FileInfo;
 
 // file types
@@ -227,6 +246,10 @@ enum {
 };
 extern const char *pszOptionNames[];
 
+// save states (savestate.h)
+struct MachineState;
+struct StateReader;
+
 // One instance created per defined disk -- not necessarily the same as the real thing where
 // one controller may run multiple drives, but that's okay. Eventually I intend to emulate the
 // real controller, too, for those rare cases where that is needed.
@@ -237,7 +260,7 @@ public:
 		bAutomapDSK1=false;		// off by default, can induce bugs in theory
 		bWriteProtect=false;
 	}
-	~BaseDisk() {
+	virtual ~BaseDisk() {
 		CloseAllFiles();
 	}
 
@@ -255,12 +278,17 @@ public:
 	virtual const char *GetDiskTypeAsString() { return szDiskTypes[GetDiskType()]; };
 	virtual bool CheckOpenFiles();
 	virtual void CloseAllFiles();
+	virtual void WriteBack(bool /*bForce*/) { }							// write cached changes out to the host (force, or only ones that have waited)
 	virtual void SetOption(int nOption, int nValue);
 	virtual bool GetOption(int nOption, int &nValue);
 	virtual FileInfo *AllocateFileInfo();
 	virtual FileInfo *FindFileInfo(CString csFile);
 	virtual CString BuildFilename(FileInfo *pFile);
 
+	// save states - remembers where each open file was, doesn't save the files
+	virtual void SaveOpenFiles(MachineState *pState);
+	virtual void RestoreOpenFiles(StateReader *pRead);
+
 	// disk support
     // these ones don't call unsupported because we don't need to print a message to the user
 	virtual bool Flush(FileInfo *pFile) { pFile->LastError=ERR_ILLEGALOPERATION; return false; }
@@ -335,6 +363,10 @@ protected:
         debug_write("Operation not supported on this disk type."); pFile->LastError=ERR_ILLEGALOPERATION; return false; 
     }
 
+	// record index support
+	void FreeRecordIndex(FileInfo *pFile);
+	void ForgetHostIndex(CString csFileName);
+
 	// writes a TI floating point value
 	char *WriteAsFloat(char *pData, int nVal);
 	// remap a buffer from DSK1
@@ -551,6 +551,7 @@ bool callTipi() {
     // because of the address hacks (for reboot, etc), the console doesn't
     // always get a chance to do it, so just fake it here
     nCurrentDSR = -1;
+    InvalidateMemoryMap();
 
     // load the file - TODO: does TIPI load through VDP or straight to CPU?
     // if file fails to load, reset
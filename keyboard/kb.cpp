@@ -278,6 +278,7 @@ void decode(unsigned char sc)
         case VK_F1:		// ctrl+F1 - edit->paste
         case VK_F2:		// ctrl+F2 - edit->copy screen
         case VK_HOME:	// ctrl+HOME - edit->debugger
+        case VK_BACK:	// ctrl+BACKSPACE - rewind
 			is_up = 0;	// we're ignoring the whole thing, so assume the up event is complete
             return;
         }
@@ -407,6 +407,9 @@
 #define ID_DEBUG_RESETTIMERSTATISTICS   40192
 #define ID_VIEW_LOGDISASMTODISK         40193
 #define ID_STRETCHMODE_DXFULLSCREEN     40194
+#define ID_EDIT_PROFILER                40195
+#define ID_FILE_SAVESTATE               40196
+#define ID_FILE_LOADSTATE               40197
 
 // Next default values for new objects
 // 